@@ -28,6 +28,7 @@
 #include "read.h"
 #include "filebuf.h"
 #include "ds.h"
+#include "taxonomy.h"
 #include "edit.h"
 #include "limit.h"
 
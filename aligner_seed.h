@@ -1964,6 +1964,7 @@ bool SeedAligner<index_t>::oneMmSearch(
 									   SeedSearchMetrics&    met)    // metrics
 {
 	assert(!rep1mm || ebwtBw != NULL);
+	read.ensureReverses();
 	const size_t len = read.length();
 	int nceil = sc.nCeil.f<int>((double)len);
 	size_t ns = read.ns();
@@ -269,6 +269,9 @@ bool SwAligner::align(
     btncanddoneSucc_ = btncanddoneFail_ = 0;
     best = std::numeric_limits<TAlScore>::min();
     sse8succ_ = sse16succ_ = false;
+#ifdef SW_AVX2
+    sse8lazy_ = false;
+#endif
     int flag = 0;
     size_t rdlen = rdf_ - rdi_;
     bool checkpointed = rdlen >= cperMinlen_;
@@ -283,6 +286,19 @@ bool SwAligner::align(
                     gathered = true;
                 }
             } else {
+#ifdef SW_AVX2
+                if(avx2_) {
+                    // The matrix is filled in only if we backtrace
+                    best = alignNucleotidesEnd2EndAvx2U8(flag);
+                    sse8lazy_ = (flag == 0);
+#ifndef NDEBUG
+                    int flagtmp = 0;
+                    TAlScore besttmp = alignNucleotidesEnd2EndSseU8(flagtmp, true);
+                    assert_eq(flagtmp, flag);
+                    assert_eq(besttmp, best);
+#endif
+                } else
+#endif
                 best = alignNucleotidesEnd2EndSseU8(flag, false);
 #ifndef NDEBUG
                 int flagtmp = 0;
@@ -335,13 +351,29 @@ bool SwAligner::align(
                     gathered = true;
                 }
             } else {
-                best = alignNucleotidesLocalSseU8(flag, false);
+#ifdef SW_AVX2
+                // Only take the AVX2 kernel's word for it when there's no
+                // alignment; otherwise fill in the matrix as usual
+                if(avx2_) {
+                    best = alignNucleotidesLocalAvx2U8(flag);
+                }
+                if(avx2_ && flag == -1) {
 #ifndef NDEBUG
-                int flagtmp = 0;
-                TAlScore besttmp = alignGatherLoc8(flagtmp, true);
-                assert_eq(flag, flagtmp);
-                assert_eq(best, besttmp);
+                    int flagtmp = 0;
+                    alignNucleotidesLocalSseU8(flagtmp, true);
+                    assert_neq(0, flagtmp);
 #endif
+                } else
+#endif
+                {
+                    best = alignNucleotidesLocalSseU8(flag, false);
+#ifndef NDEBUG
+                    int flagtmp = 0;
+                    TAlScore besttmp = alignGatherLoc8(flagtmp, true);
+                    assert_eq(flag, flagtmp);
+                    assert_eq(best, besttmp);
+#endif
+                }
             }
         }
         if(flag == -2) {
@@ -446,6 +478,11 @@ bool SwAligner::align(
         assert(sse8succ_ || sse16succ_);
         if(sc_->monotone) {
             if(sse8succ_) {
+#ifdef SW_AVX2
+                if(sse8lazy_) {
+                    gatherCellsNucleotidesEnd2EndAvx2U8(best);
+                } else
+#endif
                 gatherCellsNucleotidesEnd2EndSseU8(best);
 #ifndef NDEBUG
                 if(sse16succ_) {
@@ -501,6 +538,17 @@ bool SwAligner::nextAlignment(
 		return false;
 	}
 	assert(!done());
+#ifdef SW_AVX2
+	if(sse8lazy_) {
+		// The AVX2 kernel kept only the scores; fill in the matrix to
+		// backtrace through
+		int flag = 0;
+		alignNucleotidesEnd2EndSseU8(flag, true);
+		assert_eq(0, flag);
+		(fw_ ? sseU8fw_ : sseU8rc_).mat_.initMasks();
+		sse8lazy_ = false;
+	}
+#endif
 	size_t off = 0, nbts = 0;
 	assert_lt(cural_, btncand_.size());
 	assert(res.repOk());
@@ -84,6 +84,36 @@
 #include "aligner_swsse.h"
 #include "aligner_bt.h"
 
+// 32-lane versions of the 8-bit kernels, picked at run time when the
+// processor supports AVX2
+#if defined(POPCNT_CAPABILITY) && defined(__GNUC__) && defined(__x86_64__)
+#define SW_AVX2
+#include <immintrin.h>
+#include "processor_support.h"
+
+/**
+ * Move every byte of v up one place across the whole 256-bit register,
+ * shifting in a zero, as _mm_slli_si128(v, 1) does for 128 bits.
+ */
+__attribute__((target("avx2")))
+static inline __m256i swAvx2ShiftUp8(__m256i v) {
+	return _mm256_alignr_epi8(v, _mm256_permute2x128_si256(v, v, 0x08), 15);
+}
+
+/**
+ * Return the largest of the 32 unsigned bytes in v.
+ */
+__attribute__((target("avx2")))
+static inline int swAvx2MaxU8(__m256i v) {
+	__m128i m = _mm_max_epu8(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+	m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+	return _mm_cvtsi128_si32(m) & 0xff;
+}
+#endif
+
 #define QUAL2(d, f) sc_->mm((int)(*rd_)[rdi_ + d], \
 							(int)  rf_ [rfi_ + f], \
 							(int)(*qu_)[rdi_ + d] - 33)
@@ -230,7 +260,20 @@ public:
 		lastsolcol_(0),
 		cural_(0)
 		ASSERT_ONLY(, cand_tmp_(DP_CAT))
-	{ }
+	{
+#ifdef SW_AVX2
+		ProcessorSupport ps;
+		avx2_ = ps.AVX2enabled();
+		sse8lazy_ = false;
+#endif
+	}
+
+#ifdef SW_AVX2
+	/**
+	 * Use the SSE2 kernels even if the processor supports AVX2.
+	 */
+	void disableAvx2() { avx2_ = false; }
+#endif
 
 	/**
 	 * Prepare the dynamic programming driver with a new read and a new scoring
@@ -453,6 +496,23 @@ protected:
 		int& flag, bool debug);
 	TAlScore alignNucleotidesLocalSseI16(   // signed 16-bit elements
 		int& flag, bool debug);
+
+#ifdef SW_AVX2
+	/**
+	 * Same as the 8-bit SSE kernels above but 32 cells at a time, and
+	 * keeping only the scores, not the matrix.  The end-to-end kernel
+	 * returns exactly what alignNucleotidesEnd2EndSseU8 would and keeps
+	 * the last row for gatherCellsNucleotidesEnd2EndAvx2U8.  The local
+	 * kernel scores every column; flag is -1 only if no cell reaches the
+	 * minimum, in which case the SSE kernel wouldn't find an alignment
+	 * either.
+	 */
+	TAlScore alignNucleotidesEnd2EndAvx2U8(int& flag);
+	TAlScore alignNucleotidesLocalAvx2U8(int& flag);
+	void buildQueryProfileEnd2EndAvx2U8(size_t seglen);
+	void buildQueryProfileLocalAvx2U8(size_t seglen);
+	bool gatherCellsNucleotidesEnd2EndAvx2U8(TAlScore best);
+#endif
 	
 	/**
 	 * Aligns by filling a dynamic programming matrix with the SSE-accelerated,
@@ -604,6 +664,15 @@ protected:
 	bool                sseI16fwBuilt_;  // built fw query profile, 16-bit score
 	bool                sseI16rcBuilt_;  // built rc query profile, 16-bit score
 
+#ifdef SW_AVX2
+	bool                avx2_;        // use the AVX2 8-bit kernels
+	bool                sse8lazy_;    // 8-bit e2e matrix not filled in yet
+	int                 avx2bias_;    // local profile shifted up by this
+	EList_m128i         avx2prof_;    // 32-lane query profile
+	EList_m128i         avx2vec_;     // H, E and F columns
+	EList<uint8_t>      avx2lastrow_; // last-row H of each column
+#endif
+
 	SSEMetrics			sseU8ExtendMet_;
 	SSEMetrics			sseU8MateMet_;
 	SSEMetrics			sseI16ExtendMet_;
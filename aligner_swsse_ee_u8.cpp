@@ -1329,7 +1329,7 @@ bool SwAligner::backtraceNucleotidesEnd2EndSseU8(
 	size_t origCol = col;
 	size_t gaps = 0, readGaps = 0, refGaps = 0;
 	res.alres.reset();
-    EList<Edit>& ned = res.alres.ned();
+	EList<Edit> ned; // AlnRes doesn't keep edits
 	assert(ned.empty());
 	assert_gt(dpRows(), row);
 	ASSERT_ONLY(size_t trimEnd = dpRows() - row - 1);
@@ -1849,7 +1849,7 @@ bool SwAligner::backtraceNucleotidesEnd2EndSseU8(
 	off = col;
 	assert_lt(col + (size_t)rfi_, (size_t)rff_);
 	// score.gaps_ = gaps;
-	res.alres.setScore(score);
+	res.alres.setScore(score.score());
 #if 0
 	res.alres.setShape(
 		refidx_,                  // ref id
@@ -1903,3 +1903,232 @@ bool SwAligner::backtraceNucleotidesEnd2EndSseU8(
 	met.btsucc++; // DP backtraces succeeded
 	return true;
 }
+
+#ifdef SW_AVX2
+
+static const size_t NWORDS_PER_AVX2_REG = 32;
+
+/**
+ * Build the query profile for alignNucleotidesEnd2EndAvx2U8: the same
+ * penalties and gap barrier as buildQueryProfileEnd2EndSseU8 but striped
+ * over 32 bytes.  For each reference character and segment there are 32
+ * bytes of penalties followed by 32 bytes of gap barrier.
+ */
+void SwAligner::buildQueryProfileEnd2EndAvx2U8(size_t seglen) {
+	const BTDnaString* rd = fw_ ? rdfw_ : rdrc_;
+	const BTString* qu = fw_ ? qufw_ : qurc_;
+	const size_t len = dpRows();
+	avx2prof_.resizeNoCopy(seglen * ALPHA_SIZE * 2 * 2);
+	uint8_t *words = reinterpret_cast<uint8_t*>(avx2prof_.ptr());
+	for(size_t refc = 0; refc < ALPHA_SIZE; refc++) {
+		for(size_t i = 0; i < seglen; i++) {
+			size_t j = i;
+			uint8_t *qprofWords = words;
+			uint8_t *gbarWords = words + NWORDS_PER_AVX2_REG;
+			for(size_t k = 0; k < NWORDS_PER_AVX2_REG; k++) {
+				int sc = 0;
+				*gbarWords = 0;
+				if(j < len) {
+					int readc = (*rd)[j];
+					int readq = (*qu)[j];
+					sc = -sc_->score(readc, (int)(1 << refc), readq - 33);
+					assert_range(0, 255, sc);
+					size_t j_from_end = len - j - 1;
+					if(j < (size_t)sc_->gapbar ||
+					   j_from_end < (size_t)sc_->gapbar)
+					{
+						*gbarWords = 0xff;
+					}
+				}
+				*qprofWords = (uint8_t)sc;
+				gbarWords++;
+				qprofWords++;
+				j += seglen;
+			}
+			words += 2 * NWORDS_PER_AVX2_REG;
+		}
+	}
+}
+
+/**
+ * Solve the current alignment problem with the recurrences of
+ * alignNucleotidesEnd2EndSseU8, 32 unsigned 8-bit cells at a time.  Only
+ * two H columns, E and F are kept, plus the last-row H of each column.
+ */
+__attribute__((target("avx2")))
+TAlScore SwAligner::alignNucleotidesEnd2EndAvx2U8(int& flag) {
+	assert_lt(rfi_, rff_);
+	assert_lt(rdi_, rdf_);
+	assert_geq(sc_->gapbar, 1);
+	SSEMetrics& met = extend_ ? sseU8ExtendMet_ : sseU8MateMet_;
+	met.dp++;
+	const size_t len = dpRows();
+	const size_t iter = (len + (NWORDS_PER_AVX2_REG-1)) / NWORDS_PER_AVX2_REG;
+	const size_t lastIter = (len - 1) % iter;
+	const size_t lastWord = (len - 1) / iter;
+	buildQueryProfileEnd2EndAvx2U8(iter);
+	const uint8_t *prof = reinterpret_cast<const uint8_t*>(avx2prof_.ptr());
+	
+	// Previous and current H column, E and F, 32 bytes per segment each
+	avx2vec_.resizeNoCopy(iter * 4 * 2);
+	uint8_t *hload  = reinterpret_cast<uint8_t*>(avx2vec_.ptr());
+	uint8_t *hstore = hload + iter * NWORDS_PER_AVX2_REG;
+	uint8_t *ebuf   = hstore + iter * NWORDS_PER_AVX2_REG;
+	uint8_t *fbuf   = ebuf + iter * NWORDS_PER_AVX2_REG;
+	avx2lastrow_.resize(rff_ - rfi_);
+	
+	const __m256i rfgapo = _mm256_set1_epi8((char)sc_->refGapOpen());
+	const __m256i rfgape = _mm256_set1_epi8((char)sc_->refGapExtend());
+	const __m256i rdgapo = _mm256_set1_epi8((char)sc_->readGapOpen());
+	const __m256i rdgape = _mm256_set1_epi8((char)sc_->readGapExtend());
+	const __m256i vzero  = _mm256_setzero_si256();
+	const __m256i vhilsw = _mm256_set_epi64x(0, 0, 0, 0xff);
+	__m256i vh, ve, vf, vtmp;
+	
+	for(size_t j = 0; j < iter; j++) {
+		_mm256_storeu_si256((__m256i*)(hload + j * NWORDS_PER_AVX2_REG), vzero);
+		_mm256_storeu_si256((__m256i*)(ebuf + j * NWORDS_PER_AVX2_REG), vzero);
+	}
+	
+	size_t nfixup = 0;
+	TCScore lrmax = MIN_U8;
+	colstop_ = rff_ - 1;
+	lastsolcol_ = 0;
+	
+	for(size_t i = (size_t)rfi_; i < (size_t)rff_; i++) {
+		const int refc = (int)rf_[i];
+		const uint8_t *pvScore = prof + (size_t)firsts5[refc] * iter * 2 * NWORDS_PER_AVX2_REG;
+		
+		vf = vzero;
+		vh = _mm256_loadu_si256((const __m256i*)(hload + (iter-1) * NWORDS_PER_AVX2_REG));
+		vh = swAvx2ShiftUp8(vh);
+		vh = _mm256_or_si256(vh, vhilsw);
+		
+		size_t j;
+		for(j = 0; j < iter; j++) {
+			const size_t off = j * NWORDS_PER_AVX2_REG;
+			const __m256i vsc = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off));
+			const __m256i vgb = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off + NWORDS_PER_AVX2_REG));
+			ve = _mm256_loadu_si256((const __m256i*)(ebuf + off));
+			
+			vf = _mm256_subs_epu8(vf, vgb); // veto some ref gap extensions
+			_mm256_storeu_si256((__m256i*)(fbuf + off), vf);
+			
+			vh = _mm256_subs_epu8(vh, vsc);
+			vh = _mm256_max_epu8(vh, ve);
+			vh = _mm256_max_epu8(vh, vf);
+			_mm256_storeu_si256((__m256i*)(hstore + off), vh);
+			
+			vtmp = vh;
+			vh = _mm256_subs_epu8(vh, rdgapo);
+			vh = _mm256_subs_epu8(vh, vgb); // veto some read gap opens
+			ve = _mm256_subs_epu8(ve, rdgape);
+			ve = _mm256_max_epu8(ve, vh);
+			_mm256_storeu_si256((__m256i*)(ebuf + off), ve);
+			
+			vh = _mm256_loadu_si256((const __m256i*)(hload + off));
+			
+			vtmp = _mm256_subs_epu8(vtmp, rfgapo);
+			vf = _mm256_subs_epu8(vf, rfgape);
+			vf = _mm256_max_epu8(vf, vtmp);
+		}
+		
+		// Fix up F (and H and E along with it) the same way as the SSE
+		// kernel, until F stops changing
+		__m256i vgb = _mm256_loadu_si256((const __m256i*)(pvScore + NWORDS_PER_AVX2_REG));
+		vtmp = _mm256_loadu_si256((const __m256i*)fbuf);
+		vh = _mm256_loadu_si256((const __m256i*)hstore);
+		ve = _mm256_loadu_si256((const __m256i*)ebuf);
+		vf = swAvx2ShiftUp8(vf);
+		vf = _mm256_subs_epu8(vf, vgb);
+		vf = _mm256_max_epu8(vtmp, vf);
+		vtmp = _mm256_cmpeq_epi8(_mm256_subs_epu8(vf, vtmp), vzero);
+		uint32_t cmp = (uint32_t)_mm256_movemask_epi8(vtmp);
+		j = 0;
+		while(cmp != 0xffffffff) {
+			size_t off = j * NWORDS_PER_AVX2_REG;
+			_mm256_storeu_si256((__m256i*)(fbuf + off), vf);
+			vh = _mm256_max_epu8(vh, vf);
+			_mm256_storeu_si256((__m256i*)(hstore + off), vh);
+			vh = _mm256_subs_epu8(vh, rdgapo);
+			vh = _mm256_subs_epu8(vh, vgb); // veto some read gap opens
+			ve = _mm256_max_epu8(ve, vh);
+			_mm256_storeu_si256((__m256i*)(ebuf + off), ve);
+			
+			if(++j == iter) {
+				j = 0;
+				vf = swAvx2ShiftUp8(vf);
+			}
+			off = j * NWORDS_PER_AVX2_REG;
+			vgb = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off + NWORDS_PER_AVX2_REG));
+			vtmp = _mm256_loadu_si256((const __m256i*)(fbuf + off));
+			vh = _mm256_loadu_si256((const __m256i*)(hstore + off));
+			ve = _mm256_loadu_si256((const __m256i*)(ebuf + off));
+			
+			vf = _mm256_subs_epu8(vf, rfgape);
+			vf = _mm256_subs_epu8(vf, vgb); // veto some ref gap extensions
+			vf = _mm256_max_epu8(vtmp, vf);
+			vtmp = _mm256_cmpeq_epi8(_mm256_subs_epu8(vf, vtmp), vzero);
+			cmp = (uint32_t)_mm256_movemask_epi8(vtmp);
+			nfixup++;
+		}
+		
+		TCScore lr = hstore[lastIter * NWORDS_PER_AVX2_REG + lastWord];
+		avx2lastrow_[i - rfi_] = lr;
+		if(lr > lrmax) {
+			lrmax = lr;
+		}
+		std::swap(hload, hstore);
+	}
+	
+	size_t ninner = (rff_ - rfi_) * iter;
+	met.col   += (rff_ - rfi_);                  // DP columns
+	met.cell  += (ninner * NWORDS_PER_AVX2_REG); // DP cells
+	met.inner += ninner;                         // DP inner loop iters
+	met.fixup += nfixup;                         // DP fixup loop iters
+	
+	flag = 0;
+	TAlScore score = (TAlScore)(lrmax - 0xff);
+	if(score < minsc_) {
+		flag = -1; // no
+		met.dpfail++;
+		return score;
+	}
+	if(lrmax == MIN_U8) {
+		flag = -2; // yes
+		met.dpsat++;
+		return MIN_I64;
+	}
+	met.dpsucc++;
+	return score;
+}
+
+/**
+ * gatherCellsNucleotidesEnd2EndSseU8 for when alignNucleotidesEnd2EndAvx2U8
+ * did the alignment: the candidates come from the last row it kept.
+ */
+bool SwAligner::gatherCellsNucleotidesEnd2EndAvx2U8(TAlScore best) {
+	assert(sse8succ_);
+	assert(sse8lazy_);
+	const size_t ncol = rff_ - rfi_;
+	const size_t nrow = dpRows();
+	btncand_.clear();
+	btncanddone_.clear();
+	SSEMetrics& met = extend_ ? sseU8ExtendMet_ : sseU8MateMet_;
+	assert_eq(ncol, avx2lastrow_.size());
+	ASSERT_ONLY(bool sawbest = false);
+	for(size_t j = 0; j < ncol; j++) {
+		TAlScore sc = (TAlScore)(avx2lastrow_[j] - 0xff);
+		assert_leq(sc, best);
+		ASSERT_ONLY(sawbest = (sawbest || sc == best));
+		if(sc >= minsc_) {
+			met.gathsol++;
+			btncand_.expand();
+			btncand_.back().init(nrow-1, j, sc);
+		}
+	}
+	assert(sawbest);
+	return !btncand_.empty();
+}
+
+#endif /*def SW_AVX2*/
@@ -1690,7 +1690,7 @@ bool SwAligner::backtraceNucleotidesLocalSseI16(
 	size_t origCol = col;
 	size_t gaps = 0, readGaps = 0, refGaps = 0;
 	res.alres.reset();
-    EList<Edit>& ned = res.alres.ned();
+	EList<Edit> ned; // AlnRes doesn't keep edits
 	assert(ned.empty());
 	assert_gt(dpRows(), row);
 	ASSERT_ONLY(size_t trimEnd = dpRows() - row - 1);
@@ -2221,7 +2221,7 @@ bool SwAligner::backtraceNucleotidesLocalSseI16(
 	off = col;
 	assert_lt(col + (size_t)rfi_, (size_t)rff_);
 	// score.gaps_ = gaps;
-	res.alres.setScore(score);
+	res.alres.setScore(score.score());
 #if 0
 	res.alres.setShape(
 		refidx_,                  // ref id
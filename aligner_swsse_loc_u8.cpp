@@ -1699,7 +1699,7 @@ bool SwAligner::backtraceNucleotidesLocalSseU8(
 	ASSERT_ONLY(size_t origCol = col);
 	size_t gaps = 0, readGaps = 0, refGaps = 0;
 	res.alres.reset();
-    EList<Edit>& ned = res.alres.ned();
+	EList<Edit> ned; // AlnRes doesn't keep edits
 	assert(ned.empty());
 	assert_gt(dpRows(), row);
 	ASSERT_ONLY(size_t trimEnd = dpRows() - row - 1);
@@ -2215,7 +2215,7 @@ bool SwAligner::backtraceNucleotidesLocalSseU8(
 	off = col;
 	assert_lt(col + (size_t)rfi_, (size_t)rff_);
 	// score.gaps_ = gaps;
-	res.alres.setScore(score);
+	res.alres.setScore(score.score());
 #if 0
 	res.alres.setShape(
 		refidx_,                  // ref id
@@ -2267,3 +2267,209 @@ bool SwAligner::backtraceNucleotidesLocalSseU8(
 	met.btsucc++; // DP backtraces succeeded
 	return true;
 }
+
+#ifdef SW_AVX2
+
+static const size_t NWORDS_PER_AVX2_REG = 32;
+
+/**
+ * Build the query profile for alignNucleotidesLocalAvx2U8: the same
+ * biased scores and gap barrier as buildQueryProfileLocalSseU8 but
+ * striped over 32 bytes.  For each reference character and segment there
+ * are 32 bytes of scores followed by 32 bytes of gap barrier.
+ */
+void SwAligner::buildQueryProfileLocalAvx2U8(size_t seglen) {
+	const BTDnaString* rd = fw_ ? rdfw_ : rdrc_;
+	const BTString* qu = fw_ ? qufw_ : qurc_;
+	const size_t len = dpRows();
+	avx2prof_.resizeNoCopy(seglen * ALPHA_SIZE * 2 * 2);
+	avx2bias_ = 0;
+	for(size_t refc = 0; refc < ALPHA_SIZE; refc++) {
+		for(size_t i = 0; i < len; i++) {
+			int sc = sc_->score((*rd)[i], (int)(1 << refc), (*qu)[i] - 33);
+			if(sc < avx2bias_) {
+				avx2bias_ = sc;
+			}
+		}
+	}
+	avx2bias_ = -avx2bias_;
+	uint8_t *words = reinterpret_cast<uint8_t*>(avx2prof_.ptr());
+	for(size_t refc = 0; refc < ALPHA_SIZE; refc++) {
+		for(size_t i = 0; i < seglen; i++) {
+			size_t j = i;
+			uint8_t *qprofWords = words;
+			uint8_t *gbarWords = words + NWORDS_PER_AVX2_REG;
+			for(size_t k = 0; k < NWORDS_PER_AVX2_REG; k++) {
+				int sc = 0;
+				*gbarWords = 0;
+				if(j < len) {
+					int readc = (*rd)[j];
+					int readq = (*qu)[j];
+					sc = sc_->score(readc, (int)(1 << refc), readq - 33);
+					assert_range(0, 255, sc + avx2bias_);
+					size_t j_from_end = len - j - 1;
+					if(j < (size_t)sc_->gapbar ||
+					   j_from_end < (size_t)sc_->gapbar)
+					{
+						*gbarWords = 0xff;
+					}
+				}
+				*qprofWords = (uint8_t)(sc + avx2bias_);
+				gbarWords++;
+				qprofWords++;
+				j += seglen;
+			}
+			words += 2 * NWORDS_PER_AVX2_REG;
+		}
+	}
+}
+
+/**
+ * Find the best local alignment score with the recurrences of
+ * alignNucleotidesLocalSseU8, 32 unsigned 8-bit cells at a time and
+ * without keeping the matrix.  Unlike the SSE kernel it doesn't stop
+ * early, so its score is at least the one the SSE kernel would return.
+ */
+__attribute__((target("avx2")))
+TAlScore SwAligner::alignNucleotidesLocalAvx2U8(int& flag) {
+	assert_lt(rfi_, rff_);
+	assert_lt(rdi_, rdf_);
+	SSEMetrics& met = extend_ ? sseU8ExtendMet_ : sseU8MateMet_;
+	const size_t len = dpRows();
+	const size_t iter = (len + (NWORDS_PER_AVX2_REG-1)) / NWORDS_PER_AVX2_REG;
+	buildQueryProfileLocalAvx2U8(iter);
+	const uint8_t *prof = reinterpret_cast<const uint8_t*>(avx2prof_.ptr());
+	
+	// Previous and current H column, E and F, 32 bytes per segment each
+	avx2vec_.resizeNoCopy(iter * 4 * 2);
+	uint8_t *hload  = reinterpret_cast<uint8_t*>(avx2vec_.ptr());
+	uint8_t *hstore = hload + iter * NWORDS_PER_AVX2_REG;
+	uint8_t *ebuf   = hstore + iter * NWORDS_PER_AVX2_REG;
+	uint8_t *fbuf   = ebuf + iter * NWORDS_PER_AVX2_REG;
+	
+	const __m256i rfgapo = _mm256_set1_epi8((char)sc_->refGapOpen());
+	const __m256i rfgape = _mm256_set1_epi8((char)sc_->refGapExtend());
+	const __m256i rdgapo = _mm256_set1_epi8((char)sc_->readGapOpen());
+	const __m256i rdgape = _mm256_set1_epi8((char)sc_->readGapExtend());
+	const __m256i vbias  = _mm256_set1_epi8((char)avx2bias_);
+	const __m256i vzero  = _mm256_setzero_si256();
+	__m256i vh, ve, vf, vtmp, vcolmax;
+	
+	for(size_t j = 0; j < iter; j++) {
+		_mm256_storeu_si256((__m256i*)(hload + j * NWORDS_PER_AVX2_REG), vzero);
+		_mm256_storeu_si256((__m256i*)(ebuf + j * NWORDS_PER_AVX2_REG), vzero);
+	}
+	
+	size_t nfixup = 0;
+	int score = 0;
+	
+	for(size_t i = (size_t)rfi_; i < (size_t)rff_; i++) {
+		const int refm = (int)rf_[i];
+		const uint8_t *pvScore = prof + (size_t)firsts5[refm] * iter * 2 * NWORDS_PER_AVX2_REG;
+		
+		vf = vzero;
+		vcolmax = vzero;
+		vh = _mm256_loadu_si256((const __m256i*)(hload + (iter-1) * NWORDS_PER_AVX2_REG));
+		vh = swAvx2ShiftUp8(vh);
+		
+		size_t j;
+		for(j = 0; j < iter; j++) {
+			const size_t off = j * NWORDS_PER_AVX2_REG;
+			const __m256i vsc = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off));
+			const __m256i vgb = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off + NWORDS_PER_AVX2_REG));
+			ve = _mm256_loadu_si256((const __m256i*)(ebuf + off));
+			
+			vf = _mm256_subs_epu8(vf, vgb); // veto some ref gap extensions
+			_mm256_storeu_si256((__m256i*)(fbuf + off), vf);
+			
+			vh = _mm256_adds_epu8(vh, vsc);
+			vh = _mm256_subs_epu8(vh, vbias);
+			vh = _mm256_max_epu8(vh, ve);
+			vh = _mm256_max_epu8(vh, vf);
+			vcolmax = _mm256_max_epu8(vcolmax, vh);
+			_mm256_storeu_si256((__m256i*)(hstore + off), vh);
+			
+			vtmp = vh;
+			vh = _mm256_subs_epu8(vh, rdgapo);
+			vh = _mm256_subs_epu8(vh, vgb); // veto some read gap opens
+			ve = _mm256_subs_epu8(ve, rdgape);
+			ve = _mm256_max_epu8(ve, vh);
+			_mm256_storeu_si256((__m256i*)(ebuf + off), ve);
+			
+			vh = _mm256_loadu_si256((const __m256i*)(hload + off));
+			
+			vtmp = _mm256_subs_epu8(vtmp, rfgapo);
+			vf = _mm256_subs_epu8(vf, rfgape);
+			vf = _mm256_max_epu8(vf, vtmp);
+		}
+		
+		// Fix up F (and H and E along with it) the same way as the SSE
+		// kernel, until F stops changing
+		__m256i vgb = _mm256_loadu_si256((const __m256i*)(pvScore + NWORDS_PER_AVX2_REG));
+		vtmp = _mm256_loadu_si256((const __m256i*)fbuf);
+		vh = _mm256_loadu_si256((const __m256i*)hstore);
+		ve = _mm256_loadu_si256((const __m256i*)ebuf);
+		vf = swAvx2ShiftUp8(vf);
+		vf = _mm256_subs_epu8(vf, vgb);
+		vf = _mm256_max_epu8(vtmp, vf);
+		vtmp = _mm256_cmpeq_epi8(_mm256_subs_epu8(vf, vtmp), vzero);
+		uint32_t cmp = (uint32_t)_mm256_movemask_epi8(vtmp);
+		j = 0;
+		while(cmp != 0xffffffff) {
+			size_t off = j * NWORDS_PER_AVX2_REG;
+			_mm256_storeu_si256((__m256i*)(fbuf + off), vf);
+			vh = _mm256_max_epu8(vh, vf);
+			_mm256_storeu_si256((__m256i*)(hstore + off), vh);
+			vcolmax = _mm256_max_epu8(vcolmax, vh);
+			vh = _mm256_subs_epu8(vh, rdgapo);
+			vh = _mm256_subs_epu8(vh, vgb); // veto some read gap opens
+			ve = _mm256_max_epu8(ve, vh);
+			_mm256_storeu_si256((__m256i*)(ebuf + off), ve);
+			
+			if(++j == iter) {
+				j = 0;
+				vf = swAvx2ShiftUp8(vf);
+			}
+			off = j * NWORDS_PER_AVX2_REG;
+			vgb = _mm256_loadu_si256((const __m256i*)(pvScore + 2 * off + NWORDS_PER_AVX2_REG));
+			vtmp = _mm256_loadu_si256((const __m256i*)(fbuf + off));
+			vh = _mm256_loadu_si256((const __m256i*)(hstore + off));
+			ve = _mm256_loadu_si256((const __m256i*)(ebuf + off));
+			
+			vf = _mm256_subs_epu8(vf, rfgape);
+			vf = _mm256_subs_epu8(vf, vgb); // veto some ref gap extensions
+			vf = _mm256_max_epu8(vtmp, vf);
+			vtmp = _mm256_cmpeq_epi8(_mm256_subs_epu8(vf, vtmp), vzero);
+			cmp = (uint32_t)_mm256_movemask_epi8(vtmp);
+			nfixup++;
+		}
+		
+		int colmax = swAvx2MaxU8(vcolmax);
+		if(colmax + avx2bias_ >= 255) {
+			flag = -2; // saturated
+			return MIN_I64;
+		}
+		if(colmax > score) {
+			score = colmax;
+		}
+		std::swap(hload, hstore);
+	}
+	
+	size_t ninner = (rff_ - rfi_) * iter;
+	met.col   += (rff_ - rfi_);                  // DP columns
+	met.cell  += (ninner * NWORDS_PER_AVX2_REG); // DP cells
+	met.inner += ninner;                         // DP inner loop iters
+	met.fixup += nfixup;                         // DP fixup loop iters
+	
+	// Only a failure is final; otherwise the SSE kernel runs and counts the
+	// DP problem
+	flag = 0;
+	if(score == MIN_U8 || score < minsc_) {
+		flag = -1; // no
+		met.dp++;
+		met.dpfail++;
+	}
+	return (TAlScore)score;
+}
+
+#endif /*def SW_AVX2*/
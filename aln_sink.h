@@ -87,6 +87,7 @@ struct SpeciesMetrics {
 		//	it->second.reset();
 		//} //TODO: is this required?
 		species_kmers.clear();
+        observed.clear();
         num_non_leaves = 0;
 	}
 
@@ -271,9 +272,19 @@ struct SpeciesMetrics {
         }
     }
     
-    void calculateAbundance(const Ebwt<uint64_t>& ebwt, uint8_t rank)
+    /**
+     * Estimate abundances from the observed read assignments with EM.  If
+     * 'prior' is given (abundance_len of an earlier estimate, e.g. for
+     * fewer reads), taxa in it start from their earlier abundance, which
+     * usually takes far fewer iterations to converge.
+     */
+    void calculateAbundance(
+                            const Ebwt<uint64_t>& ebwt,
+                            uint8_t rank,
+                            const map<uint64_t, double>* prior = NULL,
+                            bool verbose = true)
     {
-        const map<uint64_t, TaxonomyNode>& tree = ebwt.tree();
+        const TaxTreeTable& tree = ebwt.tree();
         
         // Find leaves
         set<uint64_t> leaves;
@@ -281,7 +292,7 @@ struct SpeciesMetrics {
             const IDs& ids = itr->first;
             for(size_t i = 0; i < ids.ids.size(); i++) {
                 uint64_t tid = ids.ids[i];
-                map<uint64_t, TaxonomyNode>::const_iterator tree_itr = tree.find(tid);
+                TaxTreeTable::const_iterator tree_itr = tree.find(tid);
                 if(tree_itr == tree.end())
                     continue;
                 const TaxonomyNode& node = tree_itr->second;
@@ -316,7 +327,7 @@ struct SpeciesMetrics {
                     assert(tree.find(tid2)->second.leaf);
                     uint64_t temp_tid2 = tid2;
                     while(true) {
-                        map<uint64_t, TaxonomyNode>::const_iterator tree_itr = tree.find(temp_tid2);
+                        TaxTreeTable::const_iterator tree_itr = tree.find(temp_tid2);
                         if(tree_itr == tree.end())
                             break;
                         const TaxonomyNode& node = tree_itr->second;
@@ -339,7 +350,7 @@ struct SpeciesMetrics {
             const EList<uint64_t>& children = itr->second;
             if(children.size() <= 0)
                 continue;
-            map<uint64_t, TaxonomyNode>::const_iterator tree_itr = tree.find(tid);
+            TaxTreeTable::const_iterator tree_itr = tree.find(tid);
             if(tree_itr == tree.end())
                 continue;
             const TaxonomyNode& node = tree_itr->second;
@@ -360,7 +371,7 @@ struct SpeciesMetrics {
         uint64_t test_tid = 0, test_tid2 = 0;
 #endif
         // Lengths of genomes (or contigs)
-        const map<uint64_t, uint64_t>& size_table = ebwt.size();
+        const TaxSizeTable& size_table = ebwt.size();
         
         // Initialize probabilities
         map<uint64_t, uint64_t> tid_to_num; // taxonomic ID to corresponding element of a list
@@ -390,7 +401,7 @@ struct SpeciesMetrics {
                 if(tid_to_num.find(tid) == tid_to_num.end()) {
                     tid_to_num[tid] = p.size();
                     p.push_back(1.0 / ids.ids.size() * count);
-                    map<uint64_t, uint64_t>::const_iterator size_itr = size_table.find(tid);
+                    TaxSizeTable::const_iterator size_itr = size_table.find(tid);
                     if(size_itr != size_table.end()) {
                         len.push_back(size_itr->second);
                     } else {
@@ -416,6 +427,24 @@ struct SpeciesMetrics {
             }
         }
         
+        if(prior != NULL && !prior->empty()) {
+            double sum = 0.0;
+            for(map<uint64_t, uint64_t>::iterator itr = tid_to_num.begin(); itr != tid_to_num.end(); itr++) {
+                map<uint64_t, double>::const_iterator prior_itr = prior->find(itr->first);
+                // EM can't bring back a taxon it has driven to 0, so
+                // those start over
+                if(prior_itr != prior->end() && prior_itr->second > 0.0) {
+                    p[itr->second] = prior_itr->second;
+                }
+                sum += p[itr->second];
+            }
+            if(sum > 0.0) {
+                for(size_t i = 0; i < p.size(); i++) {
+                    p[i] /= sum;
+                }
+            }
+        }
+        
         EList<double> p_next; p_next.resizeExact(p.size());
         EList<double> p_next2; p_next2.resizeExact(p.size());
         EList<double> p_r; p_r.resizeExact(p.size());
@@ -468,8 +497,10 @@ struct SpeciesMetrics {
             p = p_next;
         }
         
-        cerr << "Number of iterations in EM algorithm: " << num_iteration << endl;
-        cerr << "Probability diff. (P - P_prev) in the last iteration: " << diff << endl;
+        if(verbose) {
+            cerr << "Number of iterations in EM algorithm: " << num_iteration << endl;
+            cerr << "Probability diff. (P - P_prev) in the last iteration: " << diff << endl;
+        }
         
         {
             // Calculate abundance normalized by genome size
@@ -1071,11 +1102,13 @@ public:
 		AlnSink<index_t>& g,       // AlnSink being wrapped
 		const ReportingParams& rp, // Parameters governing reporting
 		size_t threadId,           // Thread ID
-        bool secondary = false) :  // Secondary alignments
+        bool secondary = false,    // Secondary alignments
+		StageMetrics *stages = NULL) : // where to time formatting and output, if anywhere
 		g_(g),
 		rp_(rp),
         threadid_(threadId),
     	secondary_(secondary),
+		stages_(stages),
 		init_(false),   
 		maxed1_(false),       // read is pair and we maxed out mate 1 unp alns
 		maxed2_(false),       // read is pair and we maxed out mate 2 unp alns
@@ -1204,6 +1237,11 @@ public:
 	 */
 	bool inited() const { return init_; }
 
+	/**
+	 * Return the id of the read passed to the last call to nextRead().
+	 */
+	TReadId rdid() const { return rdid_; }
+
 	/**
 	 * Return a const ref to the ReportingState object associated with the
 	 * AlnSinkWrap.
@@ -1328,6 +1366,7 @@ protected:
 	ReportingParams   rp_;    // reporting parameters: khits, mhits etc
 	size_t            threadid_; // thread ID
     bool              secondary_; // allow for secondary alignments
+	StageMetrics*     stages_;    // NULL unless timing formatting and output
 	bool              init_;  // whether we're initialized w/ read pair
 	bool              maxed1_; // true iff # unpaired mate-1 alns reported so far exceeded -m/-M
 	bool              maxed2_; // true iff # unpaired mate-2 alns reported so far exceeded -m/-M
@@ -1653,7 +1692,8 @@ void AlnSinkWrap<index_t>::finishRead(
 									  bool suppressAlignments)         // = false
 {
 	obuf_.clear();
-	OutputQueueMark qqm(g_.outq(), obuf_, rdid_, threadid_);
+	OutputQueueMark qqm(g_.outq(), obuf_, rdid_, threadid_, stages_);
+	StageTimer formatTimer(stages_, STAGE_FORMAT); // stops before qqm's
 	assert(init_);
 	if(!suppressSeedSummary) {
 		if(sr1 != NULL) {
@@ -2217,9 +2257,9 @@ void appendReadID(BTString& o, const BTString & rd_name) {
 }
 
 inline
-void appendSeqID(BTString& o, const AlnRes* rs, const std::map<uint64_t, TaxonomyNode>& tree) { 
+void appendSeqID(BTString& o, const AlnRes* rs, const TaxTreeTable& tree) { 
     bool leaf = true;
-    std::map<uint64_t, TaxonomyNode>::const_iterator itr = tree.find(rs->taxID());
+    TaxTreeTable::const_iterator itr = tree.find(rs->taxID());
     if(itr != tree.end()) {
         const TaxonomyNode& node = itr->second;
         leaf = node.leaf;
@@ -2316,7 +2356,7 @@ void AlnSinkSam<index_t>::appendMate(
 
 			case TAX_ID:       appendTaxID(o, taxid); break;
 			case TAX_RANK:     o.append(get_tax_rank_string(rs->taxRank())); break;
-			case TAX_NAME:     o.append(find_or_use_default(ebwt.name(), taxid, empty_string).c_str()); break;
+			case TAX_NAME:     o.append(ebwt.name().find(taxid, "")); break;
 
 			case SCORE:        appendNumber<uint64_t>(o, rs->score(), buf); break;
 			case SCORE2:       appendNumber<uint64_t>(o,
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string.h>
+#include "bgzf.h"
+
+using namespace std;
+
+// gzip member header with the BGZF "BC" extra field; the last two bytes,
+// the block size less one, are filled in per block
+static const unsigned char bgzfHeader[18] = {
+	31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+// The empty block that ends a BGZF file
+static const unsigned char bgzfEof[28] = {
+	31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0,
+	3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void initDeflate(z_stream& zs, int level) {
+	memset(&zs, 0, sizeof(zs));
+	// Raw deflate; we write the gzip header and trailer ourselves
+	if(deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		cerr << "Error: could not initialize zlib for compressed output" << endl;
+		throw 1;
+	}
+}
+
+static void putLE32(char *p, uint32_t v) {
+	p[0] = (char)(v & 0xff);
+	p[1] = (char)((v >> 8) & 0xff);
+	p[2] = (char)((v >> 16) & 0xff);
+	p[3] = (char)((v >> 24) & 0xff);
+}
+
+BgzfWriter::BgzfWriter(FILE *out, size_t nthreads, int level) :
+	out_(out),
+	level_(level),
+	jobs_(NULL),
+	njobs_(nthreads == 0 ? 1 : 4 * nthreads),
+	head_(0),
+	tail_(0),
+	nsub_(0),
+	next_(0),
+	stop_(false),
+	finished_(false)
+{
+	jobs_ = new Job[njobs_];
+	for(size_t i = 0; i < njobs_; i++) {
+		jobs_[i].inlen = jobs_[i].outlen = 0;
+		jobs_[i].state = JOB_FREE;
+	}
+	initDeflate(zs_, level_);
+	for(size_t i = 0; i < nthreads; i++) {
+		threads_.push_back(new tthread::thread(BgzfWriter::compressMain, (void*)this));
+	}
+}
+
+BgzfWriter::~BgzfWriter() {
+	{
+		tthread::lock_guard<tthread::mutex> lock(mutex_);
+		stop_ = true;
+		cond_.notify_all();
+	}
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	deflateEnd(&zs_);
+	delete[] jobs_;
+}
+
+/**
+ * Take the next 'len' bytes of output.
+ */
+void BgzfWriter::write(const char *buf, size_t len) {
+	assert(!finished_);
+	while(len > 0) {
+		Job& job = jobs_[tail_];
+		size_t n = min(len, BLOCK_IN - job.inlen);
+		memcpy(job.in + job.inlen, buf, n);
+		job.inlen += n;
+		buf += n;
+		len -= n;
+		if(job.inlen == BLOCK_IN) {
+			submit();
+		}
+	}
+}
+
+/**
+ * Compress and write everything taken so far, then the end-of-file block.
+ */
+void BgzfWriter::finish() {
+	if(finished_) {
+		return;
+	}
+	if(jobs_[tail_].inlen > 0) {
+		submit();
+	}
+	writeDone(0);
+	writeBlock((const char*)bgzfEof, sizeof(bgzfEof));
+	finished_ = true;
+}
+
+/**
+ * Queue the block being filled for compression and move on to the next
+ * one, writing finished blocks until it's free.
+ */
+void BgzfWriter::submit() {
+	Job& job = jobs_[tail_];
+	if(threads_.empty()) {
+		compress(job, zs_);
+		writeBlock(job.out, job.outlen);
+		job.inlen = 0;
+		return;
+	}
+	{
+		tthread::lock_guard<tthread::mutex> lock(mutex_);
+		job.state = JOB_FILLED;
+		cond_.notify_all();
+	}
+	tail_ = (tail_ + 1) % njobs_;
+	nsub_++;
+	writeDone(njobs_ - 1);
+}
+
+/**
+ * Write compressed blocks from head_ on, waiting for them while more than
+ * 'maxsub' blocks are queued.
+ */
+void BgzfWriter::writeDone(size_t maxsub) {
+	while(nsub_ > 0) {
+		Job& job = jobs_[head_];
+		{
+			tthread::lock_guard<tthread::mutex> lock(mutex_);
+			if(job.state != JOB_DONE && nsub_ <= maxsub) {
+				break;
+			}
+			while(job.state != JOB_DONE) {
+				cond_.wait(mutex_);
+			}
+		}
+		writeBlock(job.out, job.outlen);
+		job.inlen = 0;
+		{
+			tthread::lock_guard<tthread::mutex> lock(mutex_);
+			job.state = JOB_FREE;
+		}
+		head_ = (head_ + 1) % njobs_;
+		nsub_--;
+	}
+}
+
+/**
+ * Compress job.in into a complete BGZF block in job.out.
+ */
+void BgzfWriter::compress(Job& job, z_stream& zs) {
+	const size_t hlen = sizeof(bgzfHeader), tlen = 8;
+	memcpy(job.out, bgzfHeader, hlen);
+	deflateReset(&zs);
+	zs.next_in = (Bytef*)job.in;
+	zs.avail_in = (uInt)job.inlen;
+	zs.next_out = (Bytef*)(job.out + hlen);
+	zs.avail_out = (uInt)(BLOCK_OUT - hlen - tlen);
+	size_t clen;
+	if(deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+		clen = BLOCK_OUT - hlen - tlen - zs.avail_out;
+	} else {
+		// Incompressible input doesn't fit; store it as it is
+		char *p = job.out + hlen;
+		p[0] = 1; // final block, stored
+		p[1] = (char)(job.inlen & 0xff);
+		p[2] = (char)((job.inlen >> 8) & 0xff);
+		p[3] = (char)(~job.inlen & 0xff);
+		p[4] = (char)((~job.inlen >> 8) & 0xff);
+		memcpy(p + 5, job.in, job.inlen);
+		clen = 5 + job.inlen;
+	}
+	char *t = job.out + hlen + clen;
+	putLE32(t, (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef*)job.in, (uInt)job.inlen));
+	putLE32(t + 4, (uint32_t)job.inlen);
+	job.outlen = hlen + clen + tlen;
+	assert_leq(job.outlen, BLOCK_OUT);
+	job.out[16] = (char)((job.outlen - 1) & 0xff);
+	job.out[17] = (char)(((job.outlen - 1) >> 8) & 0xff);
+}
+
+void BgzfWriter::writeBlock(const char *buf, size_t len) {
+	if(!fwrite((const void *)buf, len, 1, out_)) {
+		cerr << "Error while writing compressed output" << endl;
+		throw 1;
+	}
+}
+
+/**
+ * Body of a compressing thread: compress filled blocks in order until told
+ * to stop with none left.
+ */
+void BgzfWriter::compressMain(void *vp) {
+	BgzfWriter& w = *(BgzfWriter*)vp;
+	z_stream zs;
+	initDeflate(zs, w.level_);
+	while(true) {
+		Job *job = NULL;
+		{
+			tthread::lock_guard<tthread::mutex> lock(w.mutex_);
+			while(!w.stop_ && w.jobs_[w.next_].state != JOB_FILLED) {
+				w.cond_.wait(w.mutex_);
+			}
+			if(w.jobs_[w.next_].state != JOB_FILLED) {
+				break;
+			}
+			job = &w.jobs_[w.next_];
+			job->state = JOB_BUSY;
+			w.next_ = (w.next_ + 1) % w.njobs_;
+		}
+		w.compress(*job, zs);
+		{
+			tthread::lock_guard<tthread::mutex> lock(w.mutex_);
+			job->state = JOB_DONE;
+			w.cond_.notify_all();
+		}
+	}
+	deflateEnd(&zs);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#include <stdio.h>
+#include <zlib.h>
+#include "ds.h"
+#include "filebuf.h"
+#include "threading.h"
+
+/**
+ * Compresses the output of an OutFileBuf into BGZF: a series of gzip
+ * members, each holding at most BLOCK_IN bytes of input, followed by the
+ * empty end-of-file member.  Any gzip reader can read the result, and
+ * tools that know BGZF (bgzip, tabix, samtools) can also seek in it.
+ *
+ * Blocks are filled in order by the one thread writing to the OutFileBuf
+ * and compressed by 'nthreads' threads of our own (or by the writing
+ * thread if 'nthreads' is 0); compressed blocks are written in order, by
+ * the writing thread, as it needs their slots back.
+ */
+class BgzfWriter : public OutFileSink {
+
+	static const size_t BLOCK_IN  = 0xff00; // input bytes per block, as bgzip
+	static const size_t BLOCK_OUT = 0x10000; // largest block BGZF allows
+
+public:
+
+	BgzfWriter(FILE *out, size_t nthreads, int level = Z_DEFAULT_COMPRESSION);
+
+	virtual ~BgzfWriter();
+
+	virtual void write(const char *buf, size_t len);
+
+	virtual void finish();
+
+protected:
+
+	enum {
+		JOB_FREE = 0, // being filled, or not yet
+		JOB_FILLED,   // waiting to be compressed
+		JOB_BUSY,     // being compressed
+		JOB_DONE      // waiting to be written
+	};
+
+	struct Job {
+		char   in[BLOCK_IN];
+		char   out[BLOCK_OUT];
+		size_t inlen;
+		size_t outlen;
+		int    state;
+	};
+
+	/**
+	 * Queue the block being filled for compression and move on to the
+	 * next one, writing finished blocks until it's free.
+	 */
+	void submit();
+
+	/**
+	 * Write compressed blocks from head_ on, waiting for them while more
+	 * than 'maxsub' blocks are queued.
+	 */
+	void writeDone(size_t maxsub);
+
+	/**
+	 * Compress job.in into a complete BGZF block in job.out.
+	 */
+	void compress(Job& job, z_stream& zs);
+
+	void writeBlock(const char *buf, size_t len);
+
+	static void compressMain(void *vp);
+
+	FILE  *out_;
+	int    level_;
+	Job   *jobs_;
+	size_t njobs_;
+	size_t head_;     // oldest block not yet written
+	size_t tail_;     // block being filled
+	size_t nsub_;     // blocks queued from head_ on; only the filling thread uses these three
+	size_t next_;     // next block for a compressing thread to take
+	bool   stop_;
+	bool   finished_;
+	z_stream zs_;     // for compressing without threads of our own
+
+	EList<tthread::thread*>     threads_;
+	tthread::mutex              mutex_; // guards job states, next_ and stop_
+	tthread::condition_variable cond_;
+};
+
+#endif /*BGZF_H_*/
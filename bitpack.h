@@ -50,4 +50,64 @@ static inline int unpack_2b_from_32b(const uint32_t thirty2, const int off) {
 	return ((thirty2 >> (off*2)) & 0x3);
 }
 
+/**
+ * Routines for marshalling fixed-width values of 1-32 bits into and out
+ * of an array of 64-bit words.  Element i occupies bits [i*bits,
+ * (i+1)*bits) of the array, least significant bit first, so it spans
+ * at most two adjacent words.
+ */
+
+/**
+ * Return the number of 64-bit words needed to hold n elements of the
+ * given width.
+ */
+static inline uint64_t packed_64b_words(const uint64_t n, const int bits) {
+	return (n * (uint64_t)bits + 63) >> 6;
+}
+
+/**
+ * Return the smallest width (in bits, at least 1) that can hold every
+ * value in [0, n).
+ */
+static inline int packed_bits_for(const uint64_t n) {
+	int bits = 1;
+	while(bits < 64 && (1ull << bits) < n) bits++;
+	return bits;
+}
+
+/**
+ * OR the value 'val' into element i of 'words'.  The element must
+ * currently be zero.
+ */
+static inline void pack_bits_in_64b(const uint64_t val, uint64_t* words, const uint64_t i, const int bits) {
+	assert_gt(bits, 0);
+	assert_leq(bits, 32);
+	assert_lt(val, 1ull << bits);
+	const uint64_t bit = i * (uint64_t)bits;
+	const uint64_t w = bit >> 6;
+	const int sh = (int)(bit & 63);
+	words[w] |= (val << sh);
+	if(sh + bits > 64) {
+		words[w+1] |= (val >> (64 - sh));
+	}
+}
+
+/**
+ * Extract element i from 'words'.  Only word-aligned loads are used;
+ * the second word is touched only when the element straddles a word
+ * boundary.
+ */
+static inline uint64_t unpack_bits_from_64b(const uint64_t* words, const uint64_t i, const int bits) {
+	assert_gt(bits, 0);
+	assert_leq(bits, 32);
+	const uint64_t bit = i * (uint64_t)bits;
+	const uint64_t w = bit >> 6;
+	const int sh = (int)(bit & 63);
+	uint64_t val = words[w] >> sh;
+	if(sh + bits > 64) {
+		val |= (words[w+1] << (64 - sh));
+	}
+	return val & ((1ull << bits) - 1);
+}
+
 #endif /*BITPACK_H_*/
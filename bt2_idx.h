@@ -61,6 +61,7 @@
 #ifdef POPCNT_CAPABILITY
 #include "processor_support.h"
 #endif
+#include "rank_simd.h"
 
 using namespace std;
 
@@ -98,11 +99,30 @@ if(this->verbose()) { \
  */
 enum EBWT_FLAGS {
 	EBWT_COLOR = 2,     // true -> Ebwt is colorspace
-	EBWT_ENTIRE_REV = 4 // true -> reverse Ebwt is the whole
-	                    // concatenated string reversed, rather than
-						// each stretch reversed
+	EBWT_ENTIRE_REV = 4, // true -> reverse Ebwt is the whole
+	                     // concatenated string reversed, rather than
+	                     // each stretch reversed
+	EBWT_PACKED_OFFS = 8, // true -> SA samples are bit-packed genome IDs
+	EBWT_TEXT_OFFS = 16,  // true -> SA sampled every 2^offRate text
+	                      // offsets (and at the first offset of each
+	                      // sequence) rather than every 2^offRate rows
+	EBWT_LINE_OCC = 32    // true -> each side (counts + BWT chunk) is
+	                      // exactly one cache line and ebwt[] starts on
+	                      // a cache-line boundary in the .1 file
 };
 
+/// Size in bytes of the cache line that EBWT_LINE_OCC sides occupy
+static const int EBWT_LINE_OCC_SZ = 64;
+static const int EBWT_LINE_OCC_RATE = 6; // log2(EBWT_LINE_OCC_SZ)
+
+/// Version and magic number following the endianness sentinel of a .3.cf
+/// file in the v2 layout; a v1 file has its reference count there instead
+static const uint32_t TAX_FILE_VERSION = 2;
+static const uint64_t TAX_FILE_MAGIC = 0x324e4f5841544643ull; // "CFTAXON2"
+static const size_t   TAX_FILE_HDR_SZ = 16 + 9 * sizeof(uint64_t);
+/// Flags in a v2 .3.cf file
+static const uint64_t TAX_FILE_COMPRESSED = 1; // references are compressed sequences
+
 /**
  * Extended Burrows-Wheeler transform header.  This together with the
  * actual data arrays and other text-specific parameters defined in
@@ -120,14 +140,15 @@ public:
 		int32_t offRate,
 		int32_t ftabChars,
 		bool color,
-		bool entireReverse)
+		bool entireReverse,
+		bool lineOcc = false)
 	{
-		init(len, lineRate, offRate, ftabChars, color, entireReverse);
+		init(len, lineRate, offRate, ftabChars, color, entireReverse, lineOcc);
 	}
 
 	EbwtParams(const EbwtParams& eh) {
 		init(eh._len, eh._lineRate, eh._offRate,
-		     eh._ftabChars, eh._color, eh._entireReverse);
+		     eh._ftabChars, eh._color, eh._entireReverse, eh._lineOcc);
 	}
 
 	void init(
@@ -136,10 +157,12 @@ public:
 		int32_t offRate,
 		int32_t ftabChars,
 		bool color,
-		bool entireReverse)
+		bool entireReverse,
+		bool lineOcc = false)
 	{
 		_color = color;
 		_entireReverse = entireReverse;
+		_lineOcc = lineOcc;
 		_len = len;
 		_bwtLen = _len + 1;
 		_sz = (len+3)/4;
@@ -192,6 +215,18 @@ public:
 	index_t ebwtTotSz() const     { return _ebwtTotSz; }
 	bool color() const            { return _color; }
 	bool entireReverse() const    { return _entireReverse; }
+	bool lineOcc() const          { return _lineOcc; }
+
+	/**
+	 * Number of zero bytes written ahead of ebwt[] in the primary file,
+	 * given the file offset 'off' where ebwt[] would otherwise start.
+	 * Cache-line layouts pad to a line boundary so that a memory-mapped
+	 * index keeps each side within one line.
+	 */
+	index_t ebwtPad(uint64_t off) const {
+		if(!_lineOcc) return 0;
+		return (index_t)((EBWT_LINE_OCC_SZ - off % EBWT_LINE_OCC_SZ) % EBWT_LINE_OCC_SZ);
+	}
 
 	/**
 	 * Set a new suffix-array sampling rate, which involves updating
@@ -215,6 +250,7 @@ public:
         assert_lt(_lineRate, 32);
 		assert_lt(_ftabChars, 32);
 		assert_eq(0, _ebwtTotSz % _lineSz);
+		assert(!_lineOcc || _sideSz == (index_t)EBWT_LINE_OCC_SZ);
 		return true;
 	}
 #endif
@@ -247,7 +283,8 @@ public:
 		    << "    ebwtTotLen: "   << _ebwtTotLen << endl
 		    << "    ebwtTotSz: "    << _ebwtTotSz << endl
 		    << "    color: "        << _color << endl
-		    << "    reverse: "      << _entireReverse << endl;
+		    << "    reverse: "      << _entireReverse << endl
+		    << "    lineOcc: "      << _lineOcc << endl;
 	}
 
 	index_t _len;
@@ -275,6 +312,7 @@ public:
 	index_t _ebwtTotSz;
 	bool     _color;
 	bool     _entireReverse;
+	bool     _lineOcc;
 };
 
 /**
@@ -394,7 +432,9 @@ struct SideLocus {
 	/**
 	 * Convert locus to BW row it corresponds to.
 	 */
-    index_t toBWRow() const;
+	index_t toBWRow(const EbwtParams<index_t>& ep) const {
+		return _sideNum * ep._sideBwtLen + _charOff;
+	}
 	
 #ifndef NDEBUG
 	/**
@@ -402,7 +442,7 @@ struct SideLocus {
 	 * with the (provided) EbwtParams.
 	 */
 	bool repOk(const EbwtParams<index_t>& ep) const {
-		ASSERT_ONLY(index_t row = toBWRow());
+		ASSERT_ONLY(index_t row = toBWRow(ep));
 		assert_leq(row, ep._len);
 		assert_range(-1, 3, _bp);
 		assert_range(0, (int)ep._sideBwtSz, _by);
@@ -440,33 +480,6 @@ struct SideLocus {
 	int32_t _bp;          // bitpair within byte (not adjusted for bw sides)
 };
 
-/**
- * Convert locus to BW row it corresponds to.
- */
-template <typename index_t>
-inline index_t SideLocus<index_t>::toBWRow() const {
-    if(sizeof(index_t) == 8) {
-        return _sideNum * (512 - 16 * sizeof(index_t)) + _charOff;
-    } else {
-        return _sideNum * (256 - 16 * sizeof(index_t)) + _charOff;
-    }
-}
-
-template <>
-inline uint64_t SideLocus<uint64_t>::toBWRow() const {
-    return _sideNum * (512 - 16 * sizeof(uint64_t)) + _charOff;
-}
-
-template <>
-inline uint32_t SideLocus<uint32_t>::toBWRow() const {
-    return _sideNum * (256 - 16 * sizeof(uint32_t)) + _charOff;
-}
-
-template <>
-inline uint16_t SideLocus<uint16_t>::toBWRow() const {
-    return _sideNum * (256 - 16 * sizeof(uint16_t)) + _charOff;
-}
-
 #ifdef POPCNT_CAPABILITY   // wrapping of "struct"
 struct USE_POPCNT_GENERIC {
 #endif
@@ -519,6 +532,23 @@ inline static int countInU64(int c, uint64_t dw) {
 // Forward declarations for Ebwt class
 class EbwtSearchParams;
 
+/**
+ * How much memory one part of a loaded index takes, and whether it's
+ * private to the process (on the heap) or lives in a memory-mapped file
+ * or in shared memory, where other processes can share it.
+ */
+struct EbwtMemPart {
+
+	EbwtMemPart() : name(NULL), bytes(0), heap(true) { }
+
+	EbwtMemPart(const char *name_, uint64_t bytes_, bool heap_) :
+		name(name_), bytes(bytes_), heap(heap_) { }
+
+	const char *name;
+	uint64_t    bytes;
+	bool        heap;
+};
+
 /**
  * Extended Burrows-Wheeler transform data.
  *
@@ -551,15 +581,25 @@ public:
 	    _ftab(EBWT_CAT), \
 	    _eftab(EBWT_CAT), \
         _offw(false), \
+        _offp(false), \
+        _offBits(0), \
 	    _offs(EBWT_CAT), \
         _offsw(EBWT_CAT), \
+        _offsp(EBWT_CAT), \
+        _offText(false), \
+        _nOffs(0), \
+        _offMarks(EBWT_CAT), \
+        _offMarkRanks(EBWT_CAT), \
 	    _ebwt(EBWT_CAT), \
+	    _ebwtAlloc(EBWT_CAT), \
 	    _useMm(false), \
 	    useShmem_(false), \
 	    _refnames(EBWT_CAT), \
 	    mmFile1_(NULL), \
 	    mmFile2_(NULL), \
-        _compressed(false)
+        _compressed(false), \
+        _taxMm(NULL), \
+        _taxMmLen(0)
 
 	/// Construct an Ebwt from the given input file
 	Ebwt(const string& in,
@@ -587,6 +627,7 @@ public:
 #ifdef POPCNT_CAPABILITY
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
+        _rankKernel = rankKernelFor(ps);
 #endif
         
 		packed_ = false;
@@ -622,16 +663,19 @@ public:
         // Read conversion table, genome size table, and taxonomy tree
         string in3Str = in + ".3." + gEbwt_ext;
         if(verbose || startVerbose) cerr << "Opening \"" << in3Str.c_str() << "\"" << endl;
+        initial_tax_rank_num();
+        if(readTaxonomyV2(in3Str, startVerbose)) {
+            return;
+        }
+
         ifstream in3(in3Str.c_str(), ios::binary);
         if(!in3.good()) {
             cerr << "Could not open index file " << in3Str.c_str() << endl;
         }
         
-        initial_tax_rank_num();
-        
         set<uint64_t> leaves;
         size_t num_cids = 0; // number of compressed sequences
-        _uid_to_tid.clear();
+        EList<pair<string, uint64_t> > uid_to_tid;
         readU32(in3, this->toBe());
         uint64_t nref = readIndex<uint64_t>(in3, this->toBe());
         if(nref > 0) {
@@ -648,20 +692,20 @@ public:
                     num_cids++;
                 }
                 tid = readIndex<uint64_t>(in3, this->toBe());
-                _uid_to_tid.expand();
-                _uid_to_tid.back().first = uid;
-                _uid_to_tid.back().second = tid;
+                uid_to_tid.expand();
+                uid_to_tid.back().first = uid;
+                uid_to_tid.back().second = tid;
                 leaves.insert(tid);
-                if(nref == _uid_to_tid.size()) break;
+                if(nref == uid_to_tid.size()) break;
             }
-            assert_eq(nref, _uid_to_tid.size());
+            assert_eq(nref, uid_to_tid.size());
         }
         
         if(num_cids >= 10) {
             this->_compressed = true;
         }
         
-        _tree.clear();
+        TaxonomyTree tree;
         uint64_t ntid = readIndex<uint64_t>(in3, this->toBe());
         if(ntid > 0) {
             while(!in3.eof()) {
@@ -670,13 +714,13 @@ public:
                 node.parent_tid = readIndex<uint64_t>(in3, this->toBe());
                 node.rank = readIndex<uint16_t>(in3, this->toBe());
                 node.leaf = (leaves.find(tid) != leaves.end());
-                _tree[tid] = node;
-                if(ntid == _tree.size()) break;
+                tree[tid] = node;
+                if(ntid == tree.size()) break;
             }
-            assert_eq(ntid, _tree.size());
+            assert_eq(ntid, tree.size());
         }
         
-        _name.clear();
+        std::map<uint64_t, string> names;
         uint64_t nname = readIndex<uint64_t>(in3, this->toBe());
         if(nname > 0) {
             string name;
@@ -684,67 +728,35 @@ public:
                 uint64_t tid = readIndex<uint64_t>(in3, this->toBe());
                 in3 >> name;
                 in3.seekg(1, ios_base::cur);
-                assert(_name.find(tid) == _name.end());
+                assert(names.find(tid) == names.end());
                 std::replace(name.begin(), name.end(), '@', ' ');
-                _name[tid] = name;
-                if(_name.size() == nname)
+                names[tid] = name;
+                if(names.size() == nname)
                     break;
             }
         }
         
-        _size.clear();
+        std::map<uint64_t, uint64_t> sizes;
         uint64_t nsize = readIndex<uint64_t>(in3, this->toBe());
         if(nsize > 0) {
             while(!in3.eof()) {
                 uint64_t tid = readIndex<uint64_t>(in3, this->toBe());
                 uint64_t size = readIndex<uint64_t>(in3, this->toBe());
-                assert(_size.find(tid) == _size.end());
-                _size[tid] = size;
-                if(_size.size() == nsize)
+                assert(sizes.find(tid) == sizes.end());
+                sizes[tid] = size;
+                if(sizes.size() == nsize)
                     break;
             }
         }
         
         // Calculate average genome size
         if(!this->_offw) { // Skip if there are many sequences (e.g. >64K)
-            for(map<uint64_t, TaxonomyNode>::const_iterator tree_itr = _tree.begin(); tree_itr != _tree.end(); tree_itr++) {
-                uint64_t tid = tree_itr->first;
-                const TaxonomyNode& node = tree_itr->second;
-                if(node.rank == RANK_SPECIES || node.rank == RANK_GENUS || node.rank == RANK_FAMILY ||
-                   node.rank == RANK_ORDER || node.rank == RANK_CLASS || node.rank == RANK_PHYLUM) {
-                    size_t sum = 0, count = 0;
-                    for(map<uint64_t, uint64_t>::const_iterator size_itr = _size.begin(); size_itr != _size.end(); size_itr++) {
-                        uint64_t c_tid = size_itr->first;
-                        map<uint64_t, TaxonomyNode>::const_iterator tree_itr2 = _tree.find(c_tid);
-                        if(tree_itr2 == _tree.end())
-                            continue;
-                        
-                        assert(tree_itr2 != _tree.end());
-                        const TaxonomyNode& c_node = tree_itr2->second;
-                        if((c_node.rank == RANK_UNKNOWN && c_node.leaf) ||
-                           tax_rank_num[c_node.rank] < tax_rank_num[RANK_SPECIES]) {
-                            c_tid = c_node.parent_tid;
-                            while(true) {
-                                if(c_tid == tid) {
-                                    sum += size_itr->second;
-                                    count += 1;
-                                    break;
-                                }
-                                tree_itr2 = _tree.find(c_tid);
-                                if(tree_itr2 == _tree.end())
-                                    break;
-                                if(c_tid == tree_itr2->second.parent_tid)
-                                    break;
-                                c_tid = tree_itr2->second.parent_tid;
-                            }
-                        }
-                    }
-                    if(count > 0) {
-                        _size[tid] = sum / count;
-                    }
-                }
-            }
+            average_genome_sizes(tree, sizes);
         }
+        _uid_to_tid.assign(uid_to_tid);
+        _tree.assign(tree);
+        _name.assign(names);
+        _size.assign(sizes);
         _paths.buildPaths(_uid_to_tid, _tree);
         
         in3.close();
@@ -784,6 +796,7 @@ public:
 #ifdef POPCNT_CAPABILITY
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
+        _rankKernel = rankKernelFor(ps);
 #endif
 		packed_ = packed;
 	}
@@ -824,7 +837,9 @@ public:
          int kmer_size = 0,
          bool verbose = false,
          bool passMemExc = false,
-         bool sanityCheck = false) :
+         bool sanityCheck = false,
+         bool textSampled = false,
+         bool lineOcc = false) :
     Ebwt_INITS,
     _eh(
         joinedLen(szs),
@@ -832,15 +847,19 @@ public:
         offRate,
         ftabChars,
         color,
-        refparams.reverse == REF_READ_REVERSE)
+        refparams.reverse == REF_READ_REVERSE,
+        lineOcc)
 	{
 #ifdef POPCNT_CAPABILITY
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
+        _rankKernel = rankKernelFor(ps);
 #endif
 		_in1Str = file + ".1." + gEbwt_ext;
 		_in2Str = file + ".2." + gEbwt_ext;
 		packed_ = packed;
+		_offp = true; // always write bit-packed SA samples
+		_offText = textSampled;
 		// Open output files
 		ofstream fout1(_in1Str.c_str(), ios::binary);
 		if(!fout1.good()) {
@@ -1154,8 +1173,8 @@ public:
                         const string& base_fname,
                         const string& conversion_table_fname,
                         const string& taxonomy_fname,
-                        const string& size_table_fname,
                         const string& name_table_fname,
+                        const string& size_table_fname,
 	                    bool useBlockwise,
 	                    index_t bmax,
 	                    index_t bmaxSqrtMult,
@@ -1224,6 +1243,9 @@ public:
 		}
         
         this->_offw = this->_nPat > std::numeric_limits<uint16_t>::max();
+        if(this->_offp) {
+            this->_offBits = packed_bits_for(this->_nPat);
+        }
         
         std::set<string> uids;
         for(size_t i = 0; i < _refnames.size(); i++) {
@@ -1266,27 +1288,34 @@ public:
             << "Please make sure the directory exists and that permissions allow writing by Centrifuge" << endl;
             throw 1;
         }
-        std::set<uint64_t> tids;
-        writeIndex<int32_t>(fout3, 1, this->toBe()); // endianness sentinel
-        writeIndex<uint64_t>(fout3, _refnames.size(), this->toBe());
+        std::set<uint64_t> tids, leaves;
+        EList<pair<string, uint64_t> > refs;
+        size_t num_cids = 0; // number of compressed sequences
         for(size_t i = 0; i < _refnames.size(); i++) {
             const string& refname = _refnames[i];
             string uid = get_uid(refname);
+            refs.expand();
             for(size_t c = 0; c < uid.length(); c++) {
-                fout3 << uid[c];
+                if(!isspace(uid[c])) refs.back().first.push_back(uid[c]);
+            }
+            if(uid.find("cid") == 0) {
+                num_cids++;
             }
-            fout3 << '\0';
             if(uid_to_tid.find(uid) != uid_to_tid.end()) {
                 uint64_t tid = uid_to_tid[uid];
-                writeIndex<uint64_t>(fout3, tid, this->toBe());
+                refs.back().second = tid;
                 tids.insert(tid);
             } else {
                 cerr << "Warning: taxomony id doesn't exists for " << uid << "!" << endl;
-                writeIndex<uint64_t>(fout3, 0, this->toBe());
+                refs.back().second = 0;
             }
+            leaves.insert(refs.back().second);
         }
+        _compressed = (num_cids >= 10);
 
         // Read taxonomy
+        TaxonomyTree tree_out;
+        std::map<uint64_t, string> names;
         {
             TaxonomyTree tree = read_taxonomy_tree(taxonomy_fname);
             std::set<uint64_t> tree_color;
@@ -1304,18 +1333,14 @@ public:
                     tid = parent_tid;
                 }
             }
-            writeIndex<uint64_t>(fout3, tree_color.size(), this->toBe());
             for(std::set<uint64_t>::iterator itr = tree_color.begin(); itr != tree_color.end(); itr++) {
                 uint64_t tid = *itr;
-                writeIndex<uint64_t>(fout3, tid, this->toBe());
                 assert(tree.find(tid) != tree.end());
                 const TaxonomyNode& node = tree[tid];
-                writeIndex<uint64_t>(fout3, node.parent_tid, this->toBe());
-                writeIndex<uint16_t>(fout3, node.rank, this->toBe());
+                tree_out[tid] = TaxonomyNode(node.parent_tid, node.rank, leaves.find(tid) != leaves.end());
             }
         
             // Read name table
-            _name.clear();
             if(name_table_fname != "") {
                 ifstream table_file(name_table_fname.c_str(), ios::in);
                 if(table_file.is_open()) {
@@ -1335,10 +1360,10 @@ public:
                         while(true) {
                             cline >> temp;
                             if(temp == "|") break;
-                            scientific_name.push_back('@');
+                            scientific_name.push_back(' ');
                             scientific_name += temp;
                         }
-                        _name[tid] = scientific_name;
+                        names[tid] = scientific_name;
                     }
                     table_file.close();
                 } else {
@@ -1346,18 +1371,11 @@ public:
                     throw 1;
                 }
             }
-            
-            writeIndex<uint64_t>(fout3, _name.size(), this->toBe());
-            for(std::map<uint64_t, string>::const_iterator itr = _name.begin(); itr != _name.end(); itr++) {
-                writeIndex<uint64_t>(fout3, itr->first, this->toBe());
-                fout3 << itr->second << endl;
-            }
         }
         
         // Read size table
+        std::map<uint64_t, uint64_t> sizes;
         {
-            _size.clear();
-            
             // Calculate contig (or genome) sizes corresponding to each taxonomic ID
             for(size_t i = 0; i < _refnames.size(); i++) {
                 string uid = get_uid(_refnames[i]);
@@ -1365,10 +1383,10 @@ public:
                     continue;
                 uint64_t tid = uid_to_tid[uid];
                 uint64_t contig_size = plen()[i];
-                if(_size.find(tid) == _size.end()) {
-                    _size[tid] = contig_size;
+                if(sizes.find(tid) == sizes.end()) {
+                    sizes[tid] = contig_size;
                 } else {
-                    _size[tid] += contig_size;
+                    sizes[tid] += contig_size;
                 }
             }
             
@@ -1382,7 +1400,7 @@ public:
                         uint64_t tid = get_tid(stid);
                         uint64_t size;
                         table_file >> size;
-                        _size[tid] = size;
+                        sizes[tid] = size;
                     }
                     table_file.close();
                 } else {
@@ -1391,13 +1409,19 @@ public:
                 }
             }
             
-            writeIndex<uint64_t>(fout3, _size.size(), this->toBe());
-            for(std::map<uint64_t, uint64_t>::const_iterator itr = _size.begin(); itr != _size.end(); itr++) {
-                writeIndex<uint64_t>(fout3, itr->first, this->toBe());
-                writeIndex<uint64_t>(fout3, itr->second, this->toBe());
+            // Calculate average genome size
+            if(!this->_offw) { // Skip if there are many sequences (e.g. >64K)
+                initial_tax_rank_num();
+                average_genome_sizes(tree_out, sizes);
             }
         }
         
+        _uid_to_tid.assign(refs);
+        _tree.assign(tree_out);
+        _name.assign(names);
+        _size.assign(sizes);
+        _paths.buildPaths(_uid_to_tid, _tree);
+        writeTaxonomy(fout3);
         fout3.close();
     
 		// Succesfully obtained joined reference string
@@ -1550,18 +1574,45 @@ public:
 		_rstarts.reset();
 		_offs.reset();
         _offsw.reset();
+        _offsp.reset();
+        _offMarks.reset();
+        _offMarkRanks.reset();
 		_ebwt.reset();
+		_ebwtAlloc.reset();
 		if(offs() != NULL && useShmem_) {
 			FREE_SHARED(offs());
 		}
         if(offsw() != NULL && useShmem_) {
             FREE_SHARED(offsw());
+        }
+        if(offsp() != NULL && useShmem_) {
+            FREE_SHARED(offsp());
+        }
+        if(offMarks() != NULL && useShmem_) {
+            FREE_SHARED(offMarks());
         }
 		if(ebwt() != NULL && useShmem_) {
 			FREE_SHARED(ebwt());
 		}
 		if (_in1 != NULL) fclose(_in1);
 		if (_in2 != NULL) fclose(_in2);
+		releaseTaxonomyFile();
+	}
+
+	/**
+	 * Let go of the .3.cf file the taxonomy tables point into, once they
+	 * no longer do.
+	 */
+	void releaseTaxonomyFile() {
+#ifdef BOWTIE_MM
+		if(_taxMm != NULL) {
+			munmap(_taxMm, _taxMmLen);
+		}
+#endif
+		_taxMm = NULL;
+		_taxMmLen = 0;
+		EList<uint64_t> empty;
+		_taxBuf.swap(empty);
 	}
 
 	/// Accessors
@@ -1576,6 +1627,7 @@ public:
 	inline index_t*   eftab()             { return _eftab.get(); }
 	inline uint16_t*   offs()              { return _offs.get(); }
     inline uint32_t*   offsw()             { return _offsw.get(); }
+    inline uint64_t*   offsp()             { return _offsp.get(); }
 	inline index_t*   plen()              { return _plen.get(); }
 	inline index_t*   rstarts()           { return _rstarts.get(); }
 	inline uint8_t*    ebwt()              { return _ebwt.get(); }
@@ -1584,6 +1636,10 @@ public:
 	inline const index_t* eftab() const   { return _eftab.get(); }
     inline const uint16_t* offs() const    { return _offs.get(); }
     inline const uint32_t* offsw() const    { return _offsw.get(); }
+    inline const uint64_t* offsp() const    { return _offsp.get(); }
+    inline const uint64_t* offMarks() const { return _offMarks.get(); }
+    inline uint64_t*   offMarks()          { return _offMarks.get(); }
+    int         offBits() const      { return _offBits; }
 	inline const index_t* plen() const    { return _plen.get(); }
 	inline const index_t* rstarts() const { return _rstarts.get(); }
 	inline const uint8_t*  ebwt() const    { return _ebwt.get(); }
@@ -1593,16 +1649,248 @@ public:
 	EList<string>& refnames()        { return _refnames; }
 	bool        fw() const           { return fw_; }
     
-    const EList<pair<string, uint64_t> >&   uid_to_tid() const { return _uid_to_tid; }
-    const TaxonomyTree& tree() const { return _tree; }
-    const TaxonomyPathTable&                paths() const { return _paths; }
-    const std::map<uint64_t, string>&       name() const { return _name; }
-    const std::map<uint64_t, uint64_t>&     size() const { return _size; }
-    bool                                    compressed() const { return _compressed; }
-    
-    
+    const TaxRefTable&       uid_to_tid() const { return _uid_to_tid; }
+    const TaxTreeTable&      tree() const { return _tree; }
+    const TaxonomyPathTable& paths() const { return _paths; }
+    const TaxNameTable&      name() const { return _name; }
+    const TaxSizeTable&      size() const { return _size; }
+    bool                     compressed() const { return _compressed; }
+
+    /**
+     * Append the sequences of another shard of the same database to the
+     * uid table, add its taxa, names and sizes that aren't here yet, and
+     * rebuild the taxonomy paths over both.  The other shard's uniqueIDs are then valid here once offset by the
+     * size the uid table had before.  The merged tables are held on the
+     * heap, so this shard's .3.cf file is let go of.
+     */
+    void appendTaxonomy(const Ebwt<index_t>& o) {
+        EList<pair<string, uint64_t> > refs;
+        for(size_t i = 0; i < _uid_to_tid.size(); i++) {
+            refs.push_back(make_pair(string(_uid_to_tid.uid(i)), _uid_to_tid.tid(i)));
+        }
+        for(size_t i = 0; i < o._uid_to_tid.size(); i++) {
+            refs.push_back(make_pair(string(o._uid_to_tid.uid(i)), o._uid_to_tid.tid(i)));
+        }
+        TaxonomyTree tree(_tree.begin(), _tree.end());
+        for(TaxTreeTable::const_iterator itr = o._tree.begin(); itr != o._tree.end(); itr++) {
+            TaxonomyTree::iterator found = tree.find(itr->first);
+            if(found == tree.end()) {
+                tree[itr->first] = itr->second;
+            } else if(itr->second.leaf) {
+                found->second.leaf = true;
+            }
+        }
+        std::map<uint64_t, string> names;
+        for(size_t i = 0; i < _name.size(); i++) {
+            names[_name.tid(i)] = _name.name(i);
+        }
+        for(size_t i = 0; i < o._name.size(); i++) {
+            names.insert(make_pair(o._name.tid(i), string(o._name.name(i))));
+        }
+        std::map<uint64_t, uint64_t> sizes(_size.begin(), _size.end());
+        sizes.insert(o._size.begin(), o._size.end());
+        _uid_to_tid.assign(refs);
+        _tree.assign(tree);
+        _name.assign(names);
+        _size.assign(sizes);
+        _paths.buildPaths(_uid_to_tid, _tree);
+        releaseTaxonomyFile();
+    }
+
+    /**
+     * Write the conversion table, taxonomy tree, name and size tables and
+     * taxonomy paths to 'out' in the v2 layout of the .3.cf file.
+     */
+    void writeTaxonomy(ostream& out) const {
+        const bool be = this->toBe();
+        const size_t uidLen = (_uid_to_tid.poolLen() + 7) & ~(size_t)7;
+        const size_t nameLen = (_name.poolLen() + 7) & ~(size_t)7;
+        writeIndex<int32_t>(out, 1, be); // endianness sentinel
+        writeIndex<uint32_t>(out, TAX_FILE_VERSION, be);
+        writeIndex<uint64_t>(out, TAX_FILE_MAGIC, be);
+        writeIndex<uint64_t>(out, _uid_to_tid.size(), be);
+        writeIndex<uint64_t>(out, uidLen, be);
+        writeIndex<uint64_t>(out, _tree.size(), be);
+        writeIndex<uint64_t>(out, _name.size(), be);
+        writeIndex<uint64_t>(out, nameLen, be);
+        writeIndex<uint64_t>(out, _size.size(), be);
+        writeIndex<uint64_t>(out, _paths.tid_to_pid.size(), be);
+        writeIndex<uint64_t>(out, _paths.npaths, be);
+        writeIndex<uint64_t>(out, _compressed ? TAX_FILE_COMPRESSED : 0, be);
+        for(size_t i = 0; i < _uid_to_tid.size(); i++) {
+            writeIndex<uint64_t>(out, _uid_to_tid.tid(i), be);
+        }
+        for(size_t i = 0; i < _uid_to_tid.size(); i++) {
+            writeIndex<uint64_t>(out, _uid_to_tid.offsets()[i], be);
+        }
+        const char zeros[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+        out.write(_uid_to_tid.pool(), _uid_to_tid.poolLen());
+        out.write(zeros, uidLen - _uid_to_tid.poolLen());
+        for(TaxTreeTable::const_iterator itr = _tree.begin(); itr != _tree.end(); itr++) {
+            writeIndex<uint64_t>(out, itr->first, be);
+            writeIndex<uint64_t>(out, itr->second.parent_tid, be);
+            out.put((char)itr->second.rank);
+            out.put((char)itr->second.leaf);
+            out.write(zeros, 6);
+        }
+        for(size_t i = 0; i < _name.size(); i++) {
+            writeIndex<uint64_t>(out, _name.offsets()[i].first, be);
+            writeIndex<uint64_t>(out, _name.offsets()[i].second, be);
+        }
+        out.write(_name.pool(), _name.poolLen());
+        out.write(zeros, nameLen - _name.poolLen());
+        for(TaxSizeTable::const_iterator itr = _size.begin(); itr != _size.end(); itr++) {
+            writeIndex<uint64_t>(out, itr->first, be);
+            writeIndex<uint64_t>(out, itr->second, be);
+        }
+        for(size_t i = 0; i < _paths.tid_to_pid.size(); i++) {
+            writeIndex<uint64_t>(out, _paths.tid_to_pid[i].first, be);
+            writeIndex<uint64_t>(out, _paths.tid_to_pid[i].second, be);
+        }
+        for(size_t i = 0; i < _paths.npaths * TaxonomyPathTable::nranks; i++) {
+            writeIndex<uint64_t>(out, _paths.path_ids[i], be);
+        }
+    }
+
+    /**
+     * If 'fname' is a .3.cf file in the v2 layout, point the conversion
+     * table, taxonomy tree, name and size tables and taxonomy paths into it
+     * and return true; return false if it's in the v1 layout, which has to
+     * be parsed.  After the endianness sentinel, version and magic number,
+     * a v2 file holds nine uint64 counts (references, bytes of their unique
+     * IDs, taxa, names, bytes of names, sizes, taxa with a path, paths, and
+     * flags) and then, each starting on an 8-byte boundary: the references'
+     * taxonomic IDs, the offsets of their unique IDs, the NUL-terminated
+     * unique IDs, the (ID, TaxonomyNode) records of the tree, the (ID,
+     * offset) pairs and pool of the names, the (ID, size) pairs with sizes
+     * already averaged, the (ID, path ID) pairs and the paths, nranks IDs
+     * each.  Records are sorted by ID, so the tables can be used as they
+     * lie.  With --mm the file is memory-mapped, and processes share it
+     * through the page cache; otherwise it's read in one go.
+     */
+    bool readTaxonomyV2(const string& fname, bool startVerbose) {
+        FILE *f = fopen(fname.c_str(), "rb");
+        if(f == NULL) {
+            return false;
+        }
+        uint64_t hdr[2];
+        if(fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) {
+            fclose(f);
+            return false;
+        }
+        int32_t one;
+        uint32_t version;
+        memcpy(&one, hdr, sizeof(one));
+        memcpy(&version, (const char*)hdr + sizeof(one), sizeof(version));
+        uint64_t magic = hdr[1];
+        bool swap = (one != 1);
+        if(swap) {
+            version = endianSwapU32(version);
+            magic = endianSwapU64(magic);
+        }
+        if(magic != TAX_FILE_MAGIC || (swap && one != endianSwapI32(1))) {
+            fclose(f);
+            return false;
+        }
+        if(version != TAX_FILE_VERSION) {
+            cerr << "Error: " << fname << " is version " << version << " of the taxonomy file; this Centrifuge reads version "
+                 << TAX_FILE_VERSION << endl;
+            fclose(f);
+            throw 1;
+        }
+        struct stat sbuf;
+        if(fstat(fileno(f), &sbuf) == -1) {
+            perror("fstat");
+            cerr << "Error: Could not stat index file " << fname << endl;
+            fclose(f);
+            throw 1;
+        }
+        const size_t len = (size_t)sbuf.st_size;
+        char *buf = NULL;
+#ifdef BOWTIE_MM
+        if(_useMm && !swap && len > 0) {
+            if(_verbose || startVerbose) {
+                cerr << "  Memory-mapping taxonomy file " << fname << ": ";
+                logTime(cerr);
+            }
+            buf = (char*)mmap((void *)0, len, PROT_READ, MAP_SHARED, fileno(f), 0);
+            if(buf == (void *)(-1)) {
+                perror("mmap");
+                cerr << "Error: Could not memory-map the index file " << fname << endl;
+                fclose(f);
+                throw 1;
+            }
+            _taxMm = buf;
+            _taxMmLen = len;
+        }
+#endif
+        if(buf == NULL) {
+            _taxBuf.resizeExact((len + 7) / 8);
+            rewind(f);
+            if(fread(_taxBuf.ptr(), 1, len, f) != len) {
+                cerr << "Error: Could not read index file " << fname << endl;
+                fclose(f);
+                throw 1;
+            }
+            buf = (char*)_taxBuf.ptr();
+        }
+        fclose(f);
+
+        // Counts, then the number of words in and start of each table
+        const uint64_t nranks = TaxonomyPathTable::nranks;
+        uint64_t cnt[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+        bool ok = (len >= TAX_FILE_HDR_SZ);
+        for(size_t i = 0; i < 9 && ok; i++) {
+            cnt[i] = ((const uint64_t*)(buf + 16))[i];
+            if(swap) cnt[i] = endianSwapU64(cnt[i]);
+            ok = (cnt[i] <= len);
+        }
+        ok = ok && (cnt[1] % 8 == 0) && (cnt[4] % 8 == 0);
+        uint64_t nwords[9] = {
+            cnt[0], cnt[0], cnt[1] / 8, // references
+            cnt[2] * 3,                 // tree
+            cnt[3] * 2, cnt[4] / 8,     // names
+            cnt[5] * 2,                 // sizes
+            cnt[6] * 2, cnt[7] * nranks // paths
+        };
+        size_t start[9], off = TAX_FILE_HDR_SZ;
+        for(size_t i = 0; i < 9 && ok; i++) {
+            start[i] = off;
+            ok = (nwords[i] * 8 <= len - off);
+            off += nwords[i] * 8;
+        }
+        if(!ok) {
+            cerr << "Error: index file " << fname << " is truncated or corrupt" << endl;
+            throw 1;
+        }
+        if(swap) {
+            // Only a heap copy gets here.  Unique IDs and names are bytes, and
+            // so are the rank and leaf flag in the last word of a tree record.
+            nwords[2] = nwords[5] = 0;
+            for(size_t i = 0; i < 9; i++) {
+                uint64_t *w = (uint64_t*)(buf + start[i]);
+                for(uint64_t j = 0; j < nwords[i]; j++) {
+                    if(i == 3 && j % 3 == 2) continue;
+                    w[j] = endianSwapU64(w[j]);
+                }
+            }
+        }
+        assert_eq(24, sizeof(TaxTreeTable::value_type));
+        _uid_to_tid.borrow((const uint64_t*)(buf + start[0]), (const uint64_t*)(buf + start[1]), cnt[0],
+                           buf + start[2], cnt[1]);
+        _tree.borrow((const TaxTreeTable::value_type*)(buf + start[3]), cnt[2]);
+        _name.borrow((const pair<uint64_t, uint64_t>*)(buf + start[4]), cnt[3], buf + start[5], cnt[4]);
+        _size.borrow((const TaxSizeTable::value_type*)(buf + start[6]), cnt[5]);
+        _paths.borrow((const pair<uint64_t, uint64_t>*)(buf + start[7]), cnt[6],
+                      (const uint64_t*)(buf + start[8]), cnt[7]);
+        _compressed = (cnt[8] & TAX_FILE_COMPRESSED) != 0;
+        return true;
+    }
+
+
 #ifdef POPCNT_CAPABILITY
     bool _usePOPCNTinstruction;
+    int _rankKernel; // RANK_KERNEL_* chosen from CPUID at startup
 #endif
 
 	/**
@@ -1649,6 +1937,8 @@ public:
 			assert(fchr() == NULL);
 			assert(offs() == NULL);
             assert(offsw() == NULL);
+            assert(offsp() == NULL);
+            assert(offMarks() == NULL);
 			// assert(rstarts() == NULL); // FIXME FB: Assertion fails when calling centrifuge-build-bin-debug
 			assert_eq(_zEbwtByteOff, (index_t)OFF_MASK);
 			assert_eq(_zEbwtBpOff, -1);
@@ -1661,6 +1951,40 @@ public:
 		return !isInMemory();
 	}
 
+	/**
+	 * Append the memory taken by each part of the index, as currently
+	 * loaded, to parts.
+	 */
+	void memoryUse(EList<EbwtMemPart>& parts) const {
+		parts.push_back(EbwtMemPart("BWT", _ebwt.size(),
+			_ebwt.freeable() || _ebwtAlloc.freeable()));
+		parts.push_back(EbwtMemPart("ftab", ((uint64_t)_ftab.size() + _eftab.size() + _fchr.size()) * sizeof(index_t),
+			_ftab.freeable() || _ftab.get() == NULL));
+		uint64_t sa = (uint64_t)_offs.size() * sizeof(uint16_t) +
+		              (uint64_t)_offsw.size() * sizeof(uint32_t) +
+		              (uint64_t)_offsp.size() * sizeof(uint64_t);
+		parts.push_back(EbwtMemPart("SA samples", sa,
+			_offs.freeable() || _offsw.freeable() || _offsp.freeable() || sa == 0));
+		if(_offMarks.get() != NULL) {
+			parts.push_back(EbwtMemPart("SA sample marks",
+				(uint64_t)_offMarks.size() * sizeof(uint64_t) + (uint64_t)_offMarkRanks.size() * sizeof(index_t),
+				_offMarks.freeable()));
+		}
+		parts.push_back(EbwtMemPart("text offsets", ((uint64_t)_plen.size() + _rstarts.size()) * sizeof(index_t),
+			_rstarts.freeable() || _rstarts.get() == NULL));
+		uint64_t names = (uint64_t)_refnames.capacity() * sizeof(string);
+		for(size_t i = 0; i < _refnames.size(); i++) {
+			names += _refnames[i].capacity();
+		}
+		parts.push_back(EbwtMemPart("reference names", names, true));
+		// Taxonomy tables in a memory-mapped .3.cf file are in the page cache
+		const bool taxHeap = (_taxMm == NULL);
+		parts.push_back(EbwtMemPart("conversion table", _uid_to_tid.bytes(), taxHeap));
+		parts.push_back(EbwtMemPart("taxonomy tree", _tree.bytes() + _paths.bytes(), taxHeap));
+		parts.push_back(EbwtMemPart("taxonomy names", _name.bytes(), taxHeap));
+		parts.push_back(EbwtMemPart("genome sizes", _size.bytes(), taxHeap));
+	}
+
 	/**
 	 * Load this Ebwt into memory by reading it in from the _in1 and
 	 * _in2 streams.
@@ -1698,7 +2022,11 @@ public:
 		_rstarts.free();
 		_offs.free(); // might not be under control of APtrWrap
         _offsw.free(); // might not be under control of APtrWrap
+        _offsp.free(); // might not be under control of APtrWrap
+        _offMarks.free(); // might not be under control of APtrWrap
+        _offMarkRanks.free();
 		_ebwt.free(); // might not be under control of APtrWrap
+		_ebwtAlloc.free();
 		// Keep plen; it's small and the client may want to seq it
 		// even when the others are evicted.
 		//_plen  = NULL;
@@ -1823,10 +2151,18 @@ public:
 		if(fi == std::numeric_limits<index_t>::max()) {
 			return false;
 		}
+		ftabLoHi(fi, top, bot);
+		return true;
+	}
+
+	/**
+	 * Get the range of the ftab entry for the integer ftabSeqToInt() makes
+	 * from a sequence, for callers that have it already.
+	 */
+	void ftabLoHi(index_t fi, index_t& top, index_t& bot) const {
 		top = ftabHi(fi);
 		bot = ftabLo(fi+1);
 		assert_geq(bot, top);
-		return true;
 	}
 	
 	/**
@@ -1856,6 +2192,64 @@ public:
 		}
 	}
 
+	/**
+	 * Population count using the POPCNT instruction if it's available.
+	 */
+	inline int popCount64(uint64_t x) const {
+#ifdef POPCNT_CAPABILITY
+		if(_usePOPCNTinstruction) {
+			return USE_POPCNT_INSTRUCTION::pop64(x);
+		}
+		return USE_POPCNT_GENERIC::pop64(x);
+#else
+		return pop64(x);
+#endif
+	}
+
+	/**
+	 * Return true iff BWT row 'row' has an SA sample.
+	 */
+	inline bool isSampled(index_t row) const {
+		if(this->_offText) {
+			return ((offMarks()[row >> 6] >> (row & 63)) & 1) != 0;
+		}
+		return (row & _eh._offMask) == row;
+	}
+
+	/**
+	 * Return the index of sampled row 'row' into the SA sample.  For a
+	 * text-sampled index that's the number of sampled rows above it.
+	 */
+	inline index_t sampleIdx(index_t row) const {
+		assert(isSampled(row));
+		if(!this->_offText) {
+			return row >> _eh._offRate;
+		}
+		const uint64_t* marks = offMarks();
+		const index_t w = row >> 6;
+		index_t idx = _offMarkRanks.get()[w >> 3];
+		for(index_t i = (w & ~(index_t)7); i < w; i++) {
+			idx += popCount64(marks[i]);
+		}
+		idx += popCount64(marks[w] & ((1ull << (row & 63)) - 1));
+		assert_lt(idx, _nOffs);
+		return idx;
+	}
+
+	/**
+	 * Return the i'th SA sample, i.e. the genome ID of the i'th sampled
+	 * row, from whichever representation was loaded.
+	 */
+	inline index_t saSample(index_t i) const {
+		if(this->_offp) {
+			return (index_t)unpack_bits_from_64b(offsp(), i, this->_offBits);
+		} else if(this->_offw) {
+			return offsw()[i];
+		} else {
+			return offs()[i];
+		}
+	}
+
 	/**
 	 * Try to resolve the reference offset of the BW element 'elt'.  If
 	 * it can be resolved immediately, return the reference offset.  If
@@ -1863,22 +2257,19 @@ public:
 	 */
 	index_t tryOffset(index_t elt) const {
 #ifndef NDEBUG
-        if(this->_offw) {
+        if(this->_offp) {
+            assert(offsp() != NULL);
+        } else if(this->_offw) {
             assert(offsw() != NULL);
         } else {
             assert(offs() != NULL);
         }
 #endif
 		if(elt == _zOff) return 0;
-		if((elt & _eh._offMask) == elt) {
-			index_t eltOff = elt >> _eh._offRate;
-			assert_lt(eltOff, _eh._offsLen);
-            index_t off;
-            if(this->_offw) {
-                off = offsw()[eltOff];
-            } else {
-                off = offs()[eltOff];
-            }
+		if(isSampled(elt)) {
+			index_t eltOff = sampleIdx(elt);
+			assert_lt(eltOff, _nOffs);
+            index_t off = saSample(eltOff);
 			assert_neq((index_t)OFF_MASK, off);
 			return off;
 		} else {
@@ -2008,10 +2399,12 @@ public:
 			out << "non-NULL, [0] = " << eftab()[0] << endl;
 		}
 		out << "    offs: ";
-		if(offs() == NULL) {
+		if(offs() == NULL && offsw() == NULL && offsp() == NULL) {
 			out << "NULL" << endl;
 		} else {
-			out << "non-NULL, [0] = " << offs()[0] << endl;
+			out << "non-NULL, [0] = " << saSample(0);
+			if(_offp) out << " (" << _offBits << "-bit packed)";
+			out << endl;
 		}
 	}
 
@@ -2030,6 +2423,7 @@ public:
 	void sanityCheckUpToSide(int upToSide) const;
 	void sanityCheckAll(int reverse) const;
 	void restore(SString<char>& s) const;
+	void restore(SString<char>& s, int nthreads) const;
 	void checkOrigs(const EList<SString<char> >& os, bool color, bool mirror) const;
 
 	// Searching and reporting
@@ -2069,7 +2463,7 @@ public:
         assert_range(0, 3, (int)l._bp);
         const uint8_t *side = l.side(this->ebwt());
         index_t cCnt = countUpTo(l, c);
-        assert_leq(cCnt, l.toBWRow());
+        assert_leq(cCnt, l.toBWRow(this->_eh));
         assert_leq(cCnt, this->_eh._sideBwtLen);
         if(c == 0 && l._sideByteOff <= _zEbwtByteOff && l._sideByteOff + l._by >= _zEbwtByteOff) {
             // Adjust for the fact that we represented $ with an 'A', but
@@ -2236,13 +2630,24 @@ public:
 	 * Function gets 11.09% in profile
 	 */
 	inline index_t countUpTo(const SideLocus<index_t>& l, int c) const {
-		// Count occurrences of c in each 64-bit (using bit trickery);
-		// Someday countInU64() and pop() functions should be
-		// vectorized/SSE-ized in case that helps.
+		// Count occurrences of c in each 64-bit (using bit trickery),
+		// or a whole vector at a time if the CPU has AVX2/AVX-512.
         bool usePOPCNT = false;
 		index_t cCnt = 0;
 		const uint8_t *side = l.side(this->ebwt());
 		int i = 0;
+#ifdef RANK_SIMD_AVX2
+        if(_rankKernel != RANK_KERNEL_SCALAR) {
+            // Whole bytes in one vector pass, partial byte by LUT below
+#ifdef RANK_SIMD_AVX512
+            if(_rankKernel == RANK_KERNEL_AVX512) {
+                cCnt = (index_t)rankCountAVX512(side, l._by, c);
+            } else
+#endif
+            cCnt = (index_t)rankCountAVX2(side, l._by, c);
+            i = l._by;
+        } else
+#endif
 #ifdef POPCNT_CAPABILITY
         if(_usePOPCNTinstruction) {
             usePOPCNT = true;
@@ -2410,9 +2815,23 @@ public:
 		// significant boost to performance in practice.  If you comment
 		// out this whole loop (which won't affect correctness - it will
 		// just cause the following loop to take up the slack) then runtime
-		// does not change noticeably. Someday the countInU64() and pop()
-		// functions should be vectorized/SSE-ized in case that helps.
+		// does not change noticeably. The AVX2/AVX-512 kernels replace both
+		// loops with a single pass that yields all four counts at once.
 		const uint8_t *side = l.side(this->ebwt());
+#ifdef RANK_SIMD_AVX2
+        // All four nucleotides in a single vector pass over the side
+        if(_rankKernel == RANK_KERNEL_AVX2) {
+            rankCountExAVX2(side, l._by, arrs);
+            i = l._by;
+        }
+#ifdef RANK_SIMD_AVX512
+        else if(_rankKernel == RANK_KERNEL_AVX512) {
+            rankCountExAVX512(side, l._by, arrs);
+            i = l._by;
+        }
+#endif
+        else
+#endif
 #ifdef POPCNT_CAPABILITY
         if (_usePOPCNTinstruction) {
             for(; i+7 < l._by; i += 8) {
@@ -2591,7 +3010,7 @@ public:
 			// Make sure results match up with a call to mapLFEx.
 			index_t tops[4] = {0, 0, 0, 0};
 			index_t bots[4] = {0, 0, 0, 0};
-			index_t top = l.toBWRow();
+			index_t top = l.toBWRow(this->_eh);
 			index_t bot = top + nm;
 			mapLFEx(top, bot, tops, bots, false);
 			assert(myarrs[0] == (bots[0] - tops[0]) || myarrs[0] == (bots[0] - tops[0])+1);
@@ -2641,7 +3060,7 @@ public:
 	{
 		assert(ltop.repOk(this->eh()));
 		assert(lbot.repOk(this->eh()));
-		assert_eq(num, lbot.toBWRow() - ltop.toBWRow());
+		assert_eq(num, lbot.toBWRow(this->_eh) - ltop.toBWRow(this->_eh));
 		assert_eq(0, cntsUpto[0]); assert_eq(0, cntsIn[0]);
 		assert_eq(0, cntsUpto[1]); assert_eq(0, cntsIn[1]);
 		assert_eq(0, cntsUpto[2]); assert_eq(0, cntsIn[2]);
@@ -2679,7 +3098,7 @@ public:
 		ASSERT_ONLY(, bool overrideSanity = false)
 		) const
 	{
-		ASSERT_ONLY(index_t srcrow = l.toBWRow());
+		ASSERT_ONLY(index_t srcrow = l.toBWRow(this->_eh));
 		index_t ret;
 		assert(l.side(this->ebwt()) != NULL);
 		int c = rowL(l);
@@ -2930,11 +3349,19 @@ public:
 	// offset every 16 rows), the total size of _offs is the same as
 	// the total size of the input sequence
     bool _offw;
+    bool _offp;                // SA samples are bit-packed (_offsp)
+    int  _offBits;             // bits per packed sample; ceil(log2(_nPat))
 	APtrWrap<uint16_t> _offs;  // offset when # of seq. is less than 2^16
     APtrWrap<uint32_t> _offsw; // offset when # of seq. is more than 2^16
+    APtrWrap<uint64_t> _offsp; // offsets packed _offBits bits apiece
+    bool _offText;             // SA sampled by text offset, not by row
+    index_t _nOffs;            // # of SA samples loaded
+    APtrWrap<uint64_t> _offMarks;    // bit i set iff BWT row i is sampled (_offText)
+    APtrWrap<index_t> _offMarkRanks; // # set bits preceding each 512-bit block of _offMarks
 	// _ebwt is the Extended Burrows-Wheeler Transform itself, and thus
 	// is at least as large as the input sequence.
 	APtrWrap<uint8_t> _ebwt;
+	APtrWrap<uint8_t> _ebwtAlloc; // heap block under a line-aligned _ebwt
 	bool       _useMm;        /// use memory-mapped files to hold the index
 	bool       useShmem_;     /// use shared memory to hold large parts of the index
 	EList<string> _refnames; /// names of the reference sequences
@@ -2942,15 +3369,18 @@ public:
 	char *mmFile2_;
     
     bool                             _compressed; // compressed index?
+    char                            *_taxMm;      // memory-mapped .3.cf file the tables point into
+    size_t                           _taxMmLen;
     
 	EbwtParams<index_t> _eh;
 	bool packed_;
     
-    EList<pair<string, uint64_t> >   _uid_to_tid; // table that converts uid to tid
-    TaxonomyTree _tree;
+    TaxRefTable                      _uid_to_tid; // table that converts uid to tid
+    TaxTreeTable                     _tree;
     TaxonomyPathTable                _paths;
-    std::map<uint64_t, string>       _name;
-    std::map<uint64_t, uint64_t>     _size;
+    TaxNameTable                     _name;
+    TaxSizeTable                     _size;
+    EList<uint64_t>                  _taxBuf;     // .3.cf file read in, if not memory-mapped
     
 
 	static const uint64_t default_bmax = OFF_MASK;
@@ -3334,6 +3764,10 @@ void Ebwt<index_t>::buildToDisk(
 	                               // end)
 	// Iterate over packed bwt bytes
 	VMSG_NL("Entering Ebwt loop");
+	// Pad so that ebwt[] starts on a cache line when memory-mapped
+	for(index_t i = eh.ebwtPad((uint64_t)out1.tellp()); i > 0; i--) {
+		out1.put(0);
+	}
 	ASSERT_ONLY(index_t beforeEbwtOff = (index_t)out1.tellp());
     
     // First integer in the suffix-array output file is the length of the
@@ -3349,6 +3783,37 @@ void Ebwt<index_t>::buildToDisk(
         writeIndex<index_t>(*bwtOut, len+1, this->toBe());
     }
     
+    // Bit-packed SA samples are preceded by their width, which also
+    // puts the first 64-bit word at an 8-byte boundary in the file;
+    // 'offWord' accumulates samples until a full word can be written
+    uint64_t offWord = 0;
+    int offWordBits = 0;
+    if(this->_offp) {
+        assert_gt(this->_offBits, 0);
+        writeI32(out2, this->_offBits, this->toBe());
+    }
+    // When sampling by text offset, every 2^offRate-th offset and the
+    // first offset of every sequence are sampled, so a walk never takes
+    // more than 2^offRate-1 steps and never leaves the sequence it
+    // started in; the sample then holds the sequence of the offset
+    // itself.  The sampled rows are irregular, so they're marked in a
+    // bit vector written after the samples.
+    assert(this->_offp || !this->_offText);
+    EList<uint64_t> offMarks(EBWT_CAT);
+    EList<index_t> seqStarts(EBWT_CAT);
+    index_t nOffs = eh._offsLen;
+    if(this->_offText) {
+        offMarks.resize((size_t)packed_64b_words(eh._bwtLen, 1));
+        offMarks.fillZero();
+        for(index_t i = 0; i < this->_nFrag; i++) {
+            if(i > 0 && this->rstarts()[i*3+1] == this->rstarts()[(i-1)*3+1]) continue;
+            seqStarts.push_back(this->rstarts()[i*3]);
+            if((seqStarts.back() & eh._offMask) != seqStarts.back()) nOffs++;
+        }
+        writeIndex<uint64_t>(out2, nOffs, this->toBe());
+    }
+    ASSERT_ONLY(index_t offsWritten = 0);
+    
     // Count the number of distinct k-mers if kmer_size is non-zero
     EList<uint8_t> kmer;
     EList<size_t> kmer_count;
@@ -3464,13 +3929,36 @@ void Ebwt<index_t>::buildToDisk(
                     }
                 }
 				// Suffix array offset boundary? - update offset array
-				if((si & eh._offMask) == si) {
-					assert_lt((si >> eh._offRate), eh._offsLen);
+				bool sampled;
+				if(this->_offText) {
+					sampled = ((saElt & eh._offMask) == saElt);
+					if(!sampled) {
+						size_t i = seqStarts.bsearchLoBound(saElt);
+						sampled = (i < seqStarts.size() && seqStarts[i] == saElt);
+					}
+					if(sampled) offMarks[si >> 6] |= (1ull << (si & 63));
+				} else {
+					sampled = ((si & eh._offMask) == si);
+				}
+				if(sampled) {
+					assert_lt(offsWritten, nOffs);
+					ASSERT_ONLY(offsWritten++);
 					// Write offsets directly to the secondary output
 					// stream, thereby avoiding keeping them in memory
                     index_t tidx = 0, toff = 0, tlen = 0;
                     bool straddled2 = false;
-                    if(saElt > 0) {
+                    if(this->_offText) {
+                        if(saElt < len) {
+                            joinedToTextOff(
+                                            0,
+                                            saElt,
+                                            tidx,
+                                            toff,
+                                            tlen,
+                                            false,        // reject straddlers?
+                                            straddled2);  // straddled?
+                        }
+                    } else if(saElt > 0) {
                         joinedToTextOff(
                                         0,
                                         saElt - 1,
@@ -3480,7 +3968,17 @@ void Ebwt<index_t>::buildToDisk(
                                         false,        // reject straddlers?
                                         straddled2);  // straddled?
                     }
-                    if(this->_offw) {
+                    if(this->_offp) {
+                        const uint64_t v = tidx;
+                        assert_lt(v, 1ull << this->_offBits);
+                        offWord |= (v << offWordBits);
+                        offWordBits += this->_offBits;
+                        if(offWordBits >= 64) {
+                            writeIndex<uint64_t>(out2, offWord, this->toBe());
+                            offWordBits -= 64;
+                            offWord = (offWordBits > 0) ? (v >> (this->_offBits - offWordBits)) : 0;
+                        }
+                    } else if(this->_offw) {
                         writeIndex<uint32_t>(out2, (uint32_t)tidx, this->toBe());
                     } else {
                         assert_lt(tidx, std::numeric_limits<uint16_t>::max());
@@ -3552,6 +4050,14 @@ void Ebwt<index_t>::buildToDisk(
 	}
 	VMSG_NL("Exited Ebwt loop");
 	assert_neq(zOff, (index_t)OFF_MASK);
+	assert_eq(offsWritten, nOffs);
+	if(offWordBits > 0) {
+		// Flush the last, partially filled word of packed SA samples
+		writeIndex<uint64_t>(out2, offWord, this->toBe());
+	}
+	for(size_t i = 0; i < offMarks.size(); i++) {
+		writeIndex<uint64_t>(out2, offMarks[i], this->toBe());
+	}
 	if(absorbCnt > 0) {
 		// Absorb any trailing, as-yet-unabsorbed short suffixes into
 		// the last element of ftab
@@ -3777,7 +4283,9 @@ void Ebwt<index_t>::joinedToTextOff(
 template <typename index_t>
 index_t Ebwt<index_t>::walkLeft(index_t row, index_t steps) const {
 #ifndef NDEBUG
-    if(this->_offw) {
+    if(this->_offp) {
+        assert(offsp() != NULL);
+    } else if(this->_offw) {
         assert(offsw() != NULL);
     } else {
         assert(offs() != NULL);
@@ -3804,7 +4312,9 @@ index_t Ebwt<index_t>::walkLeft(index_t row, index_t steps) const {
 template <typename index_t>
 index_t Ebwt<index_t>::getOffset(index_t row) const {
 #ifndef NDEBUG
-    if(this->_offw) {
+    if(this->_offp) {
+        assert(offsp() != NULL);
+    } else if(this->_offw) {
         assert(offsw() != NULL);
     } else {
         assert(offs() != NULL);
@@ -3812,12 +4322,8 @@ index_t Ebwt<index_t>::getOffset(index_t row) const {
 #endif
 	assert_neq((index_t)OFF_MASK, row);
 	if(row == _zOff) return 0;
-    if((row & _eh._offMask) == row) {
-        if(this->_offw) {
-            return this->offsw()[row >> _eh._offRate];
-        } else {
-            return this->offs()[row >> _eh._offRate];
-        }
+    if(isSampled(row)) {
+        return this->saSample(sampleIdx(row));
     }
 	index_t jumps = 0;
 	SideLocus<index_t> l;
@@ -3830,12 +4336,8 @@ index_t Ebwt<index_t>::getOffset(index_t row) const {
 		row = newrow;
 		if(row == _zOff) {
 			return jumps;
-		} else if((row & _eh._offMask) == row) {
-            if(this->_offw) {
-                return jumps + this->offsw()[row >> _eh._offRate];
-            } else {
-                return jumps + this->offs()[row >> _eh._offRate];
-            }
+		} else if(isSampled(row)) {
+            return jumps + this->saSample(sampleIdx(row));
 		}
 		l.initFromRow(row, _eh, ebwt());
 	}
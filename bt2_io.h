@@ -204,17 +204,25 @@ void Ebwt<index_t>::readIntoMemory(
 			throw 1;
 		}
 	} else entireRev = true;
+	this->_offp = (flags < 0 && (((-flags) & EBWT_PACKED_OFFS) != 0));
+	this->_offText = (flags < 0 && (((-flags) & EBWT_TEXT_OFFS) != 0));
+	bool lineOcc = (flags < 0 && (((-flags) & EBWT_LINE_OCC) != 0));
 	bytesRead += 4;
+	if(lineOcc && lineRate != EBWT_LINE_OCC_RATE) {
+		cerr << "Error: index has a cache-line occurrence layout but a line rate of "
+		     << lineRate << endl;
+		throw 1;
+	}
 	
 	// Create a new EbwtParams from the entries read from primary stream
 	EbwtParams<index_t> *eh;
 	bool deleteEh = false;
 	if(params != NULL) {
-		params->init(len, lineRate, offRate, ftabChars, color, entireRev);
+		params->init(len, lineRate, offRate, ftabChars, color, entireRev, lineOcc);
 		if(_verbose || startVerbose) params->print(cerr);
 		eh = params;
 	} else {
-		eh = new EbwtParams<index_t>(len, lineRate, offRate, ftabChars, color, entireRev);
+		eh = new EbwtParams<index_t>(len, lineRate, offRate, ftabChars, color, entireRev, lineOcc);
 		deleteEh = true;
 	}
 	
@@ -240,6 +248,12 @@ void Ebwt<index_t>::readIntoMemory(
 		cerr << "Error: Can't use memory-mapped files when the offrate is overridden" << endl;
 		throw 1;
 	}
+	// Text-offset samples can't be thinned; we don't know which text
+	// offset each sample came from
+	if(this->_offText && offRateDiff) {
+		cerr << "Error: Can't override the offrate of an index whose SA is sampled by text offset" << endl;
+		throw 1;
+	}
 	
 	// Read nPat from primary stream
 	this->_nPat = readIndex<index_t>(_in1, switchEndian);
@@ -278,6 +292,7 @@ void Ebwt<index_t>::readIntoMemory(
 	}
     
     this->_offw = this->_nPat > std::numeric_limits<uint16_t>::max();
+    this->_offBits = this->_offp ? packed_bits_for(this->_nPat) : 0;
 	
 	bool shmemLeader;
     size_t OFFSET_SIZE;
@@ -329,8 +344,18 @@ void Ebwt<index_t>::readIntoMemory(
 	}
 	
 	_ebwt.reset();
+	_ebwtAlloc.reset();
+	{
+		// Skip padding that puts ebwt[] on a cache-line boundary
+		index_t pad = eh->ebwtPad((uint64_t)ftell(_in1));
+		if(pad > 0) {
+			fseek(_in1, pad, SEEK_CUR);
+			bytesRead += pad;
+		}
+	}
 	if(_useMm) {
 #ifdef BOWTIE_MM
+		assert_eq(bytesRead, (size_t)ftell(_in1));
 		_ebwt.init((uint8_t*)(mmFile[0] + bytesRead), eh->_ebwtTotLen, false);
 		bytesRead += eh->_ebwtTotLen;
 		fseek(_in1, eh->_ebwtTotLen, SEEK_CUR);
@@ -354,7 +379,16 @@ void Ebwt<index_t>::readIntoMemory(
 			}
 		} else {
 			try {
-				_ebwt.init(new uint8_t[eh->_ebwtTotLen], eh->_ebwtTotLen, true);
+				if(eh->_lineOcc) {
+					// Over-allocate and align so each side is one line
+					_ebwtAlloc.init(new uint8_t[eh->_ebwtTotLen + EBWT_LINE_OCC_SZ - 1],
+					                eh->_ebwtTotLen + EBWT_LINE_OCC_SZ - 1, true);
+					uintptr_t p = (uintptr_t)_ebwtAlloc.get();
+					p = (p + EBWT_LINE_OCC_SZ - 1) & ~(uintptr_t)(EBWT_LINE_OCC_SZ - 1);
+					_ebwt.init((uint8_t*)p, eh->_ebwtTotLen, false);
+				} else {
+					_ebwt.init(new uint8_t[eh->_ebwtTotLen], eh->_ebwtTotLen, true);
+				}
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
 				<< "again on a computer with more memory." << endl;
@@ -528,7 +562,192 @@ void Ebwt<index_t>::readIntoMemory(
     OFFSET_SIZE = (this->_offw ? 4 : 2);
 	_offs.reset();
     _offsw.reset();
-    if(loadSASamp) {
+    _offsp.reset();
+    if(loadSASamp && this->_offp) {
+        bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
+        int32_t offBits = readI32(_in2, switchEndian);
+        bytesRead += 4;
+        if(offBits != this->_offBits) {
+            cerr << "Error: SA samples in " << _in2Str << " are " << offBits
+                 << " bits wide, but " << this->_offBits << " bits are expected for "
+                 << this->_nPat << " sequences; the index may be corrupt" << endl;
+            throw 1;
+        }
+        if(this->_offText) {
+            // Text-offset sampling also samples sequence starts, so the
+            // number of samples is stored rather than implied by offRate
+            uint64_t nOffs = readIndex<uint64_t>(_in2, false);
+            if(switchEndian) nOffs = endianSwapU64(nOffs);
+            bytesRead += 8;
+            offsLen = offsLenSampled = (index_t)nOffs;
+        }
+        const uint64_t offsWords = packed_64b_words(offsLen, offBits);
+        const uint64_t offsWordsSampled = packed_64b_words(offsLenSampled, offBits);
+        
+        shmemLeader = true;
+        if(_verbose || startVerbose) {
+            cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << offBits << "-bit packed samples): ";
+            logTime(cerr);
+        }
+        
+        if(!_useMm) {
+            if(!useShmem_) {
+                try {
+                    _offsp.init(new uint64_t[offsWordsSampled], offsWordsSampled, true);
+                } catch(bad_alloc& e) {
+                    cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
+                    << "Please try again on a computer with more memory." << endl;
+                    throw 1;
+                }
+            } else {
+                uint64_t *tmp = NULL;
+                shmemLeader = ALLOC_SHARED_U64(
+                                               (_in2Str + "[offs]"), offsWordsSampled*8, &tmp,
+                                               "offs", (_verbose || startVerbose));
+                _offsp.init(tmp, offsWordsSampled, false);
+            }
+        }
+        
+        if(_overrideOffRate < 32) {
+            if(shmemLeader) {
+                if(switchEndian || offRateDiff > 0) {
+                    assert(!_useMm);
+                    // Samples straddle word boundaries, so read the whole
+                    // array, then byte-swap and/or thin it into _offsp
+                    uint64_t *buf = NULL;
+                    try {
+                        buf = new uint64_t[offsWords];
+                    } catch(std::bad_alloc& e) {
+                        cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
+                        throw e;
+                    }
+                    uint64_t bytesLeft = (offsWords * 8);
+                    char *offs = (char *)buf;
+                    while(bytesLeft > 0) {
+                        size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
+                        if(MM_IS_IO_ERR(_in2, r, bytesLeft)) {
+                            cerr << "Error reading block of _offs[] array: "
+                            << r << ", " << bytesLeft << gLastIOErrMsg << endl;
+                            throw 1;
+                        }
+                        offs += r;
+                        bytesLeft -= r;
+                    }
+                    if(switchEndian) {
+                        for(uint64_t i = 0; i < offsWords; i++) {
+                            buf[i] = endianSwapU64(buf[i]);
+                        }
+                    }
+                    if(offRateDiff > 0) {
+                        memset(this->offsp(), 0, offsWordsSampled * 8);
+                        for(index_t i = 0; i < offsLenSampled; i++) {
+                            pack_bits_in_64b(unpack_bits_from_64b(buf, (uint64_t)i << offRateDiff, offBits),
+                                             this->offsp(), i, offBits);
+                        }
+                    } else {
+                        memcpy(this->offsp(), buf, offsWords * 8);
+                    }
+                    delete[] buf;
+                } else {
+                    if(_useMm) {
+#ifdef BOWTIE_MM
+                        _offsp.init((uint64_t*)(mmFile[1] + bytesRead), offsWords, false);
+                        bytesRead += (offsWords * 8);
+                        fseek(_in2, (offsWords * 8), SEEK_CUR);
+#endif
+                    } else {
+                        uint64_t bytesLeft = (offsWords * 8);
+                        char *offs = (char *)this->offsp();
+                        while(bytesLeft > 0) {
+                            size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
+                            if(MM_IS_IO_ERR(_in2, r, bytesLeft)) {
+                                cerr << "Error reading block of _offs[] array: "
+                                << r << ", " << bytesLeft << gLastIOErrMsg << endl;
+                                throw 1;
+                            }
+                            offs += r;
+                            bytesLeft -= r;
+                        }
+                    }
+                }
+#ifdef BOWTIE_SHARED_MEM
+                if(useShmem_) NOTIFY_SHARED(offsp(), offsWordsSampled*8);
+#endif
+            } else {
+                // Not the shmem leader
+                fseek(_in2, offsWordsSampled*8, SEEK_CUR);
+#ifdef BOWTIE_SHARED_MEM
+                NOTIFY_SHARED(offsp(), offsWordsSampled*8);
+#endif
+            }
+            if(this->_offText) {
+                // Bit vector marking the sampled rows follows the samples
+                const uint64_t marksWords = packed_64b_words(eh->_bwtLen, 1);
+                if(_useMm) {
+#ifdef BOWTIE_MM
+                    _offMarks.init((uint64_t*)(mmFile[1] + bytesRead), marksWords, false);
+                    bytesRead += (marksWords * 8);
+                    fseek(_in2, (marksWords * 8), SEEK_CUR);
+#endif
+                } else {
+                    bool marksLeader = true;
+                    if(!useShmem_) {
+                        try {
+                            _offMarks.init(new uint64_t[marksWords], marksWords, true);
+                        } catch(bad_alloc& e) {
+                            cerr << "Out of memory allocating the SA sample marks for the Bowtie index." << endl
+                            << "Please try again on a computer with more memory." << endl;
+                            throw 1;
+                        }
+                    } else {
+                        uint64_t *tmp = NULL;
+                        marksLeader = ALLOC_SHARED_U64(
+                                                       (_in2Str + "[offmarks]"), marksWords*8, &tmp,
+                                                       "offmarks", (_verbose || startVerbose));
+                        _offMarks.init(tmp, marksWords, false);
+                    }
+                    if(marksLeader) {
+                        uint64_t bytesLeft = (marksWords * 8);
+                        char *marks = (char *)this->offMarks();
+                        while(bytesLeft > 0) {
+                            size_t r = MM_READ(_in2, (void*)marks, bytesLeft);
+                            if(MM_IS_IO_ERR(_in2, r, bytesLeft)) {
+                                cerr << "Error reading block of SA sample marks: "
+                                << r << ", " << bytesLeft << gLastIOErrMsg << endl;
+                                throw 1;
+                            }
+                            marks += r;
+                            bytesLeft -= r;
+                        }
+                        if(switchEndian) {
+                            for(uint64_t i = 0; i < marksWords; i++) {
+                                this->offMarks()[i] = endianSwapU64(this->offMarks()[i]);
+                            }
+                        }
+                    } else {
+                        fseek(_in2, marksWords*8, SEEK_CUR);
+                    }
+#ifdef BOWTIE_SHARED_MEM
+                    if(useShmem_) NOTIFY_SHARED(offMarks(), marksWords*8);
+#endif
+                }
+                // Rank directory: # of sampled rows preceding each
+                // 512-row block
+                const uint64_t marksBlocks = (marksWords + 7) >> 3;
+                _offMarkRanks.init(new index_t[marksBlocks], marksBlocks, true);
+                index_t nmarks = 0;
+                for(uint64_t i = 0; i < marksWords; i++) {
+                    if((i & 7) == 0) _offMarkRanks.get()[i >> 3] = nmarks;
+                    nmarks += this->popCount64(this->offMarks()[i]);
+                }
+                if(nmarks != offsLen) {
+                    cerr << "Error: " << nmarks << " rows are marked as sampled in " << _in2Str
+                         << " but the index has " << offsLen << " SA samples; the index may be corrupt" << endl;
+                    throw 1;
+                }
+            }
+        }
+    } else if(loadSASamp) {
         bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
         
         shmemLeader = true;
@@ -664,6 +883,7 @@ void Ebwt<index_t>::readIntoMemory(
         }
     }
     
+    this->_nOffs = offsLenSampled;
     this->postReadInit(*eh); // Initialize fields of Ebwt not read from file
     if(_verbose || startVerbose) print(cerr, *eh);
     
@@ -713,13 +933,15 @@ void readEbwtRefnames(istream& in, EList<string>& refnames) {
 	int32_t flags = readI32(in, switchEndian);
 	bool color = false;
 	bool entireReverse = false;
+	bool lineOcc = false;
 	if(flags < 0) {
 		color = (((-flags) & EBWT_COLOR) != 0);
 		entireReverse = (((-flags) & EBWT_ENTIRE_REV) != 0);
+		lineOcc = (((-flags) & EBWT_LINE_OCC) != 0);
 	}
 	
 	// Create a new EbwtParams from the entries read from primary stream
-	EbwtParams<index_t> eh(len, lineRate, offRate, ftabChars, color, entireReverse);
+	EbwtParams<index_t> eh(len, lineRate, offRate, ftabChars, color, entireReverse, lineOcc);
 	
 	index_t nPat = readIndex<index_t>(in, switchEndian); // nPat
 	in.seekg(nPat*sizeof(index_t), ios_base::cur); // skip plen
@@ -728,8 +950,8 @@ void readEbwtRefnames(istream& in, EList<string>& refnames) {
 	index_t nFrag = readIndex<index_t>(in, switchEndian);
 	in.seekg(nFrag*sizeof(index_t)*3, ios_base::cur);
 	
-	// Skip ebwt
-	in.seekg(eh._ebwtTotLen, ios_base::cur);
+	// Skip ebwt (and any padding before it)
+	in.seekg(eh.ebwtPad((uint64_t)in.tellg()) + eh._ebwtTotLen, ios_base::cur);
 	
 	// Skip zOff from primary stream
 	readIndex<index_t>(in, switchEndian);
@@ -874,6 +1096,9 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 	int32_t flags = 1;
 	if(eh._color) flags |= EBWT_COLOR;
 	if(eh._entireReverse) flags |= EBWT_ENTIRE_REV;
+	if(this->_offp) flags |= EBWT_PACKED_OFFS;
+	if(this->_offText) flags |= EBWT_TEXT_OFFS;
+	if(eh._lineOcc) flags |= EBWT_LINE_OCC;
 	writeI32(out1, -flags, be); // BTL: chunkRate is now deprecated
 	
 	if(!justHeader) {
@@ -898,6 +1123,9 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		// terribly large.  'ebwt' is written to the primary file and then
 		// discarded from memory as it is built; 'offs' is similarly
 		// written to the secondary file and discarded.
+		for(index_t i = eh.ebwtPad((uint64_t)out1.tellp()); i > 0; i--) {
+			out1.put(0);
+		}
 		out1.write((const char *)this->ebwt(), eh._ebwtTotLen);
 		writeIndex<index_t>(out1, this->zOff(), be);
 		index_t offsLen = eh._offsLen;
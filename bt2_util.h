@@ -167,6 +167,143 @@ void Ebwt<index_t>::restore(SString<char>& s) const {
 	assert_eq(jumps, this->_eh._len);
 }
 
+/**
+ * One of the LF walks of a parallel restore().  The walk starts at BWT
+ * row 'row' and steps back through the text until it reaches a row
+ * another walk starts at, or the row of text offset 0.  It keeps the
+ * characters it passes, last to first, packed 4 to a byte until they're
+ * copied into place.
+ */
+template <typename index_t>
+struct RestoreWalk {
+	index_t        row;  // row the walk starts at
+	index_t        next; // walk starting where this one stops; OFF_MASK at offset 0
+	index_t        len;  // # characters passed
+	index_t        end;  // text offset the walk starts at, once known
+	EList<uint8_t> seq;  // characters passed, 2 bits apiece
+};
+
+template <typename index_t>
+struct RestoreParam {
+	const Ebwt<index_t>*             ebwt;
+	EList<RestoreWalk<index_t> >*    walks;
+	int                              shift; // walks start at rows that are multiples of 1 << shift
+	SString<char>*                   s;     // NULL while walking; the text when copying
+	size_t*                          cur;
+	MUTEX_T*                         mutex;
+};
+
+/**
+ * Take walks from the list until there are none left, and either walk
+ * them or, once all are walked, copy their characters into the text.
+ */
+template <typename index_t>
+static void restore_worker(void *vp) {
+	RestoreParam<index_t>* param = (RestoreParam<index_t>*)vp;
+	const Ebwt<index_t>& ebwt = *param->ebwt;
+	EList<RestoreWalk<index_t> >& walks = *param->walks;
+	const index_t mask = ((index_t)1 << param->shift) - 1;
+	while(true) {
+		size_t w = 0;
+		{
+			ThreadSafe ts(param->mutex);
+			w = (*param->cur)++;
+		}
+		if(w >= walks.size()) break;
+		RestoreWalk<index_t>& walk = walks[w];
+		if(param->s == NULL) {
+			index_t i = walk.row;
+			walk.next = (index_t)OFF_MASK;
+			walk.len = 0;
+			SideLocus<index_t> l;
+			while(i != ebwt.zOff()) {
+				l.initFromRow(i, ebwt.eh(), ebwt.ebwt());
+				i = ebwt.mapLF(l ASSERT_ONLY(, false));
+				if((walk.len & 3) == 0) walk.seq.push_back(0);
+				walk.seq.back() |= (uint8_t)(ebwt.rowL(l) << ((walk.len & 3) << 1));
+				walk.len++;
+				if((i & mask) == 0) {
+					walk.next = i >> param->shift;
+					break;
+				}
+			}
+		} else {
+			char *dst = param->s->wbuf() + walk.end;
+			for(index_t j = 0; j < walk.len; j++) {
+				*(--dst) = (char)((walk.seq[j >> 2] >> ((j & 3) << 1)) & 3);
+			}
+			walk.seq.clear();
+		}
+	}
+}
+
+/**
+ * Like restore(), but with nthreads threads: the text is cut into
+ * stretches by LF walks starting at evenly spaced rows, which are walked
+ * independently, put in text order by following each walk to the one
+ * starting where it stops, and copied into place.  The BWT is one cycle
+ * through all its rows, so the walks cover the text exactly once.
+ */
+template <typename index_t>
+void Ebwt<index_t>::restore(SString<char>& s, int nthreads) const {
+	assert(isInMemory());
+	if(nthreads <= 1 || this->_eh._len == 0) {
+		restore(s);
+		return;
+	}
+	const index_t len = this->_eh._len;
+	// Enough walks that threads finishing early can pick up more
+	int shift = 0;
+	while(((uint64_t)1 << shift) * nthreads * 256 < (uint64_t)len) shift++;
+	EList<RestoreWalk<index_t> > walks(EBWT_CAT);
+	walks.resize((len >> shift) + 1);
+	for(size_t w = 0; w < walks.size(); w++) {
+		walks[w].row = (index_t)(w << shift);
+	}
+	// The walk from the last row ('$') starts at the end of the text;
+	// nothing leads there except from offset 0, so it needs its own walk
+	// unless it's already a multiple of 1 << shift
+	size_t first = len >> shift;
+	if((len & (((index_t)1 << shift) - 1)) != 0) {
+		first = walks.size();
+		walks.expand();
+		walks.back().row = len;
+	}
+	AutoArray<tthread::thread*> threads(nthreads);
+	EList<RestoreParam<index_t> > tparams;
+	tparams.resize(nthreads);
+	MUTEX_T mutex;
+	size_t cur = 0;
+	for(int pass = 0; pass < 2; pass++) {
+		if(pass == 1) {
+			// Follow the walks back from the end of the text to find
+			// where each starts
+			s.resize(len);
+			index_t end = len;
+			for(index_t w = (index_t)first; w != (index_t)OFF_MASK; w = walks[w].next) {
+				walks[w].end = end;
+				assert_geq(end, walks[w].len);
+				end -= walks[w].len;
+			}
+			assert_eq(0, end);
+		}
+		cur = 0;
+		for(int tid = 0; tid < nthreads; tid++) {
+			tparams[tid].ebwt = this;
+			tparams[tid].walks = &walks;
+			tparams[tid].shift = shift;
+			tparams[tid].s = (pass == 0 ? NULL : &s);
+			tparams[tid].cur = &cur;
+			tparams[tid].mutex = &mutex;
+			threads[tid] = new tthread::thread(restore_worker<index_t>, (void*)&tparams[tid]);
+		}
+		for(int tid = 0; tid < nthreads; tid++) {
+			threads[tid]->join();
+			delete threads[tid];
+		}
+	}
+}
+
 /**
  * Check that this Ebwt, when restored via restore(), matches up with
  * the given array of reference sequences.  For sanity checking.
@@ -28,6 +28,9 @@
 #include <utility>
 #include <limits>
 #include <map>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "endian_swap.h"
@@ -45,12 +48,17 @@
 #include "aligner_metrics.h"
 #include "aligner_seed_policy.h"
 #include "classifier.h"
+#include "kmer_filter.h"
+#include "shard_spill.h"
 #include "util.h"
 #include "pe.h"
 #include "simple_func.h"
 #include "presets.h"
 #include "opts.h"
 #include "outq.h"
+#include "bgzf.h"
+#include "stage_metrics.h"
+#include "perf_counters.h"
 
 using namespace std;
 
@@ -71,6 +79,9 @@ static int metricsIval;   // interval between alignment metrics messages (0 = no
 static string metricsFile;// output file to put alignment metrics in
 static bool metricsStderr;// output file to put alignment metrics in
 static bool metricsPerRead; // report a metrics tuple for every read
+static bool metricsJson;  // report metrics, incl. stage timings, as JSON
+static bool perfCounters; // count hardware events per stage with perf_event_open
+static uint32_t perfEvents; // the events that can be counted, bit i for event i
 static bool allHits;      // for multihits, report just one
 static bool showVersion;  // just print version and quit?
 static int ipause;        // pause before maching?
@@ -92,6 +103,8 @@ static bool fileParallel; // separate threads read separate input files in paral
 static bool useShmem;     // use shared memory to hold the index
 static bool useMm;        // use memory-mapped files to hold the index
 static bool mmSweep;      // sweep through memory-mapped files immediately after mapping
+static uint64_t maxMem;   // memory budget in bytes to fit the index and threads into; 0 = none
+static bool memReport;    // report memory use by component at startup and shutdown
 int gMinInsert;           // minimum insert size
 int gMaxInsert;           // maximum insert size
 bool gMate1fw;            // -1 mate aligns in fw orientation on fw strand
@@ -238,6 +251,7 @@ static EList<pair<int, string> > extra_opts;
 static size_t extra_opts_cur;
 
 static EList<uint64_t> thread_rids;
+static EList<ThreadMemTally> thread_mem; // memory tallied per thread, for --mem-report
 static MUTEX_T         thread_rids_mutex;
 
 static uint32_t minHitLen;   // minimum length of partial hits
@@ -248,6 +262,20 @@ static bool tree_traverse;
 static string classification_rank;
 static EList<uint64_t> host_taxIDs;
 static EList<uint64_t> excluded_taxIDs;
+static bool smem;            // extend partial hits both ways with the mirror index
+static int strandPrune;      // when to stop searching the losing strand
+static bool noPrefilter;     // don't load the index's k-mer prefilter
+static string hostFilterFile; // k-mer filter of the host genome to screen reads with
+static uint64_t hostFilterTaxID; // taxon host reads are reported as
+static double hostMinFrac;   // share of a read's k-mers in the host filter to call it host
+static string shardTmp;      // directory for the candidates spilled by index shards
+static uint32_t longReadWindow;  // search reads longer than this in windows; 0 = off
+static uint32_t longReadOverlap; // bases shared by consecutive long-read windows
+static string longReadSegments;  // write the best taxIDs of each long-read window here
+static int reportIval;       // seconds between report snapshots while classifying (0 = none)
+static uint32_t mateCandidates; // restrict mate 2 to mate 1's candidates if there are at most this many
+static bool writerThread;    // write the output from a thread of its own
+static bool outGz;           // write the output BGZF-compressed
 
 
 static string tab_fmt_col_def;
@@ -303,6 +331,9 @@ static void resetOptions() {
 	metricsFile             = ""; // output file to put alignment metrics in
 	metricsStderr           = false; // print metrics to stderr (in addition to --metrics-file if it's specified
 	metricsPerRead          = false; // report a metrics tuple for every read?
+	metricsJson             = false; // report metrics as JSON?
+	perfCounters            = false; // count hardware events per stage?
+	perfEvents              = 0;
 	allHits					= false; // for multihits, report just one
 	showVersion				= false; // just print version and quit?
 	ipause					= 0; // pause before maching?
@@ -324,6 +355,8 @@ static void resetOptions() {
 	useShmem				= false; // use shared memory to hold the index
 	useMm					= false; // use memory-mapped files to hold the index
 	mmSweep					= false; // sweep through memory-mapped files immediately after mapping
+	maxMem					= 0;     // no memory budget
+	memReport				= false; // don't report memory use
 	gMinInsert				= 0;     // minimum insert size
 	gMaxInsert				= 500;   // maximum insert size
 	gMate1fw				= true;  // -1 mate aligns in fw orientation on fw strand
@@ -476,6 +509,20 @@ static void resetOptions() {
     host_taxIDs.clear();
     classification_rank = "strain";
     excluded_taxIDs.clear();
+    smem = false;
+    strandPrune = STRAND_PRUNE_OFF;
+    noPrefilter = false;
+    hostFilterFile.clear();
+    hostFilterTaxID = 9606; // human
+    hostMinFrac = 0.5;
+    shardTmp.clear();
+    longReadWindow = 0;
+    longReadOverlap = 100;
+    longReadSegments.clear();
+    reportIval = 0;
+    mateCandidates = 0;
+    writerThread = false;
+    outGz = false;
 	sam_format = false;
 
     col_name_map["readID"] = READ_ID;
@@ -544,6 +591,8 @@ static struct option long_options[] = {
 	{(char*)"met",          required_argument, 0,            ARG_METRIC_IVAL},
 	{(char*)"met-file",     required_argument, 0,            ARG_METRIC_FILE},
 	{(char*)"met-stderr",   no_argument,       0,            ARG_METRIC_STDERR},
+	{(char*)"met-json",     no_argument,       0,            ARG_METRIC_JSON},
+	{(char*)"perf-counters", no_argument,      0,            ARG_PERF_COUNTERS},
 	{(char*)"time",         no_argument,       0,            't'},
 	{(char*)"trim3",        required_argument, 0,            '3'},
 	{(char*)"trim5",        required_argument, 0,            '5'},
@@ -581,6 +630,8 @@ static struct option long_options[] = {
 	{(char*)"mm",           no_argument,       0,            ARG_MM},
 	{(char*)"shmem",        no_argument,       0,            ARG_SHMEM},
 	{(char*)"mmsweep",      no_argument,       0,            ARG_MMSWEEP},
+	{(char*)"max-mem",      required_argument, 0,            ARG_MAX_MEM},
+	{(char*)"mem-report",   no_argument,       0,            ARG_MEM_REPORT},
 	{(char*)"hadoopout",    no_argument,       0,            ARG_HADOOPOUT},
 	{(char*)"fuzzy",        no_argument,       0,            ARG_FUZZY},
 	{(char*)"fullref",      no_argument,       0,            ARG_FULLREF},
@@ -683,6 +734,20 @@ static struct option long_options[] = {
     {(char*)"exclude-taxids",   required_argument, 0,  ARG_EXCLUDE_TAXIDS},
     {(char*)"out-fmt",          required_argument, 0,  ARG_OUT_FMT},
     {(char*)"tab-fmt-cols",     required_argument, 0,  ARG_TAB_FMT_COLS},
+    {(char*)"smem",             no_argument,       0,  ARG_SMEM},
+    {(char*)"strand-prune",     required_argument, 0,  ARG_STRAND_PRUNE},
+    {(char*)"no-prefilter",     no_argument,       0,  ARG_NO_PREFILTER},
+    {(char*)"host-filter",      required_argument, 0,  ARG_HOST_FILTER},
+    {(char*)"host-filter-taxid", required_argument, 0, ARG_HOST_FILTER_TAXID},
+    {(char*)"host-min-frac",    required_argument, 0,  ARG_HOST_MIN_FRAC},
+    {(char*)"shard-tmp",        required_argument, 0,  ARG_SHARD_TMP},
+    {(char*)"long-read-window", required_argument, 0,  ARG_LONG_READ_WINDOW},
+    {(char*)"long-read-overlap", required_argument, 0, ARG_LONG_READ_OVERLAP},
+    {(char*)"long-read-segments", required_argument, 0, ARG_LONG_READ_SEGMENTS},
+    {(char*)"report-interval",  required_argument, 0,  ARG_REPORT_INTERVAL},
+    {(char*)"mate-candidates",  required_argument, 0,  ARG_MATE_CANDIDATES},
+    {(char*)"writer-thread",    no_argument,       0,  ARG_WRITER_THREAD},
+    {(char*)"out-gz",           no_argument,       0,  ARG_OUT_GZ},
 #ifdef USE_SRA
     {(char*)"sra-acc",   required_argument, 0,        ARG_SRA_ACC},
 #endif
@@ -792,6 +857,20 @@ static void printUsage(ostream& out) {
 		<< "  --min-totallen <int>  minimum summed length of partial hits per read (default " << minTotalLen << ")" << endl
         << "  --host-taxids <taxids> comma-separated list of taxonomic IDs that will be preferred in classification" << endl
         << "  --exclude-taxids <taxids> comma-separated list of taxonomic IDs that will be excluded in classification" << endl
+        << "  --smem                extend partial hits in both directions; needs an index built with --mirror" << endl
+        << "  --strand-prune <str>  stop searching the losing strand early: off, bound or length (off)" << endl
+        << "  --no-prefilter        don't use the index's k-mer prefilter (.pf.cf) to skip reads" << endl
+        << "  --host-filter <file>  report reads mostly made of k-mers in this filter (centrifuge-build" << endl
+        << "                        --filter-only) as the host without searching the index" << endl
+        << "  --host-filter-taxid <int> taxonomic ID host reads are reported as (9606)" << endl
+        << "  --host-min-frac <float> share of a read's k-mers in --host-filter to call it host (0.5)" << endl
+        << "  --shard-tmp <dir>     where to keep per-read candidates when -x lists several index" << endl
+        << "                        shards ($TMPDIR or /tmp)" << endl
+        << "  --long-read-window <int> search reads longer than <int> bp in <int>-bp windows, in parallel (off)" << endl
+        << "  --long-read-overlap <int> bp shared by consecutive long-read windows (100)" << endl
+        << "  --long-read-segments <path> write the best taxIDs of each long-read window to <path>" << endl
+        << "  --report-interval <int> rewrite --report-file every <int> secs while classifying (off)" << endl
+        << "  --mate-candidates <int> search mate 2 only for mate 1's candidates if it has <= <int> (off)" << endl
 		<< endl
 	    << " Output:" << endl;
 	//if(wrapper == "basic-0") {
@@ -799,7 +878,8 @@ static void printUsage(ostream& out) {
 	//}
 	out << "  --out-fmt <str>       define output format, either 'tab' or 'sam' (tab)" << endl
 		<< "  --tab-fmt-cols <str>  columns in tabular format, comma separated " << endl 
-        << "                          default: " << tab_fmt_col_def << endl;
+        << "                          default: " << tab_fmt_col_def << endl
+	    << "  --out-gz              gzip (BGZF) the output; implied if -S ends in .gz (off)" << endl;
 	out << "  -t/--time             print wall-clock time taken by search phases" << endl;
 	if(wrapper == "basic-0") {
 	out << "  --un <path>           write unpaired reads that didn't align to <path>" << endl
@@ -814,13 +894,18 @@ static void printUsage(ostream& out) {
 		<< "  --met-file <path>     send metrics to file at <path> (off)" << endl
 		<< "  --met-stderr          send metrics to stderr (off)" << endl
 		<< "  --met <int>           report internal counters & metrics every <int> secs (1)" << endl
+		<< "  --met-json            report them as JSON, with time per stage & read latencies" << endl
+		<< "  --perf-counters       count cycles, instructions, cache & TLB misses per stage" << endl
 		<< endl
 	    << " Performance:" << endl
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (1)" << endl
+	    << "  --writer-thread    write output from a separate thread (off)" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many instances can share" << endl
 #endif
+	    << "  --max-mem <int>    fit index & threads into <int> MB (or <int>K, <int>G)" << endl
+	    << "  --mem-report       report memory use by index part & thread at start and end" << endl
 		<< endl
 	    << " Other:" << endl
 		<< "  --qc-filter        filter out reads that are bad according to QSEQ filter" << endl
@@ -868,6 +953,30 @@ static int parseInt(int lower, const char *errmsg, const char *arg) {
 	return parseInt(lower, std::numeric_limits<int>::max(), errmsg, arg);
 }
 
+/**
+ * Parse an amount of memory out of arg: a positive integer, in megabytes
+ * unless followed by K, M or G.  Return it in bytes.
+ */
+static uint64_t parseMem(const char *errmsg, const char *arg) {
+	char *endPtr = NULL;
+	long long l = strtoll(arg, &endPtr, 10);
+	uint64_t unit = 1024 * 1024;
+	if(endPtr != NULL && endPtr != arg && l > 0) {
+		switch(toupper(*endPtr)) {
+			case 'K': unit = 1024; endPtr++; break;
+			case 'M': endPtr++; break;
+			case 'G': unit = 1024 * 1024 * 1024; endPtr++; break;
+		}
+		if(*endPtr == '\0') {
+			return (uint64_t)l * unit;
+		}
+	}
+	cerr << errmsg << endl;
+	printUsage(cerr);
+	throw 1;
+	return 0;
+}
+
 /**
  * Parse a T string 'str'.
  */
@@ -1011,6 +1120,8 @@ static void parseOption(int next_option, const char *arg) {
 #endif
 		}
 		case ARG_MMSWEEP: mmSweep = true; break;
+		case ARG_MAX_MEM: maxMem = parseMem("--max-mem arg must be a positive number of megabytes, optionally followed by K, M or G", arg); break;
+		case ARG_MEM_REPORT: memReport = true; break;
 		case ARG_HADOOPOUT: hadoopOut = true; break;
 		case ARG_SOLEXA_QUALS: solexaQuals = true; break;
 		case ARG_INTEGER_QUALS: integerQuals = true; break;
@@ -1161,6 +1272,8 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_METRIC_FILE: metricsFile = arg; break;
 		case ARG_METRIC_STDERR: metricsStderr = true; break;
 		case ARG_METRIC_PER_READ: metricsPerRead = true; break;
+		case ARG_METRIC_JSON: metricsJson = true; break;
+		case ARG_PERF_COUNTERS: perfCounters = true; break;
 		case ARG_NO_FW: gNofw = true; break;
 		case ARG_NO_RC: gNorc = true; break;
 		case ARG_SAM_NO_QNAME_TRUNC: samTruncQname = false; break;
@@ -1420,6 +1533,72 @@ static void parseOption(int next_option, const char *arg) {
             }
             break;
         }
+        case ARG_SMEM: {
+            smem = true;
+            break;
+        }
+        case ARG_STRAND_PRUNE: {
+            if(strcmp(arg, "off") == 0) {
+                strandPrune = STRAND_PRUNE_OFF;
+            } else if(strcmp(arg, "bound") == 0) {
+                strandPrune = STRAND_PRUNE_BOUND;
+            } else if(strcmp(arg, "length") == 0) {
+                strandPrune = STRAND_PRUNE_LENGTH;
+            } else {
+                cerr << "Error: --strand-prune arg must be 'off', 'bound' or 'length'" << endl;
+                printUsage(cerr);
+                throw 1;
+            }
+            break;
+        }
+        case ARG_NO_PREFILTER: {
+            noPrefilter = true;
+            break;
+        }
+        case ARG_HOST_FILTER: {
+            hostFilterFile = arg;
+            break;
+        }
+        case ARG_HOST_FILTER_TAXID: {
+            istringstream ss(arg);
+            ss >> hostFilterTaxID;
+            break;
+        }
+        case ARG_SHARD_TMP: {
+            shardTmp = arg;
+            break;
+        }
+        case ARG_LONG_READ_WINDOW: {
+            longReadWindow = parse<uint32_t>(arg);
+            break;
+        }
+        case ARG_LONG_READ_OVERLAP: {
+            longReadOverlap = parse<uint32_t>(arg);
+            break;
+        }
+        case ARG_LONG_READ_SEGMENTS: {
+            longReadSegments = arg;
+            break;
+        }
+        case ARG_REPORT_INTERVAL: {
+            reportIval = parseInt(1, "--report-interval arg must be at least 1", arg);
+            break;
+        }
+        case ARG_MATE_CANDIDATES: {
+            mateCandidates = parse<uint32_t>(arg);
+            break;
+        }
+        case ARG_WRITER_THREAD: writerThread = true; break;
+        case ARG_OUT_GZ: outGz = true; break;
+        case ARG_HOST_MIN_FRAC: {
+            hostMinFrac = parse<double>(arg);
+            if(hostMinFrac <= 0.0 || hostMinFrac > 1.0) {
+                cerr << "Error: --host-min-frac arg must be greater than 0 and at most 1" << endl;
+                printUsage(cerr);
+                throw 1;
+            }
+            break;
+        }
         case ARG_EXCLUDE_TAXIDS: {
             EList<string> args;
             tokenize(arg, ",", args);
@@ -1549,6 +1728,15 @@ static void parseOptions(int argc, const char **argv) {
 		assert_gt(mhits, 0);
 		msample = true;
 	}
+	if(longReadWindow > 0 && longReadOverlap >= longReadWindow) {
+		cerr << "Error: --long-read-overlap (" << longReadOverlap << ") must be less than --long-read-window ("
+		     << longReadWindow << ")" << endl;
+		throw 1;
+	}
+	if(!longReadSegments.empty() && longReadWindow == 0) {
+		cerr << "Error: --long-read-segments needs --long-read-window" << endl;
+		throw 1;
+	}
 	if(mates1.size() != mates2.size()) {
 		cerr << "Error: " << mates1.size() << " mate files/sequences were specified with -1, but " << mates2.size() << endl
 		     << "mate files/sequences were specified with -2.  The same number of mate files/" << endl
@@ -1649,11 +1837,19 @@ typedef uint16_t local_index_t;
 static PairedPatternSource*              multiseed_patsrc;
 static Ebwt<index_t>*                    multiseed_ebwtFw;
 static Ebwt<index_t>*                    multiseed_ebwtBw;
+static const KmerFilter*                 multiseed_prefilter;
+static const KmerFilter*                 multiseed_hostFilter;
+static ShardSpill*                       multiseed_spillOut;    // non-NULL while searching a shard but the last
+static const EList<ShardSpill*>*         multiseed_spillIn;     // candidates of the other shards
+static const EList<uint64_t>*            multiseed_spillUidOff; // their uniqueID offsets
+static LongReadPool<index_t>*            multiseed_longReads;   // windows of long reads; NULL unless --long-read-window
 static Scoring*                          multiseed_sc;
 static BitPairReference*                 multiseed_refs;
 static AlnSink<index_t>*                 multiseed_msink;
 static OutFileBuf*                       multiseed_metricsOfb;
 static EList<string>                     multiseed_refnames;
+static int                               multiseed_nfinished;   // # worker threads done
+static MUTEX_T                           multiseed_mutex;
 
 /**
  * Metrics for measuring the work done by the outer read alignment
@@ -1710,7 +1906,11 @@ struct OuterLoopMetrics {
  */
 struct PerfMetrics {
 
-	PerfMetrics() : first(true) { reset(); }
+	PerfMetrics() : first(true) {
+		reset();
+		gettimeofday(&tv0, NULL);
+		ticks0 = stageTicks();
+	}
 
 	/**
 	 * Set all counters to 0.
@@ -1733,6 +1933,8 @@ struct PerfMetrics {
 		nbtfiltdo_u = 0;
         
         him.reset();
+		stm.reset();
+		stmu.reset();
 	}
 
 	/**
@@ -1747,6 +1949,7 @@ struct PerfMetrics {
 		uint64_t nbtfiltsc_,
 		uint64_t nbtfiltdo_,
         const HIMetrics *hi,
+		const StageMetrics *st,
 		bool getLock)
 	{
 
@@ -1769,6 +1972,9 @@ struct PerfMetrics {
         if(hi != NULL) {
             him.merge(*hi, false);
         }
+		if(st != NULL) {
+			stmu.merge(*st);
+		}
 	}
 
 	/**
@@ -1784,6 +1990,10 @@ struct PerfMetrics {
 		const BTString *name) // non-NULL name pointer if is per-read record
 	{
 		ThreadSafe ts(&mutex_m, sync);
+		if(metricsJson) {
+			reportJson(o, metricsStderr, total, name);
+			return;
+		}
 		ostringstream stderrSs;
 		time_t curtime = time(0);
 		char buf[1024];
@@ -1938,6 +2148,13 @@ struct PerfMetrics {
                 /* 134 */ "LocalSearchRecur"    "\t"
                 /* 135 */ "GlobalGenomeCoords"  "\t"
                 /* 136 */ "LocalGenomeCoords"   "\t"
+                /* 137 */ "PrefilterTests"      "\t"
+                /* 138 */ "PrefilterRejects"    "\t"
+                /* 139 */ "HostTests"           "\t"
+                /* 140 */ "HostReads"           "\t"
+                /* 141 */ "LongReadWindows"     "\t"
+                /* 142 */ "MateRestricted"      "\t"
+                /* 143 */ "MateRestrictRedone"  "\t"
             
             
 				"\n";
@@ -2145,6 +2362,34 @@ struct PerfMetrics {
 		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
         // 136
         itoa10<size_t>(him.localgenomecoords, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 137
+        itoa10<size_t>(him.prefiltertests, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 138
+        itoa10<size_t>(him.prefilterrej, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 139
+        itoa10<size_t>(him.hosttests, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 140
+        itoa10<size_t>(him.hostreads, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 141
+        itoa10<size_t>(him.windows, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 142
+        itoa10<size_t>(him.materestricts, buf);
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+        // 143
+        itoa10<size_t>(him.materestrictfbs, buf);
         if(metricsStderr) stderrSs << buf;
 		if(o != NULL) { o->writeChars(buf); }
 
@@ -2153,9 +2398,129 @@ struct PerfMetrics {
 		if(!total) mergeIncrementals();
 	}
 	
+	/**
+	 * Like reportInterval, but write the counters as one line of JSON,
+	 * with the time spent per stage and the distribution of per-read
+	 * latencies.  Stage times are summed over threads.
+	 */
+	void reportJson(
+		OutFileBuf* o,
+		bool metricsStderr,
+		bool total,
+		const BTString *name)
+	{
+		if(total) mergeIncrementals();
+		const OuterLoopMetrics& ol = total ? olm : olmu;
+		const WalkMetrics& wl = total ? wlm : wlmu;
+		const StageMetrics& st = total ? stm : stmu;
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		double tpus = ticksPerUs();
+		ostringstream os;
+		os << "{\"time\":" << tv.tv_sec;
+		if(name != NULL) {
+			os << ",\"name\":\"";
+			for(size_t i = 0; i < name->length(); i++) {
+				char c = (*name)[i];
+				if(c == '"' || c == '\\') os << '\\' << c;
+				else if((unsigned char)c >= 0x20) os << c;
+			}
+			os << '"';
+		}
+		os << ",\"reads\":" << ol.reads
+		   << ",\"bases\":" << ol.bases
+		   << ",\"filtered_reads\":" << ol.freads
+		   << ",\"stage_seconds\":{";
+		for(size_t i = 0; i < NUM_STAGES; i++) {
+			os << (i > 0 ? "," : "") << '"' << stageNames[i] << "\":" << (double)st.ticks[i] / tpus / 1e6;
+		}
+		os << "},\"stage_calls\":{";
+		for(size_t i = 0; i < NUM_STAGES; i++) {
+			os << (i > 0 ? "," : "") << '"' << stageNames[i] << "\":" << st.calls[i];
+		}
+		os << "},\"lf_ops\":" << st.lfops
+		   << ",\"walk_steps\":" << wl.bwops
+		   << ",\"resolved_rows\":" << wl.resolves
+		   << ",\"prefilter_tests\":" << him.prefiltertests
+		   << ",\"prefilter_rejects\":" << him.prefilterrej
+		   << ",\"host_tests\":" << him.hosttests
+		   << ",\"host_reads\":" << him.hostreads
+		   << ",\"long_read_windows\":" << him.windows
+		   << ",\"mate_restricted\":" << him.materestricts
+		   << ",\"mate_restrict_redone\":" << him.materestrictfbs;
+		if(perfEvents != 0) {
+			os << ",\"perf\":{";
+			for(size_t i = 0; i < NUM_STAGES; i++) {
+				os << (i > 0 ? "," : "") << '"' << stageNames[i] << "\":{";
+				bool firstEvent = true;
+				for(size_t j = 0; j < NUM_PERF; j++) {
+					if(!(perfEvents & (1u << j))) continue;
+					os << (firstEvent ? "" : ",") << '"' << perfNames[j] << "\":" << st.perf[i][j];
+					firstEvent = false;
+				}
+				os << '}';
+			}
+			os << '}';
+		}
+		os << ",\"latency_us\":[";
+		// [upper bound in microseconds, # reads] per non-empty bucket
+		bool firstBucket = true;
+		for(size_t i = 0; i < StageMetrics::NUM_LAT; i++) {
+			if(st.latency[i] == 0) continue;
+			os << (firstBucket ? "" : ",") << '[' << (double)(2ull << i) / tpus << ',' << st.latency[i] << ']';
+			firstBucket = false;
+		}
+		os << "]}\n";
+		if(o != NULL) o->writeChars(os.str().c_str());
+		if(metricsStderr) cerr << os.str().c_str();
+		if(!total) mergeIncrementals();
+	}
+
+	/**
+	 * Return ticks per microsecond since we started counting.
+	 */
+	double ticksPerUs() const {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		double us = (double)(tv.tv_sec - tv0.tv_sec) * 1e6 + (double)(tv.tv_usec - tv0.tv_usec);
+		double tpus = us > 0 ? (double)(stageTicks() - ticks0) / us : 1.0;
+		return tpus > 0 ? tpus : 1.0;
+	}
+
+	/**
+	 * Report the hardware events counted in each stage over the whole job,
+	 * one line per stage.
+	 */
+	void reportPerf(OutFileBuf* o, bool toStderr) {
+		mergeIncrementals();
+		ostringstream os;
+		os << "Stage\tCalls\tSeconds";
+		for(size_t j = 0; j < NUM_PERF; j++) {
+			if(perfEvents & (1u << j)) os << '\t' << perfNames[j];
+		}
+		const uint32_t ipcEvents = (1u << PERF_CYCLES) | (1u << PERF_INSTRUCTIONS);
+		if((perfEvents & ipcEvents) == ipcEvents) os << "\tIPC";
+		os << '\n';
+		double tpus = ticksPerUs();
+		for(size_t i = 0; i < NUM_STAGES; i++) {
+			os << stageNames[i] << '\t' << stm.calls[i] << '\t' << (double)stm.ticks[i] / tpus / 1e6;
+			for(size_t j = 0; j < NUM_PERF; j++) {
+				if(perfEvents & (1u << j)) os << '\t' << stm.perf[i][j];
+			}
+			if((perfEvents & ipcEvents) == ipcEvents) {
+				uint64_t cyc = stm.perf[i][PERF_CYCLES];
+				os << '\t' << (cyc > 0 ? (double)stm.perf[i][PERF_INSTRUCTIONS] / cyc : 0.0);
+			}
+			os << '\n';
+		}
+		if(o != NULL) o->writeChars(os.str().c_str());
+		if(toStderr) cerr << os.str().c_str();
+	}
+
 	void mergeIncrementals() {
 		olm.merge(olmu, false);
 		wlm.merge(wlmu, false);
+		stm.merge(stmu);
 		nbtfiltst_u += nbtfiltst;
 		nbtfiltsc_u += nbtfiltsc;
 		nbtfiltdo_u += nbtfiltdo;
@@ -2164,6 +2529,7 @@ struct PerfMetrics {
 		wlmu.reset();
 		rpmu.reset();
 		spmu.reset();
+		stmu.reset();
 		nbtfiltst_u = 0;
 		nbtfiltsc_u = 0;
 		nbtfiltdo_u = 0;
@@ -2190,6 +2556,11 @@ struct PerfMetrics {
     //
     HIMetrics         him;
 
+	StageMetrics      stm;   // time per stage etc. over the whole job
+	StageMetrics      stmu;  // and just since the last update
+	struct timeval    tv0;   // when we started, to turn ticks into time
+	uint64_t          ticks0;
+
 	MUTEX_T           mutex_m;  // lock for when one ob
 	bool              first; // yet to print first line?
 	time_t            lastElapsed; // used in reportInterval to measure time since last call
@@ -2288,12 +2659,14 @@ static inline void printEEScoreMsg(
 		nbtfiltsc, \
 		nbtfiltdo, \
         &him, \
+		stages, \
 		sync); \
 	olm.reset(); \
 	wlm.reset(); \
 	rpm.reset(); \
 	spm.reset(); \
     him.reset(); \
+	stm.reset(); \
 }
 
 /**
@@ -2315,10 +2688,14 @@ static void multiseedSearchWorker(void *vp) {
 
 	int tid = *((int*)vp);
 	assert(multiseed_ebwtFw != NULL);
-	assert(multiseedMms == 0 || multiseed_ebwtBw != NULL);
+	assert(!smem || multiseed_ebwtBw != NULL);
+	if(memReport) {
+		// Tally the scratch this thread allocates from here on
+		MemoryTally::setThreadTally(&thread_mem[tid-1]);
+	}
 	PairedPatternSource&             patsrc   = *multiseed_patsrc;
 	const Ebwt<index_t>&             ebwtFw   = *multiseed_ebwtFw;
-	const Ebwt<index_t>&             ebwtBw   = *multiseed_ebwtBw;
+	const Ebwt<index_t>*             ebwtBw   = multiseed_ebwtBw;
 	const Scoring&                   sc       = *multiseed_sc;
 	const BitPairReference&          ref      = *multiseed_refs;
 	AlnSink<index_t>&                msink    = *multiseed_msink;
@@ -2337,11 +2714,23 @@ static void multiseedSearchWorker(void *vp) {
     ReportingParams rp((allHits ? std::numeric_limits<THitInt>::max() : khits),
                        ebwtFw.compressed()); // -k
 
+	// Time per stage and per read; only reported with --met-json, or
+	// along with hardware events per stage with --perf-counters
+	StageMetrics stm;
+	StageMetrics* stages = ((metricsJson && (metricsOfb != NULL || metricsStderr)) || perfCounters) ? &stm : NULL;
+	// Counters must be opened by the thread they count
+	auto_ptr<PerfCounters> perfCtrs(perfCounters ? new PerfCounters() : NULL);
+	if(perfCtrs.get() != NULL && perfCtrs->ok()) {
+		stm.counters = perfCtrs.get();
+	}
+
 	// Make a per-thread wrapper for the global MHitSink object.
 	AlnSinkWrap<index_t> msinkwrap(
                                    msink,         // global sink
                                    rp,            // reporting parameters
-                                   (size_t)tid);  // thread id
+                                   (size_t)tid,   // thread id
+                                   false,         // no secondary alignments
+                                   stages);       // time formatting and output
     
     Classifier<index_t, local_index_t> classifier(
                                                   ebwtFw,
@@ -2352,7 +2741,18 @@ static void multiseedSearchWorker(void *vp) {
                                                   tree_traverse,
                                                   classification_rank,
                                                   host_taxIDs,
-                                                  excluded_taxIDs);
+                                                  excluded_taxIDs,
+                                                  strandPrune,
+                                                  multiseed_prefilter,
+                                                  multiseed_hostFilter,
+                                                  hostFilterTaxID,
+                                                  hostMinFrac,
+                                                  multiseed_spillOut,
+                                                  multiseed_spillIn,
+                                                  multiseed_spillUidOff,
+                                                  multiseed_longReads,
+                                                  mateCandidates,
+                                                  stages);
 	OuterLoopMetrics olm;
 	WalkMetrics wlm;
 	ReportingMetrics rpm;
@@ -2415,8 +2815,13 @@ static void multiseedSearchWorker(void *vp) {
 	int mergei = 0;
 	int mergeival = 16;
 	while(true) {
+		// first help search the windows of long reads other threads read
+		classifier.helpLongReads(sc, ebwtFw, ebwtBw, ref, wlm, prm, him, rp);
 		bool success = false, done = false, paired = false;
-		ps->nextReadPair(success, done, paired, outType != OUTPUT_SAM);
+		{
+			StageTimer t(stages, STAGE_PARSE);
+			ps->nextReadPair(success, done, paired, outType != OUTPUT_SAM);
+		}
 		if(!success && done) {
 			break;
 		} else if(!success) {
@@ -2438,9 +2843,10 @@ static void multiseedSearchWorker(void *vp) {
 			//
 			// Check if there is metrics reporting for us to do.
 			//
-			if(metricsIval > 0 &&
-			   (metricsOfb != NULL || metricsStderr) &&
-			   !metricsPerRead &&
+			if(((metricsIval > 0 &&
+			    (metricsOfb != NULL || metricsStderr) &&
+			    !metricsPerRead) ||
+			    reportIval > 0) &&
 			   ++mergei == mergeival)
 			{
 				// Do a periodic merge.  Update global metrics, in a
@@ -2448,7 +2854,7 @@ static void multiseedSearchWorker(void *vp) {
 				MERGE_METRICS(metrics, nthreads > 1);
 				mergei = 0;
 				// Check if a progress message should be printed
-				if(tid == 0) {
+				if(tid == 0 && metricsIval > 0 && (metricsOfb != NULL || metricsStderr)) {
 					// Only thread 1 prints progress messages
 					time_t curTime = time(0);
 					if(curTime - iTime >= metricsIval) {
@@ -2458,6 +2864,7 @@ static void multiseedSearchWorker(void *vp) {
 				}
 			}
 
+			uint64_t readTicks = (stages != NULL ? stageTicks() : 0);
 			prm.reset(); // per-read metrics
 			prm.doFmString = false;
 			if(sam_print_xt) {
@@ -2698,9 +3105,12 @@ static void multiseedSearchWorker(void *vp) {
 									 spm,                  // species metrics
                                      prm,                  // per-read metrics
                                      !seedSumm,            // suppress seed summaries?
-                                     seedSumm);            // suppress alignments?
+                                     seedSumm || multiseed_spillOut != NULL); // suppress alignments?
 				assert(!retry || msinkwrap.empty());
             } // while(retry)
+			if(stages != NULL) {
+				stm.addLatency(stageTicks() - readTicks);
+			}
 		} // if(rdid >= skipReads && rdid < qUpto)
 		else if(rdid >= qUpto) {
 			break;
@@ -2717,10 +3127,206 @@ static void multiseedSearchWorker(void *vp) {
 	
 	// One last metrics merge
 	MERGE_METRICS(metrics, nthreads > 1);
+	{
+		ThreadSafe ts(&multiseed_mutex, nthreads > 1);
+		multiseed_nfinished++;
+	}
+	MemoryTally::setThreadTally(NULL);
     
 	return;
 }
 
+/**
+ * Write the species report table for the read counts and abundances in
+ * 'spm'.  If 'atomic', the table is written next to 'fname' and renamed
+ * over it, so that a reader never sees a partial report.
+ */
+static void writeReport(
+	const string& fname,
+	SpeciesMetrics& spm,
+	const Ebwt<index_t>& ebwt,
+	bool atomic)
+{
+	string tmpName = atomic ? fname + ".tmp" : fname;
+	ofstream reportOfb;
+	reportOfb.open(tmpName.c_str());
+	const TaxTreeTable& tree = ebwt.tree();
+	const TaxNameTable& name_map = ebwt.name();
+	const TaxSizeTable& size_map = ebwt.size();
+	const map<uint64_t, double>& abundance = spm.abundance;
+	const map<uint64_t, double>& abundance_len = spm.abundance_len;
+	reportOfb << "name" << '\t' << "taxID" << '\t' << "taxRank" << '\t'
+			  << "genomeSize" << '\t' << "numReads" << '\t' << "numUniqueReads" << '\t';
+    if(false) {
+        reportOfb << "summedHitLen" << '\t' << "numWeightedReads" << '\t' << "numUniqueKmers" << '\t' << "sumScore" << '\t';
+    }
+    reportOfb << "abundance";
+    if(false) {
+        reportOfb << '\t' << "abundance_normalized_by_genome_size";
+    }
+    reportOfb << endl;
+	for(map<uint64_t, ReadCounts>::const_iterator it = spm.species_counts.begin(); it != spm.species_counts.end(); ++it) {
+
+        uint64_t taxid = it->first;
+        if(taxid == 0) continue;
+
+        const char* name = name_map.find(taxid, NULL);
+        if(name != NULL) {
+            reportOfb << name;
+        } else {
+            reportOfb << taxid;
+        }
+        reportOfb << '\t' << taxid << '\t';
+
+        uint8_t rank = 0;
+        bool leaf = false;
+        TaxTreeTable::const_iterator tree_itr = tree.find(taxid);
+        
+        if(tree_itr != tree.end()) {
+            rank = tree_itr->second.rank;
+            leaf = tree_itr->second.leaf;
+        }
+        if(rank == RANK_UNKNOWN && leaf) {
+            reportOfb << "leaf";
+        } else {
+            string rank_str = get_tax_rank_string(rank);
+            reportOfb << rank_str;
+        }
+        reportOfb << '\t';
+        
+        TaxSizeTable::const_iterator size_itr = size_map.find(taxid);
+        uint64_t genome_size = 0;
+        if(size_itr != size_map.end()) {
+            genome_size = size_itr->second;
+        }
+        
+        reportOfb << genome_size << '\t'
+				  << it->second.n_reads << '\t' << it->second.n_unique_reads << '\t';
+        if(false) {
+            reportOfb << it->second.summed_hit_len << '\t' << it->second.weighted_reads << '\t'
+                      << spm.nDistinctKmers(taxid) << '\t' << it->second.sum_score << '\t';
+        }
+        map<uint64_t, double>::const_iterator ab_len_itr = abundance_len.find(taxid);
+        if(ab_len_itr != abundance_len.end()) {
+            reportOfb << ab_len_itr->second;
+        } else {
+            reportOfb << "0.0";
+        }
+        map<uint64_t, double>::const_iterator ab_itr = abundance.find(taxid);
+        if(false) {
+            if(ab_itr != abundance.end() && ab_len_itr != abundance_len.end()) {
+                reportOfb << '\t' << ab_itr->second;
+            } else {
+                reportOfb << "\t0.0";
+            }
+        }
+        reportOfb << endl;
+
+	}
+	reportOfb.close();
+	if(atomic && rename(tmpName.c_str(), fname.c_str()) != 0) {
+		cerr << "Warning: could not rename " << tmpName.c_str() << " to " << fname.c_str()
+		     << ": " << strerror(errno) << endl;
+	}
+}
+
+/**
+ * Write a snapshot of the report for the reads classified so far.  The
+ * abundance EM starts from the abundances of the last snapshot, which
+ * are then replaced with this one's.
+ */
+static void writeReportSnapshot(
+	const Ebwt<index_t>& ebwt,
+	map<uint64_t, double>& prior)
+{
+	SpeciesMetrics snap;
+	{
+		ThreadSafe ts(&metrics.mutex_m, nthreads > 1);
+		snap.merge(metrics.spmu, false);
+	}
+	if(abundance_analysis) {
+		uint8_t rank = get_tax_rank_id(classification_rank.c_str());
+		snap.calculateAbundance(ebwt, rank, &prior, false);
+		prior = snap.abundance_len;
+	}
+	writeReport(reportFile, snap, ebwt, true);
+}
+
+// abundances of the last report snapshot, to warm-start the next EM
+static map<uint64_t, double> reportPrior;
+
+/**
+ * Write one line of a --mem-report breakdown to stderr.
+ */
+static void reportMemLine(const char *name, uint64_t bytes, const char *where) {
+	char buf[128];
+	snprintf(buf, sizeof(buf), "  %-24s %10.1f MB  %s", name, bytes / (1024.0 * 1024.0), where);
+	cerr << buf << endl;
+}
+
+/**
+ * Write how much memory each part of the loaded index and k-mer filters
+ * takes, and where it lives, to stderr.
+ */
+static void reportMemStartup(
+	const Ebwt<index_t>& ebwtFw,
+	const Ebwt<index_t>* ebwtBw,
+	const KmerFilter* prefilter,
+	const KmerFilter* hostFilter)
+{
+	const char *shared = useShmem ? "shared memory" : (useMm ? "memory-mapped" : "heap");
+	uint64_t heap = 0, other = 0;
+	cerr << "Memory at startup:" << endl;
+	for(int i = 0; i < 2; i++) {
+		const Ebwt<index_t>* ebwt = (i == 0 ? &ebwtFw : ebwtBw);
+		if(ebwt == NULL) continue;
+		EList<EbwtMemPart> parts;
+		ebwt->memoryUse(parts);
+		for(size_t j = 0; j < parts.size(); j++) {
+			if(i > 0 && parts[j].bytes == 0) continue; // mirror has no SA or taxonomy
+			string name = string(i == 0 ? "index " : "mirror ") + parts[j].name;
+			reportMemLine(name.c_str(), parts[j].bytes, parts[j].heap ? "heap" : shared);
+			(parts[j].heap ? heap : other) += parts[j].bytes;
+		}
+	}
+	if(prefilter != NULL) {
+		reportMemLine("k-mer prefilter", prefilter->bytes(), "heap");
+		heap += prefilter->bytes();
+	}
+	if(hostFilter != NULL) {
+		reportMemLine("host filter", hostFilter->bytes(), "heap");
+		heap += hostFilter->bytes();
+	}
+	reportMemLine("total", heap, "heap");
+	if(other > 0) {
+		reportMemLine("total", other, shared);
+	}
+}
+
+/**
+ * Write the most scratch memory each thread held at once, and the peaks
+ * for the whole process, to stderr.  Scratch is what the thread tallied
+ * in its own lists and arrays; per-thread taxonomy counts held in
+ * std::maps aren't tallied, but are part of the resident set size.
+ */
+static void reportMemShutdown() {
+	cerr << "Memory at shutdown:" << endl;
+	uint64_t scratch = 0;
+	for(size_t i = 0; i < thread_mem.size(); i++) {
+		ostringstream name;
+		name << "thread " << (i+1) << " scratch peak";
+		reportMemLine(name.str().c_str(), thread_mem[i].peak, "heap");
+		scratch = max<uint64_t>(scratch, thread_mem[i].peak);
+	}
+	reportMemLine("largest scratch peak", scratch, "heap");
+	reportMemLine("tallied peak", gMemTally.peak(), "heap");
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) == 0) {
+		// ru_maxrss is in kilobytes
+		reportMemLine("peak resident set", (uint64_t)ru.ru_maxrss * 1024, "");
+	}
+}
+
 /**
  * Called once per alignment job.  Sets up global pointers to the
  * shared global data structures, creates per-thread structures, then
@@ -2731,7 +3337,9 @@ static void multiseedSearch(
 	PairedPatternSource& patsrc,  // pattern source
 	AlnSink<index_t>& msink,      // hit sink
 	Ebwt<index_t>& ebwtFw,        // index of original text
-	Ebwt<index_t>& ebwtBw,        // index of mirror text
+	Ebwt<index_t>* ebwtBw,        // index of mirror text, or NULL
+	const KmerFilter* prefilter,  // k-mer prefilter, or NULL
+	const KmerFilter* hostFilter, // host k-mer filter, or NULL
     BitPairReference* refs,
     const EList<string>& refnames,
 	OutFileBuf *metricsOfb)
@@ -2740,9 +3348,12 @@ static void multiseedSearch(
     multiseed_patsrc = &patsrc;
 	multiseed_msink  = &msink;
 	multiseed_ebwtFw = &ebwtFw;
-	multiseed_ebwtBw = &ebwtBw;
+	multiseed_ebwtBw = ebwtBw;
+	multiseed_prefilter = prefilter;
+	multiseed_hostFilter = hostFilter;
 	multiseed_sc     = &sc;
 	multiseed_metricsOfb      = metricsOfb;
+	multiseed_nfinished = 0;
 	multiseed_refs = refs;
     multiseed_refnames = refnames;
 	AutoArray<tthread::thread*> threads(nthreads);
@@ -2760,35 +3371,71 @@ static void multiseedSearch(
 			!noRefNames,  // load names?
 			startVerbose);
 	}
-#if 0
-	if(multiseedMms > 0 || do1mmUpFront) {
+	if(ebwtBw != NULL) {
 		// Load the other half of the index into memory
-		assert(!ebwtBw.isInMemory());
+		assert(!ebwtBw->isInMemory());
 		Timer _t(cerr, "Time loading mirror index: ", timing);
-		ebwtBw.loadIntoMemory(
+		ebwtBw->loadIntoMemory(
 			0, // colorspace?
 			// It's bidirectional search, so we need the reverse to be
 			// constructed as the reverse of the concatenated strings.
 			1,
-			true,        // load SA samp in reverse index
-			true,         // yes, need ftab in reverse index
-			true,        // load rstarts in reverse index
-			!noRefNames,  // load names?
+			false,       // offsets are always resolved in the forward index
+			true,        // yes, need ftab in reverse index
+			false,       // no rstarts needed in reverse index
+			false,       // load names?
 			startVerbose);
 	}
-#endif
+	if(memReport) {
+		reportMemStartup(ebwtFw, ebwtBw, prefilter, hostFilter);
+		thread_mem.resize(nthreads);
+		thread_mem.fill(ThreadMemTally());
+	}
 	// Start the metrics thread
 	{
 		Timer _t(cerr, "Multiseed full-index search: ", timing);
         
         thread_rids.resize(nthreads);
         thread_rids.fill(0);
+		if(perfCounters) {
+			// Find out up front which events this machine lets us count
+			PerfCounters probe;
+			if(!probe.ok()) {
+				cerr << "Warning: hardware performance counters are unavailable ("
+				     << strerror(probe.error()) << "); ignoring --perf-counters" << endl;
+				perfCounters = false;
+			} else {
+				perfEvents = probe.avail();
+				for(size_t i = 0; i < NUM_PERF; i++) {
+					if(!(perfEvents & (1u << i))) {
+						cerr << "Warning: can't count " << perfNames[i] << " on this machine" << endl;
+					}
+				}
+			}
+		}
 		for(int i = 0; i < nthreads; i++) {
 			// Thread IDs start at 1
 			tids[i] = i+1;
             threads[i] = new tthread::thread(multiseedSearchWorker, (void*)&tids[i]);
 		}
 
+		if(reportIval > 0 && !reportFile.empty() && multiseed_spillOut == NULL) {
+			// Rewrite the report every reportIval seconds until the
+			// workers run out of reads
+			time_t lastReport = time(0);
+			while(true) {
+				sleep(1);
+				{
+					ThreadSafe ts(&multiseed_mutex, nthreads > 1);
+					if(multiseed_nfinished >= nthreads) break;
+				}
+				if(time(0) - lastReport >= reportIval) {
+					writeReportSnapshot(ebwtFw, reportPrior);
+					lastReport = time(0);
+				}
+			}
+		}
+
         for (int i = 0; i < nthreads; i++)
             threads[i]->join();
 
@@ -2796,6 +3443,232 @@ static void multiseedSearch(
 	if(!metricsPerRead && (metricsOfb != NULL || metricsStderr)) {
 		metrics.reportInterval(metricsOfb, metricsStderr, true, false, NULL);
 	}
+	if(perfCounters && !(metricsJson && (metricsOfb != NULL || metricsStderr))) {
+		// Not already in the JSON metrics; to stderr unless asked for a file
+		metrics.reportPerf(metricsOfb, metricsStderr || metricsOfb == NULL);
+	}
+	if(memReport) {
+		reportMemShutdown();
+	}
+}
+
+/**
+ * Load the k-mer prefilter next to an index, if there is one and it's
+ * usable.  Reads with no k-mer in it can't have a hit of --min-hitlen or
+ * more, so we needn't search for them.
+ */
+static KmerFilter* loadPrefilter(const string& idxBase) {
+	if(noPrefilter) {
+		return NULL;
+	}
+	string pfStr = idxBase + ".pf." + gEbwt_ext;
+	auto_ptr<KmerFilter> prefilter(new KmerFilter());
+	if(!prefilter->readFromFile(pfStr)) {
+		return NULL;
+	}
+	if((uint32_t)prefilter->k() > minHitLen) {
+		cerr << "Warning: k-mer prefilter " << pfStr.c_str() << " has k=" << prefilter->k()
+		     << ", more than --min-hitlen " << minHitLen << "; not using it" << endl;
+		return NULL;
+	}
+	if(gVerbose || startVerbose) {
+		cerr << "Loaded " << prefilter->k() << "-mer prefilter: "; logTime(cerr, true);
+	}
+	return prefilter.release();
+}
+
+/**
+ * Return the size of the named file in bytes, or 0 if it can't be
+ * stat'ed.
+ */
+static uint64_t fileBytes(const string& fn) {
+	struct stat st;
+	return stat(fn.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+// Rough sizes for planning --max-mem: the process before it loads
+// anything, a thread's scratch (read buffers, hit lists and its own
+// taxonomy counts), and the taxonomy tables per byte of a v1 .3.cf
+// file they're parsed from
+static const uint64_t MEM_BASE        = 32 * 1024 * 1024;
+static const uint64_t MEM_PER_THREAD  = 64 * 1024 * 1024;
+static const uint64_t MEM_PER_TAXBYTE = 6;
+
+/**
+ * Return the memory taken by the taxonomy tables of the named .3.cf file:
+ * its size if it's in the v2 layout, whose tables are used as they lie in
+ * the file, or an estimate of the tables parsed from the v1 layout.
+ */
+static uint64_t taxonomyBytes(const string& fn) {
+	uint64_t hdr[2] = { 0, 0 };
+	FILE *f = fopen(fn.c_str(), "rb");
+	if(f != NULL) {
+		if(fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) {
+			hdr[1] = 0;
+		}
+		fclose(f);
+	}
+	bool v2 = (hdr[1] == TAX_FILE_MAGIC || hdr[1] == endianSwapU64(TAX_FILE_MAGIC));
+	return fileBytes(fn) * (v2 ? 1 : MEM_PER_TAXBYTE);
+}
+
+/**
+ * Fit the index and threads into --max-mem.  The index is estimated from
+ * the sizes of its files; if it doesn't fit on the heap alongside -p
+ * threads, it's put in shared memory (if compiled in) or memory-mapped
+ * instead, where it's shared with every other process using the same
+ * index and so isn't charged to this one.  If it still doesn't fit,
+ * fewer threads are run.
+ */
+static void planMemory(const string& bt2indexBase) {
+	EList<string> shardBases;
+	tokenize(bt2indexBase, ",", shardBases);
+	uint64_t index = 0, filter = 0, priv = MEM_BASE;
+	for(size_t i = 0; i < shardBases.size(); i++) {
+		string base = adjustEbwtBase(argv0, shardBases[i], gVerbose);
+		uint64_t idx = fileBytes(base + ".1." + gEbwt_ext) + fileBytes(base + ".2." + gEbwt_ext);
+		if(smem) {
+			idx += fileBytes(base + ".rev.1." + gEbwt_ext);
+		}
+		// Shards are loaded one at a time, but their taxonomies are merged
+		index = max(index, idx);
+		priv += taxonomyBytes(base + ".3." + gEbwt_ext);
+		if(!noPrefilter) {
+			filter = max(filter, fileBytes(base + ".pf." + gEbwt_ext));
+		}
+	}
+	priv += filter;
+	if(!hostFilterFile.empty()) {
+		priv += fileBytes(hostFilterFile);
+	}
+	const char *how = NULL;
+	if(!useMm && !useShmem) {
+		if(priv + index + nthreads * MEM_PER_THREAD <= maxMem) {
+			return;
+		}
+#if defined(BOWTIE_SHARED_MEM)
+		useShmem = true;
+		how = "holding the index in shared memory";
+#elif defined(BOWTIE_MM)
+		useMm = true;
+		how = "memory-mapping the index";
+#else
+		priv += index;
+#endif
+	}
+	if(priv + MEM_PER_THREAD > maxMem) {
+		cerr << "Error: --max-mem of " << (maxMem >> 20) << " MB is less than the "
+		     << ((priv + MEM_PER_THREAD) >> 20) << " MB estimated to run one thread" << endl;
+		throw 1;
+	}
+	int fit = (int)min<uint64_t>((maxMem - priv) / MEM_PER_THREAD, nthreads);
+	if(how == NULL && fit == nthreads) {
+		return;
+	}
+	if(!gQuiet) {
+		cerr << "--max-mem: ";
+		if(how != NULL) {
+			cerr << how << (fit < nthreads ? " and " : "");
+		}
+		if(fit < nthreads) {
+			cerr << "running " << fit << " thread" << (fit > 1 ? "s" : "") << " instead of " << nthreads;
+		}
+		cerr << " (about " << ((priv + fit * MEM_PER_THREAD) >> 20) << " MB)" << endl;
+	}
+	nthreads = fit;
+}
+
+/**
+ * Return true iff all the files can be read a second time, i.e. none is
+ * standard input or a named pipe.
+ */
+static bool rereadable(const EList<string>& fns) {
+	for(size_t i = 0; i < fns.size(); i++) {
+		struct stat st;
+		if(fns[i] == "-" || (stat(fns[i].c_str(), &st) == 0 && S_ISFIFO(st.st_mode))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Classify all reads against each shard of a database but the last,
+ * spilling every read's candidates to a ShardSpill, so that they can be
+ * merged in while classifying against the last shard.  Only one shard is
+ * in memory at a time.  The last shard's index, 'ebwt', gets the others'
+ * sequences and taxa appended so that it can report their candidates.
+ */
+static void spillShards(
+	const EList<string>& shardBases,
+	Scoring& sc,
+	PairedPatternSource& patsrc,
+	Ebwt<index_t>& ebwt,
+	EList<ShardSpill*>& spills,
+	EList<uint64_t>& spillUidOff)
+{
+	string tmpDir = shardTmp;
+	if(tmpDir.empty()) {
+		const char* env = getenv("TMPDIR");
+		tmpDir = (env != NULL && env[0] != '\0') ? env : "/tmp";
+	}
+	for(size_t s = 0; s + 1 < shardBases.size(); s++) {
+		string shardBase = adjustEbwtBase(argv0, shardBases[s], gVerbose);
+		Ebwt<index_t> shard(
+			shardBase,
+			0,        // index is colorspace
+			-1,       // fw index
+			true,     // index is for the forward direction
+			/* overriding: */ offRate,
+			0, // amount to add to index offrate or <= 0 to do nothing
+			useMm,    // whether to use memory-mapped files
+			useShmem, // whether to use shared memory
+			mmSweep,  // sweep memory-mapped files
+			!noRefNames, // load names?
+			true,        // load SA sample?
+			true,        // load ftab?
+			true,        // load rstarts?
+			gVerbose, // whether to be talkative
+			startVerbose, // talkative during initialization
+			false /*passMemExc*/,
+			sanityCheck);
+		auto_ptr<KmerFilter> shardFilter(loadPrefilter(shardBase));
+		EList<string> shardRefnames;
+		readEbwtRefnames<index_t>(shardBase, shardRefnames);
+		ostringstream spillBase;
+		spillBase << tmpDir << "/centrifuge-" << getpid() << ".shard" << s;
+		spills.push_back(new ShardSpill());
+		spills.back()->create(spillBase.str());
+		// Nothing is reported until the last shard; this sink only
+		// keeps the per-read bookkeeping going
+		OutFileBuf nullOut;
+		OutputQueue noq(nullOut, false, nthreads, nthreads > 1, skipReads);
+		AlnSinkSam<index_t> nullSink(&shard, noq, shardRefnames, tab_fmt_cols, true);
+		multiseed_spillOut = spills.back();
+		{
+			Timer _t(cerr, "Time searching shard: ", timing);
+			multiseedSearch(
+				sc,
+				patsrc,
+				nullSink,
+				shard,
+				NULL,              // no mirror index
+				shardFilter.get(), // this shard's k-mer prefilter
+				NULL,              // host reads are screened with the last shard
+				NULL,
+				shardRefnames,
+				NULL);
+		}
+		multiseed_spillOut = NULL;
+		if(shard.isInMemory()) {
+			shard.evictFromMemory();
+		}
+		spillUidOff.push_back(ebwt.uid_to_tid().size());
+		ebwt.appendTaxonomy(shard);
+		patsrc.reset();
+		// The pass over the last shard counts every read again
+		metrics.reset();
+	}
 }
 
 static string argstr;
@@ -2813,6 +3686,9 @@ static void driver(
 	}
     
     initializeCntLut();
+	if(maxMem > 0) {
+		planMemory(bt2indexBase);
+	}
     
 	// Vector of the reference sequences; used for sanity-checking
 	EList<SString<char> > names, os;
@@ -2864,11 +3740,38 @@ static void driver(
 	} else {
 		fout = new OutFileBuf();
 	}
+	if(outGz || (outfile.length() > 3 && outfile.substr(outfile.length() - 3) == ".gz")) {
+		// Blocks are compressed by as many threads as are classifying
+		fout->setSink(new BgzfWriter(fout->file(), nthreads));
+	}
 	// Initialize Ebwt object and read in header
 	if(gVerbose || startVerbose) {
 		cerr << "About to initialize fw Ebwt: "; logTime(cerr, true);
 	}
-	adjIdxBase = adjustEbwtBase(argv0, bt2indexBase, gVerbose);
+	// A comma-separated list names the shards of a database too big to
+	// load at once; the last one is searched last and reports the results
+	EList<string> shardBases;
+	tokenize(bt2indexBase, ",", shardBases);
+	if(shardBases.empty()) {
+		cerr << "Error: no index given with -x" << endl;
+		throw 1;
+	}
+	if(shardBases.size() > 1) {
+		if(smem) {
+			cerr << "Error: --smem can't be used with several index shards" << endl;
+			throw 1;
+		}
+		if(!rereadable(queries) || !rereadable(mates1) || !rereadable(mates2) || !rereadable(mates12)) {
+			cerr << "Error: the reads are read once per index shard, so they must come from regular" << endl
+			     << "(uncompressed) files rather than standard input or pipes" << endl;
+			throw 1;
+		}
+	}
+	multiseed_spillOut = NULL;
+	multiseed_spillIn = NULL;
+	multiseed_spillUidOff = NULL;
+	multiseed_longReads = NULL;
+	adjIdxBase = adjustEbwtBase(argv0, shardBases.back(), gVerbose);
 	Ebwt<index_t> ebwt(
 		adjIdxBase,
 	    0,        // index is colorspace
@@ -2888,32 +3791,55 @@ static void driver(
 	    false /*passMemExc*/,
 	    sanityCheck);
 	Ebwt<index_t>* ebwtBw = NULL;
-#if 0
-	// We need the mirror index if mismatches are allowed
-	if(multiseedMms > 0 || do1mmUpFront) {
+	// We need the mirror index for bidirectional extension of partial hits
+	if(smem) {
 		if(gVerbose || startVerbose) {
 			cerr << "About to initialize rev Ebwt: "; logTime(cerr, true);
 		}
-		ebwtBw = new HierEbwt<index_t, local_index_t>(
+		string revStr = adjIdxBase + ".rev.1." + gEbwt_ext;
+		if(!ifstream(revStr.c_str(), ios::binary).good()) {
+			cerr << "Error: --smem requires the mirror index " << revStr.c_str() << endl
+			     << "Please rebuild the index with centrifuge-build --mirror" << endl;
+			throw 1;
+		}
+		ebwtBw = new Ebwt<index_t>(
 			adjIdxBase + ".rev",
 			0,       // index is colorspace
-			1,       // TODO: maybe not
+			1,       // need the reverse of the entire concatenated text
 		    false, // index is for the reverse direction
 		    /* overriding: */ offRate,
 			0, // amount to add to index offrate or <= 0 to do nothing
 		    useMm,    // whether to use memory-mapped files
 		    useShmem, // whether to use shared memory
 		    mmSweep,  // sweep memory-mapped files
-		    !noRefNames, // load names?
-			true,        // load SA sample?
+		    false,    // load names?
+			false,       // load SA sample?
 			true,        // load ftab?
-			true,        // load rstarts?
+			false,       // load rstarts?
 		    gVerbose,    // whether to be talkative
 		    startVerbose, // talkative during initialization
 		    false /*passMemExc*/,
 		    sanityCheck);
+		if(ebwtBw->eh().len() != ebwt.eh().len() ||
+		   ebwtBw->eh().ftabChars() != ebwt.eh().ftabChars())
+		{
+			cerr << "Error: mirror index " << revStr.c_str() << " does not match the forward index" << endl;
+			throw 1;
+		}
+	}
+	auto_ptr<KmerFilter> prefilter(loadPrefilter(adjIdxBase));
+	// Reads that are mostly host k-mers are reported as the host up front
+	auto_ptr<KmerFilter> hostFilter;
+	if(!hostFilterFile.empty()) {
+		hostFilter.reset(new KmerFilter());
+		if(!hostFilter->readFromFile(hostFilterFile)) {
+			cerr << "Error: could not open host filter " << hostFilterFile.c_str() << endl;
+			throw 1;
+		}
+		if(gVerbose || startVerbose) {
+			cerr << "Loaded " << hostFilter->k() << "-mer host filter: "; logTime(cerr, true);
+		}
 	}
-#endif
 	if(sanityCheck && !os.empty()) {
 		// Sanity check number of patterns and pattern lengths in Ebwt
 		// against original strings
@@ -2940,7 +3866,8 @@ static void driver(
 		reorder && nthreads > 1, // whether to reorder when there's >1 thread
 		nthreads,                // # threads
 		nthreads > 1,            // whether to be thread-safe
-		skipReads);              // first read will have this rdid
+		skipReads,               // first read will have this rdid
+		writerThread);           // write from a thread of its own
 	{
 		Timer _t(cerr, "Time searching: ", timing);
 		// Set up penalities
@@ -3015,15 +3942,38 @@ static void driver(
 		}
 
 
+		// Long reads are searched in windows any thread can take
+		auto_ptr<LongReadPool<index_t> > longReads;
+		auto_ptr<OutFileBuf> segmentsOfb;
+		if(longReadWindow > 0) {
+			longReads.reset(new LongReadPool<index_t>(longReadWindow, longReadOverlap, nthreads > 1));
+			if(!longReadSegments.empty()) {
+				segmentsOfb.reset(new OutFileBuf(longReadSegments));
+				segmentsOfb->writeChars("readID\tmate\tstart\tend\ttaxID\tscore\n");
+				longReads->setSegments(segmentsOfb.get());
+			}
+		}
+		multiseed_longReads = longReads.get();
+
 		// Do the search for all input reads
 		assert(patsrc != NULL);
 		assert(mssink != NULL);
+		EList<ShardSpill*> spills;
+		EList<uint64_t> spillUidOff;
+		reportPrior.clear();
+		if(shardBases.size() > 1) {
+			spillShards(shardBases, sc, *patsrc, ebwt, spills, spillUidOff);
+			multiseed_spillIn = &spills;
+			multiseed_spillUidOff = &spillUidOff;
+		}
 		multiseedSearch(
 			sc,      // scoring scheme
 			*patsrc, // pattern source
 			*mssink, // hit sink
 			ebwt,    // BWT
-			*ebwtBw, // BWT'
+			ebwtBw,  // BWT' (NULL unless --smem)
+			prefilter.get(), // k-mer prefilter (NULL if none)
+			hostFilter.get(), // host k-mer filter (NULL unless --host-filter)
             refs.get(),
             refnames,
 			metricsOfb);
@@ -3034,6 +3984,12 @@ static void driver(
 		if(ebwtBw != NULL) {
 			delete ebwtBw;
 		}
+		for(size_t i = 0; i < spills.size(); i++) {
+			delete spills[i];
+		}
+		multiseed_spillIn = NULL;
+		multiseed_spillUidOff = NULL;
+		multiseed_longReads = NULL;
 		if(!gQuiet && !seedSumm) {
 			size_t repThresh = mhits;
 			if(repThresh == 0) {
@@ -3049,88 +4005,13 @@ static void driver(
 		if (!reportFile.empty()) {
             // write the species report into the corresponding file
             cerr << "report file " << reportFile << endl;
-			ofstream reportOfb;
-			reportOfb.open(reportFile.c_str());
 			SpeciesMetrics& spm = metrics.spmu;
             if(abundance_analysis) {
                 uint8_t rank = get_tax_rank_id(classification_rank.c_str());
                 Timer timer(cerr, "Calculating abundance: ");
-                spm.calculateAbundance(ebwt, rank);
+                spm.calculateAbundance(ebwt, rank, reportIval > 0 ? &reportPrior : NULL);
             }
-            const std::map<uint64_t, TaxonomyNode>& tree = ebwt.tree();
-            const std::map<uint64_t, string>& name_map = ebwt.name();
-            const std::map<uint64_t, uint64_t>& size_map = ebwt.size();
-            const map<uint64_t, double>& abundance = spm.abundance;
-            const map<uint64_t, double>& abundance_len = spm.abundance_len;
-			reportOfb << "name" << '\t' << "taxID" << '\t' << "taxRank" << '\t'
-					  << "genomeSize" << '\t' << "numReads" << '\t' << "numUniqueReads" << '\t';
-            if(false) {
-                reportOfb << "summedHitLen" << '\t' << "numWeightedReads" << '\t' << "numUniqueKmers" << '\t' << "sumScore" << '\t';
-            }
-            reportOfb << "abundance";
-            if(false) {
-                reportOfb << '\t' << "abundance_normalized_by_genome_size";
-            }
-            reportOfb << endl;
-			for(map<uint64_t, ReadCounts>::const_iterator it = spm.species_counts.begin(); it != spm.species_counts.end(); ++it) {
-
-                uint64_t taxid = it->first;
-                if(taxid == 0) continue;
-
-                std::map<uint64_t, string>::const_iterator name_itr = name_map.find(taxid);
-                if(name_itr != name_map.end()) {
-                    reportOfb << name_itr->second;
-                } else {
-                    reportOfb << taxid;
-                }
-                reportOfb << '\t' << taxid << '\t';
-
-                uint8_t rank = 0;
-                bool leaf = false;
-                std::map<uint64_t, TaxonomyNode>::const_iterator tree_itr = tree.find(taxid);
-                
-                if(tree_itr != tree.end()) {
-                    rank = tree_itr->second.rank;
-                    leaf = tree_itr->second.leaf;
-                }
-                if(rank == RANK_UNKNOWN && leaf) {
-                    reportOfb << "leaf";
-                } else {
-                    string rank_str = get_tax_rank_string(rank);
-                    reportOfb << rank_str;
-                }
-                reportOfb << '\t';
-                
-                std::map<uint64_t, uint64_t>::const_iterator size_itr = size_map.find(taxid);
-                uint64_t genome_size = 0;
-                if(size_itr != size_map.end()) {
-                    genome_size = size_itr->second;
-                }
-                
-                reportOfb << genome_size << '\t'
-						  << it->second.n_reads << '\t' << it->second.n_unique_reads << '\t';
-                if(false) {
-                    reportOfb << it->second.summed_hit_len << '\t' << it->second.weighted_reads << '\t'
-                              << spm.nDistinctKmers(taxid) << '\t' << it->second.sum_score << '\t';
-                }
-                map<uint64_t, double>::const_iterator ab_len_itr = abundance_len.find(taxid);
-                if(ab_len_itr != abundance_len.end()) {
-                    reportOfb << ab_len_itr->second;
-                } else {
-                    reportOfb << "0.0";
-                }
-                map<uint64_t, double>::const_iterator ab_itr = abundance.find(taxid);
-                if(false) {
-                    if(ab_itr != abundance.end() && ab_len_itr != abundance_len.end()) {
-                        reportOfb << '\t' << ab_itr->second;
-                    } else {
-                        reportOfb << "\t0.0";
-                    }
-                }
-                reportOfb << endl;
-
-			}
-			reportOfb.close();
+            writeReport(reportFile, spm, ebwt, reportIval > 0);
 		}
 
 
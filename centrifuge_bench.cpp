@@ -0,0 +1,691 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks of the hot paths of classification, run by 'make bench' on a
+ * synthetic index: LF mapping, partial-hit search, resolving hits to
+ * genomes, abundance EM, output formatting and FASTQ parsing, then the
+ * whole classifier, in reads per second.  The classifier itself is
+ * compiled in, as centrifuge.cpp expects to be the one translation unit
+ * including its headers, and runs in this process.
+ */
+
+#include <iomanip>
+#include <sys/time.h>
+#include "centrifuge.cpp"
+
+static int    benchThreads = 1;    // threads for the end-to-end run
+static double benchScale   = 1.0;  // multiply the iterations of each benchmark by this
+static bool   benchE2e     = true; // run the whole classifier too?
+static bool   benchCheck   = false; // run the consistency checks instead
+static const char *bench_short_options = "p:s:h";
+
+enum {
+	ARG_BENCH_NO_E2E = 256,
+	ARG_BENCH_CHECK
+};
+
+// --long-read-window used by the long-read check
+static const int CHECK_LONG_READ_WINDOW = 1000;
+
+static struct option bench_long_options[] = {
+	{(char*)"threads",    required_argument,  0, 'p'},
+	{(char*)"scale",      required_argument,  0, 's'},
+	{(char*)"no-e2e",     no_argument,        0, ARG_BENCH_NO_E2E},
+	{(char*)"check",      no_argument,        0, ARG_BENCH_CHECK},
+	{(char*)"help",       no_argument,        0, 'h'},
+	{(char*)0, 0, 0, 0} // terminator
+};
+
+static void printBenchUsage(ostream& out) {
+	out
+	<< "Usage: centrifuge-bench-bin [options]* <cf_base> <reads.fq>" << endl
+	<< "       centrifuge-bench-bin --check <cf_base> [<long_reads.fa>]" << endl
+	<< "  <cf_base>          index filename minus trailing .1." << gEbwt_ext << "/.2." << gEbwt_ext << "/.3." << gEbwt_ext << endl
+	<< "  <reads.fq>         FASTQ reads to parse, search and classify" << endl
+	<< "  <long_reads.fa>    FASTA chimeras named <taxID1>_<taxID2>_<n>, longer than " << CHECK_LONG_READ_WINDOW << " bp," << endl
+	<< "                     for the --long-read-window check" << endl
+	<< endl
+	<< "Options:" << endl
+	<< "  -p/--threads <int> threads for the end-to-end run (default: 1)" << endl
+	<< "  -s/--scale <num>   multiply the iterations of every benchmark by this (default: 1)" << endl
+	<< "  --no-e2e           skip the end-to-end run" << endl
+	<< "  --check            instead of timing anything, check that the vector rank" << endl
+	<< "                     kernels count as the scalar code does, and that the windows of" << endl
+	<< "                     <long_reads.fa> go to the genomes they come from, with any -p" << endl
+	<< "  -h/--help          print this usage message" << endl
+	;
+}
+
+static void parseBenchOptions(int argc, char **argv) {
+	int option_index = 0;
+	int next_option;
+	do {
+		next_option = getopt_long(argc, argv, bench_short_options, bench_long_options, &option_index);
+		switch (next_option) {
+			case 'h':
+				printBenchUsage(cout);
+				throw 0;
+				break;
+			case 'p':
+				benchThreads = atoi(optarg);
+				if(benchThreads < 1) {
+					cerr << "-p/--threads arg must be at least 1" << endl;
+					throw 1;
+				}
+				break;
+			case 's':
+				benchScale = atof(optarg);
+				if(benchScale <= 0.0) {
+					cerr << "-s/--scale arg must be positive" << endl;
+					throw 1;
+				}
+				break;
+			case ARG_BENCH_NO_E2E: benchE2e = false; break;
+			case ARG_BENCH_CHECK: benchCheck = true; break;
+			case -1: break; /* Done with options. */
+			case 0:
+				if (bench_long_options[option_index].flag != 0)
+					break;
+			default:
+				printBenchUsage(cerr);
+				throw 1;
+		}
+	} while(next_option != -1);
+}
+
+static double benchNow() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static size_t benchScaled(size_t n) {
+	return max<size_t>(1, (size_t)(n * benchScale));
+}
+
+/**
+ * Print one line of results; 'unit' is what an operation is.
+ */
+static void benchReport(const char *name, uint64_t ops, double secs, const char *unit) {
+	cout << left << setw(20) << name << right
+	     << setw(14) << ops
+	     << setw(10) << fixed << setprecision(3) << secs
+	     << setw(16) << fixed << setprecision(0) << (secs > 0.0 ? ops / secs : 0.0)
+	     << " " << unit << "/s" << endl;
+}
+
+// Keeps the compiler from dropping the work of a benchmark
+static volatile uint64_t benchSink;
+
+/**
+ * Parse all of 'reads', keeping a copy of the first 'nkeep' in 'kept';
+ * return the number of reads.
+ */
+static uint64_t parseReads(const string& reads, size_t nkeep, EList<Read*>& kept) {
+	EList<string> queries, empty;
+	queries.push_back(reads);
+	PatternParams pp(
+		FASTQ, // file format
+		false, // no separate sources per file
+		0,     // pseudo-random seed
+		false, // no spin locks
+		false, // solexa64 qualities
+		false, // phred64 qualities
+		false, // integer qualities
+		false, // fuzzy fastq
+		-1,    // sampling length
+		-1,    // sampling frequency
+		0);    // skip no reads
+	PairedPatternSource *patsrc = PairedPatternSource::setupPatternSources(
+		queries, empty, empty, empty,
+#ifdef USE_SRA
+		empty,
+#endif
+		empty, empty, empty, pp, 1, false);
+	PatternSourcePerThread *ps = new WrappedPatternSourcePerThread(*patsrc);
+	uint64_t nreads = 0, nbases = 0;
+	while(true) {
+		bool success = false, done = false, paired = false;
+		ps->nextReadPair(success, done, paired, false);
+		if(!success && done) {
+			break;
+		} else if(!success) {
+			continue;
+		}
+		const Read& rd = ps->bufa();
+		nreads++;
+		nbases += rd.length();
+		if(kept.size() < nkeep) {
+			Read *r = new Read();
+			r->name = rd.name;
+			r->patFw = rd.patFw;
+			r->qual = rd.qual;
+			r->finalize();
+			kept.push_back(r);
+		}
+	}
+	benchSink = nbases;
+	delete ps;
+	delete patsrc;
+	return nreads;
+}
+
+/**
+ * Time parsing all of 'reads'; return the number of reads.
+ */
+static uint64_t benchParse(const string& reads) {
+	EList<Read*> none;
+	double t0 = benchNow();
+	uint64_t nreads = parseReads(reads, 0, none);
+	benchReport("parse-fastq", nreads, benchNow() - t0, "reads");
+	return nreads;
+}
+
+/**
+ * Check that each vector rank kernel this CPU can run gives the same
+ * counts as the scalar code, in both countUpTo and countUpToEx, at random
+ * rows (so at random sides and offsets within them).  Return the number
+ * of rows where some kernel disagrees.
+ */
+static uint64_t checkRankKernels(Ebwt<index_t>& ebwt) {
+	uint64_t bad = 0;
+#ifdef POPCNT_CAPABILITY
+	const EbwtParams<index_t>& eh = ebwt.eh();
+	const int kernel = ebwt._rankKernel;
+	const bool usePopcnt = ebwt._usePOPCNTinstruction;
+	EList<int> kernels;
+	ProcessorSupport ps;
+#ifdef RANK_SIMD_AVX2
+	if(ps.AVX2enabled()) kernels.push_back(RANK_KERNEL_AVX2);
+#endif
+#ifdef RANK_SIMD_AVX512
+	if(ps.AVX512POPCNTenabled()) kernels.push_back(RANK_KERNEL_AVX512);
+#endif
+	RandomSource rnd(2);
+	const size_t nrows = benchScaled(1 << 20);
+	for(size_t i = 0; i < nrows; i++) {
+		index_t row = (index_t)(((uint64_t)rnd.nextU32() << 32 | rnd.nextU32()) % eh.len());
+		SideLocus<index_t> l;
+		l.initFromRow(row, eh, ebwt.ebwt());
+		// The scalar code, with and without the POPCNT instruction
+		index_t want[4], wantEx[4] = {0, 0, 0, 0};
+		ebwt._rankKernel = RANK_KERNEL_SCALAR;
+		ebwt._usePOPCNTinstruction = false;
+		for(int c = 0; c < 4; c++) {
+			want[c] = ebwt.countUpTo(l, c);
+		}
+		ebwt.countUpToEx(l, wantEx);
+		ebwt._usePOPCNTinstruction = usePopcnt;
+		bool ok = true;
+		for(int c = 0; c < 4; c++) {
+			ok = ok && (wantEx[c] == want[c]) && (ebwt.countUpTo(l, c) == want[c]);
+		}
+		for(size_t k = 0; k < kernels.size(); k++) {
+			ebwt._rankKernel = kernels[k];
+			index_t gotEx[4] = {0, 0, 0, 0};
+			ebwt.countUpToEx(l, gotEx);
+			for(int c = 0; c < 4; c++) {
+				ok = ok && (gotEx[c] == want[c]) && (ebwt.countUpTo(l, c) == want[c]);
+			}
+		}
+		if(!ok && bad++ < 10) {
+			cerr << "Rank kernels disagree at row " << row << " (byte " << l._by << ", bitpair " << (int)l._bp << ")" << endl;
+		}
+	}
+	ebwt._rankKernel = kernel;
+	ebwt._usePOPCNTinstruction = usePopcnt;
+	cout << "rank kernels: " << kernels.size() << " vector kernel" << (kernels.size() == 1 ? "" : "s")
+	     << " checked against scalar at " << nrows << " rows, " << bad << " mismatch" << (bad == 1 ? "" : "es") << endl;
+#else
+	(void)ebwt;
+	cout << "rank kernels: built without POPCNT_CAPABILITY, nothing to check" << endl;
+#endif
+	return bad;
+}
+
+/**
+ * Read the lines of a tab-separated file but the header, sorted.
+ */
+static void readSortedLines(const string& fname, EList<string>& lines) {
+	ifstream in(fname.c_str());
+	if(!in.good()) {
+		cerr << "Error: could not open " << fname << endl;
+		throw 1;
+	}
+	string line;
+	getline(in, line); // header
+	while(getline(in, line)) {
+		lines.push_back(line);
+	}
+	lines.sort();
+}
+
+/**
+ * Return the 'col'th (from 0) tab-separated field of 'line'.
+ */
+static string field(const string& line, int col) {
+	size_t beg = 0;
+	for(int i = 0; i < col && beg != string::npos; i++) {
+		beg = line.find('\t', beg);
+		if(beg != string::npos) beg++;
+	}
+	if(beg == string::npos) return "";
+	return line.substr(beg, line.find('\t', beg) - beg);
+}
+
+/**
+ * Classify 'reads', chimeras named <taxID1>_<taxID2>_<n> whose first half
+ * comes from a genome of taxID1 and second half from one of taxID2, with
+ * --long-read-window and --long-read-segments, on one thread and on
+ * several.  Check that both runs give the same classification and
+ * segments, and that the first window of each read goes to taxID1 and the
+ * last to taxID2.  Return the number of reads (or lines) that fail.
+ */
+static uint64_t checkLongReads(const string& idx, const string& reads) {
+	char wstr[16];
+	snprintf(wstr, sizeof(wstr), "%d", CHECK_LONG_READ_WINDOW);
+	const char *threads[] = { "1", "4" };
+	EList<string> out[2], segs[2];
+	for(int t = 0; t < 2; t++) {
+		string outName = reads + ".p" + threads[t] + ".tsv";
+		string segName = reads + ".p" + threads[t] + ".segments";
+		const char *args[] = {
+			"centrifuge-class", "-p", threads[t], "-x", idx.c_str(), "-f", "-U", reads.c_str(),
+			"-S", outName.c_str(), "--report-file", "/dev/null", "--quiet",
+			"--long-read-window", wstr, "--long-read-segments", segName.c_str()
+		};
+		if(centrifuge((int)(sizeof(args) / sizeof(args[0])), args) != 0) {
+			cerr << "Error: classifying " << reads << " failed" << endl;
+			throw 1;
+		}
+		readSortedLines(outName, out[t]);
+		readSortedLines(segName, segs[t]);
+		remove(outName.c_str());
+		remove(segName.c_str());
+	}
+	uint64_t bad = 0;
+	for(int f = 0; f < 2; f++) {
+		const EList<string>* l = (f == 0 ? out : segs);
+		size_t n = max(l[0].size(), l[1].size());
+		for(size_t i = 0; i < n; i++) {
+			if(i < l[0].size() && i < l[1].size() && l[0][i] == l[1][i]) continue;
+			if(bad++ < 10) {
+				cerr << (f == 0 ? "Classified" : "Segment") << " differently with -p " << threads[1] << ": "
+				     << (i < l[1].size() ? l[1][i] : string("(none)")) << endl;
+			}
+		}
+	}
+	
+	// segments are sorted by read, then window start as text; find the
+	// windows at the start and end of each read
+	size_t nreads = 0, nright = 0;
+	const EList<string>& sg = segs[0];
+	for(size_t i = 0; i < sg.size(); ) {
+		string rd = field(sg[i], 0);
+		size_t j = i;
+		uint64_t last = 0;
+		while(j < sg.size() && field(sg[j], 0) == rd) {
+			last = max<uint64_t>(last, strtoull(field(sg[j], 2).c_str(), NULL, 10));
+			j++;
+		}
+		string tax1 = rd.substr(0, rd.find('_'));
+		string tax2 = rd.substr(tax1.length() + 1, rd.find('_', tax1.length() + 1) - tax1.length() - 1);
+		bool first = false, second = false;
+		for(size_t k = i; k < j; k++) {
+			uint64_t start = strtoull(field(sg[k], 2).c_str(), NULL, 10);
+			if(start == 0 && field(sg[k], 4) == tax1) first = true;
+			if(start == last && field(sg[k], 4) == tax2) second = true;
+		}
+		nreads++;
+		if(first && second) {
+			nright++;
+		} else if(bad++ < 10) {
+			cerr << "Windows of " << rd << " not at " << tax1 << " then " << tax2 << endl;
+		}
+		i = j;
+	}
+	cout << "long reads: " << nreads << " chimeras in " << CHECK_LONG_READ_WINDOW << "-bp windows, "
+	     << nright << " with the first window at the first genome and the last at the second, "
+	     << bad << " failures (incl. differences between -p " << threads[0] << " and -p " << threads[1] << ")" << endl;
+	return bad;
+}
+
+/**
+ * LF-map random rows on random characters, one row at a time (mapLF) and
+ * a range of rows on all four characters at once (mapLFEx).
+ */
+static void benchMapLF(const Ebwt<index_t>& ebwt) {
+	const EbwtParams<index_t>& eh = ebwt.eh();
+	const size_t nrows = 1 << 20;
+	EList<index_t> rows;
+	RandomSource rnd(1);
+	for(size_t i = 0; i < nrows; i++) {
+		rows.push_back((index_t)(((uint64_t)rnd.nextU32() << 32 | rnd.nextU32()) % eh.len()));
+	}
+	size_t reps = benchScaled(8);
+	uint64_t sum = 0;
+	double t0 = benchNow();
+	for(size_t r = 0; r < reps; r++) {
+		for(size_t i = 0; i < nrows; i++) {
+			SideLocus<index_t> l;
+			l.initFromRow(rows[i], eh, ebwt.ebwt());
+			sum += ebwt.mapLF(l, (int)(i & 3));
+		}
+	}
+	benchReport("mapLF", (uint64_t)reps * nrows, benchNow() - t0, "ops");
+
+	t0 = benchNow();
+	for(size_t r = 0; r < reps; r++) {
+		for(size_t i = 0; i < nrows; i++) {
+			index_t top = rows[i], bot = min<index_t>(top + 1 + (i & 63), eh.len());
+			index_t tops[4] = {0, 0, 0, 0}, bots[4] = {0, 0, 0, 0};
+			ebwt.mapLFEx(top, bot, tops, bots);
+			sum += tops[i & 3] + bots[i & 3];
+		}
+	}
+	benchReport("mapLFEx", (uint64_t)reps * nrows, benchNow() - t0, "ops");
+	benchSink = sum;
+}
+
+/**
+ * A partial hit kept for resolving to genomes.
+ */
+struct BenchHit {
+	index_t top;
+	index_t bot;
+	bool    fw;
+	index_t rdoff;
+	index_t len;
+	index_t rdlen;
+};
+
+/**
+ * Search both strands of every read for partial hits the way
+ * Classifier::searchForwardAndReverse does, keeping those long enough to
+ * be resolved, then resolve them to genomes with getGenomeIdx.
+ */
+static void benchSearch(
+	const Ebwt<index_t>& ebwt,
+	Classifier<index_t, local_index_t>& classifier,
+	const EList<Read*>& reads,
+	index_t minHitLen,
+	index_t maxelt)
+{
+	Scoring sc = Scoring::base1();
+	RandomSource rnd(1);
+	EList<BenchHit> hits;
+	ReadBWTHit<index_t> hit;
+	size_t reps = benchScaled(1);
+	uint64_t nsearched = 0;
+	double t0 = benchNow();
+	for(size_t r = 0; r < reps; r++) {
+		for(size_t i = 0; i < reads.size(); i++) {
+			const Read& rd = *reads[i];
+			index_t rdlen = (index_t)rd.length();
+			if(rdlen < minHitLen) continue;
+			for(int fwi = 0; fwi < 2; fwi++) {
+				bool fw = (fwi == 0);
+				hit.init(fw, rdlen);
+				while(true) {
+					size_t mineFw = 0, mineRc = 0;
+					classifier.partialSearch(ebwt, rd, sc, fw, 0, mineFw, mineRc, hit, rnd);
+					BWTHit<index_t>& lastHit = hit.getPartialHit(hit.offsetSize() - 1);
+					if(r == 0 && lastHit.len() >= minHitLen && lastHit.size() > 0) {
+						BenchHit bh;
+						bh.top = lastHit._top;
+						bh.bot = lastHit._bot;
+						bh.fw = fw;
+						bh.rdoff = rdlen - lastHit._bwoff - lastHit._len;
+						bh.len = lastHit._len;
+						bh.rdlen = rdlen;
+						hits.push_back(bh);
+					}
+					if(hit.done()) break;
+					hit.setOffset(hit.cur() + 1);
+					if(hit.cur() + minHitLen >= rdlen) break;
+				}
+			}
+			nsearched++;
+		}
+	}
+	benchReport("partialSearch", nsearched, benchNow() - t0, "reads");
+
+	// The classifier never looks at the reference; centrifuge passes no
+	// reference either
+	const BitPairReference *refs = NULL;
+	EList<Coord> coords;
+	WalkMetrics wlm;
+	PerReadMetrics prm;
+	HIMetrics him;
+	uint64_t ncoords = 0;
+	reps = benchScaled(4);
+	t0 = benchNow();
+	for(size_t r = 0; r < reps; r++) {
+		for(size_t i = 0; i < hits.size(); i++) {
+			const BenchHit& bh = hits[i];
+			bool straddled = false;
+			classifier.getGenomeIdx(ebwt, *refs, rnd, bh.top, bh.bot, !bh.fw, maxelt,
+			                        bh.rdoff, bh.len, coords, wlm, prm, him, false, straddled);
+			ncoords += coords.size();
+		}
+	}
+	benchReport("getGenomeIdx", (uint64_t)reps * hits.size(), benchNow() - t0, "hits");
+	benchSink = ncoords;
+}
+
+/**
+ * Run EM on read assignments spread over 'nleaves' species in genera of
+ * eight: most reads are assigned to one to four species of a genus, the
+ * rest to the genus itself.
+ */
+static void benchEM(size_t nleaves) {
+	const size_t nsets = 20000, genusSz = 8, genusBase = 1000000;
+	map<SpeciesMetrics::IDs, uint64_t> observed;
+	map<uint64_t, EList<uint64_t> > ancestors;
+	map<uint64_t, uint64_t> tid_to_num;
+	for(size_t i = 0; i < nleaves; i++) {
+		tid_to_num[i] = i;
+		ancestors[genusBase + i / genusSz].push_back(i);
+	}
+	RandomSource rnd(1);
+	for(size_t s = 0; s < nsets; s++) {
+		SpeciesMetrics::IDs ids;
+		uint64_t genus = rnd.nextU32() % ((nleaves + genusSz - 1) / genusSz);
+		if(rnd.nextU32() % 8 == 0) {
+			ids.ids.push_back(genusBase + genus);
+		} else {
+			size_t n = 1 + rnd.nextU32() % 4;
+			for(size_t j = 0; j < n; j++) {
+				uint64_t tid = min<uint64_t>(genus * genusSz + rnd.nextU32() % genusSz, nleaves - 1);
+				bool dup = false;
+				for(size_t k = 0; k < ids.ids.size(); k++) {
+					if(ids.ids[k] == tid) dup = true;
+				}
+				if(!dup) ids.ids.push_back(tid);
+			}
+			ids.ids.sort();
+		}
+		observed[ids] += 1 + rnd.nextU32() % 100;
+	}
+	EList<double> p, p_next;
+	EList<size_t> len;
+	for(size_t i = 0; i < nleaves; i++) {
+		p.push_back(1.0 / nleaves);
+		len.push_back(100000 + rnd.nextU32() % 1000000);
+	}
+	p_next.resizeExact(nleaves);
+	size_t iters = benchScaled(100);
+	double t0 = benchNow();
+	for(size_t i = 0; i < iters; i++) {
+		SpeciesMetrics::EM(observed, ancestors, tid_to_num, p, p_next, len);
+		p.swap(p_next);
+	}
+	benchReport("SpeciesMetrics::EM", iters, benchNow() - t0, "iters");
+	benchSink = (uint64_t)(p[0] * 1e9);
+}
+
+/**
+ * Format a tabular record per read with AlnSinkSam::appendMate.
+ */
+static void benchFormat(Ebwt<index_t>& ebwt, const EList<Read*>& reads) {
+	OutFileBuf fout("/dev/null");
+	OutputQueue oq(fout, false, 1, false);
+	EList<string> refnames;
+	EList<uint32_t> cols;
+	cols.push_back(READ_ID);
+	cols.push_back(SEQ_ID);
+	cols.push_back(TAX_ID);
+	cols.push_back(SCORE);
+	cols.push_back(SCORE2);
+	cols.push_back(HIT_LENGTH);
+	cols.push_back(QUERY_LENGTH);
+	cols.push_back(NUM_MATCHES);
+	AlnSinkSam<index_t> sink(&ebwt, oq, refnames, cols, true);
+
+	// Report each read as one of the species in the index
+	EList<uint64_t> tids;
+	const TaxTreeTable& tree = ebwt.tree();
+	for(TaxTreeTable::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
+		if(itr->second.leaf) tids.push_back(itr->first);
+	}
+	if(tids.empty()) tids.push_back(0);
+	EList<pair<uint32_t, uint32_t> > positions;
+	AlnSetSumm summ;
+	PerReadMetrics prm;
+	SpeciesMetrics sm;
+	AlnRes rs;
+	BTString o;
+	uint64_t nbytes = 0, nrecs = 0;
+	size_t reps = benchScaled(4);
+	double t0 = benchNow();
+	for(size_t r = 0; r < reps; r++) {
+		for(size_t i = 0; i < reads.size(); i++) {
+			const Read& rd = *reads[i];
+			rs.init(4225, 4225, get_tax_rank_string(RANK_SPECIES), tids[i % tids.size()],
+			        RANK_SPECIES, rd.length(), positions, true);
+			o.clear();
+			sink.append(o, 0, &rd, NULL, i, &rs, NULL, summ, prm, sm, false, 1);
+			nbytes += o.length();
+			nrecs++;
+		}
+	}
+	benchReport("appendMate", nrecs, benchNow() - t0, "records");
+	benchSink = nbytes;
+}
+
+/**
+ * Classify all of 'reads' with the classifier proper, writing the results
+ * to /dev/null, and benchReport reads per second including loading the index.
+ */
+static void benchEndToEnd(const string& idx, const string& reads, uint64_t nreads) {
+	char pstr[16];
+	snprintf(pstr, sizeof(pstr), "%d", benchThreads);
+	const char *args[] = {
+		"centrifuge-class", "-p", pstr, "-x", idx.c_str(), "-U", reads.c_str(),
+		"-S", "/dev/null", "--report-file", "/dev/null", "--quiet"
+	};
+	double t0 = benchNow();
+	int ret = centrifuge((int)(sizeof(args) / sizeof(args[0])), args);
+	double secs = benchNow() - t0;
+	if(ret != 0) {
+		cerr << "Error: the end-to-end run failed" << endl;
+		throw 1;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "classify (-p %d)", benchThreads);
+	benchReport(name, nreads, secs, "reads");
+}
+
+int main(int argc, char **argv) {
+	try {
+		parseBenchOptions(argc, argv);
+		if(optind + (benchCheck ? 1 : 2) > argc) {
+			cerr << "No index or reads given!" << endl;
+			printBenchUsage(cerr);
+			return 1;
+		}
+		string idx = argv[optind++];
+		string reads = (optind < argc) ? argv[optind++] : "";
+
+		initializeCntLut();
+		Ebwt<index_t> ebwt(
+			idx,
+			0,     // index is colorspace
+			-1,    // fw index
+			true,  // index is for the forward direction
+			-1,    // don't override offrate
+			0,     // amount to add to index offrate or <= 0 to do nothing
+			false, // whether to use memory-mapped files
+			false, // whether to use shared memory
+			false, // sweep memory-mapped files
+			true,  // load names?
+			true,  // load SA sample?
+			true,  // load ftab?
+			true,  // load rstarts?
+			false, // whether to be talkative
+			false, // talkative during initialization
+			false, // pass memory exceptions up
+			false);// sanity check
+		ebwt.loadIntoMemory(0, -1, true, true, true, true, false);
+		if(benchCheck) {
+			uint64_t bad = checkRankKernels(ebwt);
+			if(!reads.empty()) {
+				bad += checkLongReads(idx, reads);
+			}
+			return bad == 0 ? 0 : 1;
+		}
+
+		cout << left << setw(20) << "benchmark" << right
+		     << setw(14) << "ops" << setw(10) << "seconds" << setw(16) << "rate" << endl;
+
+		uint64_t nreads = benchParse(reads);
+		EList<Read*> kept;
+		parseReads(reads, 100000, kept);
+
+		EList<string> refnames;
+		EList<uint64_t> none;
+		const index_t minHitLen = 22, khits = 5;
+		Classifier<index_t, local_index_t> classifier(
+			ebwt, refnames, true, false, minHitLen, false, "species", none, none);
+
+		benchMapLF(ebwt);
+		benchSearch(ebwt, classifier, kept, minHitLen, khits);
+		benchEM(2000);
+		benchFormat(ebwt, kept);
+		for(size_t i = 0; i < kept.size(); i++) {
+			delete kept[i];
+		}
+		kept.clear();
+		ebwt.evictFromMemory();
+
+		if(benchE2e) {
+			benchEndToEnd(idx, reads, nreads);
+		}
+		return 0;
+	} catch(std::exception& e) {
+		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+		return 1;
+	} catch(int e) {
+		if(e != 0) {
+			cerr << "Error: Encountered internal Centrifuge exception (#" << e << ")" << endl;
+		}
+		return e;
+	}
+}
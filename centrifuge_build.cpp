@@ -35,6 +35,7 @@
 #include "filebuf.h"
 #include "reference.h"
 #include "ds.h"
+#include "kmer_filter.h"
 
 /**
  * \file Driver for the bowtie-build indexing tool.
@@ -55,6 +56,7 @@ static int showVersion;
 static int nthreads;      // number of pthreads operating concurrently
 //   Ebwt parameters
 static int32_t lineRate;
+static bool lineRateSet;   // -l given?
 static int32_t linesPerSide;
 static int32_t offRate;
 static int32_t ftabChars;
@@ -75,6 +77,11 @@ static bool justRef;
 static bool reverseEach;
 static string wrapper;
 static int kmer_count;
+static bool textSampled; // sample SA by text offset rather than by row
+static bool lineOcc;     // one side per cache line, counts embedded
+static bool mirror;      // also build the mirror index over the reversed text
+static int prefilterK;   // k of the k-mer prefilter; 0 = don't build one
+static bool filterOnly;  // write just the k-mer prefilter, no index
 
 static void resetOptions() {
 	verbose        = true;  // be talkative (default)
@@ -91,6 +98,7 @@ static void resetOptions() {
     nthreads       = 1;
 	//   Ebwt parameters
 	lineRate       = Ebwt<TIndexOffU>::default_lineRate;
+	lineRateSet    = false;
 	linesPerSide   = 1;  // 1 64-byte line on a side
 	offRate        = 4;  // sample 1 out of 16 SA elts
 	ftabChars      = 10; // 10 chars in initial lookup table
@@ -111,6 +119,11 @@ static void resetOptions() {
 	reverseEach    = false;
     wrapper.clear();
     kmer_count     = 0; // k : k-mer to be counted
+    textSampled    = false; // sample every 2^offRate rows
+    lineOcc        = false; // Bowtie-style sides of 2^lineRate bytes
+    mirror         = false; // forward index only
+    prefilterK     = 0;     // no k-mer prefilter
+    filterOnly     = false; // build the index
 }
 
 // Argument constants for getopts
@@ -135,6 +148,11 @@ enum {
     ARG_NAME_TABLE,
     ARG_SIZE_TABLE,
     ARG_KMER_COUNT,
+    ARG_SA_SAMPLE,
+    ARG_OCC_LAYOUT,
+    ARG_MIRROR,
+    ARG_PREFILTER,
+    ARG_FILTER_ONLY,
 };
 
 /**
@@ -165,6 +183,16 @@ static void printUsage(ostream& out) {
 	    << "    -r/--noref              don't build .3/.4.bt2 (packed reference) portion" << endl
 	    << "    -3/--justref            just build .3/.4.bt2 (packed reference) portion" << endl
 	    << "    -o/--offrate <int>      SA is sampled every 2^offRate BWT chars (default: 5)" << endl
+	    << "    --sa-sample <row|text>  sample every 2^offRate rows or text offsets (row);" << endl
+	    << "                            'text' caps lookups at 2^offRate-1 LF steps" << endl
+	    << "    --occ-layout <side|line> BWT occurrence layout (side); 'line' puts counts" << endl
+	    << "                            and BWT chunk in one 64-byte cache line" << endl
+	    << "    --mirror                also build the mirror index (.rev.*) over the" << endl
+	    << "                            reversed text, needed by centrifuge --smem" << endl
+	    << "    --prefilter <int>       also build a filter (.pf.cf) of the reference's" << endl
+	    << "                            k-mers of this length (off); 1 byte/ref. base" << endl
+	    << "    --filter-only           just write the --prefilter file, e.g. of a host" << endl
+	    << "                            genome for centrifuge --host-filter" << endl
 	    << "    -t/--ftabchars <int>    # of chars consumed in initial lookup (default: 10)" << endl
         << "    --conversion-table <file name>  a table that converts any id to a taxonomy id" << endl
         << "    --taxonomy-tree    <file name>  taxonomy tree" << endl
@@ -222,6 +250,11 @@ static struct option long_options[] = {
 	{(char*)"justref",        no_argument,       0,            '3'},
 	{(char*)"noref",          no_argument,       0,            'r'},
 	{(char*)"kmer-count",     required_argument, 0,            ARG_KMER_COUNT},
+	{(char*)"sa-sample",      required_argument, 0,            ARG_SA_SAMPLE},
+	{(char*)"occ-layout",     required_argument, 0,            ARG_OCC_LAYOUT},
+	{(char*)"mirror",         no_argument,       0,            ARG_MIRROR},
+	{(char*)"prefilter",      required_argument, 0,            ARG_PREFILTER},
+	{(char*)"filter-only",    no_argument,       0,            ARG_FILTER_ONLY},
     {(char*)"sa",             no_argument,       0,            ARG_SA},
 	{(char*)"reverse-each",   no_argument,       0,            ARG_REVERSE_EACH},
 	{(char*)"usage",          no_argument,       0,            ARG_USAGE},
@@ -277,6 +310,7 @@ static void parseOptions(int argc, const char **argv) {
 				break;
 			case 'l':
 				lineRate = parseNumber<int>(3, "-l/--lineRate arg must be at least 3");
+				lineRateSet = true;
 				break;
 			case 'i':
 				linesPerSide = parseNumber<int>(1, "-i/--linesPerSide arg must be at least 1");
@@ -347,6 +381,42 @@ static void parseOptions(int argc, const char **argv) {
                 break;
             case ARG_KMER_COUNT:
                 kmer_count = parseNumber<int>(1, "--kmer-count arg must be at least 1");
+                break;
+            case ARG_SA_SAMPLE:
+                if(strcmp(optarg, "text") == 0) {
+                    textSampled = true;
+                } else if(strcmp(optarg, "row") == 0) {
+                    textSampled = false;
+                } else {
+                    cerr << "Error: --sa-sample arg must be 'row' or 'text'" << endl;
+                    printUsage(cerr);
+                    throw 1;
+                }
+                break;
+            case ARG_OCC_LAYOUT:
+                if(strcmp(optarg, "line") == 0) {
+                    lineOcc = true;
+                } else if(strcmp(optarg, "side") == 0) {
+                    lineOcc = false;
+                } else {
+                    cerr << "Error: --occ-layout arg must be 'side' or 'line'" << endl;
+                    printUsage(cerr);
+                    throw 1;
+                }
+                break;
+            case ARG_MIRROR:
+                mirror = true;
+                break;
+            case ARG_PREFILTER:
+                prefilterK = parseNumber<int>(1, "--prefilter arg must be at least 1");
+                if(prefilterK > 32) {
+                    cerr << "Error: --prefilter arg must be at most 32" << endl;
+                    printUsage(cerr);
+                    throw 1;
+                }
+                break;
+            case ARG_FILTER_ONLY:
+                filterOnly = true;
                 break;
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
@@ -363,6 +433,15 @@ static void parseOptions(int argc, const char **argv) {
 				throw 1;
 		}
 	} while(next_option != -1);
+	if(lineOcc) {
+		// Each side is exactly one cache line
+		if(lineRateSet && lineRate != EBWT_LINE_OCC_RATE) {
+			cerr << "Error: --occ-layout line uses " << EBWT_LINE_OCC_SZ << "-byte lines; -l/--linerate "
+			     << lineRate << " can't be used with it" << endl;
+			throw 1;
+		}
+		lineRate = EBWT_LINE_OCC_RATE;
+	}
 	if(bmax < 40) {
 		cerr << "Warning: specified bmax is very small (" << bmax << ").  This can lead to" << endl
 		     << "extremely slow performance and memory exhaustion.  Perhaps you meant to specify" << endl
@@ -372,6 +451,24 @@ static void parseOptions(int argc, const char **argv) {
 
 EList<string> filesWritten;
 
+/**
+ * Write the filter of the reference's k-mers that centrifuge uses to skip
+ * reads with no k-mer in the reference.
+ */
+static void writePrefilter(EList<FileBuf*>& is, size_t len, const string& outfile) {
+	Timer _t(cout, "  Time building k-mer prefilter: ", verbose);
+	string pffile = outfile + ".pf." + gEbwt_ext;
+	filesWritten.push_back(pffile);
+	KmerFilter pf;
+	pf.init(prefilterK, len);
+	uint64_t nkmers = pf.addFasta(is, nsToAs);
+	pf.writeToFile(pffile);
+	if(verbose) {
+		cout << "Wrote " << nkmers << " " << prefilterK << "-mers to \"" << pffile.c_str()
+		     << "\" (" << pf.bytes() << " bytes)" << endl;
+	}
+}
+
 /**
  * Delete all the index files that we tried to create.  For when we had to
  * abort the index-building process due to an error.
@@ -460,6 +557,10 @@ static void driver(
 		Timer _t(cout, "  Time reading reference sizes: ", verbose);
         sztot = BitPairReference::szsFromFasta(is, string(), bigEndian, refparams, szs, sanityCheck);
 	}
+	if(filterOnly) {
+		writePrefilter(is, sztot.first, outfile);
+		return;
+	}
 	if(justRef) return;
 	assert_gt(sztot.first, 0);
 	assert_gt(sztot.second, 0);
@@ -500,13 +601,18 @@ static void driver(
                           kmer_count,   // Count the number of distinct k-mers if non-zero
                           verbose,      // be talkative
                           autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-                          sanityCheck); // verify results and internal consistency
+                          sanityCheck,  // verify results and internal consistency
+                          textSampled,  // sample SA by text offset rather than by row
+                          lineOcc);     // one side per cache line
 	// Note that the Ebwt is *not* resident in memory at this time.  To
 	// load it into memory, call ebwt.loadIntoMemory()
 	if(verbose) {
 		// Print Ebwt's vital stats
 		ebwt.eh().print(cout);
 	}
+	if(prefilterK > 0 && reverse == REF_READ_FORWARD) {
+		writePrefilter(is, sztot.first, outfile);
+	}
 	if(sanityCheck) {
 		// Try restoring the original string (if there were
 		// multiple texts, what we'll get back is the joined,
@@ -607,19 +713,25 @@ int centrifuge_build(int argc, const char **argv) {
 			return 1;
 		}
         
-        if(conversion_table_fname == "") {
+        if(filterOnly && prefilterK == 0) {
+            cerr << "Please specify --prefilter with --filter-only!" << endl;
+            printUsage(cerr);
+            return 1;
+        }
+        
+        if(conversion_table_fname == "" && !filterOnly) {
             cerr << "Please specify --conversion-table!" << endl;
             printUsage(cerr);
             return 1;
         }
         
-        if(taxonomy_fname == "") {
+        if(taxonomy_fname == "" && !filterOnly) {
             cerr << "Please specify --taxonomy-tree!" << endl;
             printUsage(cerr);
             return 1;
         }
         
-        if(name_table_fname == "") {
+        if(name_table_fname == "" && !filterOnly) {
             cerr << "Please specify --name-table!" << endl;
             printUsage(cerr);
             return 1;
@@ -631,7 +743,11 @@ int centrifuge_build(int argc, const char **argv) {
 				 << "  Output files: \"" << outfile.c_str() << ".*." << gEbwt_ext << "\"" << endl
 				 << "  Line rate: " << lineRate << " (line is " << (1<<lineRate) << " bytes)" << endl
 				 << "  Lines per side: " << linesPerSide << " (side is " << ((1<<lineRate)*linesPerSide) << " bytes)" << endl
+				 << "  Occurrence layout: " << (lineOcc ? "cache line" : "side") << endl
+				 << "  Mirror index: " << (mirror ? "yes" : "no") << endl
+				 << "  K-mer prefilter: " << prefilterK << (prefilterK > 0 ? "-mers" : " (none)") << endl
 				 << "  Offset rate: " << offRate << " (one in " << (1<<offRate) << ")" << endl
+				 << "  SA sampled by: " << (textSampled ? "text offset" : "row") << endl
 				 << "  FTable chars: " << ftabChars << endl
 				 << "  Strings: " << (packed? "packed" : "unpacked") << endl
                  << "  Local offset rate: " << localOffRate << " (one in " << (1<<localOffRate) << ")" << endl
@@ -679,8 +795,8 @@ int centrifuge_build(int argc, const char **argv) {
                                            infiles,
                                            conversion_table_fname,
                                            taxonomy_fname,
-                                           size_table_fname,
                                            name_table_fname,
+                                           size_table_fname,
                                            outfile,
                                            false,
                                            REF_READ_FORWARD);
@@ -706,26 +822,46 @@ int centrifuge_build(int argc, const char **argv) {
                                      REF_READ_FORWARD);
 			}
 		}
-#if 0
-		int reverseType = reverseEach ? REF_READ_REVERSE_EACH : REF_READ_REVERSE;
-		srand(seed);
-		Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
-		if(!packed) {
-			try {
-				driver<SString<char> >(infile, infiles, outfile + ".rev", false, reverseType);
-			} catch(bad_alloc& e) {
-				if(autoMem) {
-					cerr << "Switching to a packed string representation." << endl;
-					packed = true;
-				} else {
-					throw e;
+		if(mirror && !filterOnly) {
+			// The mirror index is built over the reverse of the entire
+			// joined text so that its SA ranges can be kept in step with
+			// the forward index's during bidirectional search
+			srand(seed);
+			Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
+			if(!packed) {
+				try {
+					driver<SString<char> >(
+                                           infile,
+                                           infiles,
+                                           conversion_table_fname,
+                                           taxonomy_fname,
+                                           name_table_fname,
+                                           size_table_fname,
+                                           outfile + ".rev",
+                                           false,
+                                           REF_READ_REVERSE);
+				} catch(bad_alloc& e) {
+					if(autoMem) {
+						cerr << "Switching to a packed string representation." << endl;
+						packed = true;
+					} else {
+						throw e;
+					}
 				}
 			}
+			if(packed) {
+				driver<S2bDnaString>(
+                                     infile,
+                                     infiles,
+                                     conversion_table_fname,
+                                     taxonomy_fname,
+                                     name_table_fname,
+                                     size_table_fname,
+                                     outfile + ".rev",
+                                     true,
+                                     REF_READ_REVERSE);
+			}
 		}
-		if(packed) {
-			driver<S2bDnaString>(infile, infiles, outfile + ".rev", true, reverseType);
-		}
-#endif
 		return 0;
 	} catch(std::exception& e) {
 		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
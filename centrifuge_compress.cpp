@@ -36,6 +36,7 @@
 #include "reference.h"
 #include "ds.h"
 #include "aligner_sw.h"
+#include "threading.h"
 
 /**
  * \file Driver for the bowtie-build indexing tool.
@@ -73,6 +74,8 @@ static string wrapper;
 static int across;
 static size_t minSimLen;  // minimum similar length
 static bool printN;
+static int nthreads;      // number of threads
+static bool noAvx2;       // use the SSE2 alignment kernels only
 
 static void resetOptions() {
 	verbose        = true;  // be talkative (default)
@@ -105,6 +108,8 @@ static void resetOptions() {
     across         = 60; // number of characters across in FASTA output
     minSimLen      = 100;
     printN         = false;
+    nthreads       = 1;
+    noAvx2         = false;
     wrapper.clear();
 }
 
@@ -126,6 +131,9 @@ enum {
     ARG_LOCAL_FTABCHARS,
     ARG_MIN_SIMLEN,
     ARG_PRINTN,
+    ARG_THREADS,
+    ARG_PACKED,
+    ARG_NO_AVX2,
 };
 
 /**
@@ -154,7 +162,8 @@ static void printUsage(ostream& out) {
 		<< "                            has fewer than 4 billion nucleotides" << endl;
 	}
     out << "    -a/--noauto             disable automatic -p/--bmax/--dcv memory-fitting" << endl
-	    << "    -p/--packed             use packed strings internally; slower, uses less mem" << endl
+	    << "    --packed                use packed strings internally; slower, uses less mem" << endl
+	    << "    -p/--threads <int>      number of threads to launch (1)" << endl
 	    << "    --bmax <int>            max bucket sz for blockwise suffix-array builder" << endl
 	    << "    --bmaxdivn <int>        max bucket sz as divisor of ref len (default: 4)" << endl
 	    << "    --dcv <int>             diff-cover period for blockwise (default: 1024)" << endl
@@ -168,6 +177,7 @@ static void printUsage(ostream& out) {
 	    << "    --seed <int>            seed for random number generator" << endl
 	    << "    -q/--quiet              verbose output (for debugging)" << endl
         << "    --printN                print original sequence with mask" << endl
+        << "    --no-avx2               align with the SSE2 kernels even if AVX2 is there" << endl
 	    << "    -h/--help               print detailed description of tool and its options" << endl
 	    << "    --usage                 print this usage message" << endl
 	    << "    --version               print version information and quit" << endl
@@ -182,12 +192,13 @@ static void printUsage(ostream& out) {
 	}
 }
 
-static const char *short_options = "qraph?nscfl:i:o:t:h:3C";
+static const char *short_options = "qrap:h?nscfl:i:o:t:h:3C";
 
 static struct option long_options[] = {
 	{(char*)"quiet",          no_argument,       0,            'q'},
 	{(char*)"sanity",         no_argument,       0,            's'},
-	{(char*)"packed",         no_argument,       0,            'p'},
+	{(char*)"packed",         no_argument,       0,            ARG_PACKED},
+	{(char*)"threads",        required_argument, 0,            ARG_THREADS},
 	{(char*)"little",         no_argument,       &bigEndian,   0},
 	{(char*)"big",            no_argument,       &bigEndian,   1},
 	{(char*)"bmax",           required_argument, 0,            ARG_BMAX},
@@ -215,6 +226,7 @@ static struct option long_options[] = {
 	{(char*)"reverse-each",   no_argument,       0,            ARG_REVERSE_EACH},
     {(char*)"min-simlen",     required_argument, 0,            ARG_MIN_SIMLEN},
     {(char*)"printN",         no_argument,       0,            ARG_PRINTN},
+    {(char*)"no-avx2",        no_argument,       0,            ARG_NO_AVX2},
 	{(char*)"usage",          no_argument,       0,            ARG_USAGE},
     {(char*)"wrapper",        required_argument, 0,            ARG_WRAPPER},
 	{(char*)0, 0, 0, 0} // terminator
@@ -259,7 +271,11 @@ static void parseOptions(int argc, const char **argv) {
 				break;
 			case 'f': format = FASTA; break;
 			case 'c': format = CMDLINE; break;
-			case 'p': packed = true; break;
+			case ARG_PACKED: packed = true; break;
+			case ARG_THREADS:
+			case 'p':
+				nthreads = parseNumber<int>(1, "-p/--threads arg must be at least 1");
+				break;
 			case 'C':
 				cerr << "Error: -C specified but Bowtie 2 does not support colorspace input." << endl;
 				throw 1;
@@ -326,6 +342,7 @@ static void parseOptions(int argc, const char **argv) {
                 minSimLen = parseNumber<size_t>(2, "--min-simlen arg must be at least 2");
                 break;
             case ARG_PRINTN: printN = true; break;
+            case ARG_NO_AVX2: noAvx2 = true; break;
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
 			case 's': sanityCheck = true; break;
@@ -443,6 +460,666 @@ struct RegionToMerge {
     }
 };
 
+/**
+ * Suffix array written by centrifuge-build --sa: the number of entries,
+ * then the entries, all as 64-bit words in the local endianness.  Entries
+ * are read a block at a time; they must be asked for in increasing order,
+ * except that we can go back as far as the last call to release().
+ */
+class SABuf {
+
+public:
+
+    SABuf(const string& fname, size_t first) : f_(NULL), begin_(first) {
+        f_ = fopen(fname.c_str(), "rb");
+        if(f_ == NULL) {
+            cerr << "Error: could not open " << fname.c_str() << endl;
+            throw 1;
+        }
+        if(fseeko(f_, (off_t)((first + 1) * sizeof(uint64_t)), SEEK_SET) != 0) {
+            cerr << "Error: could not seek in " << fname.c_str() << endl;
+            throw 1;
+        }
+    }
+
+    ~SABuf() {
+        if(f_ != NULL) fclose(f_);
+    }
+
+    /**
+     * Return the i-th entry of the suffix array.
+     */
+    size_t operator[](size_t i) {
+        assert_geq(i, begin_);
+        while(i >= begin_ + buf_.size()) {
+            size_t cur = buf_.size();
+            buf_.resize(cur + BLOCK);
+            size_t n = fread(buf_.ptr() + cur, sizeof(uint64_t), BLOCK, f_);
+            buf_.resize(cur + n);
+            if(n == 0) {
+                cerr << "Error: suffix array file ended before entry " << i << endl;
+                throw 1;
+            }
+        }
+        return (size_t)buf_[i - begin_];
+    }
+
+    /**
+     * Let go of the entries before the i-th.
+     */
+    void release(size_t i) {
+        if(i < begin_ + BLOCK || i > begin_ + buf_.size()) return;
+        buf_.erase(0, i - begin_);
+        begin_ = i;
+    }
+
+private:
+
+    static const size_t BLOCK = 64 * 1024; // entries read at a time
+
+    FILE*            f_;
+    size_t           begin_; // entry buf_[0] holds
+    EList<uint64_t>  buf_;
+};
+
+/**
+ * Where a scan of the suffix array stands at the top of its loop: the
+ * entry it's about to look at, the last entry it compared with its
+ * neighbors, and how many seeds it had found by then.  Where the scan
+ * goes next depends on nothing but i1 and last_i1.
+ */
+struct SeedScanState {
+    size_t i1;
+    size_t last_i1;
+    size_t nregions;
+    size_t nsimilar;
+};
+
+/**
+ * A thread goes back this many steps at most to find where its own scan
+ * and the scan of the stretch before it come together.
+ */
+static const size_t SEED_SYNC_VISITS = 4096;
+
+/**
+ * A scan finding seeds in one stretch of the suffix array.
+ */
+struct SeedParam {
+    const string*          safile;
+    size_t                 sa_size;
+    size_t                 end;     // stop once i1 gets here
+    size_t                 start_i1;
+    size_t                 start_last_i1;
+    const SString<char>*   s;
+    size_t                 min_kmer;
+    size_t                 min_seed_length;
+    bool                   progress; // report how far we've gotten
+    const EList<SeedScanState>* sync; // stop on reaching one of these
+    size_t                 synced;  // which one, or sync->size()
+    EList<SeedScanState>   visits;  // the first SEED_SYNC_VISITS steps
+    size_t                 exit_i1; // where the scan left off
+    size_t                 exit_last_i1;
+    EList<Region>          regions;
+    EList<RegionSimilar>   regions_similar;
+};
+
+/**
+ * Compare each suffix the scan visits with its neighbors and, where they
+ * share at least min_seed_length bases, add a seed to 'regions' and the
+ * matching stretches to 'regions_similar', in suffix array order.  The
+ * seeds aren't checked against the ones found so far; filter_seeds()
+ * does that afterwards.
+ */
+static void scan_seeds(SeedParam& param) {
+    const SString<char>& s = *param.s;
+    EList<Region>& regions = param.regions;
+    EList<RegionSimilar>& regions_similar = param.regions_similar;
+    const size_t sa_size = param.sa_size;
+    const size_t sense_seq_len = s.length();
+    const size_t both_seq_len = sense_seq_len * 2;
+    const size_t min_kmer = param.min_kmer;
+    const size_t min_seed_length = param.min_seed_length;
+
+    size_t i1 = param.start_i1;
+    size_t last_i1 = param.start_last_i1;
+    SABuf sa(*param.safile, min(i1, last_i1 + 1));
+    size_t k = 0;
+    if(param.sync != NULL) param.synced = param.sync->size();
+
+    // Compress sequences by removing redundant sub-sequences
+    for(; i1 < param.end; i1++) {
+        if(param.sync != NULL) {
+            const EList<SeedScanState>& sync = *param.sync;
+            while(k < sync.size() && sync[k].i1 < i1) k++;
+            if(k < sync.size() && sync[k].i1 == i1 && sync[k].last_i1 == last_i1) {
+                param.synced = k;
+                break;
+            }
+        }
+        if(param.visits.size() < SEED_SYNC_VISITS) {
+            param.visits.expand();
+            param.visits.back().i1 = i1;
+            param.visits.back().last_i1 = last_i1;
+            param.visits.back().nregions = regions.size();
+            param.visits.back().nsimilar = regions_similar.size();
+        }
+
+        // daehwan - for debugging purposes
+        if(param.progress && (i1 + 1) % 1000000 == 0) {
+            cerr << "\t\t" << (i1 + 1) / 1000000 << " million" << endl;
+        }
+        size_t pos1 = sa[i1];
+
+        if(pos1 == both_seq_len) continue;
+        if(pos1 + min_seed_length >= sense_seq_len) continue;
+
+        // Compare with the following sequences
+        bool expanded = false;
+        size_t i2 = last_i1 + 1;
+        for(; i2 < sa_size; i2++) {
+            if(i1 == i2) continue;
+            size_t pos2 = sa[i2];
+            if(pos2 == both_seq_len) continue;
+            // opos2 is relative pos of pos2 on the other strand
+            size_t opos2 = both_seq_len - pos2 - 1;
+            // cpos2 is canonical pos on the sense strand
+            size_t cpos2 = min(pos2, opos2);
+            bool fw = pos2 == cpos2;
+            if(fw) {
+                if(pos2 + min_kmer > sense_seq_len) continue;
+            } else {
+                if(pos2 + min_kmer > both_seq_len) continue;
+            }
+
+            size_t j1 = 0; // includes the base at 'pos1'
+            while(pos1 + j1 < sense_seq_len && pos2 + j1 < (fw ? sense_seq_len : both_seq_len)) {
+                if(!fw) {
+                    if(pos1 < cpos2 && pos1 + (j1 * 2) >= cpos2) break;
+                }
+                int base1 = s[pos1 + j1];
+                int base2;
+                if(fw) {
+                    base2 = s[pos2 + j1];
+                } else {
+                    assert_geq(cpos2, j1);
+                    base2 = 3 - s[cpos2 - j1];
+                }
+                if(base1 > 3 || base2 > 3) break;
+                if(base1 != base2) break;
+                j1++;
+            }
+            if(j1 < min_kmer) {
+                if(i2 > i1) break;
+                else continue;
+            }
+
+            size_t j2 = 0; // doesn't include the base at 'pos1'
+            while(j2 <= pos1 && (fw ? 0 : sense_seq_len) + j2 <= pos2) {
+                if(!fw) {
+                    if(cpos2 < pos1 && cpos2 + (j2 * 2) >= pos1) break;
+                }
+                int base1 = s[pos1 - j2];
+                int base2;
+                if(fw) {
+                    base2 = s[pos2 - j2];
+                } else {
+                    assert_lt(cpos2 + j2, s.length());
+                    base2 = 3 - s[cpos2 + j2];
+                }
+                if(base1 > 3 || base2 > 3) break;
+                if(base1 != base2) break;
+                j2++;
+            }
+            if(j2 > 0) j2--;
+
+            size_t j = j1 + j2;
+
+            // Do not proceed if two sequences are not similar
+            if(j < min_seed_length) continue;
+
+            assert_leq(pos1 + j1, sense_seq_len);
+            if(!expanded) {
+                regions.expand();
+                regions.back().reset();
+                regions.back().pos = pos1;
+                regions.back().match_begin = regions.back().match_end = regions_similar.size();
+                expanded = true;
+            }
+
+            regions_similar.expand();
+            regions_similar.back().reset();
+            regions_similar.back().fw = fw;
+            regions_similar.back().pos = cpos2;
+            if(fw) {
+                regions_similar.back().fw_length = j1;
+                regions_similar.back().bw_length = j2;
+            } else {
+                regions_similar.back().fw_length = j1 > 0 ? j2 + 1 : 0;
+                regions_similar.back().bw_length = j1 > 0 ? j1 - 1 : 0;
+            }
+
+            regions.back().match_end = regions_similar.size();
+            if(regions.back().match_size() >= 20) break;
+        }
+
+        last_i1 = i1;
+        sa.release(last_i1);
+
+        // daehwan - for debugging purposes
+#if 1
+        assert_lt(i1, i2);
+        if(i1 + 8 < i2) {
+            i1 = i1 + (i2 - i1) / 2;
+        }
+#endif
+    }
+    param.exit_i1 = i1;
+    param.exit_last_i1 = last_i1;
+}
+
+static void find_seeds_worker(void *vp) {
+    scan_seeds(*(SeedParam*)vp);
+}
+
+/**
+ * How many bases from the seed's own position on a similar stretch
+ * matches.
+ */
+static inline size_t seed_prefix_length(const RegionSimilar& r) {
+    return r.fw ? r.fw_length : r.bw_length + 1;
+}
+
+/**
+ * Go over the seeds in the order they were found and drop the similar
+ * stretches that don't reach past what an earlier seed already covers,
+ * then the seeds left with none.  prefix_lengths[i] holds how far the
+ * seeds kept so far cover the sequence from position i.
+ */
+static void filter_seeds(
+    EList<Region>& regions,
+    EList<RegionSimilar>& regions_similar,
+    EList<uint16_t>& prefix_lengths)
+{
+    size_t nregions = 0, nsimilar = 0;
+    for(size_t r = 0; r < regions.size(); r++) {
+        Region region = regions[r];
+        size_t m = region.match_begin;
+        while(m < region.match_end &&
+              seed_prefix_length(regions_similar[m]) <= prefix_lengths[region.pos]) {
+            m++;
+        }
+        if(m == region.match_end) continue;
+        
+        const size_t j1 = seed_prefix_length(regions_similar[m]);
+        for(size_t k = 0; k < j1; k++) {
+            if(prefix_lengths[region.pos + k] < j1 - k) {
+                prefix_lengths[region.pos + k] = (uint16_t)(j1 - k);
+            }
+        }
+        region.fw_length = 0;
+        region.match_begin = nsimilar;
+        for(; m < region.match_end; m++) {
+            if(region.fw_length < seed_prefix_length(regions_similar[m])) {
+                region.fw_length = seed_prefix_length(regions_similar[m]);
+            }
+            regions_similar[nsimilar++] = regions_similar[m];
+        }
+        region.match_end = nsimilar;
+        
+        if(region.match_size() > 1) {
+            regions_similar.sortPortion(region.match_begin, region.match_size());
+            size_t cur_pos = region.match_begin + 1;
+            for(size_t i = region.match_begin + 1; i < region.match_end; i++) {
+                assert_gt(cur_pos, 0);
+                const RegionSimilar& last_region = regions_similar[cur_pos-1];
+                const RegionSimilar& new_region = regions_similar[i];
+                if(last_region.fw == new_region.fw) {
+                    if(last_region.fw) {
+                        if(last_region.pos + last_region.fw_length >= new_region.pos) {
+                            continue;
+                        }
+                    } else {
+                        if(last_region.pos + last_region.fw_length >= new_region.pos) {
+                            regions_similar[cur_pos-1] = new_region;
+                            continue;
+                        }
+                    }
+                }
+                if(cur_pos != i) {
+                    regions_similar[cur_pos] = new_region;
+                }
+                cur_pos++;
+            }
+            if(cur_pos < region.match_end) {
+                region.low_complexity = true;
+            }
+            nsimilar = cur_pos;
+            region.match_end = nsimilar;
+        }
+        regions[nregions++] = region;
+    }
+    regions.resize(nregions);
+    regions_similar.resize(nsimilar);
+}
+
+/**
+ * A Smith-Waterman comparison of the stretches between the k-th and
+ * (k+1)-th seeds of a merge and its similar regions, and whether it
+ * found them similar enough to combine the two.
+ */
+struct SwCall {
+    size_t   k;
+    size_t   left, right;         // stretch of the sequence
+    size_t   cmp_left, cmp_right; // stretch it's compared with
+    bool     fw;
+    TAlScore minsc;
+    bool     combined;
+
+    bool sameAs(const SwCall& o) const {
+        return k == o.k && left == o.left && right == o.right &&
+               cmp_left == o.cmp_left && cmp_right == o.cmp_right &&
+               fw == o.fw && minsc == o.minsc;
+    }
+};
+
+/**
+ * Go through the seeds of 'merge' in order, combining each with the next
+ * when the stretches between them are close enough, and mask what the
+ * result covers in 'mask' unless it's NULL.  The merge's regions and
+ * similar regions are copied into 'rg' and 'rs' and updated there, for
+ * the caller to write back.  Comparisons are appended to 'calls'; one
+ * that was already made, as recorded in 'done', isn't aligned again.
+ */
+static void merge_regions(
+                          const RegionToMerge& merge,
+                          const EList<Region>& regions,
+                          const EList<RegionSimilar>& regions_similar,
+                          const SString<char>& s,
+                          const Scoring& sc,
+                          size_t min_sim_length,
+                          SwAligner& sw,
+                          EList<Region>& rg,
+                          EList<RegionSimilar>& rs,
+                          const EList<SwCall>* done,
+                          EList<SwCall>& calls,
+                          EList<uint8_t>* mask)
+{
+    rg.clear();
+    rs.clear();
+    calls.clear();
+    size_t next_done = 0;
+
+    assert_gt(merge.list.size(), 0);
+    for(size_t k = 0; k < merge.list.size(); k++) {
+        uint32_t region_id1 = merge.list[k].first;
+        assert_lt(region_id1, regions.size());
+        rg.push_back(regions[region_id1]);
+        Region& region1 = rg.back();
+
+        uint32_t cmp_region_id1 = merge.list[k].second;
+        assert_lt(cmp_region_id1, regions_similar.size());
+        rs.push_back(regions_similar[cmp_region_id1]);
+        const RegionSimilar& cmp_region1 = rs.back();
+
+        if(cmp_region1.fw) {
+            region1.fw_length = cmp_region1.fw_length;
+            region1.bw_length = cmp_region1.bw_length;
+        } else {
+            region1.fw_length = cmp_region1.fw_length > 0 ? cmp_region1.bw_length + 1 : 0;
+            region1.bw_length = cmp_region1.fw_length > 0 ? cmp_region1.fw_length - 1 : 0;
+        }
+    }
+
+    for(size_t k = 0; k < merge.list.size(); k++) {
+        const Region& region1 = rg[k];
+        const RegionSimilar& cmp_region1 = rs[k];
+
+        const bool fw = cmp_region1.fw;
+        bool combined = false;
+        if(k + 1 < merge.list.size()) {
+            assert_lt(merge.list[k].first, merge.list[k+1].first);
+            Region& region2 = rg[k+1];
+            RegionSimilar& cmp_region2 = rs[k+1];
+
+            assert_eq(cmp_region1.fw, cmp_region2.fw);
+            size_t query_len, left = region1.pos, right = region2.pos, cmp_left, cmp_right;
+            if(fw) {
+                assert_lt(cmp_region1.pos, cmp_region2.pos);
+                query_len = cmp_region2.pos - cmp_region1.pos + cmp_region2.fw_length + cmp_region1.bw_length;
+                cmp_left = cmp_region1.pos, cmp_right = cmp_region2.pos;
+
+                assert_gt(cmp_region1.fw_length, 0);
+                left = left + cmp_region1.fw_length - 1;
+                cmp_left = cmp_left + cmp_region1.fw_length - 1;
+
+                assert_geq(right, cmp_region2.bw_length);
+                right = right - cmp_region2.bw_length;
+                assert_geq(cmp_right, cmp_region2.bw_length);
+                cmp_right = cmp_right - cmp_region2.bw_length;
+
+            } else {
+                assert_lt(cmp_region2.pos, cmp_region1.pos);
+                query_len = cmp_region1.pos - cmp_region2.pos + cmp_region1.fw_length + cmp_region2.bw_length;
+                cmp_left = cmp_region2.pos, cmp_right = cmp_region1.pos;
+
+                left = left + cmp_region1.bw_length;
+                assert_gt(cmp_region2.fw_length, 0);
+                cmp_left = cmp_left + cmp_region2.fw_length - 1;
+
+                assert_geq(right + 1, cmp_region2.fw_length);
+                right = right + 1 - cmp_region2.fw_length;
+                assert_geq(cmp_right, cmp_region1.bw_length);
+                cmp_right = cmp_right - cmp_region1.bw_length;
+            }
+
+#if 0
+            cout << "query length: " << query_len << endl;
+            cout << "left-right: " << left << "\t" << right << endl;
+            cout << "cmp left-right: " << cmp_left << "\t" << cmp_right << endl;
+#endif
+
+            size_t max_diffs = (query_len + 9) / 10;
+            if(max_diffs > cmp_region1.mismatches + cmp_region1.gaps) {
+                max_diffs -= (cmp_region1.mismatches + cmp_region1.gaps);
+            } else {
+                max_diffs = 0;
+            }
+
+            bool do_swalign = max_diffs > 0;
+            if(left >= right && cmp_left >= cmp_right) {
+                combined = true;
+            } else if(left >= right) {
+                assert_lt(cmp_left, cmp_right);
+                size_t gap = cmp_right - cmp_left + 1 + left - right;
+                if(gap <= max_diffs) {
+                    combined = true;
+                    cmp_region2.gaps += gap;
+                } else {
+                    do_swalign = false;
+                }
+            } else if(cmp_left >= cmp_right) {
+                assert_lt(left, right);
+                size_t gap = right - left + 1 + cmp_left - cmp_right;
+                if(gap <= max_diffs) {
+                    combined = true;
+                    cmp_region2.gaps += gap;
+                } else {
+                    do_swalign = false;
+                }
+            }
+            /*else if(left + max_diffs >= right && cmp_left + max_diffs >= cmp_right) {
+                combined = true;
+            }*/
+
+            TAlScore minsc = -max_diffs * 6;
+            if(!combined && do_swalign && minsc < 0 && right - left + 1 <= 200) {
+                SwCall call;
+                call.k = k;
+                call.left = left, call.right = right;
+                call.cmp_left = cmp_left, call.cmp_right = cmp_right;
+                call.fw = fw;
+                call.minsc = minsc;
+                call.combined = false;
+                while(done != NULL && next_done < done->size() && (*done)[next_done].k < k) {
+                    next_done++;
+                }
+                if(done != NULL && next_done < done->size() && (*done)[next_done].sameAs(call)) {
+                    call.combined = (*done)[next_done].combined;
+                } else {
+                    BTString seq;
+                    BTDnaString cmp_seq;
+                    BTString cmp_qual;
+
+                    assert_lt(region1.pos, region2.pos);
+                    for(size_t pos = left; pos <= right; pos++) {
+                        assert_lt(pos, s.length());
+                        seq.append(1 << s[pos]);
+                    }
+
+                    for(size_t pos = cmp_left; pos <= cmp_right; pos++) {
+                        assert_lt(pos, s.length());
+                        cmp_seq.append(s[pos]);
+                    }
+                    cmp_qual.resize(cmp_seq.length());
+                    cmp_qual.fill('I');
+                    if(!fw) {
+                        cmp_seq.reverseComp();
+                        cmp_qual.reverse();
+                    }
+
+                    sw.initRead(cmp_seq, cmp_seq, cmp_qual, cmp_qual, 0, cmp_seq.length(), sc);
+
+                    DPRect rect;
+                    rect.refl = rect.refl_pretrim = rect.corel = 0;
+                    rect.refr = rect.refr_pretrim = rect.corer = seq.length();
+                    rect.triml = rect.trimr = 0;
+                    rect.maxgap = 10;
+
+                    sw.initRef(
+                               true, // fw
+                               0, // refidx
+                               rect,
+                               const_cast<char *>(seq.toZBuf()),
+                               0,
+                               seq.length(),
+                               seq.length(),
+                               sc,
+                               minsc,
+                               true, // enable8
+                               2000, // cminlen
+                               4, // cpow2
+                               false, // doTri
+                               true); // extend);
+
+                    // Perform dynamic programing
+                    RandomSource rnd(seed);
+                    TAlScore bestCell = std::numeric_limits<TAlScore>::min();
+                    call.combined = sw.align(rnd, bestCell);
+#if 0
+                    if(call.combined) {
+                        BTDnaString seqstr;
+                        for(size_t bi = 0; bi < seq.length(); bi++) {
+                            seqstr.append(firsts5[(int)seq[bi]]);
+                        }
+                        cout << seqstr << endl;
+                        cout << cmp_seq << endl;
+
+                        SwResult res;
+                        res.reset();
+                        sw.nextAlignment(res, minsc, rnd);
+                        res.alres.ned().reverse();
+                        cout << "Succeeded (" << bestCell << "): "; Edit::print(cout, res.alres.ned()); cout << endl;
+                    }
+#endif
+                }
+                calls.push_back(call);
+                combined = call.combined;
+            }
+
+            if(combined) {
+                assert_lt(region1.pos, region2.pos);
+                region2.bw_length = region2.pos - region1.pos + region1.bw_length;
+                if(fw) {
+                    assert_lt(cmp_region1.pos, cmp_region2.pos);
+                    cmp_region2.bw_length = cmp_region2.pos - cmp_region1.pos + cmp_region1.bw_length;
+                } else {
+                    assert_lt(cmp_region2.pos, cmp_region1.pos);
+                    cmp_region2.fw_length = cmp_region1.pos - cmp_region2.pos + cmp_region1.fw_length;
+                }
+            }
+        }
+
+        // Mask sequence
+        if(mask != NULL && (!combined || k + 1 == merge.list.size())) {
+            if(cmp_region1.bw_length + cmp_region1.fw_length >= min_sim_length) {
+                size_t mask_begin = 0, mask_end = 0;
+                if(region1.pos < cmp_region1.pos) {
+                    assert_leq(cmp_region1.bw_length, cmp_region1.pos);
+                    mask_begin = cmp_region1.pos - cmp_region1.bw_length;
+                    assert_leq(cmp_region1.pos + cmp_region1.fw_length, s.length());
+                    mask_end = cmp_region1.pos + cmp_region1.fw_length;
+                } else {
+                    assert_gt(region1.pos, cmp_region1.pos);
+                    assert_leq(region1.bw_length, region1.pos);
+                    mask_begin = region1.pos - region1.bw_length;
+                    assert_leq(region1.pos + region1.fw_length, s.length());
+                    mask_end = region1.pos + region1.fw_length;
+                }
+                for(size_t mask_pos = mask_begin; mask_pos < mask_end; mask_pos ++) {
+                    assert_lt(mask_pos, mask->size());
+                    (*mask)[mask_pos] = 1;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * A thread merging seeds ahead of time, so that the Smith-Waterman
+ * comparisons are already made when the merges are done for real.
+ */
+struct SwParam {
+    const EList<size_t>*         batch;    // merges to do
+    const EList<RegionToMerge>*  merge_list;
+    const EList<Region>*         regions;
+    const EList<RegionSimilar>*  regions_similar;
+    const SString<char>*         s;
+    const Scoring*               sc;
+    size_t                       min_sim_length;
+    SwAligner*                   sw;
+    EList<EList<SwCall> >*       calls;    // per merge in 'batch'
+    size_t*                      cur;      // next merge in 'batch'
+    MUTEX_T*                     mutex;
+};
+
+static void merge_regions_worker(void *vp) {
+    SwParam* param = (SwParam*)vp;
+    const EList<size_t>& batch = *param->batch;
+    EList<Region> rg;
+    EList<RegionSimilar> rs;
+    while(true) {
+        size_t b = 0;
+        {
+            ThreadSafe ts(param->mutex);
+            b = (*param->cur)++;
+        }
+        if(b >= batch.size()) break;
+        merge_regions(
+                      (*param->merge_list)[batch[b]],
+                      *param->regions,
+                      *param->regions_similar,
+                      *param->s,
+                      *param->sc,
+                      param->min_sim_length,
+                      *param->sw,
+                      rg,
+                      rs,
+                      NULL,
+                      (*param->calls)[b],
+                      NULL);
+    }
+}
+
 /**
  * Drive the index construction process and optionally sanity-check the
  * result.
@@ -535,11 +1212,9 @@ static void driver(
     // Succesfully obtained joined reference string
     assert_eq(s.length(), jlen);
     size_t sense_seq_len = s.length();
-    size_t both_seq_len = sense_seq_len * 2;
+    ASSERT_ONLY(size_t both_seq_len = sense_seq_len * 2);
     assert_geq(sense_seq_len, 2);
     
-    SwAligner sw;
-
     SimpleFunc scoreMin; scoreMin.init(SIMPLE_FUNC_LINEAR, DEFAULT_MIN_CONST, DEFAULT_MIN_LINEAR);
     SimpleFunc nCeil; nCeil.init(SIMPLE_FUNC_LINEAR, 0.0f, std::numeric_limits<double>::max(), 2.0f, 0.1f);
     const int gGapBarrier = 4;
@@ -575,7 +1250,6 @@ static void driver(
     EList<Region> regions;
     EList<RegionSimilar> regions_similar;
     {
-        EList<size_t> sa;
         EList<uint16_t> prefix_lengths;
         prefix_lengths.resizeExact(sense_seq_len);
         prefix_lengths.fillZero();
@@ -609,195 +1283,88 @@ static void driver(
 #endif
             
             assert_eq(both_seq_len + 1, sa_size);
-            size_t sa_begin = 0, sa_end = 0;
+            in.close();
             
-            // Compress sequences by removing redundant sub-sequences
-            size_t last_i1 = 0;
-            for(size_t i1 = 0; i1 < sa_size - 1; i1++) {
-                // daehwan - for debugging purposes
-                if((i1 + 1) % 1000000 == 0) {
-                    cerr << "\t\t" << (i1 + 1) / 1000000 << " million" << endl;
-                }
-                if(i1 >= sa_end) {
-                    assert_leq(sa_begin, sa_end);
-                    assert_eq(i1, sa_end);
-                    size_t sa_pos = (size_t)readIndex<uint64_t>(in, false);
-                    sa.push_back(sa_pos);
-                    sa_end++;
-                    assert_eq(sa_end - sa_begin, sa.size());
-                }
-                
-                assert_geq(i1, sa_begin); assert_lt(i1, sa_end);
-                size_t pos1 = sa[i1-sa_begin];
-                
-                if(pos1 == both_seq_len) continue;
-                if(pos1 + min_seed_length >= sense_seq_len) continue;
-                
-                // Compare with the following sequences
-                bool expanded = false;
-                size_t i2 = last_i1 + 1;
-                for(; i2 < sa_size; i2++) {
-                    if(i1 == i2) continue;
-                    if(i2 >= sa_end) {
-                        assert_leq(sa_begin, sa_end);
-                        assert_eq(i2, sa_end);
-                        size_t sa_pos = (size_t)readIndex<uint64_t>(in, false);
-                        sa.push_back(sa_pos);
-                        sa_end++;
-                        assert_eq(sa_end - sa_begin, sa.size());
-                    }
-                    
-                    assert_geq(i2, sa_begin); assert_lt(i2, sa_end);
-                    size_t pos2 = sa[i2-sa_begin];
-                    if(pos2 == both_seq_len) continue;
-                    // opos2 is relative pos of pos2 on the other strand
-                    size_t opos2 = both_seq_len - pos2 - 1;
-                    // cpos2 is canonical pos on the sense strand
-                    size_t cpos2 = min(pos2, opos2);
-                    bool fw = pos2 == cpos2;
-                    if(fw) {
-                        if(pos2 + min_kmer > sense_seq_len) continue;
-                    } else {
-                        if(pos2 + min_kmer > both_seq_len) continue;
-                    }
-                    
-                    size_t j1 = 0; // includes the base at 'pos1'
-                    while(pos1 + j1 < sense_seq_len && pos2 + j1 < (fw ? sense_seq_len : both_seq_len)) {
-                        if(!fw) {
-                            if(pos1 < cpos2 && pos1 + (j1 * 2) >= cpos2) break;
-                        }
-                        int base1 = s[pos1 + j1];
-                        int base2;
-                        if(fw) {
-                            base2 = s[pos2 + j1];
-                        } else {
-                            assert_geq(cpos2, j1);
-                            base2 = 3 - s[cpos2 - j1];
-                        }
-                        if(base1 > 3 || base2 > 3) break;
-                        if(base1 != base2) break;
-                        j1++;
-                    }
-                    if(j1 < min_kmer) {
-                        if(i2 > i1) break;
-                        else continue;
-                    }
-                    
-                    size_t j2 = 0; // doesn't include the base at 'pos1'
-                    while(j2 <= pos1 && (fw ? 0 : sense_seq_len) + j2 <= pos2) {
-                        if(!fw) {
-                            if(cpos2 < pos1 && cpos2 + (j2 * 2) >= pos1) break;
-                        }
-                        int base1 = s[pos1 - j2];
-                        int base2;
-                        if(fw) {
-                            base2 = s[pos2 - j2];
-                        } else {
-                            assert_lt(cpos2 + j2, s.length());
-                            base2 = 3 - s[cpos2 + j2];
-                        }
-                        if(base1 > 3 || base2 > 3) break;
-                        if(base1 != base2) break;
-                        j2++;
-                    }
-                    if(j2 > 0) j2--;
-                    
-                    size_t j = j1 + j2;
-                    
-                    // Do not proceed if two sequences are not similar
-                    if(j < min_seed_length) continue;
-                    
-                    assert_leq(pos1 + j1, prefix_lengths.size());
-                    if(!expanded && j1 <= prefix_lengths[pos1]) continue;
-                    
-                    if(!expanded) {
-                        regions.expand();
-                        regions.back().reset();
-                        regions.back().pos = pos1;
-                        regions.back().fw_length = j1;
-                        regions.back().match_begin = regions.back().match_end = regions_similar.size();
-                        for(size_t k = 0; k < j1; k++) {
-                            size_t tmp_length = j1 - k;
-                            if(prefix_lengths[pos1 + k] < tmp_length) {
-                                prefix_lengths[pos1 + k] = tmp_length;
-                            }
-                        }
-                        expanded = true;
+            // Each thread goes over a stretch of the suffix array.  All but
+            // the first start their stretch without knowing where the scan
+            // of the stretch before left off, so they may visit different
+            // entries than a single scan would until the two come together.
+            AutoArray<tthread::thread*> threads(nthreads);
+            EList<SeedParam> tparams;
+            tparams.resize(nthreads);
+            const size_t per_thread = (sa_size - 1 + nthreads - 1) / nthreads;
+            for(int tid = 0; tid < nthreads; tid++) {
+                tparams[tid].safile = &safile;
+                tparams[tid].sa_size = sa_size;
+                tparams[tid].start_i1 = tparams[tid].start_last_i1 = min(tid * per_thread, sa_size - 1);
+                tparams[tid].end = min(tparams[tid].start_i1 + per_thread, sa_size - 1);
+                tparams[tid].s = &s;
+                tparams[tid].min_kmer = min_kmer;
+                tparams[tid].min_seed_length = min_seed_length;
+                tparams[tid].progress = (tid == 0);
+                tparams[tid].sync = NULL;
+                threads[tid] = new tthread::thread(find_seeds_worker, (void*)&tparams[tid]);
+            }
+            for(int tid = 0; tid < nthreads; tid++) {
+                threads[tid]->join();
+                delete threads[tid];
+            }
+            
+            // Pick up each stretch from where the scan of the one before
+            // left off and go until reaching a step the thread took itself;
+            // from there on the thread found what a single scan would have
+            for(int tid = 1; tid < nthreads; tid++) {
+                SeedParam& cur = tparams[tid];
+                SeedParam redo;
+                redo.safile = &safile;
+                redo.sa_size = sa_size;
+                redo.start_i1 = tparams[tid-1].exit_i1;
+                redo.start_last_i1 = tparams[tid-1].exit_last_i1;
+                redo.end = cur.end;
+                redo.s = &s;
+                redo.min_kmer = min_kmer;
+                redo.min_seed_length = min_seed_length;
+                redo.progress = false;
+                redo.sync = &cur.visits;
+                redo.exit_i1 = redo.start_i1;
+                redo.exit_last_i1 = redo.start_last_i1;
+                scan_seeds(redo);
+                if(redo.synced < cur.visits.size()) {
+                    const SeedScanState& at = cur.visits[redo.synced];
+                    for(size_t i = at.nregions; i < cur.regions.size(); i++) {
+                        redo.regions.push_back(cur.regions[i]);
+                        redo.regions.back().match_begin = redo.regions.back().match_begin - at.nsimilar + redo.regions_similar.size();
+                        redo.regions.back().match_end = redo.regions.back().match_end - at.nsimilar + redo.regions_similar.size();
                     }
-                    
-                    if(regions.back().fw_length < j1) {
-                        regions.back().fw_length = j1;
+                    for(size_t i = at.nsimilar; i < cur.regions_similar.size(); i++) {
+                        redo.regions_similar.push_back(cur.regions_similar[i]);
                     }
-                    
-                    regions_similar.expand();
-                    regions_similar.back().reset();
-                    regions_similar.back().fw = fw;
-                    regions_similar.back().pos = cpos2;
-                    if(fw) {
-                        regions_similar.back().fw_length = j1;
-                        regions_similar.back().bw_length = j2;
-                    } else {
-                        regions_similar.back().fw_length = j1 > 0 ? j2 + 1 : 0;
-                        regions_similar.back().bw_length = j1 > 0 ? j1 - 1 : 0;
-                    }
-                    
-                    regions.back().match_end = regions_similar.size();
-                    if(regions.back().match_size() >= 20) break;
-                }
-                
-                last_i1 = i1;
-                assert_geq(last_i1, sa_begin);
-                if(last_i1 >= sa_begin + 1024) {
-                    assert_lt(last_i1, sa_end);
-                    sa.erase(0, last_i1 - sa_begin);
-                    sa_begin = last_i1;                    
-                    assert_eq(sa_end - sa_begin, sa.size());
+                } else {
+                    cur.exit_i1 = redo.exit_i1;
+                    cur.exit_last_i1 = redo.exit_last_i1;
                 }
-                
-                if(expanded) {
-                    assert_gt(regions.size(), 0);
-                    assert_lt(regions.back().match_begin, regions.back().match_end);
-                    assert_eq(regions.back().match_end, regions_similar.size());
-                    if(regions.back().match_size() > 1) {
-                        regions_similar.sortPortion(regions.back().match_begin, regions.back().match_size());
-                        size_t cur_pos = regions.back().match_begin + 1;
-                        for(size_t i = regions.back().match_begin + 1; i < regions.back().match_end; i++) {
-                            assert_gt(cur_pos, 0);
-                            const RegionSimilar& last_region = regions_similar[cur_pos-1];
-                            const RegionSimilar& new_region = regions_similar[i];
-                            if(last_region.fw == new_region.fw) {
-                                if(last_region.fw) {
-                                    if(last_region.pos + last_region.fw_length >= new_region.pos) {
-                                        continue;
-                                    }
-                                } else {
-                                    if(last_region.pos + last_region.fw_length >= new_region.pos) {
-                                        regions_similar[cur_pos-1] = new_region;
-                                        continue;
-                                    }
-                                }
-                            }
-                            if(cur_pos != i) {
-                                assert_lt(cur_pos, regions_similar.size());
-                                regions_similar[cur_pos] = new_region;
-                            }
-                            cur_pos++;
-                        }
-                        if(cur_pos < regions.back().match_end) {
-                            regions.back().low_complexity = true;
-                        }
-                        regions_similar.resize(cur_pos);
-                        regions.back().match_end = regions_similar.size();
-                    }
+                cur.regions.swap(redo.regions);
+                cur.regions_similar.swap(redo.regions_similar);
+            }
+            
+            // Put the threads' seeds together, in suffix array order
+            for(int tid = 0; tid < nthreads; tid++) {
+                const EList<Region>& tregions = tparams[tid].regions;
+                const EList<RegionSimilar>& tsimilar = tparams[tid].regions_similar;
+                size_t offset = regions_similar.size();
+                for(size_t i = 0; i < tregions.size(); i++) {
+                    regions.push_back(tregions[i]);
+                    regions.back().match_begin += offset;
+                    regions.back().match_end += offset;
                 }
-                
-                // daehwan - for debugging purposes
-#if 1
-                assert_lt(i1, i2);
-                if(i1 + 8 < i2) {
-                    i1 = i1 + (i2 - i1) / 2;
+                for(size_t i = 0; i < tsimilar.size(); i++) {
+                    regions_similar.push_back(tsimilar[i]);
                 }
-#endif
+            }
+            filter_seeds(regions, regions_similar, prefix_lengths);
+            if(verbose) {
+                cerr << "\t\t" << regions.size() << " seeds, "
+                     << regions_similar.size() << " similar stretches" << endl;
             }
         }
         
@@ -850,6 +1417,24 @@ static void driver(
         mask.fillZero();
         
         EList<RegionToMerge> merge_list;
+        EList<size_t> batch;
+        EList<Region> rg;
+        EList<RegionSimilar> rs;
+        EList<SwCall> sw_calls;
+        EList<EList<SwCall> > calls;
+        EList<SwAligner> sws;
+        sws.resizeExact(nthreads);
+#ifdef SW_AVX2
+        if(noAvx2) {
+            for(int tid = 0; tid < nthreads; tid++) {
+                sws[tid].disableAvx2();
+            }
+        }
+#endif
+        AutoArray<tthread::thread*> threads(nthreads);
+        EList<SwParam> tparams;
+        tparams.resize(nthreads);
+        MUTEX_T mutex;
         for(size_t i = 0; i < regions.size(); i++) {
             const Region& region = regions[i];
             if(i == 0) {
@@ -922,6 +1507,8 @@ static void driver(
                 }
             }
             
+            batch.clear();
+            size_t nmulti = 0; // merges with seeds to combine
             for(size_t j = 0; j < merge_list.size(); j++) {
                 RegionToMerge& merge = merge_list[j];
                 uint32_t region_id1 = merge.list.back().first;
@@ -980,226 +1567,58 @@ static void driver(
                 }
 #endif
                 
-                assert_gt(merge.list.size(), 0);
-                for(size_t k = 0; k < merge.list.size(); k++) {
-                    uint32_t region_id1 = merge.list[k].first;
-                    assert_lt(region_id1, regions.size());
-                    Region& region1 = regions[region_id1];
-                    
-                    uint32_t cmp_region_id1 = merge.list[k].second;
-                    assert_lt(cmp_region_id1, regions_similar.size());
-                    const RegionSimilar& cmp_region1 = regions_similar[cmp_region_id1];
-                    
-                    if(cmp_region1.fw) {
-                        region1.fw_length = cmp_region1.fw_length;
-                        region1.bw_length = cmp_region1.bw_length;
-                    } else {
-                        region1.fw_length = cmp_region1.fw_length > 0 ? cmp_region1.bw_length + 1 : 0;
-                        region1.bw_length = cmp_region1.fw_length > 0 ? cmp_region1.fw_length - 1 : 0;
-                    }
+                batch.push_back(j);
+                if(merge.list.size() > 1) nmulti++;
+            }
+            
+            // Merge ahead of time on all threads, so that the merges done
+            // in order below find their Smith-Waterman comparisons made
+            const bool ahead = nthreads > 1 && nmulti > 1;
+            if(ahead) {
+                calls.resize(batch.size());
+                for(size_t b = 0; b < batch.size(); b++) {
+                    calls[b].clear();
                 }
-                
+                size_t cur = 0;
+                for(int tid = 0; tid < nthreads; tid++) {
+                    tparams[tid].batch = &batch;
+                    tparams[tid].merge_list = &merge_list;
+                    tparams[tid].regions = &regions;
+                    tparams[tid].regions_similar = &regions_similar;
+                    tparams[tid].s = &s;
+                    tparams[tid].sc = &sc;
+                    tparams[tid].min_sim_length = min_sim_length;
+                    tparams[tid].sw = &sws[tid];
+                    tparams[tid].calls = &calls;
+                    tparams[tid].cur = &cur;
+                    tparams[tid].mutex = &mutex;
+                    threads[tid] = new tthread::thread(merge_regions_worker, (void*)&tparams[tid]);
+                }
+                for(int tid = 0; tid < nthreads; tid++) {
+                    threads[tid]->join();
+                    delete threads[tid];
+                }
+            }
+            
+            for(size_t b = 0; b < batch.size(); b++) {
+                RegionToMerge& merge = merge_list[batch[b]];
+                merge_regions(
+                              merge,
+                              regions,
+                              regions_similar,
+                              s,
+                              sc,
+                              min_sim_length,
+                              sws[0],
+                              rg,
+                              rs,
+                              ahead ? &calls[b] : NULL,
+                              sw_calls,
+                              &mask);
                 for(size_t k = 0; k < merge.list.size(); k++) {
-                    uint32_t region_id1 = merge.list[k].first;
-                    assert_lt(region_id1, regions.size());
-                    const Region& region1 = regions[region_id1];
-
-                    uint32_t cmp_region_id1 = merge.list[k].second;
-                    assert_lt(cmp_region_id1, regions_similar.size());
-                    const RegionSimilar& cmp_region1 = regions_similar[cmp_region_id1];
-
-                    const bool fw = cmp_region1.fw;
-                    bool combined = false;
-                    if(k + 1 < merge.list.size()) {
-                        uint32_t region_id2 = merge.list[k+1].first;
-                        assert_lt(region_id1, region_id2);
-                        assert_lt(region_id2, regions.size());
-                        Region& region2 = regions[region_id2];
-                        
-                        uint32_t cmp_region_id2 = merge.list[k+1].second;
-                        assert_lt(cmp_region_id2, regions_similar.size());
-                        RegionSimilar& cmp_region2 = regions_similar[cmp_region_id2];
-                        
-                        assert_eq(cmp_region1.fw, cmp_region2.fw);
-                        size_t query_len, left = region1.pos, right = region2.pos, cmp_left, cmp_right;
-                        if(fw) {
-                            assert_lt(cmp_region1.pos, cmp_region2.pos);
-                            query_len = cmp_region2.pos - cmp_region1.pos + cmp_region2.fw_length + cmp_region1.bw_length;
-                            cmp_left = cmp_region1.pos, cmp_right = cmp_region2.pos;
-                            
-                            assert_gt(cmp_region1.fw_length, 0);
-                            left = left + cmp_region1.fw_length - 1;
-                            cmp_left = cmp_left + cmp_region1.fw_length - 1;
-                            
-                            assert_geq(right, cmp_region2.bw_length);
-                            right = right - cmp_region2.bw_length;
-                            assert_geq(cmp_right, cmp_region2.bw_length);
-                            cmp_right = cmp_right - cmp_region2.bw_length;
-                            
-                        } else {
-                            assert_lt(cmp_region2.pos, cmp_region1.pos);
-                            query_len = cmp_region1.pos - cmp_region2.pos + cmp_region1.fw_length + cmp_region2.bw_length;
-                            cmp_left = cmp_region2.pos, cmp_right = cmp_region1.pos;
-                            
-                            left = left + cmp_region1.bw_length;
-                            assert_gt(cmp_region2.fw_length, 0);
-                            cmp_left = cmp_left + cmp_region2.fw_length - 1;
-                            
-                            assert_geq(right + 1, cmp_region2.fw_length);
-                            right = right + 1 - cmp_region2.fw_length;
-                            assert_geq(cmp_right, cmp_region1.bw_length);
-                            cmp_right = cmp_right - cmp_region1.bw_length;
-                        }
-                        
-#if 0
-                        cout << "query length: " << query_len << endl;
-                        cout << "left-right: " << left << "\t" << right << endl;
-                        cout << "cmp left-right: " << cmp_left << "\t" << cmp_right << endl;
-#endif
-                        
-                        size_t max_diffs = (query_len + 9) / 10;
-                        if(max_diffs > cmp_region1.mismatches + cmp_region1.gaps) {
-                            max_diffs -= (cmp_region1.mismatches + cmp_region1.gaps);
-                        } else {
-                            max_diffs = 0;
-                        }
-                        
-                        bool do_swalign = max_diffs > 0;
-                        if(left >= right && cmp_left >= cmp_right) {
-                            combined = true;
-                        } else if(left >= right) {
-                            assert_lt(cmp_left, cmp_right);
-                            size_t gap = cmp_right - cmp_left + 1 + left - right;
-                            if(gap <= max_diffs) {
-                                combined = true;
-                                cmp_region2.gaps += gap;
-                            } else {
-                                do_swalign = false;
-                            }
-                        } else if(cmp_left >= cmp_right) {
-                            assert_lt(left, right);
-                            size_t gap = right - left + 1 + cmp_left - cmp_right;
-                            if(gap <= max_diffs) {
-                                combined = true;
-                                cmp_region2.gaps += gap;
-                            } else {
-                                do_swalign = false;
-                            }
-                        }
-                        /*else if(left + max_diffs >= right && cmp_left + max_diffs >= cmp_right) {
-                            combined = true;
-                        }*/
-                        
-                        if(!combined && do_swalign) {
-                            BTString seq;
-                            BTDnaString cmp_seq;
-                            BTString cmp_qual;
-                            
-                            assert_lt(region1.pos, region2.pos);
-                            for(size_t pos = left; pos <= right; pos++) {
-                                assert_lt(pos, s.length());
-                                seq.append(1 << s[pos]);
-                            }
-                            
-                            for(size_t pos = cmp_left; pos <= cmp_right; pos++) {
-                                assert_lt(pos, s.length());
-                                cmp_seq.append(s[pos]);
-                            }
-                            cmp_qual.resize(cmp_seq.length());
-                            cmp_qual.fill('I');
-                            if(!fw) {
-                                cmp_seq.reverseComp();
-                                cmp_qual.reverse();
-                            }
-                            
-                            sw.initRead(cmp_seq, cmp_seq, cmp_qual, cmp_qual, 0, cmp_seq.length(), sc);
-                            
-                            DPRect rect;
-                            rect.refl = rect.refl_pretrim = rect.corel = 0;
-                            rect.refr = rect.refr_pretrim = rect.corer = seq.length();
-                            rect.triml = rect.trimr = 0;
-                            rect.maxgap = 10;
-                            
-                            TAlScore minsc = -max_diffs * 6;
-                            if(minsc < 0) {
-                                sw.initRef(
-                                           true, // fw
-                                           0, // refidx
-                                           rect,
-                                           const_cast<char *>(seq.toZBuf()),
-                                           0,
-                                           seq.length(),
-                                           seq.length(),
-                                           sc,
-                                           minsc,
-                                           true, // enable8
-                                           2000, // cminlen
-                                           4, // cpow2
-                                           false, // doTri
-                                           true); // extend);
-                                
-                                // Perform dynamic programing
-                                RandomSource rnd(seed);
-                                TAlScore bestCell = std::numeric_limits<TAlScore>::min();
-                                if(seq.length() <= 200) {
-                                    combined = sw.align(rnd, bestCell);
-                                }
-#if 0
-                                if(combined) {
-                                    BTDnaString seqstr;
-                                    for(size_t bi = 0; bi < seq.length(); bi++) {
-                                        seqstr.append(firsts5[(int)seq[bi]]);
-                                    }
-                                    cout << seqstr << endl;
-                                    cout << cmp_seq << endl;
-                                    
-                                    SwResult res;
-                                    res.reset();
-                                    sw.nextAlignment(res, minsc, rnd);
-                                    res.alres.ned().reverse();
-                                    cout << "Succeeded (" << bestCell << "): "; Edit::print(cout, res.alres.ned()); cout << endl;
-                                }
-#endif
-                            }
-                        }
-                        
-                        if(combined) {
-                            assert_lt(region1.pos, region2.pos);
-                            region2.bw_length = region2.pos - region1.pos + region1.bw_length;
-                            if(fw) {
-                                assert_lt(cmp_region1.pos, cmp_region2.pos);
-                                cmp_region2.bw_length = cmp_region2.pos - cmp_region1.pos + cmp_region1.bw_length;
-                            } else {
-                                assert_lt(cmp_region2.pos, cmp_region1.pos);
-                                cmp_region2.fw_length = cmp_region1.pos - cmp_region2.pos + cmp_region1.fw_length;
-                            }
-                        }
-                    }
-                    
-                    // Mask sequence
-                    if(!combined || k + 1 == merge.list.size()) {
-                        if(cmp_region1.bw_length + cmp_region1.fw_length >= min_sim_length) {
-                            size_t mask_begin = 0, mask_end = 0;
-                            if(region1.pos < cmp_region1.pos) {
-                                assert_leq(cmp_region1.bw_length, cmp_region1.pos);
-                                mask_begin = cmp_region1.pos - cmp_region1.bw_length;
-                                assert_leq(cmp_region1.pos + cmp_region1.fw_length, s.length());
-                                mask_end = cmp_region1.pos + cmp_region1.fw_length;
-                            } else {
-                                assert_gt(region1.pos, cmp_region1.pos);
-                                assert_leq(region1.bw_length, region1.pos);
-                                mask_begin = region1.pos - region1.bw_length;
-                                assert_leq(region1.pos + region1.fw_length, s.length());
-                                mask_end = region1.pos + region1.fw_length;
-                            }
-                            for(size_t mask_pos = mask_begin; mask_pos < mask_end; mask_pos ++) {
-                                assert_lt(mask_pos, mask.size());
-                                mask[mask_pos] = 1;
-                            }
-                        }
-                    }
+                    regions[merge.list[k].first] = rg[k];
+                    regions_similar[merge.list[k].second] = rs[k];
                 }
-                
                 merge.list.resizeExact(0);
             }
             
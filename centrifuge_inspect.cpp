@@ -39,14 +39,13 @@ static int summarize_only = 0; // just print summary of index and quit
 static int across       = 60; // number of characters across in FASTA output
 static bool refFromEbwt = false; // true -> when printing reference, decode it from Ebwt instead of reading it from BitPairReference
 static string wrapper;
-static const char *short_options = "vhnsea:";
+static const char *short_options = "vhnsea:p:";
 static int conversion_table = 0;
 static int taxonomy_tree = 0;
 static int name_table = 0;
 static int size_table = 0;
 static int count_kmers = 0;
-
-//#define TEST_KMER_COUNTING
+static int nthreads = 1; // # threads restoring the text and counting k-mers
 
 enum {
 	ARG_VERSION = 256,
@@ -68,6 +67,7 @@ static struct option long_options[] = {
 	{(char*)"help",     no_argument,        0, 'h'},
 	{(char*)"across",   required_argument,  0, 'a'},
 	{(char*)"ebwt-ref", no_argument,        0, 'e'},
+	{(char*)"threads",  required_argument,  0, 'p'},
     {(char*)"wrapper",  required_argument,  0, ARG_WRAPPER},
     {(char*)"conversion-table", no_argument,  0, ARG_CONVERSION_TABLE},
     {(char*)"taxonomy-tree",    no_argument,  0, ARG_TAXONOMY_TREE},
@@ -103,6 +103,7 @@ static void printUsage(ostream& out) {
     << "  --taxonomy-tree    Print taxonomy tree" << endl
     << "  --name-table       Print names corresponding to taxonomic IDs" << endl
     << "  --size-table       Print the lengths of the sequences belonging to the same taxonomic ID" << endl
+	<< "  -p/--threads <int> # of threads restoring sequences & counting k-mers (1)" << endl
 	<< "  -v/--verbose       Verbose output (for debugging)" << endl
 	<< "  -h/--help          print detailed description of tool and its options" << endl
 	<< "  --help             print this usage message" << endl
@@ -177,6 +178,7 @@ static void parseOptions(int argc, char **argv) {
 			case 'n': names_only = true; break;
 			case 's': summarize_only = true; break;
 			case 'a': across = parseInt(-1, "-a/--across arg must be at least 1"); break;
+			case 'p': nthreads = parseInt(1, "-p/--threads arg must be at least 1"); break;
 			case -1: break; /* Done with options. */
 			case 0:
 				if (long_options[option_index].flag != 0)
@@ -200,49 +202,61 @@ static void print_fasta_record(
 		size_t i = 0;
 		while (i + across < seq.length())
 		{
-			fout << seq.substr(i, across).c_str() << endl;
+			fout.write(seq.data() + i, across);
+			fout << '\n';
 			i += across;
 		}
-		if (i < seq.length())
-			fout << seq.substr(i).c_str() << endl;
+		if (i < seq.length()) {
+			fout.write(seq.data() + i, seq.length() - i);
+			fout << '\n';
+		}
 	} else {
-		fout << seq.c_str() << endl;
+		fout << seq.c_str() << '\n';
 	}
 }
 
 /**
- * Counts the number of unique k-mers in the reference sequence
- * that's reconstructed from the index
+ * A run of fragments of the joined text whose k-mers are counted by one
+ * thread.  Runs break only between sequences, so no k-mer straddles two.
  */
-template<typename index_t, typename TStr>
-static uint64_t count_idx_kmers ( Ebwt<index_t>& ebwt)
-{
-	TStr cat_ref;
-	ebwt.restore(cat_ref);
-	cerr << "Index loaded" << endl;
-#ifdef TEST_KMER_COUNTING
-	std::set<uint64_t> my_set;
-#endif
-
-	HyperLogLogPlusMinus<uint64_t> kmer_counter(16);
-	uint64_t word = 0;
-	uint64_t curr_length = 0;
-	uint8_t k = 32;
+struct KmerCountParam {
+	const EList<pair<size_t, size_t> >*    runs;   // [first, last) fragment of each run
+	EList<HyperLogLogPlusMinus<uint64_t> >* counters; // one per run
+	const TIndexOffU*                      rstarts;
+	TIndexOffU                             nfrag;
+	TIndexOffU                             len;    // length of the joined text
+	const SString<char>*                   cat_ref;
+	size_t*                                cur;
+	MUTEX_T*                               mutex;
+};
 
-	TIndexOffU curr_ref = OFF_MASK;
-	TIndexOffU last_text_off = 0;
-	size_t orig_len = cat_ref.length();
-	TIndexOffU tlen = OFF_MASK;
-	bool first = true;
-
-	for(size_t i = 0; i < orig_len; i++) {
-		TIndexOffU tidx = OFF_MASK;
-		TIndexOffU textoff = OFF_MASK;
-		tlen = OFF_MASK;
-		bool straddled = false;
-		ebwt.joinedToTextOff(1 /* qlen */, (TIndexOffU)i, tidx, textoff, tlen, true, straddled);
-
-		if (tidx != OFF_MASK && textoff < tlen) {
+/**
+ * Count the k-mers of runs of fragments until there are none left.  The
+ * text offset of each position of a fragment follows from the fragment's
+ * entry in rstarts, so there's no search per position.
+ */
+static void count_kmers_worker(void *vp) {
+	KmerCountParam* param = (KmerCountParam*)vp;
+	const TIndexOffU* rstarts = param->rstarts;
+	const SString<char>& cat_ref = *param->cat_ref;
+	const uint8_t k = 32;
+	while(true) {
+		size_t r = 0;
+		{
+			ThreadSafe ts(param->mutex);
+			r = (*param->cur)++;
+		}
+		if(r >= param->runs->size()) break;
+		HyperLogLogPlusMinus<uint64_t>& kmer_counter = (*param->counters)[r];
+		uint64_t word = 0;
+		uint64_t curr_length = 0;
+		TIndexOffU curr_ref = OFF_MASK;
+		TIndexOffU last_text_off = 0;
+		bool first = true;
+		for(size_t f = (*param->runs)[r].first; f < (*param->runs)[r].second; f++) {
+			TIndexOffU lower = rstarts[f*3];
+			TIndexOffU upper = (f + 1 == param->nfrag) ? param->len : rstarts[(f+1)*3];
+			TIndexOffU tidx = rstarts[f*3+1];
 			if (curr_ref != tidx) {
 				// End of the sequence - reset word and counter
 				curr_ref = tidx;
@@ -250,46 +264,86 @@ static uint64_t count_idx_kmers ( Ebwt<index_t>& ebwt)
 				last_text_off = 0;
 				first = true;
 			}
-
-			TIndexOffU textoff_adj = textoff;
-			if(first && textoff > 0) textoff_adj++;
-			if (textoff_adj - last_text_off > 1) {
-				// there's an N - reset word and counter
-				word = 0; curr_length = 0;
-			}
-			// add another char.
-            int bp = (int)cat_ref[i];
-
-            // shift the first two bits off the word
-            word = word << 2;
-            // put the base-pair code from pos at that position
-            word |= bp;
-			++curr_length;
-			//cerr << "[" << i << "; " << curr_length << "; " << word << ":" << kmer_counter.cardinality()  << "]" << endl;
-			if (curr_length >= k) {
-				kmer_counter.add(word);
-#ifdef TEST_KMER_COUNTING
-				my_set.insert(word);
-				cerr << " " << kmer_counter.cardinality()  << " vs " << my_set.size() << endl;
-#endif
+			for(TIndexOffU i = lower, textoff = rstarts[f*3+2]; i < upper; i++, textoff++) {
+				TIndexOffU textoff_adj = textoff;
+				if(first && textoff > 0) textoff_adj++;
+				if (textoff_adj - last_text_off > 1) {
+					// there's an N - reset word and counter
+					word = 0; curr_length = 0;
+				}
+				// shift the first two bits off the word and put the
+				// base-pair code from pos at that position
+				word = (word << 2) | (int)cat_ref[i];
+				++curr_length;
+				if (curr_length >= k) {
+					kmer_counter.add(word);
+				}
+				last_text_off = textoff;
+				first = false;
 			}
+		}
+	}
+}
 
-			last_text_off = textoff;
-			first = false;
+/**
+ * Counts the number of unique k-mers in the reference sequence
+ * that's reconstructed from the index.  The sequences are split into
+ * runs counted by separate threads, and the counters are merged.
+ */
+template<typename index_t, typename TStr>
+static uint64_t count_idx_kmers ( Ebwt<index_t>& ebwt)
+{
+	TStr cat_ref;
+	ebwt.restore(cat_ref, nthreads);
+	cerr << "Index loaded" << endl;
 
+	// Cut the fragments into runs of about equal length, several per
+	// thread, ending each at the end of a sequence
+	const TIndexOffU* rstarts = ebwt.rstarts();
+	TIndexOffU nfrag = ebwt.nFrag();
+	TIndexOffU len = (TIndexOffU)cat_ref.length();
+	TIndexOffU runLen = len / (nthreads * 4) + 1;
+	EList<pair<size_t, size_t> > runs;
+	size_t runFirst = 0;
+	for(size_t f = 1; f <= nfrag; f++) {
+		if(f < nfrag &&
+		   (rstarts[f*3] - rstarts[runFirst*3] < runLen || rstarts[f*3+1] == rstarts[(f-1)*3+1]))
+		{
+			continue;
 		}
+		runs.push_back(make_pair(runFirst, f));
+		runFirst = f;
 	}
-	if (curr_length >= k) {
-		kmer_counter.add(word);
-#ifdef TEST_KMER_COUNTING
-		my_set.insert(word);
-#endif
+	EList<HyperLogLogPlusMinus<uint64_t> > counters;
+	counters.resize(runs.size());
+	for(size_t r = 0; r < counters.size(); r++) {
+		counters[r] = HyperLogLogPlusMinus<uint64_t>(16);
+	}
+	AutoArray<tthread::thread*> threads(nthreads);
+	EList<KmerCountParam> tparams;
+	tparams.resize(nthreads);
+	MUTEX_T mutex;
+	size_t cur = 0;
+	for(int tid = 0; tid < nthreads; tid++) {
+		tparams[tid].runs = &runs;
+		tparams[tid].counters = &counters;
+		tparams[tid].rstarts = rstarts;
+		tparams[tid].nfrag = nfrag;
+		tparams[tid].len = len;
+		tparams[tid].cat_ref = &cat_ref;
+		tparams[tid].cur = &cur;
+		tparams[tid].mutex = &mutex;
+		threads[tid] = new tthread::thread(count_kmers_worker, (void*)&tparams[tid]);
+	}
+	for(int tid = 0; tid < nthreads; tid++) {
+		threads[tid]->join();
+		delete threads[tid];
 	}
 
-#ifdef TEST_KMER_COUNTING
-	cerr << "Exact count: " << my_set.size() << endl;
-#endif
-
+	HyperLogLogPlusMinus<uint64_t> kmer_counter(16);
+	for(size_t r = 0; r < counters.size(); r++) {
+		kmer_counter.merge(&counters[r]);
+	}
 	return kmer_counter.cardinality();
 }
 
@@ -363,7 +417,8 @@ static void print_ref_sequences(
 
 /**
  * Given an index, reconstruct the reference by LF mapping through the
- * entire thing.
+ * entire thing.  Each sequence starts out as all Ns and has its
+ * fragments copied in at the text offsets rstarts gives for them.
  */
 template<typename index_t, typename TStr>
 static void print_index_sequences(ostream& fout, Ebwt<index_t>& ebwt)
@@ -371,58 +426,34 @@ static void print_index_sequences(ostream& fout, Ebwt<index_t>& ebwt)
 	EList<string>* refnames = &(ebwt.refnames());
 
 	TStr cat_ref;
-	ebwt.restore(cat_ref);
+	ebwt.restore(cat_ref, nthreads);
 
-	HyperLogLogPlusMinus<uint64_t> kmer_counter;
+	const TIndexOffU* rstarts = ebwt.rstarts();
+	TIndexOffU nfrag = ebwt.nFrag();
+	TIndexOffU len = (TIndexOffU)cat_ref.length();
 	TIndexOffU curr_ref = OFF_MASK;
-	string curr_ref_seq = "";
-	TIndexOffU curr_ref_len = OFF_MASK;
-	TIndexOffU last_text_off = 0;
-	size_t orig_len = cat_ref.length();
-	TIndexOffU tlen = OFF_MASK;
-	bool first = true;
-	for(size_t i = 0; i < orig_len; i++) {
-		TIndexOffU tidx = OFF_MASK;
-		TIndexOffU textoff = OFF_MASK;
-		tlen = OFF_MASK;
-		bool straddled = false;
-		ebwt.joinedToTextOff(1 /* qlen */, (TIndexOffU)i, tidx, textoff, tlen, true, straddled);
-
-		if (tidx != OFF_MASK && textoff < tlen)
+	string curr_ref_seq;
+	for(TIndexOffU f = 0; f < nfrag; f++) {
+		TIndexOffU lower = rstarts[f*3];
+		TIndexOffU upper = (f + 1 == nfrag) ? len : rstarts[(f+1)*3];
+		TIndexOffU tidx = rstarts[f*3+1];
+		TIndexOffU textoff = rstarts[f*3+2];
+		if (curr_ref != tidx)
 		{
-			if (curr_ref != tidx)
+			if (curr_ref != OFF_MASK)
 			{
-				if (curr_ref != OFF_MASK)
-				{
-					// Add trailing gaps, if any exist
-					if(curr_ref_seq.length() < curr_ref_len) {
-						curr_ref_seq += string(curr_ref_len - curr_ref_seq.length(), 'N');
-					}
-					print_fasta_record(fout, (*refnames)[curr_ref], curr_ref_seq);
-				}
-				curr_ref = tidx;
-				curr_ref_seq = "";
-				curr_ref_len = tlen;
-				last_text_off = 0;
-				first = true;
+				print_fasta_record(fout, (*refnames)[curr_ref], curr_ref_seq);
 			}
-
-			TIndexOffU textoff_adj = textoff;
-			if(first && textoff > 0) textoff_adj++;
-			if (textoff_adj - last_text_off > 1)
-				curr_ref_seq += string(textoff_adj - last_text_off - 1, 'N');
-
-            curr_ref_seq.push_back("ACGT"[int(cat_ref[i])]);			
-			last_text_off = textoff;
-			first = false;
+			curr_ref = tidx;
+			curr_ref_seq.assign(ebwt.plen()[tidx], 'N');
+		}
+		assert_leq(textoff + (upper - lower), curr_ref_seq.length());
+		for(TIndexOffU i = lower; i < upper; i++) {
+			curr_ref_seq[textoff++] = "ACGT"[int(cat_ref[i])];
 		}
 	}
 	if (curr_ref < refnames->size())
 	{
-		// Add trailing gaps, if any exist
-		if(curr_ref_seq.length() < curr_ref_len) {
-			curr_ref_seq += string(curr_ref_len - curr_ref_seq.length(), 'N');
-		}
 		print_fasta_record(fout, (*refnames)[curr_ref], curr_ref_seq);
 	}
 
@@ -520,10 +551,10 @@ static void driver(
                                             false);               // sanity check?        
         
         if(conversion_table) {
-            const EList<pair<string, uint64_t> >& uid_to_tid = ebwt.uid_to_tid();
+            const TaxRefTable& uid_to_tid = ebwt.uid_to_tid();
             for(size_t i = 0; i < uid_to_tid.size(); i++) {
-                uint64_t tid = uid_to_tid[i].second;
-                cout << uid_to_tid[i].first << "\t"
+                uint64_t tid = uid_to_tid.tid(i);
+                cout << uid_to_tid.uid(i) << "\t"
                      << (tid & 0xffffffff);
                 tid >>= 32;
                 if(tid > 0) {
@@ -532,25 +563,25 @@ static void driver(
                 cout << endl;
             }
         } else if(taxonomy_tree) {
-            const map<uint64_t, TaxonomyNode>& tree = ebwt.tree();
-            for(map<uint64_t, TaxonomyNode>::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
+            const TaxTreeTable& tree = ebwt.tree();
+            for(TaxTreeTable::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
                 string rank = get_tax_rank_string(itr->second.rank);
                 cout << itr->first << "\t|\t" << itr->second.parent_tid << "\t|\t" << rank << endl;
             }
         } else if(name_table) {
-            const std::map<uint64_t, string>& name_map = ebwt.name();
-            for(std::map<uint64_t, string>::const_iterator itr = name_map.begin(); itr != name_map.end(); itr++) {
-                uint64_t tid = itr->first;
+            const TaxNameTable& name_map = ebwt.name();
+            for(size_t i = 0; i < name_map.size(); i++) {
+                uint64_t tid = name_map.tid(i);
                 cout << (tid & 0xffffffff);
                 tid >>= 32;
                 if(tid > 0) {
                     cout << "." << tid;
                 }
-                cout << "\t" << itr->second << endl;
+                cout << "\t" << name_map.name(i) << endl;
             }
         } else if(size_table) {
-            const std::map<uint64_t, uint64_t>& size_map = ebwt.size();
-            for(std::map<uint64_t, uint64_t>::const_iterator itr = size_map.begin(); itr != size_map.end(); itr++) {
+            const TaxSizeTable& size_map = ebwt.size();
+            for(TaxSizeTable::const_iterator itr = size_map.begin(); itr != size_map.end(); itr++) {
                 uint64_t tid = itr->first;
                 uint64_t size = itr->second;
                 cout << (tid & 0xffffffff);
@@ -25,8 +25,16 @@
 #include <algorithm>
 #include <vector>
 #include "hi_aligner.h"
+#include "filebuf.h"
+#include "kmer_filter.h"
+#include "shard_spill.h"
+#include "threading.h"
 #include "util.h"
 
+// most read positions kept per candidate; the rest of a long read's hits
+// still count toward its score
+static const size_t MAX_READ_POSITIONS = 1024;
+
 template<typename index_t>
 struct HitCount {
     uint64_t uniqueID;
@@ -42,7 +50,7 @@ struct HitCount {
     uint32_t num_leaves;
     
     uint8_t rank;
-    EList<uint64_t> path;
+    TaxPath path;  // in the index's TaxonomyPathTable
     
     void reset() {
         uniqueID = taxID = count = score = timeStamp = 0;
@@ -51,7 +59,7 @@ struct HitCount {
         summedHitLens[0][0] = summedHitLens[0][1] = summedHitLens[1][0] = summedHitLens[1][1] = 0.0;
         readPositions.clear();
         rank = 0;
-        path.clear();
+        path = TaxPath();
         leaf = true;
         num_leaves = 1;
     }
@@ -60,6 +68,34 @@ struct HitCount {
         if(this == &o)
             return *this;
         
+        copyScalars(o);
+        readPositions = o.readPositions;
+        return *this;
+    }
+    
+    /**
+     * Like operator=, but take o's read positions instead of copying them,
+     * leaving o with this one's old list.  Used to fill a hole in a list
+     * of hits from its back without copying.
+     */
+    void moveFrom(HitCount& o) {
+        if(this == &o)
+            return;
+        copyScalars(o);
+        readPositions.swap(o.readPositions);
+    }
+    
+    /**
+     * Record that a hit of 'length' bases at 'offset' of the read counted
+     * toward this candidate.
+     */
+    void addReadPosition(uint32_t offset, uint32_t length) {
+        if(readPositions.size() < MAX_READ_POSITIONS) {
+            readPositions.push_back(make_pair(offset, length));
+        }
+    }
+    
+    void copyScalars(const HitCount& o) {
         uniqueID = o.uniqueID;
         taxID = o.taxID;
         count = o.count;
@@ -74,13 +110,10 @@ struct HitCount {
         summedHitLens[1][0] = o.summedHitLens[1][0];
         summedHitLens[1][1] = o.summedHitLens[1][1];
         timeStamp = o.timeStamp;
-        readPositions = o.readPositions;
         leaf = o.leaf;
         num_leaves = o.num_leaves;
         rank = o.rank;
         path = o.path;
-        
-        return *this;
     }
 
     void finalize(
@@ -120,6 +153,146 @@ struct HitCount {
     }
 };
 
+/**
+ * One window of a long read, searched as a read of its own by whichever
+ * thread claims it.  Only the hits that start (on the forward strand) in
+ * the first 'own' bases of the window are counted into 'hits'; those
+ * starting in the overlap with the next window are left to it.  Read
+ * positions in 'hits' are those in the whole mate.
+ */
+template<typename index_t>
+struct LongReadWindow {
+    Read     rd;        // the window's bases
+    int      rdi;       // mate the window is from
+    bool     nofw;
+    bool     norc;
+    index_t  off;       // where the window starts in the mate
+    index_t  own;       // count only hits starting in [0, own) of the window
+    index_t  shift[2];  // added to the offsets of forward and reverse-complement hits
+    uint32_t seed;      // seeds the window's RandomSource
+    EList<HitCount<index_t> > hits;
+};
+
+/**
+ * The windows of one long read or pair, posted to a LongReadPool by the
+ * thread that read it.
+ */
+template<typename index_t>
+struct LongReadJob {
+    LongReadJob() : nwins(0), next(0), nfinished(0) { }
+    
+    EList<LongReadWindow<index_t> > windows; // reused; only the first nwins are this read's
+    size_t nwins;
+    size_t next;      // first window no thread has claimed
+    size_t nfinished; // windows whose hits are in
+};
+
+/**
+ * Windows of long reads waiting to be searched.  The thread that reads a
+ * long read posts its windows here, and it and any thread between reads
+ * claim and search them; the posting thread waits for the last of them,
+ * then pools their hits.  Each window is searched the same way whichever
+ * thread claims it, so results don't depend on the number of threads.
+ */
+template<typename index_t>
+class LongReadPool {
+    
+public:
+    
+    LongReadPool(index_t window, index_t overlap, bool locked) :
+    _window(window),
+    _overlap(overlap),
+    _locked(locked),
+    _segments(NULL)
+    {
+        assert_gt(_window, _overlap);
+    }
+    
+    index_t window() const { return _window; }
+    index_t overlap() const { return _overlap; }
+    
+    /**
+     * Offer the windows of 'job' to all threads.
+     */
+    void post(LongReadJob<index_t>* job) {
+        assert_eq(job->next, 0);
+        assert_eq(job->nfinished, 0);
+        ThreadSafe ts(&_mutex, _locked);
+        _jobs.push_back(job);
+    }
+    
+    /**
+     * Claim a window no thread has claimed yet, from 'job' if it's not
+     * NULL and otherwise from the job posted first.  Returns NULL if
+     * there is none; otherwise 'from' is set to the window's job.
+     */
+    LongReadWindow<index_t>* claim(LongReadJob<index_t>* job, LongReadJob<index_t>*& from) {
+        ThreadSafe ts(&_mutex, _locked);
+        size_t j = 0;
+        if(job != NULL) {
+            while(j < _jobs.size() && _jobs[j] != job) j++;
+        }
+        if(j >= _jobs.size()) return NULL;
+        from = _jobs[j];
+        LongReadWindow<index_t>* w = &from->windows[from->next++];
+        if(from->next == from->nwins) {
+            // all claimed; no need to offer it any more
+            _jobs.erase(j);
+        }
+        return w;
+    }
+    
+    /**
+     * Note that a window claimed from 'job' has been searched.
+     */
+    void finish(LongReadJob<index_t>* job) {
+        ThreadSafe ts(&_mutex, _locked);
+        job->nfinished++;
+    }
+    
+    /**
+     * Return true iff all of the windows of 'job' have been searched.
+     */
+    bool done(LongReadJob<index_t>* job) {
+        ThreadSafe ts(&_mutex, _locked);
+        return job->nfinished == job->nwins;
+    }
+    
+    /**
+     * Write per-window assignments to 'out' (with --long-read-segments);
+     * the pool doesn't own it.
+     */
+    void setSegments(OutFileBuf* out) { _segments = out; }
+    bool segments() const { return _segments != NULL; }
+    
+    /**
+     * Append the lines of one read's windows to the segments file.
+     */
+    void writeSegments(const BTString& lines) {
+        assert(_segments != NULL);
+        ThreadSafe ts(&_mutex, _locked);
+        _segments->writeString(lines);
+    }
+    
+private:
+    
+    index_t                       _window;   // bases per window
+    index_t                       _overlap;  // bases shared by consecutive windows
+    bool                          _locked;   // more than one thread
+    EList<LongReadJob<index_t>*>  _jobs;     // jobs with unclaimed windows, oldest first
+    OutFileBuf*                   _segments; // NULL unless reporting windows
+    MUTEX_T                       _mutex;
+};
+
+/**
+ * When to stop searching the strand that is losing
+ */
+enum {
+    STRAND_PRUNE_OFF = 0, // search both strands to the end of the read
+    STRAND_PRUNE_BOUND,   // stop once the strand can't outscore the other
+    STRAND_PRUNE_LENGTH,  // stop once the strand trails by more than its remaining length
+};
+
 /**
  * With a hierarchical indexing, SplicedAligner provides several alignment strategies
  * , which enable effective alignment of RNA-seq reads
@@ -140,7 +313,18 @@ public:
                bool tree_traverse,
                const string& classification_rank,
                const EList<uint64_t>& hostGenomes,
-               const EList<uint64_t>& excluded_taxIDs) :
+               const EList<uint64_t>& excluded_taxIDs,
+               int strandPrune = STRAND_PRUNE_OFF,
+               const KmerFilter* prefilter = NULL,
+               const KmerFilter* hostFilter = NULL,
+               uint64_t hostFilterTaxID = 0,
+               double hostMinFrac = 0.5,
+               ShardSpill* spillOut = NULL,
+               const EList<ShardSpill*>* spillIn = NULL,
+               const EList<uint64_t>* spillUidOff = NULL,
+               LongReadPool<index_t>* longReads = NULL,
+               size_t mateCandidates = 0,
+               StageMetrics* stages = NULL) :
     HI_Aligner<index_t, local_index_t>(
                                        ebwt,
                                        0,    // don't make use of splice sites found by earlier reads
@@ -149,15 +333,28 @@ public:
     _minHitLen(minHitLen),
     _mate1fw(mate1fw),
     _mate2fw(mate2fw),
-    _tree_traverse(tree_traverse)
+    _tree_traverse(tree_traverse),
+    _strandPrune(strandPrune),
+    _prefilter(prefilter),
+    _hostFilter(hostFilter),
+    _hostFilterTaxID(hostFilterTaxID),
+    _hostMinFrac(hostMinFrac),
+    _spillOut(spillOut),
+    _spillIn(spillIn),
+    _spillUidOff(spillUidOff),
+    _longReads(longReads),
+    _mateCandidates(mateCandidates),
+    _restrictMate(false),
+    _stages(stages)
     {
+        _posShift[0] = _posShift[1] = 0;
         _classification_rank = get_tax_rank_id(classification_rank.c_str());
         _classification_rank = TaxonomyPathTable::rank_to_pathID(_classification_rank);
         
-        const map<uint64_t, TaxonomyNode>& tree = ebwt.tree();
+        const TaxTreeTable& tree = ebwt.tree();
         _host_taxIDs.clear();
         if(hostGenomes.size() > 0) {
-            for(map<uint64_t, TaxonomyNode>::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
+            for(TaxTreeTable::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
                 uint64_t tmp_taxID = itr->first;
                 while(true) {
                     bool found = false;
@@ -169,7 +366,7 @@ public:
                         }
                     }
                     if(found) break;
-                    map<uint64_t, TaxonomyNode>::const_iterator itr2 = tree.find(tmp_taxID);
+                    TaxTreeTable::const_iterator itr2 = tree.find(tmp_taxID);
                     if(itr2 == tree.end()) break;
                     const TaxonomyNode& node = itr2->second;
                     if(tmp_taxID == node.parent_tid) break;
@@ -180,7 +377,7 @@ public:
         
         _excluded_taxIDs.clear();
         if(excluded_taxIDs.size() > 0) {
-            for(map<uint64_t, TaxonomyNode>::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
+            for(TaxTreeTable::const_iterator itr = tree.begin(); itr != tree.end(); itr++) {
                 uint64_t tmp_taxID = itr->first;
                 while(true) {
                     bool found = false;
@@ -192,7 +389,7 @@ public:
                         }
                     }
                     if(found) break;
-                    map<uint64_t, TaxonomyNode>::const_iterator itr2 = tree.find(tmp_taxID);
+                    TaxTreeTable::const_iterator itr2 = tree.find(tmp_taxID);
                     if(itr2 == tree.end()) break;
                     if(tmp_taxID == itr2->second.parent_tid) break;
                     tmp_taxID = itr2->second.parent_tid;
@@ -212,7 +409,7 @@ public:
     int go(
            const Scoring&           sc,
            const Ebwt<index_t>&     ebwtFw,
-           const Ebwt<index_t>&     ebwtBw,
+           const Ebwt<index_t>*     ebwtBw,  // mirror index, or NULL
            const BitPairReference&  ref,
            WalkMetrics&             wlm,
            PerReadMetrics&          prm,
@@ -223,160 +420,94 @@ public:
     {
         _hitMap.clear();
         
+        // screen out host reads before searching the index at all; when
+        // spilling, that is left to the pass over the last shard
+        if(_hostFilter != NULL && _spillOut == NULL && screenHost(ebwtFw, him, sink)) {
+            return 0;
+        }
+        
         const index_t increment = (2 * _minHitLen <= 33) ? 10 : (2 * _minHitLen - 33);
         const ReportingParams& rp = sink.reportingParams();
         index_t maxGenomeHitSize = rp.khits;
 		bool isFw = false;
         
+        // in long-read mode, a read or pair with a mate longer than the
+        // window is searched one window at a time, by any thread
+        bool windowed = false;
+        for(int rdi = 0; _longReads != NULL && rdi < (this->_paired ? 2 : 1); rdi++) {
+            windowed |= (this->_rds[rdi]->length() > _longReads->window());
+        }
+        
         //
         uint32_t ts = 0; // time stamp
         // for each mate. only called once for unpaired data
-        for(int rdi = 0; rdi < (this->_paired ? 2 : 1); rdi++) {
+        for(int rdi = 0; rdi < (this->_paired ? 2 : 1) && !windowed; rdi++) {
             assert(this->_rds[rdi] != NULL);
             
+            // see if mate 2 can be restricted to the candidates of mate 1
+            index_t maxGenomeHitSize1 = maxGenomeHitSize;
+            _restrictMate = (rdi == 1 && _mateCandidates > 0 &&
+                             _hitMap.size() > 0 && _hitMap.size() <= _mateCandidates);
+            
+            // a read none of whose k-mers is in the reference can't have a
+            // hit of _minHitLen or more, so leave its hits empty
+            bool rejected = false;
+            if(_prefilter != NULL) {
+                him.prefiltertests++;
+                if(!_prefilter->anyKmer(this->_rds[rdi]->patFw)) {
+                    him.prefilterrej++;
+                    this->_hits[rdi][0].done(true);
+                    this->_hits[rdi][1].done(true);
+                    rejected = true;
+                }
+            }
+            
             // search for partial hits on the forward and reverse strand (saved in this->_hits[rdi])
-            searchForwardAndReverse(rdi, ebwtFw, sc, rnd, rp, increment);
+            if(!rejected) {
+                StageTimer t(_stages, STAGE_SEARCH);
+                uint64_t bwops = this->bwops_;
+                searchForwardAndReverse(rdi, ebwtFw, ebwtBw, sc, rnd, rp, increment);
+                if(_stages != NULL) _stages->lfops += this->bwops_ - bwops;
+            }
             
-            // get forward or reverse hits for this read from this->_hits[rdi]
-            //  the strand is chosen based on higher average hit length in either direction
-            pair<int, int> fwp = getForwardOrReverseHit(rdi);
-            for(int fwi = fwp.first; fwi < fwp.second; fwi++) {
-                ReadBWTHit<index_t>& hit = this->_hits[rdi][fwi];
-                assert(hit.done());
-                isFw = hit._fw;  // TODO: Sync between mates!
-                
-                // choose candidate partial alignments for further alignment
-                index_t offsetSize = hit.offsetSize();
-                this->_genomeHits.clear();
-                
-                // sort partial hits by size (number of genome positions), ascending, and then length, descending
-                for(size_t hi = 0; hi < offsetSize; hi++) {
-                    const BWTHit<index_t> partialHit = hit.getPartialHit(hi);
-#ifdef LI_DEBUG
-                    cout << partialHit.len() << " " << partialHit.size() << endl;
-#endif
-                    if(partialHit.len() >= _minHitLen && partialHit.size() > maxGenomeHitSize) {
-                        maxGenomeHitSize = partialHit.size();
-                    }
+            index_t rdlen = (index_t)this->_rds[rdi]->length();
+            addPartialHits(rdi, ebwtFw, ref, rnd, rp, wlm, prm, him, 0, rdlen, maxGenomeHitSize, ts, isFw);
+            
+            if(_restrictMate) {
+                _restrictMate = false;
+                him.materestricts++;
+                bool matched = false;
+                for(size_t i = 0; i < _hitMap.size() && !matched; i++) {
+                    matched = (_hitMap[i].scores[1][0] > 0 || _hitMap[i].scores[1][1] > 0);
                 }
-                
-                if(maxGenomeHitSize > (index_t)rp.khits) {
-                    maxGenomeHitSize += rp.khits;
+                if(!matched) {
+                    // mate 2 hit none of mate 1's candidates, so nothing
+                    // was added; count its hits again without restriction,
+                    // resolving those whose walk was cut short
+                    him.materestrictfbs++;
+                    maxGenomeHitSize = maxGenomeHitSize1;
+                    addPartialHits(rdi, ebwtFw, ref, rnd, rp, wlm, prm, him, 0, rdlen, maxGenomeHitSize, ts, isFw, true);
                 }
-                
-                hit._partialHits.sort(compareBWTHits());
-                size_t usedPortion = 0;
-                size_t genomeHitCnt = 0;
-                for(size_t hi = 0; hi < offsetSize; hi++, ts++) {
-                    const BWTHit<index_t>& partialHit = hit.getPartialHit(hi);
-                    size_t partialHitLen = partialHit.len();
-                    if(partialHitLen <= _minHitLen) continue;                    
-                    if(partialHit.size() == 0) continue;
-                    
-                    // only keep this partial hit if it is equal to or bigger than minHitLen (default: 22 bp)
-                    // TODO: consider not requiring minHitLen when we have already hits to the same genome
-                    bool considerOnlyIfPreviouslyObserved = partialHitLen < _minHitLen;
-                    
-                    // get all coordinates of the hit
-                    EList<Coord>& coords = getCoords(
-                                                     hit,
-                                                     hi,
-                                                     ebwtFw,
-                                                     ref,
-                                                     rnd,
-                                                     maxGenomeHitSize,
-                                                     wlm,
-                                                     prm,
-                                                     him);
-                    if(coords.empty())
-                        continue;
-                    
-                    usedPortion += partialHitLen;
-                    assert_gt(coords.size(), 0);
-                    
-                    // the maximum number of hits per read is maxGenomeHitSize (change with parameter -k)
-                    size_t nHitsToConsider = coords.size();
-                    if(coords.size() > rp.ihits) {
-                        continue;
-                    }
-
-                    // find the genome id for all coordinates, and count the number of genomes
-                    EList<pair<uint64_t, uint64_t> > coord_ids;
-                    for(index_t k = 0; k < nHitsToConsider; k++, genomeHitCnt++) {
-                        const Coord& coord = coords[k];
-                        assert_lt(coord.ref(), _refnames.size()); // gives a warning - coord.ref() is signed integer. why?
-                        
-                        // extract numeric id from refName
-                        const EList<pair<string, uint64_t> >& uid_to_tid = ebwtFw.uid_to_tid();
-                        assert_lt(coord.ref(), uid_to_tid.size());
-                        uint64_t taxID = uid_to_tid[coord.ref()].second;
-                        bool found = false;
-                        for(index_t k2 = 0; k2 < coord_ids.size(); k2++) {
-                            // count the genome if it is not in coord_ids, yet
-                            if(coord_ids[k2].first == (uint64_t)coord.ref()) {
-                                found = true;
-                                break;
-                            }
-                        }
-                        if(found) continue;
-                        // add to coord_ids
-                        coord_ids.expand();
-                        coord_ids.back().first = coord.ref();
-                        coord_ids.back().second = taxID;
-                    }
-                    
-                    ASSERT_ONLY(size_t n_genomes = coord_ids.size());
-                    // scoring function: calculate the weight of this partial hit
-                    assert_gt(partialHitLen, 15);
-                    assert_gt(n_genomes, 0);
-                    uint32_t partialHitScore = (uint32_t)((partialHitLen - 15) * (partialHitLen - 15)) ; // / n_genomes;
-                    double weightedHitLen = double(partialHitLen) ; // / double(n_genomes) ;
-                    
-                    // go through all coordinates reported for partial hit
-                    for(index_t k = 0; k < coord_ids.size(); ++k) {
-                        uint64_t uniqueID = coord_ids[k].first;
-                        uint64_t taxID = coord_ids[k].second;
-                        if(_excluded_taxIDs.find(taxID) != _excluded_taxIDs.end())
-                            break;
-                        // add hit to genus map and get new index in the map
-                        size_t idx = addHitToHitMap(
-                                                    ebwtFw,
-                                                    _hitMap,
-                                                    rdi,
-                                                    fwi,
-                                                    uniqueID,
-                                                    taxID,
-                                                    ts,
-                                                    partialHitScore,
-                                                    weightedHitLen,
-                                                    considerOnlyIfPreviouslyObserved,
-                                                    partialHit._bwoff,
-                                                    partialHit.len());
-                        
-                        //if considerOnlyIfPreviouslyObserved and it was not found, genus Idx size is equal to the genus Map size
-                        if(idx >= _hitMap.size()) {
-                            continue;
-                        }
-                        
-#ifdef FLORIAN_DEBUG
-                        std::cerr << speciesID << ';';
-#endif
-                    }
-                    
-                    if(genomeHitCnt >= maxGenomeHitSize)
-                        break;
-                    
-#ifdef FLORIAN_DEBUG
-                    std::cerr << "  partialHits-done";
-#endif
-                } // partialHits
-            } // fwi
+            }
             
 #ifdef FLORIAN_DEBUG
             std::cerr << "  rdi-done" << endl;
 #endif
         } // rdi
         
+        if(windowed) {
+            searchWindows(sc, ebwtFw, ebwtBw, ref, wlm, prm, him, rnd, rp, isFw);
+        }
+        
+        if(_spillOut != NULL) {
+            // not the last shard; report nothing until then
+            spillHits(sink.rdid(), isFw);
+            return 0;
+        }
+        if(_spillIn != NULL) {
+            mergeSpilledHits(ebwtFw, sink.rdid(), isFw);
+        }
+        
         for(size_t i = 0; i < _hitMap.size(); i++) {
             _hitMap[i].finalize(this->_paired, this->_mate1fw, this->_mate2fw);
         }
@@ -397,6 +528,7 @@ public:
         // If the number of hits is more than -k,
         //   traverse up the taxonomy tree to reduce the number
         if (!only_host_taxIDs && _hitMap.size() > (size_t)rp.khits) {
+            StageTimer t(_stages, STAGE_TREE);
             // Count the number of the best hits
             uint32_t best_score = _hitMap[0].score;
             for(size_t i = 1; i < _hitMap.size(); i++) {
@@ -409,7 +541,7 @@ public:
             for(int i = 0; i < (int)_hitMap.size(); i++) {
                 if(_hitMap[i].score < best_score) {
                     if(i + 1 < _hitMap.size()) {
-                        _hitMap[i] = _hitMap.back();
+                        _hitMap[i].moveFrom(_hitMap.back());
                     }
                     _hitMap.pop_back();
                     i--;
@@ -427,6 +559,7 @@ public:
             uint8_t rank = 0;
             while(_hitMap.size() > (size_t)rp.khits) {
                 _hitTaxCount.clear();
+                _hitParents.clear();
                 for(size_t i = 0; i < _hitMap.size(); i++) {
                     while(_hitMap[i].rank < rank) {
                         if(_hitMap[i].rank + 1 >= _hitMap[i].path.size()) {
@@ -442,19 +575,17 @@ public:
                     uint64_t parent_taxID = (rank + 1 >= _hitMap[i].path.size() ? 1 : _hitMap[i].path[rank + 1]);
                     // Traverse up the tree more until we get non-zero taxID.
                     if(parent_taxID == 0) continue;
-                    
-                    size_t j = 0;
-                    for(; j < _hitTaxCount.size(); j++) {
-                        if(_hitTaxCount[j].second == parent_taxID) {
-                            _hitTaxCount[j].first += 1;
-                            break;
-                        }
-                    }
-                    if(j == _hitTaxCount.size()) {
-                        _hitTaxCount.expand();
-                        _hitTaxCount.back().first = 1;
-                        _hitTaxCount.back().second = parent_taxID;
-                    }
+                    _hitParents.push_back(make_pair(parent_taxID, (uint32_t)i));
+                }
+                // count the hits under each parent
+                _hitParents.sort();
+                for(size_t k = 0; k < _hitParents.size();) {
+                    size_t k2 = k + 1;
+                    while(k2 < _hitParents.size() && _hitParents[k2].first == _hitParents[k].first) k2++;
+                    _hitTaxCount.expand();
+                    _hitTaxCount.back().first = (uint32_t)(k2 - k);
+                    _hitTaxCount.back().second = _hitParents[k].first;
+                    k = k2;
                 }
                 if(_hitTaxCount.size() <= 0) {
                     if(rank < _hitMap[0].path.size()) {
@@ -465,46 +596,19 @@ public:
                     }
                 }
                 _hitTaxCount.sort();
+                // hits are known by their index at the start of this rank
+                // (their id) while merging moves them around
+                _hitTaxIDs.clear();
+                _id2pos.resize(_hitMap.size());
+                _pos2id.resize(_hitMap.size());
+                for(size_t i = 0; i < _hitMap.size(); i++) {
+                    _hitTaxIDs.push_back(make_pair(_hitMap[i].taxID, (uint32_t)i));
+                    _id2pos[i] = _pos2id[i] = (uint32_t)i;
+                }
+                _hitTaxIDs.sort();
                 size_t j = _hitTaxCount.size();
                 while(j-- > 0) {
-                    uint64_t parent_taxID = _hitTaxCount[j].second;
-                    int64_t max_score = 0;
-                    for(size_t i = 0; i < _hitMap.size(); i++) {
-                        assert_geq(_hitMap[i].rank, rank);
-                        if(_hitMap[i].rank != rank) continue;
-                        uint64_t cur_parent_taxID = (rank + 1 >= _hitMap[i].path.size() ? 1 : _hitMap[i].path[rank + 1]);
-                        if(parent_taxID == cur_parent_taxID) {
-                            _hitMap[i].uniqueID = std::numeric_limits<uint64_t>::max();
-                            _hitMap[i].rank = rank + 1;
-                            _hitMap[i].taxID = parent_taxID;
-                            _hitMap[i].leaf = false;
-                        }
-                        if(parent_taxID == _hitMap[i].taxID) {
-                            if(_hitMap[i].score > max_score) {
-                                max_score = _hitMap[i].score;
-                            }
-                        }
-                    }
-                    
-                    bool first = true;
-                    size_t rep_i = _hitMap.size();
-                    for(size_t i = 0; i < _hitMap.size(); i++) {
-                        if(parent_taxID == _hitMap[i].taxID) {
-                            if(!first) {
-                                assert_lt(rep_i, _hitMap.size());
-                                _hitMap[rep_i].num_leaves += _hitMap[i].num_leaves;
-                                if(i + 1 < _hitMap.size()) {
-                                    _hitMap[i] = _hitMap.back();
-                                }
-                                _hitMap.pop_back();
-                                i--;
-                            } else {
-                                first = false;
-                                rep_i = i;
-                            }
-                        }
-                    }
-                    
+                    mergeIntoParent(_hitTaxCount[j].second, rank);
                     if(_hitMap.size() <= (size_t)rp.khits)
                         break;
                 }
@@ -528,10 +632,10 @@ public:
 #endif
         
         index_t rdlen = this->_rds[0]->length();
-        int64_t max_score = (rdlen > 15 ? (rdlen - 15) * (rdlen - 15) : 0);
+        int64_t max_score = (rdlen > 15 ? (int64_t)(rdlen - 15) * (rdlen - 15) : 0);
         if(this->_paired) {
             rdlen = this->_rds[1]->length();
-            max_score += (rdlen > 15 ? (rdlen - 15) * (rdlen - 15) : 0);
+            max_score += (rdlen > 15 ? (int64_t)(rdlen - 15) * (rdlen - 15) : 0);
         }
         
       	bool reported = false ; 
@@ -542,19 +646,19 @@ public:
                 if(_host_taxIDs.find(_hitMap[gi].taxID) == _host_taxIDs.end())
                     continue;
             }
-            const EList<pair<string, uint64_t> >& uid_to_tid = ebwtFw.uid_to_tid();
-            const std::map<uint64_t, TaxonomyNode>& tree = ebwtFw.tree();
+            const TaxRefTable& uid_to_tid = ebwtFw.uid_to_tid();
+            const TaxTreeTable& tree = ebwtFw.tree();
             uint8_t taxRank = RANK_UNKNOWN;
-            std::map<uint64_t, TaxonomyNode>::const_iterator itr = tree.find(hitCount.taxID);
+            TaxTreeTable::const_iterator itr = tree.find(hitCount.taxID);
             if(itr != tree.end()) {
                 taxRank = itr->second.rank;
             }
             // report
-            AlnRes rs;
+            AlnRes& rs = _rs;
             rs.init(
                     hitCount.score,
                     max_score,
-                    hitCount.uniqueID < uid_to_tid.size() ? uid_to_tid[hitCount.uniqueID].first : get_tax_rank_string(taxRank),
+                    hitCount.uniqueID < uid_to_tid.size() ? uid_to_tid.uid(hitCount.uniqueID) : get_tax_rank_string(taxRank),
                     hitCount.taxID,
                     taxRank,
                     hitCount.summedHitLen,
@@ -570,6 +674,570 @@ public:
 	return 0;
     }
     
+    /**
+     * Raise the hits at 'rank' whose parent is 'parent_taxID' to the
+     * parent, then merge all hits now at the parent into the first of
+     * them, filling the holes from the back of _hitMap.  Only the hits
+     * under or at the parent are visited, via _hitParents and _hitTaxIDs
+     * (sorted (taxID, id) lists made at the start of the rank) and
+     * _id2pos, so the reduction takes O(n log n) time per rank instead of
+     * O(n) per parent.
+     */
+    void mergeIntoParent(uint64_t parent_taxID, uint8_t rank) {
+        const uint32_t removed = std::numeric_limits<uint32_t>::max();
+        _matchPos.clear();
+        size_t k = lowerBound(_hitParents, parent_taxID);
+        for(; k < _hitParents.size() && _hitParents[k].first == parent_taxID; k++) {
+            uint32_t pos = _id2pos[_hitParents[k].second];
+            if(pos == removed) continue;
+            HitCount<index_t>& hit = _hitMap[pos];
+            if(hit.rank != rank) continue;
+            hit.uniqueID = std::numeric_limits<uint64_t>::max();
+            hit.rank = rank + 1;
+            hit.taxID = parent_taxID;
+            hit.leaf = false;
+            _matchPos.push_back(pos);
+        }
+        k = lowerBound(_hitTaxIDs, parent_taxID);
+        for(; k < _hitTaxIDs.size() && _hitTaxIDs[k].first == parent_taxID; k++) {
+            uint32_t pos = _id2pos[_hitTaxIDs[k].second];
+            if(pos == removed || _hitMap[pos].taxID != parent_taxID) continue;
+            _matchPos.push_back(pos);
+        }
+        if(_matchPos.size() <= 1) return;
+        _matchPos.sort();
+        size_t nmatch = 1;
+        for(size_t m = 1; m < _matchPos.size(); m++) {
+            if(_matchPos[m] != _matchPos[nmatch - 1]) _matchPos[nmatch++] = _matchPos[m];
+        }
+        _matchPos.resize(nmatch);
+        
+        // Remove the matches after the first in order of position.  A
+        // match moved from the back into a hole is removed in turn.
+        size_t rep_i = _matchPos[0];
+        size_t lo = 1, hi = _matchPos.size() - 1;
+        while(lo <= hi) {
+            size_t i = _matchPos[lo];
+            size_t last = _hitMap.size() - 1;
+            _hitMap[rep_i].num_leaves += _hitMap[i].num_leaves;
+            _id2pos[_pos2id[i]] = removed;
+            if(i == last) {
+                _hitMap.pop_back();
+                break;
+            }
+            bool backMatches = (_matchPos[hi] == last);
+            _hitMap[i].moveFrom(_hitMap.back());
+            _pos2id[i] = _pos2id[last];
+            _id2pos[_pos2id[i]] = (uint32_t)i;
+            _hitMap.pop_back();
+            if(backMatches) {
+                hi--;
+            } else {
+                lo++;
+            }
+        }
+    }
+    
+    /**
+     * Index of the first element of a list sorted by taxID whose taxID is
+     * not less than 'taxID'.
+     */
+    static size_t lowerBound(const EList<pair<uint64_t, uint32_t> >& l, uint64_t taxID) {
+        size_t lo = 0, hi = l.size();
+        while(lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if(l[mid].first < taxID) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+    
+    /**
+     * Add the partial hits found for mate 'rdi' that start (on the
+     * forward strand of the mate) in [winBeg, winEnd) to _hitMap.  Only a
+     * long-read window leaves some of them out, those in its overlap with
+     * the next window.
+     */
+    void addPartialHits(
+                        int                     rdi,
+                        const Ebwt<index_t>&    ebwtFw,
+                        const BitPairReference& ref,
+                        RandomSource&           rnd,
+                        const ReportingParams&  rp,
+                        WalkMetrics&            wlm,
+                        PerReadMetrics&         prm,
+                        HIMetrics&              him,
+                        index_t                 winBeg,
+                        index_t                 winEnd,
+                        index_t&                maxGenomeHitSize,
+                        uint32_t&               ts,
+                        bool&                   isFw,
+                        bool                    sorted = false) // hits sorted by an earlier pass
+    {
+        index_t rdlen = (index_t)this->_rds[rdi]->length();
+        // get forward or reverse hits for this read from this->_hits[rdi]
+        //  the strand is chosen based on higher average hit length in either direction
+        pair<int, int> fwp = getForwardOrReverseHit(rdi);
+        for(int fwi = fwp.first; fwi < fwp.second; fwi++) {
+            ReadBWTHit<index_t>& hit = this->_hits[rdi][fwi];
+            assert(hit.done());
+            isFw = hit._fw;  // TODO: Sync between mates!
+            
+            // choose candidate partial alignments for further alignment
+            index_t offsetSize = hit.offsetSize();
+            this->_genomeHits.clear();
+            
+            // sort partial hits by size (number of genome positions), ascending, and then length, descending
+            for(size_t hi = 0; hi < offsetSize; hi++) {
+                const BWTHit<index_t> partialHit = hit.getPartialHit(hi);
+#ifdef LI_DEBUG
+                cout << partialHit.len() << " " << partialHit.size() << endl;
+#endif
+                if(!inWindow(hit, partialHit, rdlen, winBeg, winEnd)) continue;
+                if(partialHit.len() >= _minHitLen && partialHit.size() > maxGenomeHitSize) {
+                    maxGenomeHitSize = partialHit.size();
+                }
+            }
+            
+            if(maxGenomeHitSize > (index_t)rp.khits) {
+                maxGenomeHitSize += rp.khits;
+            }
+            
+            if(!sorted) {
+                hit._partialHits.sort(compareBWTHits());
+            }
+            size_t genomeHitCnt = 0;
+            for(size_t hi = 0; hi < offsetSize; hi++, ts++) {
+                const BWTHit<index_t>& partialHit = hit.getPartialHit(hi);
+                size_t partialHitLen = partialHit.len();
+                if(partialHitLen <= _minHitLen) continue;                    
+                if(partialHit.size() == 0) continue;
+                if(!inWindow(hit, partialHit, rdlen, winBeg, winEnd)) continue;
+                size_t rdoff = partialHit._bwoff + _posShift[hit._fw ? 0 : 1];
+
+                // only keep this partial hit if it is equal to or bigger than minHitLen (default: 22 bp)
+                // TODO: consider not requiring minHitLen when we have already hits to the same genome
+                bool considerOnlyIfPreviouslyObserved = _restrictMate || partialHitLen < _minHitLen;
+                
+                // the number of coordinates a full walk of the hit resolves;
+                // with too many the hit is skipped, so don't walk it
+                index_t nelt = min<index_t>(partialHit.size(), maxGenomeHitSize - (index_t)this->_genomeHits.size());
+                if(nelt > rp.ihits) {
+                    continue;
+                }
+                
+                // get all coordinates of the hit (with _restrictMate, only
+                // those up to the last candidate found)
+                EList<Coord>& coords = getCoords(
+                                                 hit,
+                                                 hi,
+                                                 ebwtFw,
+                                                 ref,
+                                                 rnd,
+                                                 maxGenomeHitSize,
+                                                 wlm,
+                                                 prm,
+                                                 him);
+                if(coords.empty())
+                    continue;
+                
+                assert_gt(coords.size(), 0);
+                assert_leq(coords.size(), nelt);
+                
+                // the maximum number of hits per read is maxGenomeHitSize (change with parameter -k)
+                size_t nHitsToConsider = coords.size();
+                genomeHitCnt += nelt;
+
+                // find the genome id for all coordinates, and count the number of genomes
+                EList<pair<uint64_t, uint64_t> >& coord_ids = _coordIDs;
+                coord_ids.clear();
+                for(index_t k = 0; k < nHitsToConsider; k++) {
+                    const Coord& coord = coords[k];
+                    assert_lt(coord.ref(), _refnames.size()); // gives a warning - coord.ref() is signed integer. why?
+                    
+                    // extract numeric id from refName
+                    const TaxRefTable& uid_to_tid = ebwtFw.uid_to_tid();
+                    assert_lt(coord.ref(), uid_to_tid.size());
+                    uint64_t taxID = uid_to_tid.tid(coord.ref());
+                    bool found = false;
+                    for(index_t k2 = 0; k2 < coord_ids.size(); k2++) {
+                        // count the genome if it is not in coord_ids, yet
+                        if(coord_ids[k2].first == (uint64_t)coord.ref()) {
+                            found = true;
+                            break;
+                        }
+                    }
+                    if(found) continue;
+                    // add to coord_ids
+                    coord_ids.expand();
+                    coord_ids.back().first = coord.ref();
+                    coord_ids.back().second = taxID;
+                }
+                
+                ASSERT_ONLY(size_t n_genomes = coord_ids.size());
+                // scoring function: calculate the weight of this partial hit
+                assert_gt(partialHitLen, 15);
+                assert_gt(n_genomes, 0);
+                uint32_t partialHitScore = (uint32_t)((partialHitLen - 15) * (partialHitLen - 15)) ; // / n_genomes;
+                double weightedHitLen = double(partialHitLen) ; // / double(n_genomes) ;
+                
+                // go through all coordinates reported for partial hit
+                for(index_t k = 0; k < coord_ids.size(); ++k) {
+                    uint64_t uniqueID = coord_ids[k].first;
+                    uint64_t taxID = coord_ids[k].second;
+                    if(_excluded_taxIDs.find(taxID) != _excluded_taxIDs.end())
+                        break;
+                    // add hit to genus map and get new index in the map
+                    size_t idx = addHitToHitMap(
+                                                ebwtFw,
+                                                _hitMap,
+                                                rdi,
+                                                fwi,
+                                                uniqueID,
+                                                taxID,
+                                                ts,
+                                                partialHitScore,
+                                                weightedHitLen,
+                                                considerOnlyIfPreviouslyObserved,
+                                                rdoff,
+                                                partialHit.len());
+                    
+                    //if considerOnlyIfPreviouslyObserved and it was not found, genus Idx size is equal to the genus Map size
+                    if(idx >= _hitMap.size()) {
+                        continue;
+                    }
+                    
+#ifdef FLORIAN_DEBUG
+                    std::cerr << speciesID << ';';
+#endif
+                }
+                
+                if(genomeHitCnt >= maxGenomeHitSize)
+                    break;
+                
+#ifdef FLORIAN_DEBUG
+                std::cerr << "  partialHits-done";
+#endif
+            } // partialHits
+        } // fwi
+    }
+    
+    /**
+     * Return true iff 'partialHit' of 'hit' starts in [winBeg, winEnd) of
+     * the forward strand of its 'rdlen'-long mate.  Offsets of partial hits
+     * count from the right end of the strand searched.
+     */
+    static bool inWindow(
+                         const ReadBWTHit<index_t>& hit,
+                         const BWTHit<index_t>&     partialHit,
+                         index_t                    rdlen,
+                         index_t                    winBeg,
+                         index_t                    winEnd)
+    {
+        if(winBeg == 0 && winEnd >= rdlen) return true;
+        index_t fwoff = hit._fw ? rdlen - partialHit._bwoff - partialHit._len : partialHit._bwoff;
+        return fwoff >= winBeg && fwoff < winEnd;
+    }
+    
+    /**
+     * Search the windows of long reads posted by any thread until none
+     * is left unclaimed.  Called by each thread between reads.
+     */
+    void helpLongReads(
+                       const Scoring&           sc,
+                       const Ebwt<index_t>&     ebwtFw,
+                       const Ebwt<index_t>*     ebwtBw,
+                       const BitPairReference&  ref,
+                       WalkMetrics&             wlm,
+                       PerReadMetrics&          prm,
+                       HIMetrics&               him,
+                       const ReportingParams&   rp)
+    {
+        if(_longReads == NULL) return;
+        LongReadJob<index_t>* from = NULL;
+        LongReadWindow<index_t>* w = NULL;
+        while((w = _longReads->claim(NULL, from)) != NULL) {
+            searchWindow(*w, sc, ebwtFw, ebwtBw, ref, wlm, prm, him, rp);
+            _longReads->finish(from);
+        }
+    }
+    
+    /**
+     * Search the current read or pair one window at a time: cut its mates
+     * into windows overlapping by the pool's overlap, post them for any
+     * thread to search, search them along with the others, then pool the
+     * candidates of all windows in _hitMap in window order.
+     */
+    void searchWindows(
+                       const Scoring&           sc,
+                       const Ebwt<index_t>&     ebwtFw,
+                       const Ebwt<index_t>*     ebwtBw,
+                       const BitPairReference&  ref,
+                       WalkMetrics&             wlm,
+                       PerReadMetrics&          prm,
+                       HIMetrics&               him,
+                       RandomSource&            rnd,
+                       const ReportingParams&   rp,
+                       bool&                    isFw)
+    {
+        assert(_longReads != NULL);
+        // searching a window replaces the read; keep it to put back
+        Read* rds[2] = { this->_rds[0], this->_rds[1] };
+        bool paired = this->_paired, rightendonly = this->_rightendonly;
+        bool nofw[2] = { this->_nofw[0], this->_nofw[1] };
+        bool norc[2] = { this->_norc[0], this->_norc[1] };
+        TAlScore minsc[2] = { this->_minsc[0], this->_minsc[1] };
+        TAlScore maxpen[2] = { this->_maxpen[0], this->_maxpen[1] };
+        
+        const index_t window = _longReads->window();
+        const index_t step = window - _longReads->overlap();
+        _job.nwins = _job.next = _job.nfinished = 0;
+        for(int rdi = 0; rdi < (paired ? 2 : 1); rdi++) {
+            const Read& rd = *rds[rdi];
+            index_t rdlen = (index_t)rd.length();
+            for(index_t off = 0; ; off += step) {
+                index_t len = min<index_t>(window, rdlen - off);
+                if(_job.nwins == _job.windows.size()) {
+                    _job.windows.expand();
+                }
+                LongReadWindow<index_t>& w = _job.windows[_job.nwins++];
+                w.rd.reset();
+                w.rd.patFw.install(rd.patFw.buf() + off, len);
+                if(rd.qual.length() == rdlen) {
+                    w.rd.qual.install(rd.qual.buf() + off, len);
+                }
+                w.rd.finalize();
+                w.rdi = rdi;
+                w.nofw = nofw[rdi];
+                w.norc = norc[rdi];
+                w.off = off;
+                w.own = (off + len < rdlen ? step : len);
+                w.shift[0] = rdlen - off - len;
+                w.shift[1] = off;
+                w.seed = rnd.nextU32();
+                if(off + len >= rdlen) break;
+            }
+        }
+        
+        // search this read's windows first, then help with others' until
+        // those other threads claimed are in
+        _longReads->post(&_job);
+        while(true) {
+            LongReadJob<index_t>* from = NULL;
+            LongReadWindow<index_t>* w = _longReads->claim(&_job, from);
+            if(w == NULL) {
+                if(_longReads->done(&_job)) break;
+                w = _longReads->claim(NULL, from);
+            }
+            if(w == NULL) {
+                tthread::this_thread::yield();
+                continue;
+            }
+            searchWindow(*w, sc, ebwtFw, ebwtBw, ref, wlm, prm, him, rp);
+            _longReads->finish(from);
+        }
+        
+        if(paired) {
+            this->initReads(rds, nofw, norc, minsc, maxpen);
+        } else {
+            this->initRead(rds[0], nofw[0], norc[0], minsc[0], maxpen[0], rightendonly);
+        }
+        if(_longReads->segments() && _spillOut == NULL) {
+            writeSegments();
+        }
+        
+        _hitMap.clear();
+        uint32_t best = 0;
+        for(size_t i = 0; i < _job.nwins; i++) {
+            const LongReadWindow<index_t>& w = _job.windows[i];
+            for(size_t j = 0; j < w.hits.size(); j++) {
+                const HitCount<index_t>& h = w.hits[j];
+                size_t idx = 0;
+                for(; idx < _hitMap.size(); idx++) {
+                    if(sameCandidate(_hitMap[idx], h.rank, h.uniqueID, h.taxID)) break;
+                }
+                if(idx == _hitMap.size()) {
+                    _hitMap.expand();
+                    _hitMap.back().reset();
+                    _hitMap.back().uniqueID = h.uniqueID;
+                    _hitMap.back().taxID = h.taxID;
+                    _hitMap.back().path = h.path;
+                    _hitMap.back().rank = h.rank;
+                }
+                HitCount<index_t>& o = _hitMap[idx];
+                o.count += h.count;
+                for(int fwi = 0; fwi < 2; fwi++) {
+                    o.scores[w.rdi][fwi] += h.scores[0][fwi];
+                    o.summedHitLens[w.rdi][fwi] += h.summedHitLens[0][fwi];
+                }
+                for(size_t k = 0; k < h.readPositions.size(); k++) {
+                    o.addReadPosition(h.readPositions[k].first, h.readPositions[k].second);
+                }
+            }
+        }
+        for(size_t i = 0; i < _hitMap.size(); i++) {
+            const HitCount<index_t>& o = _hitMap[i];
+            if(rawScore(o) > best) {
+                best = rawScore(o);
+                isFw = (o.scores[0][0] + o.scores[1][0] >= o.scores[0][1] + o.scores[1][1]);
+            }
+        }
+    }
+    
+    /**
+     * Search window 'w' of a long read as a read of its own, with its own
+     * budget of candidate genomes, and keep the candidates its hits count
+     * toward in w.hits.
+     */
+    void searchWindow(
+                      LongReadWindow<index_t>& w,
+                      const Scoring&           sc,
+                      const Ebwt<index_t>&     ebwtFw,
+                      const Ebwt<index_t>*     ebwtBw,
+                      const BitPairReference&  ref,
+                      WalkMetrics&             wlm,
+                      PerReadMetrics&          prm,
+                      HIMetrics&               him,
+                      const ReportingParams&   rp)
+    {
+        const index_t increment = (2 * _minHitLen <= 33) ? 10 : (2 * _minHitLen - 33);
+        // seeded by the read, so a window is searched the same by any thread
+        RandomSource rnd;
+        rnd.init(w.seed);
+        this->initRead(&w.rd, w.nofw, w.norc, 0, 0);
+        _hitMap.clear();
+        him.windows++;
+        
+        bool rejected = false;
+        if(_prefilter != NULL) {
+            him.prefiltertests++;
+            if(!_prefilter->anyKmer(w.rd.patFw)) {
+                him.prefilterrej++;
+                this->_hits[0][0].done(true);
+                this->_hits[0][1].done(true);
+                rejected = true;
+            }
+        }
+        if(!rejected) {
+            StageTimer t(_stages, STAGE_SEARCH);
+            uint64_t bwops = this->bwops_;
+            searchForwardAndReverse(0, ebwtFw, ebwtBw, sc, rnd, rp, increment);
+            if(_stages != NULL) _stages->lfops += this->bwops_ - bwops;
+        }
+        
+        index_t maxGenomeHitSize = rp.khits;
+        uint32_t ts = 0;
+        bool isFw = false;
+        _posShift[0] = w.shift[0];
+        _posShift[1] = w.shift[1];
+        addPartialHits(0, ebwtFw, ref, rnd, rp, wlm, prm, him, 0, w.own, maxGenomeHitSize, ts, isFw);
+        _posShift[0] = _posShift[1] = 0;
+        
+        // hand the candidates over, keeping their old lists as scratch
+        w.hits.resize(_hitMap.size());
+        for(size_t i = 0; i < _hitMap.size(); i++) {
+            w.hits[i].moveFrom(_hitMap[i]);
+        }
+        _hitMap.clear();
+    }
+    
+    /**
+     * Write a line per best candidate of each window of the current read
+     * (or one with taxID 0 for a window without hits) to the pool's
+     * segments file: readID, mate, start and end of the window in the
+     * mate, taxID and score.  Consecutive windows that disagree point to a
+     * chimeric read.
+     */
+    void writeSegments() {
+        _segBuf.clear();
+        for(size_t i = 0; i < _job.nwins; i++) {
+            const LongReadWindow<index_t>& w = _job.windows[i];
+            uint32_t best = 0;
+            for(size_t j = 0; j < w.hits.size(); j++) {
+                best = max(best, max(w.hits[j].scores[0][0], w.hits[j].scores[0][1]));
+            }
+            if(best == 0) {
+                appendSegment(w, 0, 0);
+                continue;
+            }
+            for(size_t j = 0; j < w.hits.size(); j++) {
+                const HitCount<index_t>& h = w.hits[j];
+                if(max(h.scores[0][0], h.scores[0][1]) == best) {
+                    appendSegment(w, h.taxID, best);
+                }
+            }
+        }
+        _longReads->writeSegments(_segBuf);
+    }
+    
+    void appendSegment(const LongReadWindow<index_t>& w, uint64_t taxID, uint32_t score) {
+        char buf[32];
+        const BTString& name = this->_rds[w.rdi]->name;
+        _segBuf.append(name.buf(), name.length());
+        _segBuf.append('\t');
+        itoa10<int>(w.rdi + 1, buf);
+        _segBuf.append(buf);
+        _segBuf.append('\t');
+        itoa10<uint64_t>(w.off, buf);
+        _segBuf.append(buf);
+        _segBuf.append('\t');
+        itoa10<uint64_t>(w.off + w.rd.length(), buf);
+        _segBuf.append(buf);
+        _segBuf.append('\t');
+        itoa10<uint64_t>(taxID, buf);
+        _segBuf.append(buf);
+        _segBuf.append('\t');
+        itoa10<uint32_t>(score, buf);
+        _segBuf.append(buf);
+        _segBuf.append('\n');
+    }
+    
+    /**
+     * Report the read or pair as the host if at least _hostMinFrac of its
+     * k-mers are in the host filter.  Returns true iff it was reported.
+     */
+    bool screenHost(
+                    const Ebwt<index_t>&    ebwtFw,
+                    HIMetrics&              him,
+                    AlnSinkWrap<index_t>&   sink)
+    {
+        assert(_hostFilter != NULL);
+        him.hosttests++;
+        size_t found = 0, nkmers = 0;
+        int64_t max_score = 0;
+        index_t totlen = 0;
+        for(int rdi = 0; rdi < (this->_paired ? 2 : 1); rdi++) {
+            size_t n = 0;
+            found += _hostFilter->countKmers(this->_rds[rdi]->patFw, n);
+            nkmers += n;
+            index_t rdlen = this->_rds[rdi]->length();
+            max_score += (rdlen > 15 ? (int64_t)(rdlen - 15) * (rdlen - 15) : 0);
+            totlen += rdlen;
+        }
+        if(nkmers == 0 || found < _hostMinFrac * nkmers) {
+            return false;
+        }
+        him.hostreads++;
+        const TaxTreeTable& tree = ebwtFw.tree();
+        uint8_t taxRank = RANK_UNKNOWN;
+        TaxTreeTable::const_iterator itr = tree.find(_hostFilterTaxID);
+        if(itr != tree.end()) {
+            taxRank = itr->second.rank;
+        }
+        AlnRes& rs = _rs;
+        rs.init(
+                max_score,
+                max_score,
+                get_tax_rank_string(taxRank),
+                _hostFilterTaxID,
+                taxRank,
+                totlen,
+                _hostReadPositions, // none; there are no partial hits
+                true);
+        sink.report(0, &rs);
+        return true;
+    }
+    
     bool getGenomeIdx(
                       const Ebwt<index_t>&       ebwt,
                       const BitPairReference&    ref,
@@ -597,6 +1265,12 @@ public:
         this->_offs.fill(std::numeric_limits<index_t>::max());
         this->_sas.init(top, rdlen, EListSlice<index_t, 16>(this->_offs, 0, nelt));
         this->_gws.init(ebwt, ref, this->_sas, rnd, met);
+        size_t nleft = 0;
+        if(_restrictMate) {
+            _candFound.resize(_hitMap.size());
+            _candFound.fill(false);
+            nleft = _hitMap.size();
+        }
         for(index_t off = 0; off < nelt; off++) {
             WalkResult<index_t> wr;
             this->_gws.advanceElement(
@@ -611,6 +1285,15 @@ public:
             // Coordinate of the seed hit w/r/t the pasted reference string
             coords.expand();
             coords.back().init(wr.toff, 0, fw);
+            if(_restrictMate) {
+                // the rest of the range can only add to candidates found
+                // already
+                size_t c = findCandidate(ebwt, wr.toff);
+                if(c < _hitMap.size() && !_candFound[c]) {
+                    _candFound[c] = true;
+                    if(--nleft == 0) break;
+                }
+            }
         }
         
         return true;
@@ -624,6 +1307,37 @@ private:
     bool                         _mate2fw;
     
     bool                         _tree_traverse;
+    int                          _strandPrune;
+    const KmerFilter*            _prefilter;   // k-mers of the reference, or NULL
+    const KmerFilter*            _hostFilter;  // k-mers of the host genome, or NULL
+    uint64_t                     _hostFilterTaxID;
+    double                       _hostMinFrac; // share of k-mers in _hostFilter to call a read host
+    
+    // Classifying against a database split into shards: candidates found in
+    // each shard but the last are spilled to _spillOut, then merged into
+    // those of the last shard from _spillIn.  Shard i's uniqueIDs are offset
+    // by (*_spillUidOff)[i] into the last shard's (extended) uid table.
+    ShardSpill*                  _spillOut;
+    const EList<ShardSpill*>*    _spillIn;
+    const EList<uint64_t>*       _spillUidOff;
+    EList<char>                  _spillBuf;
+    HitCount<index_t>            _spillHit;
+    
+    // Long-read mode: reads with a mate longer than the pool's window are
+    // searched in windows posted to _longReads (NULL for off) as _job;
+    // the offsets of a window's hits are moved by _posShift[fw ? 0 : 1]
+    // to those in the whole mate
+    LongReadPool<index_t>*       _longReads;
+    LongReadJob<index_t>         _job;
+    index_t                      _posShift[2];
+    
+    // Pairs: when mate 1 leaves at most _mateCandidates candidates (0 for
+    // off), mate 2 is searched with _restrictMate set, so its hits count
+    // only toward those and are resolved only until all are found
+    size_t                       _mateCandidates;
+    bool                         _restrictMate;
+    EList<bool>                  _candFound;   // candidates found in the current SA range
+    StageMetrics*                _stages;      // NULL unless timing the stages
     uint8_t                      _classification_rank;
     set<uint64_t>                _host_taxIDs; // favor these genomes
     set<uint64_t>                _excluded_taxIDs;
@@ -631,11 +1345,20 @@ private:
     // Temporary variables
     ReadBWTHit<index_t>          _tempHit;
     EList<pair<uint32_t, uint64_t> > _hitTaxCount;  // pair of count and taxID
-    EList<uint64_t>              _tempPath;
+    EList<pair<uint64_t, uint32_t> > _hitParents;   // pair of parent taxID and hit id
+    EList<pair<uint64_t, uint32_t> > _hitTaxIDs;    // pair of taxID and hit id
+    EList<uint32_t>              _id2pos;       // hit id to position in _hitMap
+    EList<uint32_t>              _pos2id;
+    EList<uint32_t>              _matchPos;
+    EList<pair<uint64_t, uint64_t> > _coordIDs;  // pair of uniqueID and taxID per partial hit
+    AlnRes                       _rs;
+    EList<pair<uint32_t, uint32_t> > _hostReadPositions; // always empty
+    BTString                     _segBuf;       // a read's lines for the segments file
     
     void searchForwardAndReverse(
                                  index_t rdi,
                                  const Ebwt<index_t>& ebwtFw,
+                                 const Ebwt<index_t>* ebwtBw,
                                  const Scoring& sc,
                                  RandomSource& rnd,
                                  const ReportingParams& rp,
@@ -649,6 +1372,7 @@ private:
         index_t rdlen = rd.length();
         //const size_t maxDiff = (rdlen / 2 > 2 * _minHitLen) ? rdlen / 2 : (2 * _minHitLen);
         size_t sum[2] = {0, 0} ;
+        size_t score[2] = {0, 0}; // as scored by getForwardOrReverseHit
         
         // search for partial hits on the forward and reverse strand
         while(!done[0] || !done[1]) {
@@ -659,16 +1383,27 @@ private:
                 size_t mineFw = 0, mineRc = 0;
                 bool fw = (fwi == 0);
                 ReadBWTHit<index_t>& hit = this->_hits[rdi][fwi];
-                this->partialSearch(
-                                    ebwtFw,
-                                    rd,
-                                    sc,
-                                    fw,
-                                    0,
-                                    mineFw,
-                                    mineRc,
-                                    hit,
-                                    rnd);
+                if(ebwtBw != NULL) {
+                    this->bidirPartialSearch(
+                                             ebwtFw,
+                                             *ebwtBw,
+                                             rd,
+                                             sc,
+                                             fw,
+                                             hit,
+                                             rnd);
+                } else {
+                    this->partialSearch(
+                                        ebwtFw,
+                                        rd,
+                                        sc,
+                                        fw,
+                                        0,
+                                        mineFw,
+                                        mineRc,
+                                        hit,
+                                        rnd);
+                }
                 
                 BWTHit<index_t>& lastHit = hit.getPartialHit(hit.offsetSize() - 1);
                 if(hit.done()) {
@@ -676,6 +1411,7 @@ private:
                     cur[fwi] = rdlen;
                     if(lastHit.len() >= _minHitLen) {
                         sum[fwi] += lastHit.len();
+                        score[fwi] += (lastHit.len() - 15) * (lastHit.len() - 15);
                         if(0) //lastHit.len() < 31 && rdlen > 31 && lastHit.size() == 1 )
                         {
                             ReadBWTHit<index_t> testHit ;
@@ -707,8 +1443,10 @@ private:
 #ifdef LI_DEBUG
                 cout << fwi << ":" << lastHit.len() << " " << cur[fwi] << " ";
 #endif
-                if(lastHit.len() >= _minHitLen)
+                if(lastHit.len() >= _minHitLen) {
                     sum[fwi] += lastHit.len();
+                    score[fwi] += (lastHit.len() - 15) * (lastHit.len() - 15);
+                }
                 
                 if(lastHit.len() > increment) {
                     if(lastHit.len() < _minHitLen) {
@@ -760,23 +1498,45 @@ private:
             cout << endl;
 #endif
 
-            // No early termination
-#if 0
-            if(sum[0] > sum[1] + (rdlen - cur[1] + 1)) {
-                this->_hits[rdi][1].done(true);
-                done[1] = true;
-            } else if(sum[1] > sum[0] + (rdlen - cur[0] + 1)) {
-                this->_hits[rdi][0].done(true);
-                done[0] = true;
+            // Early termination of the losing strand
+            if(_strandPrune == STRAND_PRUNE_OFF || (done[0] && done[1])) {
+                continue;
+            }
+            if(_strandPrune == STRAND_PRUNE_BOUND) {
+                // Best a strand can still add is one hit spanning the rest
+                // of the read
+                size_t best[2] = {0, 0};
+                for(int fwi = 0; fwi < 2; fwi++) {
+                    size_t left = rdlen - cur[fwi];
+                    if(left >= _minHitLen) {
+                        best[fwi] = (left - 15) * (left - 15);
+                    }
+                }
+                if(score[0] > score[1] + best[1]) {
+                    this->_hits[rdi][1].done(true);
+                    done[1] = true;
+                } else if(score[1] > score[0] + best[0]) {
+                    this->_hits[rdi][0].done(true);
+                    done[0] = true;
+                }
+            } else {
+                assert_eq(_strandPrune, STRAND_PRUNE_LENGTH);
+                if(sum[0] > sum[1] + (rdlen - cur[1] + 1)) {
+                    this->_hits[rdi][1].done(true);
+                    done[1] = true;
+                } else if(sum[1] > sum[0] + (rdlen - cur[0] + 1)) {
+                    this->_hits[rdi][0].done(true);
+                    done[0] = true;
+                }
             }
-#endif
         }
         
         // Extend partial hits
         if(sum[0] >= _minHitLen && sum[1] >= _minHitLen) {
             ReadBWTHit<index_t>& hits = this->_hits[rdi][0];
             ReadBWTHit<index_t>& rchits = this->_hits[rdi][1];
-            for(size_t i = 0; i < hits.offsetSize(); i++) {
+            // Hits found with the mirror index are already maximal
+            for(size_t i = 0; ebwtBw == NULL && i < hits.offsetSize(); i++) {
                 BWTHit<index_t>& hit = hits.getPartialHit(i);
                 index_t len = hit.len();
                 //if(len < _minHitLen) continue;
@@ -938,7 +1698,12 @@ private:
                             HIMetrics& him)
     {
         BWTHit<index_t>& partialHit = hit.getPartialHit(hi);
-	assert(!partialHit.hasGenomeCoords());
+        index_t maxelt = maxGenomeHitSize - (index_t)this->_genomeHits.size();
+        if(partialHit._coords.size() == min<index_t>(partialHit.size(), maxelt)) {
+            // resolved in full by an earlier pass over a restricted mate
+            return partialHit._coords;
+        }
+        StageTimer t(_stages, STAGE_COORDS);
         bool straddled = false;
         this->getGenomeIdx(
                            ebwtFw,     // FB: Why is it called ...FW here?
@@ -947,7 +1712,7 @@ private:
                            partialHit._top,
                            partialHit._bot,
                            hit._fw == 0, // FIXME: fwi and hit._fw are defined differently
-                           maxGenomeHitSize - this->_genomeHits.size(),
+                           maxelt,
                            hit._len - partialHit._bwoff - partialHit._len,
                            partialHit._len,
                            partialHit._coords,
@@ -964,6 +1729,47 @@ private:
     }
 
 
+    /**
+     * Raise 'taxID', whose path is 'path', to the classification rank or
+     * the nearest rank above it the path has, and return that rank.
+     */
+    uint8_t rankTaxID(const TaxPath& path, uint64_t& taxID) const {
+        uint8_t rank = _classification_rank;
+        if(rank > 0) {
+            for(; rank < path.size(); rank++) {
+                if(path[rank] != 0) {
+                    taxID = path[rank];
+                    break;
+                }
+            }
+        }
+        return rank;
+    }
+    
+    /**
+     * Return true iff a hit to genome 'uniqueID', raised to 'taxID' at
+     * 'rank' by rankTaxID, counts toward candidate 'h'.
+     */
+    static bool sameCandidate(const HitCount<index_t>& h, uint8_t rank, uint64_t uniqueID, uint64_t taxID) {
+        return rank == 0 ? (uniqueID == h.uniqueID) : (taxID == h.taxID);
+    }
+    
+    /**
+     * Return the index in _hitMap of the candidate a hit to genome
+     * 'uniqueID' counts toward, or _hitMap.size() if there's none.
+     */
+    size_t findCandidate(const Ebwt<index_t>& ebwt, uint64_t uniqueID) const {
+        const TaxRefTable& uid_to_tid = ebwt.uid_to_tid();
+        assert_lt(uniqueID, uid_to_tid.size());
+        uint64_t taxID = uid_to_tid.tid(uniqueID);
+        uint8_t rank = rankTaxID(ebwt.paths().pathOf(taxID), taxID);
+        size_t idx = 0;
+        for(; idx < _hitMap.size(); idx++) {
+            if(sameCandidate(_hitMap[idx], rank, uniqueID, taxID)) break;
+        }
+        return idx;
+    }
+    
     // append a hit to genus map or update entry
     size_t addHitToHitMap(
                           const Ebwt<index_t>& ebwt,
@@ -983,32 +1789,17 @@ private:
 #ifdef LI_DEBUG
 	    cout << "Add " << taxID << " " << partialHitScore << " " << weightedHitLen << endl;
 #endif
-	    const TaxonomyPathTable& pathTable = ebwt.paths();
-	    pathTable.getPath(taxID, _tempPath);
-	    uint8_t rank = _classification_rank;
-	    if(rank > 0) {
-		    for(; rank < _tempPath.size(); rank++) {
-			    if(_tempPath[rank] != 0) {
-				    taxID = _tempPath[rank];
-				    break;
-			    }
-		    }
-	    }
+	    TaxPath path = ebwt.paths().pathOf(taxID);
+	    uint8_t rank = rankTaxID(path, taxID);
 
 	    for(; idx < hitMap.size(); ++idx) {
-		    bool same = false;
-		    if(rank == 0) {
-			    same = (uniqueID == hitMap[idx].uniqueID);
-		    } else {
-			    same = (taxID == hitMap[idx].taxID);
-		    }
-		    if(same) {
+		    if(sameCandidate(hitMap[idx], rank, uniqueID, taxID)) {
 			    if(hitMap[idx].timeStamp != hi) {
 				    hitMap[idx].count += 1;
 				    hitMap[idx].scores[rdi][fwi] += partialHitScore;
 				    hitMap[idx].summedHitLens[rdi][fwi] += weightedHitLen;
 				    hitMap[idx].timeStamp = (uint32_t)hi;
-				    hitMap[idx].readPositions.push_back(make_pair(offset, length));
+				    hitMap[idx].addReadPosition((uint32_t)offset, (uint32_t)length);
 			    }
 			    break;
 		    }
@@ -1024,8 +1815,8 @@ private:
 		    hitCount.summedHitLens[rdi][fwi] = weightedHitLen;
 		    hitCount.timeStamp = (uint32_t)hi;
 		    hitCount.readPositions.clear();
-		    hitCount.readPositions.push_back(make_pair(offset, length));
-		    hitCount.path = _tempPath;
+		    hitCount.addReadPosition((uint32_t)offset, (uint32_t)length);
+		    hitCount.path = path;
 		    hitCount.rank = rank;
 		    hitCount.taxID = taxID;
 	    }
@@ -1035,9 +1826,139 @@ private:
 	    return idx;
     }
 
+    /**
+     * Score of a candidate before finalize(), as finalize() would score it
+     * for a pair; used to pick the strand to report.
+     */
+    static uint32_t rawScore(const HitCount<index_t>& h) {
+        return max(h.scores[0][0], h.scores[0][1]) + max(h.scores[1][0], h.scores[1][1]);
+    }
+    
+    template<typename T>
+    void appendSpill(T x) {
+        const char* p = (const char*)&x;
+        for(size_t i = 0; i < sizeof(T); i++) _spillBuf.push_back(p[i]);
+    }
+    
+    template<typename T>
+    T readSpill(size_t& off) {
+        T x;
+        assert_leq(off + sizeof(T), _spillBuf.size());
+        memcpy(&x, _spillBuf.ptr() + off, sizeof(T));
+        off += sizeof(T);
+        return x;
+    }
+    
+    /**
+     * Write the current read's candidates, as they stand before finalize(),
+     * to the spill for this shard.
+     */
+    void spillHits(TReadId rdid, bool isFw) {
+        assert(_spillOut != NULL);
+        _spillBuf.clear();
+        appendSpill<uint8_t>(isFw ? 1 : 0);
+        appendSpill<uint32_t>((uint32_t)_hitMap.size());
+        for(size_t i = 0; i < _hitMap.size(); i++) {
+            const HitCount<index_t>& h = _hitMap[i];
+            appendSpill<uint64_t>(h.uniqueID);
+            appendSpill<uint64_t>(h.taxID);
+            appendSpill<uint32_t>(h.count);
+            for(int r = 0; r < 2; r++) {
+                for(int f = 0; f < 2; f++) {
+                    appendSpill<uint32_t>(h.scores[r][f]);
+                    appendSpill<double>(h.summedHitLens[r][f]);
+                }
+            }
+            appendSpill<uint8_t>(h.rank);
+            appendSpill<uint32_t>((uint32_t)h.readPositions.size());
+            for(size_t j = 0; j < h.readPositions.size(); j++) {
+                appendSpill<uint32_t>(h.readPositions[j].first);
+                appendSpill<uint32_t>(h.readPositions[j].second);
+            }
+        }
+        _spillOut->put(rdid, _spillBuf);
+    }
+    
+    /**
+     * Add the candidates that earlier shards spilled for the current read to
+     * _hitMap.  A candidate for the same genome (or, above strain level, the
+     * same taxon) as one already there keeps the better score of the two for
+     * each mate and strand; scores aren't summed since both shards may have
+     * been hit by the same stretch of the read.  The strand reported is the
+     * one of the shard with the best candidate.  Taxonomy paths aren't
+     * spilled; they come from 'ebwt', whose tables take in every shard's.
+     */
+    void mergeSpilledHits(const Ebwt<index_t>& ebwt, TReadId rdid, bool& isFw) {
+        assert(_spillIn != NULL);
+        assert(_spillUidOff != NULL);
+        const TaxRefTable& uid_to_tid = ebwt.uid_to_tid();
+        uint32_t best = 0;
+        for(size_t i = 0; i < _hitMap.size(); i++) {
+            best = max(best, rawScore(_hitMap[i]));
+        }
+        for(size_t s = 0; s < _spillIn->size(); s++) {
+            if(!(*_spillIn)[s]->get(rdid, _spillBuf)) continue;
+            size_t off = 0;
+            bool fw = (readSpill<uint8_t>(off) != 0);
+            uint32_t n = readSpill<uint32_t>(off);
+            for(uint32_t c = 0; c < n; c++) {
+                HitCount<index_t>& h = _spillHit;
+                h.reset();
+                h.uniqueID = readSpill<uint64_t>(off) + (*_spillUidOff)[s];
+                h.taxID = readSpill<uint64_t>(off);
+                h.count = readSpill<uint32_t>(off);
+                for(int r = 0; r < 2; r++) {
+                    for(int f = 0; f < 2; f++) {
+                        h.scores[r][f] = readSpill<uint32_t>(off);
+                        h.summedHitLens[r][f] = readSpill<double>(off);
+                    }
+                }
+                h.rank = readSpill<uint8_t>(off);
+                uint32_t npos = readSpill<uint32_t>(off);
+                for(uint32_t j = 0; j < npos; j++) {
+                    uint32_t pos = readSpill<uint32_t>(off);
+                    uint32_t len = readSpill<uint32_t>(off);
+                    h.readPositions.push_back(make_pair(pos, len));
+                }
+                assert_lt(h.uniqueID, uid_to_tid.size());
+                h.path = ebwt.paths().pathOf(uid_to_tid.tid(h.uniqueID));
+                uint32_t score = rawScore(h);
+                if(score > best) {
+                    best = score;
+                    isFw = fw;
+                }
+                size_t idx = 0;
+                for(; idx < _hitMap.size(); idx++) {
+                    if(_classification_rank == 0 ?
+                       (h.uniqueID == _hitMap[idx].uniqueID) :
+                       (h.taxID == _hitMap[idx].taxID)) {
+                        break;
+                    }
+                }
+                if(idx == _hitMap.size()) {
+                    _hitMap.expand();
+                    _hitMap.back().moveFrom(h);
+                    continue;
+                }
+                HitCount<index_t>& o = _hitMap[idx];
+                if(score > rawScore(o)) {
+                    o.readPositions.swap(h.readPositions);
+                }
+                o.count = max(o.count, h.count);
+                for(int r = 0; r < 2; r++) {
+                    for(int f = 0; f < 2; f++) {
+                        o.scores[r][f] = max(o.scores[r][f], h.scores[r][f]);
+                        o.summedHitLens[r][f] = max(o.summedHitLens[r][f], h.summedHitLens[r][f]);
+                    }
+                }
+            }
+            assert_eq(off, _spillBuf.size());
+        }
+    }
+    
     void reportUnclassified( AlnSinkWrap<index_t>& sink )
     {
-	    AlnRes rs ;
+	    AlnRes& rs = _rs;
 	    EList<pair<uint32_t,uint32_t> > dummy ;
 	    dummy.push_back( make_pair( 0, 0 ) ) ;
 	    rs.init( 0, 0, string( "unclassified" ), 0, 0, 0, dummy, true ) ;
@@ -20,6 +20,7 @@
 #include "ds.h"
 
 MemoryTally gMemTally;
+thread_local ThreadMemTally *MemoryTally::thr_ = NULL;
 
 /**
  * Tally a memory allocation of size amt bytes.
@@ -34,6 +35,13 @@ void MemoryTally::add(int cat, uint64_t amt) {
 	if(tot_ > peak_) {
 		peak_ = tot_;
 	}
+	ThreadMemTally *t = thr_;
+	if(t != NULL) {
+		t->tot += amt;
+		if(t->tot > t->peak) {
+			t->peak = t->tot;
+		}
+	}
 }
 
 /**
@@ -45,6 +53,10 @@ void MemoryTally::del(int cat, uint64_t amt) {
 	assert_geq(tot_, amt);
 	tots_[cat] -= amt;
 	tot_ -= amt;
+	ThreadMemTally *t = thr_;
+	if(t != NULL) {
+		t->tot -= (t->tot < amt ? t->tot : amt);
+	}
 }
 	
 #ifdef MAIN_DS
@@ -31,6 +31,20 @@
 #include "random_source.h"
 #include "btypes.h"
 
+/**
+ * Memory tallied by one thread: how much it holds now and the most it
+ * has held at once.  Memory freed by a thread other than the one that
+ * allocated it is taken off the freeing thread's tally, which can't go
+ * below 0.
+ */
+struct ThreadMemTally {
+
+	ThreadMemTally() : tot(0), peak(0) { }
+
+	uint64_t tot;
+	uint64_t peak;
+};
+
 /**
  * Tally how much memory is allocated to certain 
  */
@@ -75,6 +89,12 @@ public:
 	 */
 	uint64_t peak(int cat) { return peaks_[cat]; }
 
+	/**
+	 * Also tally the calling thread's allocations and frees in t, until
+	 * it's set to something else.  NULL stops the per-thread tally.
+	 */
+	static void setThreadTally(ThreadMemTally *t) { thr_ = t; }
+
 #ifndef NDEBUG
 	/**
 	 * Check that memory tallies are internally consistent;
@@ -97,6 +117,7 @@ protected:
 	uint64_t tot_;
 	uint64_t peaks_[256];
 	uint64_t peak_;
+	static thread_local ThreadMemTally *thr_; // the calling thread's tally, or NULL
 };
 
 extern MemoryTally gMemTally;
@@ -112,7 +133,7 @@ public:
 	AutoArray(size_t sz, int cat = 0) : cat_(cat) {
 		t_ = NULL;
 		t_ = new T[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(T));
 		memset(t_, 0, sz * sizeof(T));
 		sz_ = sz;
 	}
@@ -120,7 +141,7 @@ public:
 	~AutoArray() {
 		if(t_ != NULL) {
 			delete[] t_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(T));
 		}
 	}
 	
@@ -258,6 +279,14 @@ public:
 	inline T* get() { return p_; }
 	inline const T* get() const { return p_; }
 
+	/**
+	 * Return the number of elements in the array, and whether we own
+	 * (and will delete) it rather than it living in a memory-mapped
+	 * file or shared memory.
+	 */
+	size_t size() const { return p_ == NULL ? 0 : sz_; }
+	bool freeable() const { return p_ != NULL && freeable_; }
+
 private:
 	int cat_;
 	T *p_;
@@ -405,6 +434,18 @@ public:
 		o.allocCat_ = -1;
 	}
 
+	/**
+	 * Exchange buffers with another list of the same category, without
+	 * copying elements.
+	 */
+	void swap(EList<T, S>& o) {
+		assert_eq(cat_, o.cat());
+		std::swap(allocCat_, o.allocCat_);
+		std::swap(list_, o.list_);
+		std::swap(sz_, o.sz_);
+		std::swap(cur_, o.cur_);
+	}
+
 	/**
 	 * Return number of elements.
 	 */
@@ -907,7 +948,7 @@ private:
 	T *alloc(size_t sz) {
 		T* tmp = new T[sz];
 		assert(tmp != NULL);
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		allocCat_ = cat_;
 		return tmp;
 	}
@@ -921,7 +962,7 @@ private:
 			assert_neq(-1, allocCat_);
 			assert_eq(allocCat_, cat_);
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 			sz_ = cur_ = 0;
 		}
@@ -1266,7 +1307,7 @@ protected:
 	EList<T, S1> *alloc(size_t sz) {
 		assert_gt(sz, 0);
 		EList<T, S1> *tmp = new EList<T, S1>[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		if(cat_ != 0) {
 			for(size_t i = 0; i < sz; i++) {
 				assert(tmp[i].ptr() == NULL);
@@ -1283,7 +1324,7 @@ protected:
 	void free() {
 		if(list_ != NULL) {
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 		}
 	}
@@ -1602,7 +1643,7 @@ protected:
 	ELList<T, S1, S2> *alloc(size_t sz) {
 		assert_gt(sz, 0);
 		ELList<T, S1, S2> *tmp = new ELList<T, S1, S2>[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		if(cat_ != 0) {
 			for(size_t i = 0; i < sz; i++) {
 				assert(tmp[i].ptr() == NULL);
@@ -1619,7 +1660,7 @@ protected:
 	void free() {
 		if(list_ != NULL) {
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 		}
 	}
@@ -1890,7 +1931,7 @@ private:
 	T *alloc(size_t sz) {
 		assert_gt(sz, 0);
 		T *tmp = new T[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		return tmp;
 	}
 
@@ -1901,7 +1942,7 @@ private:
 	void free() {
 		if(list_ != NULL) {
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 		}
 	}
@@ -2282,7 +2323,7 @@ protected:
 	ESet<T> *alloc(size_t sz) {
 		assert_gt(sz, 0);
 		ESet<T> *tmp = new ESet<T>[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		if(cat_ != 0) {
 			for(size_t i = 0; i < sz; i++) {
 				assert(tmp[i].ptr() == NULL);
@@ -2299,7 +2340,7 @@ protected:
 	void free() {
 		if(list_ != NULL) {
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 		}
 	}
@@ -2549,7 +2590,7 @@ private:
 	std::pair<K, V> *alloc(size_t sz) {
 		assert_gt(sz, 0);
 		std::pair<K, V> *tmp = new std::pair<K, V>[sz];
-		gMemTally.add(cat_, sz);
+		gMemTally.add(cat_, sz * sizeof(*tmp));
 		return tmp;
 	}
 
@@ -2560,7 +2601,7 @@ private:
 	void free() {
 		if(list_ != NULL) {
 			delete[] list_;
-			gMemTally.del(cat_, sz_);
+			gMemTally.del(cat_, sz_ * sizeof(*list_));
 			list_ = NULL;
 		}
 	}
@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+
+#
+# Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+#
+# This file is part of Centrifuge.
+#
+# Centrifuge is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Centrifuge is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys, random
+from argparse import ArgumentParser
+
+
+"""
+Write random genomes, and the conversion table and taxonomy that go with
+them, for building a synthetic index: species 'i' belongs to genus
+'i / species_per_genus'.  Pairs of species in a genus share a stretch of
+sequence so that some reads hit more than one genome; shared_divergence
+percent of the bases in a shared stretch are substituted.
+"""
+def random_genomes(base_fname,
+                   num_genomes,
+                   genome_len,
+                   species_per_genus,
+                   shared_len,
+                   shared_divergence,
+                   random_seed):
+    random.seed(random_seed)
+    genus_base, species_base = 1000, 100000
+
+    genomes = []
+    for g in range(num_genomes):
+        seq = [random.choice("ACGT") for i in range(genome_len)]
+        if g % species_per_genus > 0 and shared_len > 0:
+            # Copy a stretch from the first species of the genus
+            first = genomes[g - g % species_per_genus]
+            pos = random.randint(0, genome_len - shared_len)
+            seq[pos:pos + shared_len] = first[pos:pos + shared_len]
+            if shared_divergence > 0:
+                for i in range(pos, pos + shared_len):
+                    if random.random() * 100 < shared_divergence:
+                        seq[i] = random.choice([b for b in "ACGT" if b != seq[i]])
+        genomes.append(seq)
+
+    ref_file = open(base_fname + ".fa", "w")
+    conv_file = open(base_fname + ".conv", "w")
+    for g in range(num_genomes):
+        seq_id = "gi|%d" % (g + 1)
+        ref_file.write(">%s|random genome %d\n" % (seq_id, g + 1))
+        seq = "".join(genomes[g])
+        for i in range(0, genome_len, 60):
+            ref_file.write(seq[i:i+60] + "\n")
+        conv_file.write("%s\t%d\n" % (seq_id, species_base + g))
+    ref_file.close()
+    conv_file.close()
+
+    num_genera = (num_genomes + species_per_genus - 1) // species_per_genus
+    nodes_file = open(base_fname + ".nodes", "w")
+    names_file = open(base_fname + ".names", "w")
+    nodes_file.write("1\t|\t1\t|\tno rank\t|\n")
+    names_file.write("1\t|\troot\t|\t\t|\tscientific name\t|\n")
+    for i in range(num_genera):
+        nodes_file.write("%d\t|\t1\t|\tgenus\t|\n" % (genus_base + i))
+        names_file.write("%d\t|\tGenus%d\t|\t\t|\tscientific name\t|\n" % (genus_base + i, i))
+    for g in range(num_genomes):
+        nodes_file.write("%d\t|\t%d\t|\tspecies\t|\n" % (species_base + g, genus_base + g // species_per_genus))
+        names_file.write("%d\t|\tSpecies%d\t|\t\t|\tscientific name\t|\n" % (species_base + g, g))
+    nodes_file.close()
+    names_file.close()
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(
+        description='Write random genomes and a taxonomy for a synthetic Centrifuge index')
+    parser.add_argument('base_fname',
+                        nargs='?',
+                        type=str,
+                        help='output base filename')
+    parser.add_argument('-n', '--num-genomes',
+                        dest='num_genomes',
+                        action='store',
+                        type=int,
+                        default=20,
+                        help='number of genomes (default: 20)')
+    parser.add_argument('-l', '--genome-length',
+                        dest='genome_len',
+                        action='store',
+                        type=int,
+                        default=500000,
+                        help='length of each genome (default: 500000)')
+    parser.add_argument('-s', '--species-per-genus',
+                        dest='species_per_genus',
+                        action='store',
+                        type=int,
+                        default=4,
+                        help='number of species in each genus (default: 4)')
+    parser.add_argument('--shared-length',
+                        dest='shared_len',
+                        action='store',
+                        type=int,
+                        default=20000,
+                        help='length of sequence species share with their genus\' first (default: 20000)')
+    parser.add_argument('--shared-divergence',
+                        dest='shared_divergence',
+                        action='store',
+                        type=float,
+                        default=0.0,
+                        help='percent of bases substituted in a shared stretch (default: 0)')
+    parser.add_argument('--random-seed',
+                        dest='random_seed',
+                        action='store',
+                        type=int,
+                        default=0,
+                        help='random seeding value (default: 0)')
+    args = parser.parse_args()
+    if not args.base_fname:
+        parser.print_help()
+        exit(1)
+    if args.shared_len > args.genome_len:
+        args.shared_len = args.genome_len
+    random_genomes(args.base_fname,
+                   args.num_genomes,
+                   args.genome_len,
+                   args.species_per_genus,
+                   args.shared_len,
+                   args.shared_divergence,
+                   args.random_seed)
@@ -26,6 +26,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <stdexcept>
 #include "assert_helpers.h"
 
@@ -64,6 +67,7 @@ public:
 		init();
 		_in = in;
 		assert(_in != NULL);
+		_pipe = isPipe(_in);
 	}
 
 	FileBuf(std::ifstream *inf) {
@@ -128,6 +132,7 @@ public:
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
+		_pipe = isPipe(_in);
 	}
 
 	/**
@@ -140,6 +145,7 @@ public:
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
+		_pipe = false;
 	}
 
 	/**
@@ -152,6 +158,7 @@ public:
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
+		_pipe = false;
 	}
 
 	/**
@@ -195,6 +202,15 @@ public:
 				} else if(_ins != NULL) {
 					_ins->read((char*)_buf, BUF_SZ);
 					_buf_sz = _ins->gcount();
+				} else if(_pipe) {
+					// Take whatever the writer has sent so far rather
+					// than waiting for a full buffer, so reads streaming
+					// in through a pipe are handled as they arrive
+					ssize_t n;
+					do {
+						n = read(fileno(_in), _buf, BUF_SZ);
+					} while(n < 0 && errno == EINTR);
+					_buf_sz = (n > 0 ? (size_t)n : 0);
 				} else {
 					assert(_in != NULL);
 					_buf_sz = fread(_buf, 1, BUF_SZ, _in);
@@ -205,7 +221,7 @@ public:
 					// caller
 					_done = true;
 					return -1;
-				} else if(_buf_sz < BUF_SZ) {
+				} else if(_buf_sz < BUF_SZ && !_pipe) {
 					// Exhausted
 					_done = true;
 				}
@@ -434,10 +450,20 @@ private:
 		_ins = NULL;
 		_cur = _buf_sz = BUF_SZ;
 		_done = false;
+		_pipe = false;
 		_lastn_cur = 0;
 		// no need to clear _buf[]
 	}
 
+	/**
+	 * Return true iff the file is a pipe or FIFO, where a short read
+	 * doesn't mean the writer is done.
+	 */
+	static bool isPipe(FILE *in) {
+		struct stat st;
+		return fstat(fileno(in), &st) == 0 && S_ISFIFO(st.st_mode);
+	}
+
 	static const size_t BUF_SZ = 256 * 1024;
 	FILE     *_in;
 	std::ifstream *_inf;
@@ -445,6 +471,7 @@ private:
 	size_t    _cur;
 	size_t    _buf_sz;
 	bool      _done;
+	bool      _pipe;        // _in is a pipe; read what's there, not a full buffer
 	uint8_t   _buf[BUF_SZ]; // (large) input buffer
 	size_t    _lastn_cur;
 	char      _lastn_buf[LASTN_BUF_SZ]; // buffer of the last N chars dispensed
@@ -516,6 +543,25 @@ private:
 	char     buf_[BUF_SZ]; // (large) input buffer
 };
 
+/**
+ * Something an OutFileBuf can hand its bytes to instead of writing them to
+ * its file itself, e.g. to compress them.  The sink writes to the file.
+ */
+class OutFileSink {
+public:
+	virtual ~OutFileSink() { }
+
+	/**
+	 * Take the next 'len' bytes of output.
+	 */
+	virtual void write(const char *buf, size_t len) = 0;
+
+	/**
+	 * Write out everything taken so far; no more bytes follow.
+	 */
+	virtual void finish() = 0;
+};
+
 /**
  * Wrapper for a buffered output stream that writes characters and
  * other data types.  This class is *not* synchronized; the caller is
@@ -529,7 +575,7 @@ public:
 	 * Open a new output stream to a file with given name.
 	 */
 	OutFileBuf(const std::string& out, bool binary = false) :
-		name_(out.c_str()), cur_(0), closed_(false)
+		name_(out.c_str()), cur_(0), closed_(false), sink_(NULL)
 	{
 		out_ = fopen(out.c_str(), binary ? "wb" : "w");
 		if(out_ == NULL) {
@@ -544,7 +590,7 @@ public:
 	 * Open a new output stream to a file with given name.
 	 */
 	OutFileBuf(const char *out, bool binary = false) :
-		name_(out), cur_(0), closed_(false)
+		name_(out), cur_(0), closed_(false), sink_(NULL)
 	{
 		assert(out != NULL);
 		out_ = fopen(out, binary ? "wb" : "w");
@@ -557,7 +603,7 @@ public:
 	/**
 	 * Open a new output stream to standard out.
 	 */
-	OutFileBuf() : name_("cout"), cur_(0), closed_(false) {
+	OutFileBuf() : name_("cout"), cur_(0), closed_(false), sink_(NULL) {
 		out_ = stdout;
 	}
 	
@@ -598,7 +644,7 @@ public:
 		if(cur_ + slen > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(slen >= BUF_SZ) {
-				fwrite(s.c_str(), slen, 1, out_);
+				writeOut(s.c_str(), slen);
 			} else {
 				memcpy(&buf_[cur_], s.data(), slen);
 				assert_eq(0, cur_);
@@ -621,7 +667,7 @@ public:
 		if(cur_ + slen > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(slen >= BUF_SZ) {
-				fwrite(s.toZBuf(), slen, 1, out_);
+				writeOut(s.toZBuf(), slen);
 			} else {
 				memcpy(&buf_[cur_], s.toZBuf(), slen);
 				assert_eq(0, cur_);
@@ -642,7 +688,7 @@ public:
 		if(cur_ + len > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(len >= BUF_SZ) {
-				fwrite(s, len, 1, out_);
+				writeOut(s, len);
 			} else {
 				memcpy(&buf_[cur_], s, len);
 				assert_eq(0, cur_);
@@ -669,11 +715,33 @@ public:
 		if(closed_) return;
 		if(cur_ > 0) flush();
 		closed_ = true;
+		if(sink_ != NULL) {
+			sink_->finish();
+			delete sink_;
+			sink_ = NULL;
+		}
 		if(out_ != stdout) {
 			fclose(out_);
 		}
 	}
 
+	/**
+	 * Hand all output from now on to 'sink', which this object then owns
+	 * and finishes when closed.
+	 */
+	void setSink(OutFileSink *sink) {
+		assert(sink_ == NULL);
+		if(cur_ > 0) flush();
+		sink_ = sink;
+	}
+
+	/**
+	 * Return the underlying stream, for a sink to write to.
+	 */
+	FILE *file() {
+		return out_;
+	}
+
 	/**
 	 * Reset so that the next write is as though it's the first.
 	 */
@@ -683,10 +751,7 @@ public:
 	}
 
 	void flush() {
-		if(!fwrite((const void *)buf_, cur_, 1, out_)) {
-			std::cerr << "Error while flushing and closing output" << std::endl;
-			throw 1;
-		}
+		writeOut(buf_, cur_);
 		cur_ = 0;
 	}
 
@@ -706,13 +771,26 @@ public:
 
 private:
 
+	/**
+	 * Send bytes to the sink, if any, or else to the file.
+	 */
+	void writeOut(const char *s, size_t len) {
+		if(sink_ != NULL) {
+			sink_->write(s, len);
+		} else if(len > 0 && !fwrite((const void *)s, len, 1, out_)) {
+			std::cerr << "Error while flushing and closing output" << std::endl;
+			throw 1;
+		}
+	}
+
 	static const size_t BUF_SZ = 16 * 1024;
 
-	const char *name_;
-	FILE       *out_;
-	size_t      cur_;
-	char        buf_[BUF_SZ]; // (large) input buffer
-	bool        closed_;
+	const char  *name_;
+	FILE        *out_;
+	size_t       cur_;
+	char         buf_[BUF_SZ]; // (large) input buffer
+	bool         closed_;
+	OutFileSink *sink_;        // NULL unless output is handed off, e.g. to be compressed
 };
 
 #endif /*ndef FILEBUF_H_*/
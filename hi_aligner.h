@@ -650,6 +650,13 @@ struct HIMetrics {
         localsearchrecur = 0;
         globalgenomecoords = 0;
         localgenomecoords = 0;
+        prefiltertests = 0;
+        prefilterrej = 0;
+        hosttests = 0;
+        hostreads = 0;
+        windows = 0;
+        materestricts = 0;
+        materestrictfbs = 0;
 	}
 	
 	void init(
@@ -684,6 +691,13 @@ struct HIMetrics {
         localsearchrecur += r.localsearchrecur;
         globalgenomecoords += r.globalgenomecoords;
         localgenomecoords += r.localgenomecoords;
+        prefiltertests += r.prefiltertests;
+        prefilterrej += r.prefilterrej;
+        hosttests += r.hosttests;
+        hostreads += r.hostreads;
+        windows += r.windows;
+        materestricts += r.materestricts;
+        materestrictfbs += r.materestrictfbs;
     }
 	   
     uint64_t localatts;      // # attempts of local search
@@ -693,6 +707,13 @@ struct HIMetrics {
     uint64_t localsearchrecur;
     uint64_t globalgenomecoords;
     uint64_t localgenomecoords;
+    uint64_t prefiltertests; // # reads checked against the k-mer prefilter
+    uint64_t prefilterrej;   // # reads it rejected, skipping the search
+    uint64_t hosttests;      // # reads or pairs screened against the host filter
+    uint64_t hostreads;      // # reported as host without a search
+    uint64_t windows;        // # long-read windows searched
+    uint64_t materestricts;  // # mate 2s searched for mate 1's candidates only
+    uint64_t materestrictfbs; // # of those that hit none and were redone
 	
 	MUTEX_T mutex_m;
 };
@@ -719,6 +740,8 @@ public:
     _local(local),
     _gwstate(GW_CAT),
     _gwstate_local(GW_CAT),
+    bwops_(0),
+    bwedits_(0),
     _thread_rids_mindist(threads_rids_mindist),
     _no_spliced_alignment(no_spliced_alignment)
     {
@@ -792,7 +815,7 @@ public:
     int go(
            const Scoring&           sc,
            const Ebwt<index_t>&     ebwtFw,
-           const Ebwt<index_t>&     ebwtBw,
+           const Ebwt<index_t>*     ebwtBw,  // mirror index, or NULL
            const BitPairReference&  ref,
            WalkMetrics&             wlm,
            PerReadMetrics&          prm,
@@ -815,7 +838,36 @@ public:
                          ReadBWTHit<index_t>&    hit,     // holds all the seed hits (and exact hit)
                          RandomSource&           rnd);
     
+    /**
+     * Like partialSearch, but also extend the exact match to the right using
+     * the mirror index so that the reported partial hit is maximal on both
+     * ends
+     */
+    size_t bidirPartialSearch(
+                              const Ebwt<index_t>&    ebwtFw,  // BWT index
+                              const Ebwt<index_t>&    ebwtBw,  // BWT' index
+                              const Read&             read,    // read to align
+                              const Scoring&          sc,      // scoring scheme
+                              bool                    fw,
+                              ReadBWTHit<index_t>&    hit,     // holds all the seed hits
+                              RandomSource&           rnd);
+    
 protected:
+    
+    /**
+     * Extend the pattern whose ranges are [top, bot) in 'ebwt' and
+     * [topP, botP) in its mirror by prepending c in 'ebwt's text, which is
+     * appending c in the mirror's text.  Return false if the extended
+     * pattern does not occur.
+     */
+    bool bidirExtend(
+                     const Ebwt<index_t>& ebwt,
+                     int                  c,
+                     index_t&             top,
+                     index_t&             bot,
+                     index_t&             topP,
+                     index_t&             botP);
+
   
     Read *   _rds[2];
     bool     _paired;
@@ -942,26 +994,28 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
         hit.done(true);
 		return 0;
     }
-    // Does N interfere with use of Ftab?
-    for(index_t i = 0; i < ftabLen; i++) {
-        int c = seq[len-dep-1-i];
-        if(c > 3) {
-            cur += (i+1);
-            partialHits.expand();
-            partialHits.back().init((index_t)OFF_MASK,
-                                    (index_t)OFF_MASK,
-                                    fw,
-                                    (uint32_t)offset,
-                                    (uint32_t)(cur - offset));
-            if(cur >= hit._len) {
-                hit.done(true);
-            }
-			return 0;
+    // Does N interfere with use of Ftab?  The N nearest the end of the
+    // ftab window, where the search starts, is in the lowest set pair.
+    uint64_t nmask = 0;
+    uint64_t fi = read.packedKmer(fw, len - dep - ftabLen, (int)ftabLen, nmask);
+    if(nmask != 0) {
+        index_t i = (index_t)(__builtin_ctzll(nmask) >> 1);
+        cur += (i+1);
+        partialHits.expand();
+        partialHits.back().init((index_t)OFF_MASK,
+                                (index_t)OFF_MASK,
+                                fw,
+                                (uint32_t)offset,
+                                (uint32_t)(cur - offset));
+        if(cur >= hit._len) {
+            hit.done(true);
         }
+        return 0;
     }
     
     // Use ftab
-    ebwt.ftabLoHi(seq, len - dep - ftabLen, false, top, bot);
+    assert(ebwt.fw());
+    ebwt.ftabLoHi((index_t)fi, top, bot);
     dep += ftabLen;
     if(bot <= top) {
         cur = dep;
@@ -1030,4 +1084,174 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
     return nelt;
 }
 
+template <typename index_t, typename local_index_t>
+bool HI_Aligner<index_t, local_index_t>::bidirExtend(
+                                                     const Ebwt<index_t>& ebwt,
+                                                     int                  c,
+                                                     index_t&             top,
+                                                     index_t&             bot,
+                                                     index_t&             topP,
+                                                     index_t&             botP)
+{
+    assert_range(0, 3, c);
+    assert_gt(bot, top);
+    assert_eq(bot - top, botP - topP);
+    if(bot - top == 1) {
+        // A single occurrence keeps its row in the mirror
+        SideLocus<index_t> tloc;
+        tloc.initFromRow(top, ebwt.eh(), ebwt.ebwt());
+        bwops_++;
+        index_t topTemp = ebwt.mapLF1(top, tloc, c);
+        if(topTemp == (index_t)OFF_MASK) {
+            return false;
+        }
+        top = topTemp;
+        bot = topTemp + 1;
+        return true;
+    }
+    SideLocus<index_t> tloc, bloc;
+    SideLocus<index_t>::initFromTopBot(top, bot, ebwt.eh(), ebwt.ebwt(), tloc, bloc);
+    index_t tops[4] = {0, 0, 0, 0}, bots[4] = {0, 0, 0, 0};
+    bwops_ += 2;
+    ebwt.mapLFEx(tloc, bloc, tops, bots);
+    if(bots[c] <= tops[c]) {
+        return false;
+    }
+    // In the mirror, occurrences are ordered by the character that precedes
+    // them here: '$' (the pattern is a prefix of the text) first, then A, C,
+    // G and T
+    index_t below = bot - top;
+    for(int i = 0; i < 4; i++) {
+        below -= (bots[i] - tops[i]);
+    }
+    for(int i = 0; i < c; i++) {
+        below += (bots[i] - tops[i]);
+    }
+    topP += below;
+    botP = topP + (bots[c] - tops[c]);
+    top = tops[c];
+    bot = bots[c];
+    return true;
+}
+
+/**
+ * Sweep right-to-left with the forward index as partialSearch does, keeping
+ * the mirror index's range in step, then sweep left-to-right from the start
+ * offset with the mirror index.  The resulting partial hit is a maximal exact
+ * match; its range in the forward index is the one reported.
+ */
+template <typename index_t, typename local_index_t>
+size_t HI_Aligner<index_t, local_index_t>::bidirPartialSearch(
+                                                              const Ebwt<index_t>&      ebwtFw,  // BWT index
+                                                              const Ebwt<index_t>&      ebwtBw,  // BWT' index
+                                                              const Read&               read,    // read to align
+                                                              const Scoring&            sc,      // scoring scheme
+                                                              bool                      fw,
+                                                              ReadBWTHit<index_t>&      hit,     // holds all the seed hits
+                                                              RandomSource&             rnd)     // pseudo-random source
+{
+    const index_t ftabLen = ebwtFw.eh().ftabChars();
+    assert_eq(ftabLen, ebwtBw.eh().ftabChars());
+    const index_t len = (index_t)read.length();
+    const BTDnaString& seq = fw ? read.patFw : read.patRc;
+    assert(!seq.empty());
+    
+    EList<BWTHit<index_t> >& partialHits = hit._partialHits;
+    index_t& cur = hit._cur;
+    assert_lt(cur, hit._len);
+    
+    hit._numPartialSearch++;
+    
+    index_t offset = cur;
+    index_t dep = offset;
+    index_t top = 0, bot = 0, topP = 0, botP = 0;
+    index_t left = len - dep;
+    assert_gt(left, 0);
+    if(left < ftabLen) {
+        cur = hit._len;
+        partialHits.expand();
+        partialHits.back().init((index_t)OFF_MASK,
+                                (index_t)OFF_MASK,
+                                fw,
+                                (uint32_t)offset,
+                                (uint32_t)(cur - offset));
+        hit.done(true);
+        return 0;
+    }
+    // Does N interfere with use of Ftab?  The N nearest the end of the
+    // ftab window, where the search starts, is in the lowest set pair.
+    uint64_t nmask = 0;
+    uint64_t fi = read.packedKmer(fw, len - dep - ftabLen, (int)ftabLen, nmask);
+    if(nmask != 0) {
+        index_t i = (index_t)(__builtin_ctzll(nmask) >> 1);
+        cur += (i+1);
+        partialHits.expand();
+        partialHits.back().init((index_t)OFF_MASK,
+                                (index_t)OFF_MASK,
+                                fw,
+                                (uint32_t)offset,
+                                (uint32_t)(cur - offset));
+        if(cur >= hit._len) {
+            hit.done(true);
+        }
+        return 0;
+    }
+    
+    // Use both ftabs
+    assert(ebwtFw.fw());
+    ebwtFw.ftabLoHi((index_t)fi, top, bot);
+    dep += ftabLen;
+    if(bot <= top) {
+        cur = dep;
+        partialHits.expand();
+        partialHits.back().init((index_t)OFF_MASK,
+                                (index_t)OFF_MASK,
+                                fw,
+                                (uint32_t)offset,
+                                (uint32_t)(cur - offset));
+        if(cur >= hit._len) {
+            hit.done(true);
+        }
+        return 0;
+    }
+    ebwtBw.ftabLoHi(seq, len - dep, false, topP, botP);
+    assert_eq(bot - top, botP - topP);
+    
+    // Extend to the left
+    while(dep < len) {
+        int c = seq[len-dep-1];
+        if(c > 3 || !bidirExtend(ebwtFw, c, top, bot, topP, botP)) {
+            break;
+        }
+        dep++;
+    }
+    
+    // Extend to the right, past the offset the search started from
+    index_t off = offset;
+    while(off > 0) {
+        int c = seq[len-off];
+        if(c > 3 || !bidirExtend(ebwtBw, c, topP, botP, top, bot)) {
+            break;
+        }
+        off--;
+    }
+    
+    assert_gt(bot, top);
+    assert_gt(dep, off);
+    assert_leq(dep, len);
+    partialHits.expand();
+    partialHits.back().init(top,
+                            bot,
+                            fw,
+                            (uint32_t)off,
+                            (uint32_t)(dep - off),
+                            CANDIDATE_HIT);
+    cur = dep;
+    if(cur >= hit._len) {
+        hit._numUniqueSearch++;
+        hit.done(true);
+    }
+    return bot - top;
+}
+
 #endif /*HI_ALIGNER_H_*/
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KMER_FILTER_H_
+#define KMER_FILTER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include "assert_helpers.h"
+#include "alphabet.h"
+#include "ds.h"
+#include "endian_swap.h"
+#include "filebuf.h"
+#include "sstring.h"
+
+using namespace std;
+
+/// Filter bits allotted per reference k-mer
+#define KMER_FILTER_BITS_PER_KMER 8
+/// Bits set per k-mer, all within one block
+#define KMER_FILTER_PROBES 5
+/// Block size in 64-bit words; one 64-byte cache line
+#define KMER_FILTER_BLOCK_WORDS 8
+
+/**
+ * Blocked Bloom filter holding the canonical k-mers (the lesser of a k-mer
+ * and its reverse complement) of a reference.  Every k-mer sets its bits in
+ * a single 512-bit block, so a lookup touches one cache line.  There are no
+ * false negatives: a read none of whose k-mers are in the filter can't have
+ * an exact match of k or more characters anywhere in the reference.
+ */
+class KmerFilter {
+
+public:
+
+	KmerFilter() : _k(0), _nblocks(0), _words(NULL) { }
+
+	~KmerFilter() {
+		delete[] _words;
+	}
+
+	/**
+	 * Allocate an empty filter for up to 'nkmers' k-mers.
+	 */
+	void init(int k, uint64_t nkmers) {
+		assert_range(1, 32, k);
+		delete[] _words;
+		_k = k;
+		_nblocks = (nkmers * KMER_FILTER_BITS_PER_KMER + 511) / 512;
+		if(_nblocks == 0) _nblocks = 1;
+		_words = new uint64_t[_nblocks * KMER_FILTER_BLOCK_WORDS];
+		memset(_words, 0, _nblocks * KMER_FILTER_BLOCK_WORDS * sizeof(uint64_t));
+	}
+
+	bool empty() const { return _words == NULL; }
+	int k() const { return _k; }
+
+	/// Size of the bit array in bytes
+	uint64_t bytes() const {
+		return _nblocks * KMER_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+	}
+
+	/**
+	 * Add a canonical k-mer.
+	 */
+	void add(uint64_t kmer) {
+		uint64_t h = mix(kmer);
+		uint64_t *block = _words + blockOff(h);
+		uint64_t p = mix(h);
+		for(int i = 0; i < KMER_FILTER_PROBES; i++, p >>= 9) {
+			block[(p >> 6) & 7] |= (1ULL << (p & 63));
+		}
+	}
+
+	/**
+	 * Return true iff the canonical k-mer may be in the filter.
+	 */
+	bool contains(uint64_t kmer) const {
+		uint64_t h = mix(kmer);
+		const uint64_t *block = _words + blockOff(h);
+		uint64_t p = mix(h);
+		for(int i = 0; i < KMER_FILTER_PROBES; i++, p >>= 9) {
+			if((block[(p >> 6) & 7] & (1ULL << (p & 63))) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Add every k-mer of the sequences in a list of FASTA streams.
+	 * Characters other than A, C, G and T are dropped (or read as A if
+	 * 'nsToAs') and everything else is concatenated, the same way the
+	 * reference is joined into the text the index is built from, so any
+	 * k-mer the index can match is added.  Returns the number of k-mers
+	 * added.
+	 */
+	uint64_t addFasta(EList<FileBuf*>& is, bool nsToAs) {
+		assert(!empty());
+		const uint64_t mask = (_k == 32) ? ~0ULL : ((1ULL << (2 * _k)) - 1);
+		const int rcShift = 2 * (_k - 1);
+		uint64_t fw = 0, rc = 0, added = 0;
+		int filled = 0;
+		for(size_t i = 0; i < is.size(); i++) {
+			FileBuf& fb = *is[i];
+			fb.reset();
+			while(true) {
+				int c = fb.get();
+				if(c < 0) break;
+				if(c == '>') {
+					// Skip the name line
+					while(c >= 0 && c != '\n' && c != '\r') c = fb.get();
+					continue;
+				}
+				int cat = asc2dnacat[c];
+				if(cat == 0) continue; // whitespace etc.
+				int nt = 0;
+				if(cat == 1) {
+					nt = asc2dna[c];
+				} else if(!nsToAs) {
+					continue;
+				}
+				fw = ((fw << 2) | (uint64_t)nt) & mask;
+				rc = (rc >> 2) | ((uint64_t)(3 - nt) << rcShift);
+				if(++filled >= _k) {
+					add(fw < rc ? fw : rc);
+					added++;
+				}
+			}
+			fb.reset();
+		}
+		return added;
+	}
+
+	/**
+	 * Return true iff some k-mer of 'seq' (in either orientation) may be
+	 * in the filter.  Ns break k-mers.
+	 */
+	bool anyKmer(const BTDnaString& seq) const {
+		assert(!empty());
+		const uint64_t mask = (_k == 32) ? ~0ULL : ((1ULL << (2 * _k)) - 1);
+		const int rcShift = 2 * (_k - 1);
+		uint64_t fw = 0, rc = 0;
+		int filled = 0;
+		for(size_t i = 0; i < seq.length(); i++) {
+			int nt = seq[i];
+			if(nt > 3) {
+				filled = 0;
+				continue;
+			}
+			fw = ((fw << 2) | (uint64_t)nt) & mask;
+			rc = (rc >> 2) | ((uint64_t)(3 - nt) << rcShift);
+			if(++filled >= _k && contains(fw < rc ? fw : rc)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Return the number of k-mers of 'seq' that may be in the filter, and
+	 * set 'nkmers' to the number of k-mers it has.  Ns break k-mers.
+	 */
+	size_t countKmers(const BTDnaString& seq, size_t& nkmers) const {
+		assert(!empty());
+		const uint64_t mask = (_k == 32) ? ~0ULL : ((1ULL << (2 * _k)) - 1);
+		const int rcShift = 2 * (_k - 1);
+		uint64_t fw = 0, rc = 0;
+		int filled = 0;
+		size_t found = 0;
+		nkmers = 0;
+		for(size_t i = 0; i < seq.length(); i++) {
+			int nt = seq[i];
+			if(nt > 3) {
+				filled = 0;
+				continue;
+			}
+			fw = ((fw << 2) | (uint64_t)nt) & mask;
+			rc = (rc >> 2) | ((uint64_t)(3 - nt) << rcShift);
+			if(++filled >= _k) {
+				nkmers++;
+				if(contains(fw < rc ? fw : rc)) found++;
+			}
+		}
+		return found;
+	}
+
+	/**
+	 * Write the filter to a file in this machine's byte order, preceded by
+	 * an endianness sentinel.
+	 */
+	void writeToFile(const string& fname) const {
+		ofstream out(fname.c_str(), ios::binary);
+		if(!out.good()) {
+			cerr << "Could not open file for writing: \"" << fname.c_str() << "\"" << endl;
+			throw 1;
+		}
+		int32_t one = 1;
+		int32_t k = _k;
+		out.write((const char*)&one, 4);
+		out.write((const char*)&k, 4);
+		out.write((const char*)&_nblocks, 8);
+		out.write((const char*)_words, (streamsize)bytes());
+		out.close();
+		if(out.fail()) {
+			cerr << "An error occurred writing \"" << fname.c_str() << "\".  Please check if the disk is full." << endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Read a filter written by writeToFile.  Returns false if the file
+	 * can't be opened.
+	 */
+	bool readFromFile(const string& fname) {
+		ifstream in(fname.c_str(), ios::binary);
+		if(!in.good()) {
+			return false;
+		}
+		int32_t one = 0, k = 0;
+		uint64_t nblocks = 0;
+		in.read((char*)&one, 4);
+		in.read((char*)&k, 4);
+		in.read((char*)&nblocks, 8);
+		bool swap = (one != 1);
+		if(swap) {
+			k = endianSwapI32(k);
+			nblocks = endianSwapU64(nblocks);
+		}
+		if(!in.good() || k < 1 || k > 32 || nblocks == 0) {
+			cerr << "Error: \"" << fname.c_str() << "\" is not a k-mer filter file" << endl;
+			throw 1;
+		}
+		delete[] _words;
+		_k = k;
+		_nblocks = nblocks;
+		_words = new uint64_t[_nblocks * KMER_FILTER_BLOCK_WORDS];
+		in.read((char*)_words, (streamsize)bytes());
+		if((uint64_t)in.gcount() != bytes()) {
+			cerr << "Error: k-mer filter file \"" << fname.c_str() << "\" is truncated" << endl;
+			throw 1;
+		}
+		if(swap) {
+			for(uint64_t i = 0; i < _nblocks * KMER_FILTER_BLOCK_WORDS; i++) {
+				_words[i] = endianSwapU64(_words[i]);
+			}
+		}
+		return true;
+	}
+
+private:
+
+	KmerFilter(const KmerFilter&);
+	KmerFilter& operator=(const KmerFilter&);
+
+	/**
+	 * Scramble the bits of a k-mer (the splitmix64 finalizer).
+	 */
+	static inline uint64_t mix(uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	/**
+	 * Offset of the block a hash selects.  The bits probed within the
+	 * block come from a second round of mixing.
+	 */
+	inline uint64_t blockOff(uint64_t h) const {
+		return ((h >> 32) % _nblocks) * KMER_FILTER_BLOCK_WORDS;
+	}
+
+	int       _k;
+	uint64_t  _nblocks;
+	uint64_t *_words;
+};
+
+#endif /*KMER_FILTER_H_*/
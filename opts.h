@@ -31,6 +31,8 @@ enum {
 	ARG_METRIC_FILE,            // --met-file
 	ARG_METRIC_STDERR,          // --met-stderr
 	ARG_METRIC_PER_READ,        // --met-per-read
+	ARG_METRIC_JSON,            // --met-json
+	ARG_PERF_COUNTERS,          // --perf-counters
 	ARG_REFIDX,                 // --refidx
 	ARG_SANITY,                 // --sanity
 	ARG_PARTITION,              // --partition
@@ -172,6 +174,22 @@ enum {
     ARG_EXCLUDE_TAXIDS,
     ARG_OUT_FMT,
     ARG_TAB_FMT_COLS,
+    ARG_SMEM,                    // --smem
+    ARG_STRAND_PRUNE,            // --strand-prune
+    ARG_NO_PREFILTER,            // --no-prefilter
+    ARG_HOST_FILTER,             // --host-filter
+    ARG_HOST_FILTER_TAXID,       // --host-filter-taxid
+    ARG_HOST_MIN_FRAC,           // --host-min-frac
+    ARG_SHARD_TMP,               // --shard-tmp
+    ARG_LONG_READ_WINDOW,        // --long-read-window
+    ARG_LONG_READ_OVERLAP,       // --long-read-overlap
+    ARG_LONG_READ_SEGMENTS,      // --long-read-segments
+    ARG_REPORT_INTERVAL,         // --report-interval
+    ARG_MATE_CANDIDATES,         // --mate-candidates
+    ARG_WRITER_THREAD,           // --writer-thread
+    ARG_OUT_GZ,                  // --out-gz
+    ARG_MAX_MEM,                 // --max-mem
+    ARG_MEM_REPORT,              // --mem-report
 #ifdef USE_SRA
     ARG_SRA_ACC,
 #endif
@@ -31,35 +31,69 @@ void OutputQueue::beginRead(TReadId rdid, size_t threadId) {
 		assert_eq(lines_.size(), finished_.size());
 		assert_eq(lines_.size(), started_.size());
 		if(rdid - cur_ >= lines_.size()) {
-			// Make sure there's enough room in lines_, started_ and finished_
-			size_t oldsz = lines_.size();
-			lines_.resize(rdid - cur_ + 1);
-			started_.resize(rdid - cur_ + 1);
-			finished_.resize(rdid - cur_ + 1);
-			for(size_t i = oldsz; i < lines_.size(); i++) {
-				started_[i] = finished_[i] = false;
-			}
+			growRing(rdid);
 		}
-		started_[rdid - cur_] = true;
-		finished_[rdid - cur_] = false;
+		size_t s = slot(rdid);
+		started_[s] = true;
+		finished_[s] = false;
+	}
+}
+
+/**
+ * Double the ring until it has room for read 'rdid', keeping the waiting
+ * slots in order starting from slot 0.
+ */
+void OutputQueue::growRing(TReadId rdid) {
+	size_t oldsz = lines_.size();
+	size_t sz = oldsz;
+	while(rdid - cur_ >= sz) {
+		sz <<= 1;
+	}
+	EList<BTString> lines(RES_CAT);
+	lines.resize(sz);
+	for(size_t i = 0; i < oldsz; i++) {
+		lines[i].swap(lines_[(head_ + i) & (oldsz - 1)]);
 	}
+	lines_.swap(lines);
+	EList<bool> started(RES_CAT), finished(RES_CAT);
+	started.resize(sz);
+	finished.resize(sz);
+	started.fill(false);
+	finished.fill(false);
+	for(size_t i = 0; i < oldsz; i++) {
+		started[i] = started_[(head_ + i) & (oldsz - 1)];
+		finished[i] = finished_[(head_ + i) & (oldsz - 1)];
+	}
+	started_.swap(started);
+	finished_.swap(finished);
+	head_ = 0;
 }
 
 /**
- * Writer is finished writing to 
+ * Writer is finished writing to 'rec'.
  */
-void OutputQueue::finishRead(const BTString& rec, TReadId rdid, size_t threadId) {
+void OutputQueue::finishRead(BTString& rec, TReadId rdid, size_t threadId) {
+	if(!reorder_ && writer_ != NULL) {
+		// Only this thread fills its block, so it needn't hold the lock
+		write(rec, threadId);
+		ThreadSafe t(&mutex_m, threadSafe_);
+		nfinished_++;
+		nflushed_++;
+		return;
+	}
 	ThreadSafe t(&mutex_m, threadSafe_);
 	if(reorder_) {
 		assert_geq(rdid, cur_);
 		assert_eq(lines_.size(), finished_.size());
 		assert_eq(lines_.size(), started_.size());
 		assert_lt(rdid - cur_, lines_.size());
-		assert(started_[rdid - cur_]);
-		assert(!finished_[rdid - cur_]);
-		lines_[rdid - cur_] = rec;
+		size_t s = slot(rdid);
+		assert(started_[s]);
+		assert(!finished_[s]);
+		assert(lines_[s].empty());
+		lines_[s].swap(rec);
 		nfinished_++;
-		finished_[rdid - cur_] = true;
+		finished_[s] = true;
 		flush(false, false); // don't force; already have lock
 	} else {
 		// obuf_ is the OutFileBuf for the output file
@@ -69,33 +103,154 @@ void OutputQueue::finishRead(const BTString& rec, TReadId rdid, size_t threadId)
 	}
 }
 
+/**
+ * Write a record to obuf_, or to the writer thread's block 'bi'.
+ */
+void OutputQueue::write(const BTString& rec, size_t bi) {
+	if(writer_ == NULL) {
+		obuf_.writeString(rec);
+		return;
+	}
+	assert_lt(bi, blocks_.size());
+	BTString*& block = blocks_[bi];
+	block->append(rec.buf(), rec.length());
+	if(block->length() >= BLOCK_SZ) {
+		handOff(block);
+	}
+}
+
 /**
  * Write already-finished lines starting from cur_.
  */
 void OutputQueue::flush(bool force, bool getLock) {
 	if(!reorder_) {
+		if(force && writer_ != NULL) {
+			drain();
+		}
 		return;
 	}
 	ThreadSafe t(&mutex_m, getLock && threadSafe_);
+	const size_t mask = lines_.size() - 1;
 	size_t nflush = 0;
-	while(nflush < finished_.size() && finished_[nflush]) {
-		assert(started_[nflush]);
+	while(nflush < lines_.size() && finished_[(head_ + nflush) & mask]) {
+		assert(started_[(head_ + nflush) & mask]);
 		nflush++;
 	}
-	// Waiting until we have several in a row to flush cuts down on copies
-	// (but requires more buffering)
+	// Waiting until we have several in a row to flush writes them as one
+	// chunk (but requires more buffering)
 	if(force || nflush >= NFLUSH_THRESH) {
 		for(size_t i = 0; i < nflush; i++) {
-			assert(started_[i]);
-			assert(finished_[i]);
-			obuf_.writeString(lines_[i]);
+			assert(started_[head_]);
+			assert(finished_[head_]);
+			write(lines_[head_], 0);
+			lines_[head_].clear();
+			started_[head_] = finished_[head_] = false;
+			head_ = (head_ + 1) & mask;
 		}
-		lines_.erase(0, nflush);
-		started_.erase(0, nflush);
-		finished_.erase(0, nflush);
 		cur_ += nflush;
 		nflushed_ += nflush;
 	}
+	if(force && writer_ != NULL) {
+		drain();
+	}
+}
+
+void OutputQueue::startWriter(size_t nthreads) {
+	// Thread ids start at 1
+	blocks_.resize(nthreads + 1);
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		blocks_[i] = new BTString();
+	}
+	writer_ = new tthread::thread(OutputQueue::writerMain, (void*)this);
+}
+
+/**
+ * Queue a block for the writer thread and replace it with an empty one,
+ * waiting if MAX_PENDING blocks are queued already.
+ */
+void OutputQueue::handOff(BTString*& block) {
+	tthread::lock_guard<tthread::mutex> lock(wmutex_);
+	while(pending_.size() >= MAX_PENDING) {
+		wcond_.wait(wmutex_);
+	}
+	pending_.push_back(block);
+	if(spare_.empty()) {
+		block = new BTString();
+	} else {
+		block = spare_.back();
+		spare_.pop_back();
+	}
+	wcond_.notify_all();
+}
+
+/**
+ * Hand off all blocks and wait until they've been written.
+ */
+void OutputQueue::drain() {
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		if(blocks_[i]->length() > 0) {
+			handOff(blocks_[i]);
+		}
+	}
+	tthread::lock_guard<tthread::mutex> lock(wmutex_);
+	while(!pending_.empty() || writing_) {
+		wcond_.wait(wmutex_);
+	}
+}
+
+void OutputQueue::stopWriter() {
+	if(writer_ == NULL) {
+		return;
+	}
+	{
+		tthread::lock_guard<tthread::mutex> lock(wmutex_);
+		stop_ = true;
+		wcond_.notify_all();
+	}
+	writer_->join();
+	delete writer_;
+	writer_ = NULL;
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		assert_eq(0, blocks_[i]->length());
+		delete blocks_[i];
+	}
+	for(size_t i = 0; i < spare_.size(); i++) {
+		delete spare_[i];
+	}
+	blocks_.clear();
+	spare_.clear();
+}
+
+/**
+ * Body of the writer thread: write blocks to obuf_ in the order they were
+ * handed off until told to stop with none left.
+ */
+void OutputQueue::writerMain(void *vp) {
+	OutputQueue& q = *(OutputQueue*)vp;
+	while(true) {
+		BTString* block = NULL;
+		{
+			tthread::lock_guard<tthread::mutex> lock(q.wmutex_);
+			while(q.pending_.empty() && !q.stop_) {
+				q.wcond_.wait(q.wmutex_);
+			}
+			if(q.pending_.empty()) {
+				break;
+			}
+			block = q.pending_[0];
+			q.pending_.erase(0);
+			q.writing_ = true;
+			q.wcond_.notify_all();
+		}
+		q.obuf_.writeChars(block->buf(), block->length());
+		block->clear();
+		{
+			tthread::lock_guard<tthread::mutex> lock(q.wmutex_);
+			q.spare_.push_back(block);
+			q.writing_ = false;
+			q.wcond_.notify_all();
+		}
+	}
 }
 
 #ifdef OUTQ_MAIN
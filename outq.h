@@ -26,39 +26,71 @@
 #include "read.h"
 #include "threading.h"
 #include "mem_ids.h"
+#include "stage_metrics.h"
 
 /**
- * Encapsulates a list of lines of output.  If the earliest as-yet-unreported
- * read has id N and Bowtie 2 wants to write a record for read with id N+1, we
- * resize the lines_ and committed_ lists to have at least 2 elements (1 for N,
- * 1 for N+1) and return the BTString * associated with the 2nd element.  When
- * the user calls commit() for the read with id N, 
+ * Encapsulates a list of lines of output.  When reordering, records wait in
+ * a ring of per-read slots: the earliest as-yet-unreported read, cur_, is in
+ * slot head_ and read cur_+i in slot (head_+i) mod the ring size, which is a
+ * power of two.  A finished record is swapped into its slot rather than
+ * copied, and flushing just moves head_ past the run of finished slots, so
+ * neither costs more as the backlog behind a slow read grows.  The ring
+ * doubles if a read gets further than its size ahead of cur_.
  */
 class OutputQueue {
 
 	static const size_t NFLUSH_THRESH = 8;
+	static const size_t RING_SZ = 1024;         // initial number of reorder slots
+	static const size_t BLOCK_SZ = 1024 * 1024; // bytes handed to the writer thread at once
+	static const size_t MAX_PENDING = 32;       // blocks waiting for it before callers wait
 
 public:
 
+	/**
+	 * If 'writerThread' is set, a thread of the queue's own does all the
+	 * writing to 'obuf'.  Records are gathered into blocks of about
+	 * BLOCK_SZ bytes, one per calling thread (or, when reordering, one for
+	 * the records in order), and full blocks are handed to the writer, so
+	 * the threads finishing reads never wait on the output file.
+	 */
 	OutputQueue(
 		OutFileBuf& obuf,
 		bool reorder,
 		size_t nthreads,
 		bool threadSafe,
-		TReadId rdid = 0) :
+		TReadId rdid = 0,
+		bool writerThread = false) :
 		obuf_(obuf),
 		cur_(rdid),
 		nstarted_(0),
 		nfinished_(0),
 		nflushed_(0),
+		head_(0),
 		lines_(RES_CAT),
 		started_(RES_CAT),
 		finished_(RES_CAT),
 		reorder_(reorder),
 		threadSafe_(threadSafe),
-        mutex_m()
+        mutex_m(),
+		writer_(NULL),
+		writing_(false),
+		stop_(false)
 	{
 		assert(nthreads <= 1 || threadSafe);
+		if(reorder_) {
+			lines_.resize(RING_SZ);
+			started_.resize(RING_SZ);
+			finished_.resize(RING_SZ);
+			started_.fill(false);
+			finished_.fill(false);
+		}
+		if(writerThread) {
+			startWriter(nthreads);
+		}
+	}
+
+	~OutputQueue() {
+		stopWriter();
 	}
 
 	/**
@@ -68,15 +100,17 @@ public:
 	void beginRead(TReadId rdid, size_t threadId);
 	
 	/**
-	 * Writer is finished writing to 
+	 * Writer is finished writing to 'rec'.  When reordering, the record is
+	 * taken by swapping buffers with a slot, so 'rec' is left holding some
+	 * earlier record's cleared buffer.
 	 */
-	void finishRead(const BTString& rec, TReadId rdid, size_t threadId);
+	void finishRead(BTString& rec, TReadId rdid, size_t threadId);
 	
 	/**
 	 * Return the number of records currently being buffered.
 	 */
 	size_t size() const {
-		return lines_.size();
+		return (size_t)(nstarted_ - nflushed_);
 	}
 	
 	/**
@@ -101,49 +135,102 @@ public:
 	}
 
 	/**
-	 * Write already-committed lines starting from cur_.
+	 * Write already-committed lines starting from cur_.  If 'force' is
+	 * set and there's a writer thread, also hand it every partly filled
+	 * block and wait until it has written them; no other thread may be
+	 * finishing reads then.
 	 */
 	void flush(bool force = false, bool getLock = true);
 
 protected:
 
+	/**
+	 * Return the ring slot holding the record for read 'rdid'.
+	 */
+	size_t slot(TReadId rdid) const {
+		assert_geq(rdid, cur_);
+		return (head_ + (size_t)(rdid - cur_)) & (lines_.size() - 1);
+	}
+
+	/**
+	 * Double the ring until it has room for read 'rdid', keeping the
+	 * waiting slots in order starting from slot 0.
+	 */
+	void growRing(TReadId rdid);
+
+	/**
+	 * Write a record to obuf_, or to the writer thread's block 'bi'.
+	 */
+	void write(const BTString& rec, size_t bi);
+
+	void startWriter(size_t nthreads);
+
+	/**
+	 * Queue a block for the writer thread and replace it with an empty
+	 * one, waiting if MAX_PENDING blocks are queued already.
+	 */
+	void handOff(BTString*& block);
+
+	/**
+	 * Hand off all blocks and wait until they've been written.
+	 */
+	void drain();
+
+	void stopWriter();
+
+	static void writerMain(void *vp);
+
 	OutFileBuf&     obuf_;
 	TReadId         cur_;
 	TReadId         nstarted_;
 	TReadId         nfinished_;
 	TReadId         nflushed_;
-	EList<BTString> lines_;
+	size_t          head_;     // slot of read cur_
+	EList<BTString> lines_;    // ring of records; size is a power of two
 	EList<bool>     started_;
 	EList<bool>     finished_;
 	bool            reorder_;
 	bool            threadSafe_;
 	MUTEX_T         mutex_m;
+
+	tthread::thread*  writer_;  // NULL if records are written by the caller
+	EList<BTString*>  blocks_;  // block being filled per thread id, or [0] when reordering
+	EList<BTString*>  pending_; // blocks handed to the writer, oldest first
+	EList<BTString*>  spare_;   // written blocks, for reuse
+	bool              writing_; // writer is writing a block it took off pending_
+	bool              stop_;
+	tthread::mutex    wmutex_;  // guards pending_, spare_, writing_ and stop_
+	tthread::condition_variable wcond_;
 };
 
 class OutputQueueMark {
 public:
 	OutputQueueMark(
 		OutputQueue& q,
-		const BTString& rec,
+		BTString& rec,
 		TReadId rdid,
-		size_t threadId) :
+		size_t threadId,
+		StageMetrics *stages = NULL) :
 		q_(q),
 		rec_(rec),
 		rdid_(rdid),
-		threadId_(threadId)
+		threadId_(threadId),
+		stages_(stages)
 	{
 		q_.beginRead(rdid, threadId);
 	}
 	
 	~OutputQueueMark() {
+		StageTimer t(stages_, STAGE_OUTPUT);
 		q_.finishRead(rec_, rdid_, threadId_);
 	}
 	
 protected:
 	OutputQueue& q_;
-	const BTString& rec_;
+	BTString& rec_;
 	TReadId rdid_;
 	size_t threadId_;
+	StageMetrics *stages_; // NULL unless timing the output stage
 };
 
 #endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/**
+ * Hardware events counted with --perf-counters.
+ */
+enum {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES, // last-level cache
+	PERF_DTLB_MISSES,  // data TLB, loads
+	NUM_PERF
+};
+
+static const char * const perfNames[NUM_PERF] = {
+	"cycles", "instructions", "cache_misses", "dtlb_misses"
+};
+
+/**
+ * Hardware performance counters for the calling thread, counted in user
+ * space only.  The events are opened as one group so that they are
+ * counted over the same intervals; an event the CPU or the kernel doesn't
+ * offer is left out and reads as 0.  If not even cycles can be counted
+ * (no perf events in the kernel, perf_event_paranoid set too high, or a
+ * container without the syscall), ok() is false and there's nothing to
+ * read.
+ */
+class PerfCounters {
+
+public:
+
+	PerfCounters() : avail_(0), nopen_(0), errno_(0) {
+		for(size_t i = 0; i < NUM_PERF; i++) {
+			fds_[i] = -1;
+			slot_[i] = 0;
+		}
+#ifdef __linux__
+		static const uint32_t types[NUM_PERF] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+		};
+		static const uint64_t configs[NUM_PERF] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+		};
+		for(size_t i = 0; i < NUM_PERF; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[i];
+			attr.config = configs[i];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP |
+			                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+			                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+			int group = (i == 0 ? -1 : fds_[0]);
+			int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+			if(fd < 0) {
+				if(i == 0) {
+					errno_ = errno;
+					return;
+				}
+				continue;
+			}
+			fds_[i] = fd;
+			slot_[i] = nopen_++;
+			avail_ |= (1u << i);
+		}
+#else
+		errno_ = ENOSYS;
+#endif
+	}
+
+	~PerfCounters() {
+#ifdef __linux__
+		for(size_t i = 0; i < NUM_PERF; i++) {
+			if(fds_[i] >= 0) close(fds_[i]);
+		}
+#endif
+	}
+
+	/**
+	 * Return true iff there are counters to read.
+	 */
+	bool ok() const { return avail_ != 0; }
+
+	/**
+	 * Return a mask of the events being counted, bit i for event i.
+	 */
+	uint32_t avail() const { return avail_; }
+
+	/**
+	 * Return the errno that kept us from counting at all, or 0.
+	 */
+	int error() const { return errno_; }
+
+	/**
+	 * Put the counts so far in vals[0..NUM_PERF), scaled up for time the
+	 * group wasn't on the CPU because the kernel was sharing counters
+	 * between several groups.  Return false if they couldn't be read.
+	 */
+	bool read(uint64_t *vals) const {
+		memset(vals, 0, NUM_PERF * sizeof(uint64_t));
+#ifdef __linux__
+		if(!ok()) return false;
+		// nr, time enabled, time running, then a value per open event
+		uint64_t buf[3 + NUM_PERF];
+		ssize_t n = ::read(fds_[0], buf, sizeof(buf));
+		if(n < (ssize_t)(3 * sizeof(uint64_t)) || buf[0] != nopen_) {
+			return false;
+		}
+		double scale = (buf[2] > 0 && buf[2] < buf[1]) ? (double)buf[1] / (double)buf[2] : 1.0;
+		for(size_t i = 0; i < NUM_PERF; i++) {
+			if(avail_ & (1u << i)) {
+				vals[i] = (uint64_t)(buf[3 + slot_[i]] * scale);
+			}
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+private:
+
+	int      fds_[NUM_PERF];  // file descriptor per event, or -1
+	uint32_t slot_[NUM_PERF]; // where each event is in what the group reads
+	uint32_t avail_;          // events being counted
+	uint32_t nopen_;          // # events opened
+	int      errno_;          // why the group couldn't be opened
+};
+
+#endif /*PERF_COUNTERS_H_*/
@@ -2,8 +2,9 @@
 #define PROCESSOR_SUPPORT_H_
 
 // Utility class ProcessorSupport provides POPCNTenabled() to determine
-// processor support for POPCNT instruction. It uses CPUID to
-// retrieve the processor capabilities.
+// processor support for POPCNT instruction, and AVX2enabled() /
+// AVX512POPCNTenabled() for the vector rank kernels in rank_simd.h. It
+// uses CPUID to retrieve the processor capabilities.
 // for Intel ICC compiler __cpuid() is an intrinsic 
 // for Microsoft compiler __cpuid() is provided by #include <intrin.h>
 // for GCC compiler __get_cpuid() is provided by #include <cpuid.h>
@@ -17,7 +18,8 @@
 #   include <cpuid.h>
 #elif defined(_MSC_VER)
 // __MSC_VER defined by Microsoft compiler
-#define USING MSC_COMPILER
+#   define USING_MSC_COMPILER
+#   include <intrin.h>
 #endif
 
 struct regs_t {unsigned int EAX, EBX, ECX, EDX;};
@@ -49,7 +51,7 @@ public:
 #elif defined(USING_GCC_COMPILER)
         __get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX);
 #else
-        std::cerr << “ERROR: please define __cpuid() for this build.\n”; 
+        std::cerr << "ERROR: please define __cpuid() for this build.\n";
         assert(0);
 #endif
         if( !( (regs.ECX & BIT(20)) && (regs.ECX & BIT(23)) ) ) return false;
@@ -60,6 +62,79 @@ public:
     return true;
     }
 
+    /**
+     * Return true iff the processor supports AVX2 and the OS saves the
+     * YMM registers across context switches.
+     */
+    bool AVX2enabled()
+    {
+        regs_t regs;
+        if(!cpuid(0x1, 0, regs)) return false;
+        // OSXSAVE (bit 27) and AVX (bit 28)
+        if(!((regs.ECX & BIT(27)) && (regs.ECX & BIT(28)))) return false;
+        if((xgetbv0() & 0x6) != 0x6) return false; // XMM and YMM state
+        if(!cpuid(0x7, 0, regs)) return false;
+        return (regs.EBX & BIT(5)) != 0; // AVX2
+    }
+
+    /**
+     * Return true iff the processor supports AVX-512F together with the
+     * VPOPCNTDQ extension and the OS saves the ZMM registers.
+     */
+    bool AVX512POPCNTenabled()
+    {
+        regs_t regs;
+        if(!cpuid(0x1, 0, regs)) return false;
+        if(!(regs.ECX & BIT(27))) return false;
+        // XMM, YMM, opmask and both halves of the ZMM state
+        if((xgetbv0() & 0xe6) != 0xe6) return false;
+        if(!cpuid(0x7, 0, regs)) return false;
+        // AVX512F is EBX bit 16, AVX512_VPOPCNTDQ is ECX bit 14
+        return (regs.EBX & BIT(16)) && (regs.ECX & BIT(14));
+    }
+
+private:
+
+    /**
+     * Query the given CPUID leaf/subleaf; return false if the leaf is
+     * beyond the maximum the processor supports.
+     */
+    static bool cpuid(unsigned int leaf, unsigned int subleaf, regs_t& regs)
+    {
+#if ( defined(USING_INTEL_COMPILER) || defined(USING_MSC_COMPILER) )
+        int r[4];
+        __cpuid(r, 0);
+        if((unsigned int)r[0] < leaf) return false;
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        regs.EAX = r[0]; regs.EBX = r[1]; regs.ECX = r[2]; regs.EDX = r[3];
+        return true;
+#elif defined(USING_GCC_COMPILER)
+        if(__get_cpuid_max(0, NULL) < leaf) return false;
+        __cpuid_count(leaf, subleaf, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Read extended control register 0 (XCR0), which tells us which
+     * register states the OS has enabled.  Only call once OSXSAVE is
+     * known to be set.
+     */
+    static unsigned long long xgetbv0()
+    {
+#if ( defined(USING_INTEL_COMPILER) || defined(USING_MSC_COMPILER) )
+        return _xgetbv(0);
+#elif defined(USING_GCC_COMPILER)
+        unsigned int eax, edx;
+        __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+        return ((unsigned long long)edx << 32) | eax;
+#else
+        return 0;
+#endif
+    }
+
 #endif // POPCNT_CAPABILITY
 };
 
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2011, Ben Langmead <langmea@cs.jhu.edu>
+ *
+ * This file is part of Bowtie 2.
+ *
+ * Bowtie 2 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bowtie 2 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bowtie 2.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RANK_SIMD_H_
+#define RANK_SIMD_H_
+
+/**
+ * Vector kernels for counting 2-bit nucleotides in the BWT bytes of an
+ * Ebwt side.  Each kernel counts the characters in bytes [0, by) of a
+ * side; the caller adds in the partially-covered byte with the LUT.
+ *
+ * The kernels are compiled with per-function target attributes so the
+ * rest of the binary needs no -mavx2/-mavx512 flags; which one runs is
+ * decided once at startup from CPUID (see rankKernelFor()).  The AVX2
+ * kernels use the pshufb nibble-lookup popcount; the AVX-512 kernels
+ * use VPOPCNTQ.
+ *
+ * Nucleotides are packed as A=00, C=01, G=10, T=11 with the first
+ * character of a byte in the low-order bits.  With lo = the low bit of
+ * every pair and hi = the high bit, a single pass gives all four counts
+ * from three popcounts:
+ *
+ *   T = pop(hi & lo), G = pop(hi) - T, C = pop(lo) - T,
+ *   A = 4*by - pop(hi) - pop(lo) + T
+ *
+ * The final, partial vector is loaded with a per-qword mask so we never
+ * touch memory past the 8-byte word containing byte by-1, which is the
+ * same footprint as the scalar 64-bit loop.
+ */
+
+#include <stdint.h>
+
+enum {
+	RANK_KERNEL_SCALAR = 0, // countInU64/countInU64Ex + LUT
+	RANK_KERNEL_AVX2,       // 256-bit pshufb popcount
+	RANK_KERNEL_AVX512      // 512-bit VPOPCNTQ
+};
+
+#ifdef POPCNT_CAPABILITY
+#include "processor_support.h"
+#endif
+
+#if defined(POPCNT_CAPABILITY) && defined(__GNUC__) && defined(__x86_64__)
+#define RANK_SIMD_AVX2
+#if defined(__clang__) || (__GNUC__ >= 7)
+#define RANK_SIMD_AVX512
+#endif
+#endif
+
+#ifdef RANK_SIMD_AVX2
+
+#include <immintrin.h>
+
+// First n bytes of (rank_simd_bytemask + 64 - n) are 0xff, rest are 0
+static const uint8_t rank_simd_bytemask[128] __attribute__((aligned(64))) = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/**
+ * Per-qword population counts of v (pshufb nibble lookup).
+ */
+__attribute__((target("avx2")))
+static inline __m256i rankPop256(__m256i v) {
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m0f = _mm256_set1_epi8(0x0f);
+	__m256i plo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, m0f));
+	__m256i phi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(v, 4), m0f));
+	return _mm256_sad_epu8(_mm256_add_epi8(plo, phi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t rankHsum256(__m256i v) {
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	return (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_extract_epi64(s, 1);
+}
+
+/**
+ * Load the 32 bytes at p, zeroing every byte at or beyond offset n
+ * (0 < n <= 32).  Qwords entirely past n are not read at all.
+ */
+__attribute__((target("avx2")))
+static inline __m256i rankLoad256(const uint8_t *p, int n) {
+	if(n >= 32) {
+		return _mm256_loadu_si256((const __m256i*)p);
+	}
+	__m256i lanes = _mm256_cmpgt_epi64(
+		_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 8, 16, 24));
+	__m256i v = _mm256_maskload_epi64((const long long*)p, lanes);
+	return _mm256_and_si256(v,
+		_mm256_loadu_si256((const __m256i*)(rank_simd_bytemask + 64 - n)));
+}
+
+/**
+ * Count occurrences of character c in the first 'by' bytes of side.
+ */
+__attribute__((target("avx2")))
+static inline uint64_t rankCountAVX2(const uint8_t *side, int by, int c) {
+	const __m256i m55 = _mm256_set1_epi8(0x55);
+	// Pattern that turns occurrences of c into 0b11
+	const __m256i pat = _mm256_set1_epi8((char)(0xff ^ (0x55 * c)));
+	__m256i sum = _mm256_setzero_si256();
+	for(int i = 0; i < by; i += 32) {
+		int n = by - i;
+		__m256i x = _mm256_xor_si256(rankLoad256(side + i, n), pat);
+		x = _mm256_and_si256(_mm256_and_si256(x, _mm256_srli_epi64(x, 1)), m55);
+		if(n < 32) {
+			// Zeroed tail bytes must not count as matches
+			x = _mm256_and_si256(x,
+				_mm256_loadu_si256((const __m256i*)(rank_simd_bytemask + 64 - n)));
+		}
+		sum = _mm256_add_epi64(sum, rankPop256(x));
+	}
+	return rankHsum256(sum);
+}
+
+/**
+ * Count occurrences of all four characters in the first 'by' bytes of
+ * side in one pass, adding them into arrs[0..3].
+ */
+template<typename index_t>
+__attribute__((target("avx2")))
+static inline void rankCountExAVX2(const uint8_t *side, int by, index_t *arrs) {
+	const __m256i m55 = _mm256_set1_epi8(0x55);
+	__m256i shi = _mm256_setzero_si256();
+	__m256i slo = _mm256_setzero_si256();
+	__m256i sboth = _mm256_setzero_si256();
+	for(int i = 0; i < by; i += 32) {
+		__m256i v = rankLoad256(side + i, by - i);
+		__m256i lo = _mm256_and_si256(v, m55);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi64(v, 1), m55);
+		shi = _mm256_add_epi64(shi, rankPop256(hi));
+		slo = _mm256_add_epi64(slo, rankPop256(lo));
+		sboth = _mm256_add_epi64(sboth, rankPop256(_mm256_and_si256(hi, lo)));
+	}
+	uint64_t nhi = rankHsum256(shi), nlo = rankHsum256(slo), nboth = rankHsum256(sboth);
+	arrs[0] += (index_t)(((uint64_t)by << 2) - nhi - nlo + nboth);
+	arrs[1] += (index_t)(nlo - nboth);
+	arrs[2] += (index_t)(nhi - nboth);
+	arrs[3] += (index_t)nboth;
+}
+
+#ifdef RANK_SIMD_AVX512
+
+/**
+ * As rankLoad256 but for 64 bytes (0 < n <= 64).
+ */
+__attribute__((target("avx512f")))
+static inline __m512i rankLoad512(const uint8_t *p, int n) {
+	if(n >= 64) {
+		return _mm512_loadu_si512((const void*)p);
+	}
+	__mmask8 lanes = (__mmask8)((1u << ((n + 7) >> 3)) - 1);
+	__m512i v = _mm512_maskz_loadu_epi64(lanes, (const void*)p);
+	return _mm512_and_si512(v,
+		_mm512_loadu_si512((const void*)(rank_simd_bytemask + 64 - n)));
+}
+
+/**
+ * Sum the 64-bit lanes of v.  (_mm512_reduce_add_epi64 and the unmasked
+ * shifts start from _mm*_undefined_*(), which GCC warns about.)
+ */
+__attribute__((target("avx512f")))
+static inline uint64_t rankHsum512(__m512i v) {
+	uint64_t lanes[8];
+	_mm512_storeu_si512((void*)lanes, v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+	       lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+/**
+ * v >> 1 in each 64-bit lane
+ */
+__attribute__((target("avx512f")))
+static inline __m512i rankSrl512(__m512i v) {
+	return _mm512_maskz_srli_epi64((__mmask8)0xff, v, 1);
+}
+
+/**
+ * Count occurrences of character c in the first 'by' bytes of side.
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline uint64_t rankCountAVX512(const uint8_t *side, int by, int c) {
+	const __m512i m55 = _mm512_set1_epi8(0x55);
+	const __m512i pat = _mm512_set1_epi8((char)(0xff ^ (0x55 * c)));
+	__m512i sum = _mm512_setzero_si512();
+	for(int i = 0; i < by; i += 64) {
+		int n = by - i;
+		__m512i x = _mm512_xor_si512(rankLoad512(side + i, n), pat);
+		x = _mm512_and_si512(_mm512_and_si512(x, rankSrl512(x)), m55);
+		if(n < 64) {
+			x = _mm512_and_si512(x,
+				_mm512_loadu_si512((const void*)(rank_simd_bytemask + 64 - n)));
+		}
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+	}
+	return rankHsum512(sum);
+}
+
+/**
+ * Count occurrences of all four characters in the first 'by' bytes of
+ * side in one pass, adding them into arrs[0..3].
+ */
+template<typename index_t>
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline void rankCountExAVX512(const uint8_t *side, int by, index_t *arrs) {
+	const __m512i m55 = _mm512_set1_epi8(0x55);
+	__m512i shi = _mm512_setzero_si512();
+	__m512i slo = _mm512_setzero_si512();
+	__m512i sboth = _mm512_setzero_si512();
+	for(int i = 0; i < by; i += 64) {
+		__m512i v = rankLoad512(side + i, by - i);
+		__m512i lo = _mm512_and_si512(v, m55);
+		__m512i hi = _mm512_and_si512(rankSrl512(v), m55);
+		shi = _mm512_add_epi64(shi, _mm512_popcnt_epi64(hi));
+		slo = _mm512_add_epi64(slo, _mm512_popcnt_epi64(lo));
+		sboth = _mm512_add_epi64(sboth, _mm512_popcnt_epi64(_mm512_and_si512(hi, lo)));
+	}
+	uint64_t nhi = rankHsum512(shi), nlo = rankHsum512(slo), nboth = rankHsum512(sboth);
+	arrs[0] += (index_t)(((uint64_t)by << 2) - nhi - nlo + nboth);
+	arrs[1] += (index_t)(nlo - nboth);
+	arrs[2] += (index_t)(nhi - nboth);
+	arrs[3] += (index_t)nboth;
+}
+
+#endif // RANK_SIMD_AVX512
+
+#endif // RANK_SIMD_AVX2
+
+#ifdef POPCNT_CAPABILITY
+/**
+ * Pick the widest rank kernel that this binary was compiled with and
+ * the processor (and OS) supports.
+ */
+static inline int rankKernelFor(ProcessorSupport& ps) {
+#ifdef RANK_SIMD_AVX512
+	if(ps.AVX512POPCNTenabled()) return RANK_KERNEL_AVX512;
+#endif
+#ifdef RANK_SIMD_AVX2
+	if(ps.AVX2enabled()) return RANK_KERNEL_AVX2;
+#endif
+	return RANK_KERNEL_SCALAR;
+}
+#endif
+
+#endif /*RANK_SIMD_H_*/
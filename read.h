@@ -77,10 +77,17 @@ struct Read {
 		filter = '?';
 		seed = 0;
 		ns_ = 0;
+		revs_ = false;
+		packed_[0].clear();
+		packed_[1].clear();
+		packedNs_[0].clear();
+		packedNs_[1].clear();
 	}
 	
 	/**
-	 * Finish initializing a new read.
+	 * Finish initializing a new read.  The reversed sequences and
+	 * qualities (patFwRev etc.) aren't built until ensureReverses() is
+	 * called, since classification never uses them.
 	 */
 	void finalize() {
 		for(size_t i = 0; i < patFw.length(); i++) {
@@ -89,7 +96,8 @@ struct Read {
 			}
 		}
 		constructRevComps();
-		constructReverses();
+		constructPacked();
+		revs_ = false;
 	}
 
 	/**
@@ -109,6 +117,7 @@ struct Read {
 			}
 		}
 		constructRevComps();
+		constructPacked();
 		constructReverses();
 		if(nm != NULL) name.install(nm);
 	}
@@ -153,7 +162,8 @@ struct Read {
 	 * Given patFw, patRc, and qual, construct the *Rev versions in
 	 * place.  Assumes constructRevComps() was called previously.
 	 */
-	void constructReverses() {
+	void constructReverses() const {
+		revs_ = true;
 		patFwRev.installReverse(patFw);
 		patRcRev.installReverse(patRc);
 		qualRev.installReverse(qual);
@@ -164,6 +174,57 @@ struct Read {
 		}
 	}
 
+	/**
+	 * Construct the *Rev versions unless they're already there.
+	 */
+	void ensureReverses() const {
+		if(!revs_) constructReverses();
+	}
+
+	/**
+	 * Pack patFw and patRc two bits per base, 32 bases per word with the
+	 * first in the most significant bits, so that up to 32 consecutive
+	 * bases can be read as an integer with packedKmer().  Ns are stored
+	 * as 0 and marked with 3 in the same position of packedNs_.
+	 */
+	void constructPacked() {
+		size_t nwords = (patFw.length() + 31) / 32;
+		for(int fwi = 0; fwi < 2; fwi++) {
+			const BTDnaString& seq = (fwi == 0 ? patFw : patRc);
+			EList<uint64_t>& pk = packed_[fwi];
+			EList<uint64_t>& nm = packedNs_[fwi];
+			pk.resize(nwords);
+			nm.resize(nwords);
+			if(nwords > 0) {
+				pk.fillZero();
+				nm.fillZero();
+			}
+			for(size_t i = 0; i < seq.length(); i++) {
+				int shift = 62 - 2 * (int)(i & 31);
+				int c = (int)seq[i];
+				if(c > 3) {
+					nm[i >> 5] |= (3ULL << shift);
+				} else {
+					pk[i >> 5] |= ((uint64_t)c << shift);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Return the k (1 to 32) bases of patFw (or patRc if !fw) starting at
+	 * 'off' as an integer, first base in the most significant bits, as
+	 * Ebwt::ftabSeqToInt() builds it.  'nmask' gets the same bits of
+	 * packedNs_, so it's 0 iff there's no N among the bases, and otherwise
+	 * its lowest set bit is in the pair of the last N.
+	 */
+	uint64_t packedKmer(bool fw, size_t off, int k, uint64_t& nmask) const {
+		assert_range(1, 32, k);
+		assert_leq(off + k, length());
+		nmask = extractPacked(packedNs_[fw ? 0 : 1], off, k);
+		return extractPacked(packed_[fw ? 0 : 1], off, k);
+	}
+
 	/**
 	 * Append a "/1" or "/2" string onto the end of the name buf if
 	 * it's not already there.
@@ -330,13 +391,14 @@ struct Read {
 	BTDnaString altPatRc[3];
 	BTString    altQual[3];
 
-	BTDnaString patFwRev;
-	BTDnaString patRcRev;
-	BTString    qualRev;
+	// Built on demand by ensureReverses()
+	mutable BTDnaString patFwRev;
+	mutable BTDnaString patRcRev;
+	mutable BTString    qualRev;
 
-	BTDnaString altPatFwRev[3];
-	BTDnaString altPatRcRev[3];
-	BTString    altQualRev[3];
+	mutable BTDnaString altPatFwRev[3];
+	mutable BTDnaString altPatRcRev[3];
+	mutable BTString    altQualRev[3];
 
 	// For remembering the exact input text used to define a read
 	SStringExpandable<char> readOrigBuf;
@@ -357,6 +419,26 @@ struct Read {
 	int      trimmed5;  // amount actually trimmed off 5' end
 	int      trimmed3;  // amount actually trimmed off 3' end
 	HitSet  *hitset;    // holds previously-found hits; for chaining
+
+protected:
+
+	/**
+	 * Extract k two-bit fields starting at field 'off' from a list packed
+	 * as constructPacked() packs it.
+	 */
+	static uint64_t extractPacked(const EList<uint64_t>& words, size_t off, int k) {
+		size_t w = off >> 5;
+		int r = 2 * (int)(off & 31);
+		uint64_t hi = words[w] << r;
+		if(r + 2 * k > 64) {
+			hi |= words[w + 1] >> (64 - r);
+		}
+		return hi >> (64 - 2 * k);
+	}
+
+	mutable bool    revs_;        // *Rev versions are up to date
+	EList<uint64_t> packed_[2];   // patFw, patRc two bits per base
+	EList<uint64_t> packedNs_[2]; // 3 where there's an N
 };
 
 /**
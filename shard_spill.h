@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHARD_SPILL_H_
+#define SHARD_SPILL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "read.h"
+#include "threading.h"
+
+using namespace std;
+
+/**
+ * Per-read records written while classifying against one shard of a
+ * database and read back, in whatever order the reads come, while
+ * classifying against the last shard.  Records go to <base>.dat; the
+ * 8-byte slot for read id i in <base>.idx holds 1 + the record's offset,
+ * or 0 if the read has no record.  Any number of threads may put() or
+ * get() at once.
+ */
+class ShardSpill {
+
+public:
+
+	ShardSpill() : _idxfd(-1), _datfd(-1), _datlen(0) { }
+
+	~ShardSpill() {
+		remove();
+	}
+
+	/**
+	 * Create (or truncate) the spill files.
+	 */
+	void create(const string& base) {
+		_idxStr = base + ".idx";
+		_datStr = base + ".dat";
+		_idxfd = open(_idxStr.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		_datfd = open(_datStr.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if(_idxfd < 0 || _datfd < 0) {
+			cerr << "Error: could not create shard spill file " << (_idxfd < 0 ? _idxStr : _datStr).c_str()
+			     << ": " << strerror(errno) << endl;
+			throw 1;
+		}
+		_datlen = 0;
+	}
+
+	/**
+	 * Store the record for a read.
+	 */
+	void put(TReadId rdid, const EList<char>& rec) {
+		uint32_t len = (uint32_t)rec.size();
+		uint64_t off;
+		{
+			ThreadSafe ts(&_mutex);
+			off = _datlen;
+			_datlen += sizeof(len) + len;
+		}
+		pwriteAll(_datfd, (const char*)&len, sizeof(len), off);
+		if(len > 0) {
+			pwriteAll(_datfd, rec.ptr(), len, off + sizeof(len));
+		}
+		uint64_t slot = off + 1;
+		pwriteAll(_idxfd, (const char*)&slot, sizeof(slot), rdid * sizeof(slot));
+	}
+
+	/**
+	 * Fetch the record for a read.  Returns false if there is none.
+	 */
+	bool get(TReadId rdid, EList<char>& rec) const {
+		rec.clear();
+		uint64_t slot = 0;
+		if(pread(_idxfd, &slot, sizeof(slot), (off_t)(rdid * sizeof(slot))) != (ssize_t)sizeof(slot) || slot == 0) {
+			// Past the end or in a hole: no record
+			return false;
+		}
+		uint64_t off = slot - 1;
+		uint32_t len = 0;
+		preadAll(_datfd, (char*)&len, sizeof(len), off);
+		rec.resize(len);
+		if(len > 0) {
+			preadAll(_datfd, rec.ptr(), len, off + sizeof(len));
+		}
+		return true;
+	}
+
+	/**
+	 * Close and delete the spill files.
+	 */
+	void remove() {
+		if(_idxfd >= 0) {
+			close(_idxfd);
+			unlink(_idxStr.c_str());
+			_idxfd = -1;
+		}
+		if(_datfd >= 0) {
+			close(_datfd);
+			unlink(_datStr.c_str());
+			_datfd = -1;
+		}
+	}
+
+private:
+
+	void pwriteAll(int fd, const char* buf, size_t len, uint64_t off) {
+		while(len > 0) {
+			ssize_t n = pwrite(fd, buf, len, (off_t)off);
+			if(n <= 0) {
+				cerr << "Error: could not write shard spill file: " << strerror(errno) << endl;
+				throw 1;
+			}
+			buf += n; len -= n; off += n;
+		}
+	}
+
+	void preadAll(int fd, char* buf, size_t len, uint64_t off) const {
+		while(len > 0) {
+			ssize_t n = pread(fd, buf, len, (off_t)off);
+			if(n <= 0) {
+				cerr << "Error: shard spill file is truncated" << endl;
+				throw 1;
+			}
+			buf += n; len -= n; off += n;
+		}
+	}
+
+	string   _idxStr;
+	string   _datStr;
+	int      _idxfd;
+	int      _datfd;
+	uint64_t _datlen;
+	MUTEX_T  _mutex;
+};
+
+#endif /*SHARD_SPILL_H_*/
@@ -39,6 +39,7 @@ extern void waitSharedMem(void *mem, size_t len);
 #define ALLOC_SHARED_U allocSharedMem<TIndexOffU>
 #define ALLOC_SHARED_U8 allocSharedMem<uint8_t>
 #define ALLOC_SHARED_U32 allocSharedMem<uint32_t>
+#define ALLOC_SHARED_U64 allocSharedMem<uint64_t>
 #define FREE_SHARED shmdt
 #define NOTIFY_SHARED notifySharedMem
 #define WAIT_SHARED waitSharedMem
@@ -152,6 +153,7 @@ bool allocSharedMem(std::string fname,
 #define ALLOC_SHARED_U(...) 0
 #define ALLOC_SHARED_U8(...) 0
 #define ALLOC_SHARED_U32(...) 0
+#define ALLOC_SHARED_U64(...) 0
 #define FREE_SHARED(...)
 #define NOTIFY_SHARED(...)
 #define WAIT_SHARED(...)
@@ -1756,6 +1756,16 @@ public:
 		return *this;
 	}
 
+	/**
+	 * Exchange buffers with another string without copying characters.
+	 */
+	void swap(SStringExpandable<T,S>& o) {
+		std::swap(cs_, o.cs_);
+		std::swap(printcs_, o.printcs_);
+		std::swap(len_, o.len_);
+		std::swap(sz_, o.sz_);
+	}
+
 	/**
 	 * Insert char c before position 'idx'; slide subsequent chars down.
 	 */
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of Centrifuge.
+ *
+ * Centrifuge is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Centrifuge is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Centrifuge.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STAGE_METRICS_H_
+#define STAGE_METRICS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "perf_counters.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Stages of classifying a read whose time is kept.
+ */
+enum {
+	STAGE_PARSE = 0, // getting the next read from the input
+	STAGE_SEARCH,    // searchForwardAndReverse
+	STAGE_COORDS,    // resolving hits to genomes (getCoords)
+	STAGE_TREE,      // raising hits up the taxonomy to meet -k
+	STAGE_FORMAT,    // formatting the output record
+	STAGE_OUTPUT,    // handing it to the output queue, incl. waiting for it
+	NUM_STAGES
+};
+
+static const char * const stageNames[NUM_STAGES] = {
+	"parse", "search", "coords", "tree", "format", "output"
+};
+
+/**
+ * Return a cheap, steadily increasing tick count: the time-stamp counter
+ * where there is one, nanoseconds otherwise.
+ */
+static inline uint64_t stageTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * Ticks spent per stage, the number of times each was entered, LF
+ * operations done by the search, and a histogram of per-read latencies
+ * with power-of-two tick buckets.  Each thread keeps its own and merges
+ * it into a shared one now and then, like the other metrics.  If the
+ * thread has hardware counters (--perf-counters), their counts are kept
+ * per stage too.
+ */
+struct StageMetrics {
+
+	static const size_t NUM_LAT = 48;
+
+	StageMetrics() : counters(NULL) { reset(); }
+
+	void reset() {
+		memset(ticks, 0, sizeof(ticks));
+		memset(calls, 0, sizeof(calls));
+		memset(latency, 0, sizeof(latency));
+		memset(perf, 0, sizeof(perf));
+		lfops = 0;
+	}
+
+	/**
+	 * Add the counts in 'm' to these; the caller synchronizes.
+	 */
+	void merge(const StageMetrics& m) {
+		for(size_t i = 0; i < NUM_STAGES; i++) {
+			ticks[i] += m.ticks[i];
+			calls[i] += m.calls[i];
+			for(size_t j = 0; j < NUM_PERF; j++) {
+				perf[i][j] += m.perf[i][j];
+			}
+		}
+		for(size_t i = 0; i < NUM_LAT; i++) {
+			latency[i] += m.latency[i];
+		}
+		lfops += m.lfops;
+	}
+
+	/**
+	 * Count a read that took 't' ticks from start to finish.
+	 */
+	void addLatency(uint64_t t) {
+		size_t b = 0;
+		while(t > 1 && b + 1 < NUM_LAT) {
+			t >>= 1;
+			b++;
+		}
+		latency[b]++;
+	}
+
+	uint64_t ticks[NUM_STAGES];
+	uint64_t calls[NUM_STAGES];
+	uint64_t latency[NUM_LAT]; // reads taking [2^i, 2^(i+1)) ticks
+	uint64_t lfops;            // LF operations by the search
+	uint64_t perf[NUM_STAGES][NUM_PERF]; // hardware events per stage
+
+	const PerfCounters *counters; // this thread's, or NULL; not merged
+};
+
+/**
+ * Add the ticks, and hardware events if they're being counted, between
+ * construction and destruction to a stage, if there is a StageMetrics to
+ * add them to.
+ */
+class StageTimer {
+public:
+	StageTimer(StageMetrics *m, int stage) :
+		m_(m), stage_(stage), t0_(0), pok_(false)
+	{
+		if(m_ != NULL) {
+			pok_ = (m_->counters != NULL && m_->counters->read(p0_));
+			t0_ = stageTicks();
+		}
+	}
+
+	~StageTimer() {
+		if(m_ != NULL) {
+			m_->ticks[stage_] += stageTicks() - t0_;
+			m_->calls[stage_]++;
+			uint64_t p1[NUM_PERF];
+			if(pok_ && m_->counters->read(p1)) {
+				for(size_t i = 0; i < NUM_PERF; i++) {
+					if(p1[i] > p0_[i]) m_->perf[stage_][i] += p1[i] - p0_[i];
+				}
+			}
+		}
+	}
+
+private:
+	StageMetrics *m_;
+	int           stage_;
+	uint64_t      t0_;
+	uint64_t      p0_[NUM_PERF];
+	bool          pok_; // p0_ holds counts to subtract
+};
+
+#endif /*STAGE_METRICS_H_*/
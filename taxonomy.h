@@ -59,11 +59,235 @@ struct TaxonomyNode {
     TaxonomyNode(): parent_tid(0), rank(RANK_UNKNOWN), leaf(false) {};
 };
 
+/**
+ * Read-only table of values keyed by taxonomic ID: an array of (ID, value)
+ * pairs sorted by ID, searched by bisection.  The array is either held
+ * here or borrowed from someone else, e.g. a memory-mapped .3.cf file.
+ */
+template <typename V>
+class TaxIdTable {
+public:
+    typedef pair<uint64_t, V> value_type;
+    typedef const value_type* const_iterator;
+
+    TaxIdTable() : list_(NULL), n_(0), borrowed_(false) { }
+
+    /**
+     * Take a copy of the entries of 'm'.
+     */
+    void assign(const std::map<uint64_t, V>& m) {
+        own_.clear();
+        own_.reserveExact(m.size());
+        for(typename std::map<uint64_t, V>::const_iterator itr = m.begin(); itr != m.end(); itr++) {
+            own_.push_back(*itr);
+        }
+        list_ = own_.ptr();
+        n_ = own_.size();
+        borrowed_ = false;
+    }
+
+    /**
+     * Use the 'n' entries at 'list', sorted by ID, without copying them.
+     */
+    void borrow(const value_type* list, size_t n) {
+        own_.clear();
+        list_ = list;
+        n_ = n;
+        borrowed_ = true;
+    }
+
+    void clear() {
+        own_.clear();
+        list_ = NULL;
+        n_ = 0;
+        borrowed_ = false;
+    }
+
+    size_t size() const { return n_; }
+    bool empty() const { return n_ == 0; }
+    bool borrowed() const { return borrowed_; }
+    uint64_t bytes() const { return (uint64_t)n_ * sizeof(value_type); }
+    const_iterator begin() const { return list_; }
+    const_iterator end() const { return list_ + n_; }
+    const value_type& operator[](size_t i) const { assert_lt(i, n_); return list_[i]; }
+
+    const_iterator find(uint64_t tid) const {
+        const_iterator lo = begin(), hi = end();
+        while(lo < hi) {
+            const_iterator mid = lo + (hi - lo) / 2;
+            if(mid->first < tid) lo = mid + 1;
+            else hi = mid;
+        }
+        return (lo != end() && lo->first == tid) ? lo : end();
+    }
+
+private:
+    TaxIdTable(const TaxIdTable&);
+    TaxIdTable& operator=(const TaxIdTable&);
+
+    EList<value_type> own_;
+    const value_type* list_; // own_'s entries, or borrowed ones
+    size_t            n_;
+    bool              borrowed_;
+};
+
+typedef TaxIdTable<TaxonomyNode> TaxTreeTable;
+typedef TaxIdTable<uint64_t>     TaxSizeTable;
+
+/**
+ * Read-only table of taxon names by taxonomic ID.  Each name is kept
+ * NUL-terminated in a pool of characters, at the offset its entry holds.
+ */
+class TaxNameTable {
+public:
+    TaxNameTable() : pool_(NULL), poolLen_(0) { }
+
+    void assign(const std::map<uint64_t, string>& m) {
+        std::map<uint64_t, uint64_t> offs;
+        own_.clear();
+        for(std::map<uint64_t, string>::const_iterator itr = m.begin(); itr != m.end(); itr++) {
+            offs[itr->first] = own_.size();
+            for(size_t c = 0; c < itr->second.length(); c++) {
+                own_.push_back(itr->second[c]);
+            }
+            own_.push_back('\0');
+        }
+        offs_.assign(offs);
+        pool_ = own_.ptr();
+        poolLen_ = own_.size();
+    }
+
+    void borrow(const pair<uint64_t, uint64_t>* offs, size_t n, const char* pool, size_t poolLen) {
+        own_.clear();
+        offs_.borrow(offs, n);
+        pool_ = pool;
+        poolLen_ = poolLen;
+    }
+
+    void clear() {
+        own_.clear();
+        offs_.clear();
+        pool_ = NULL;
+        poolLen_ = 0;
+    }
+
+    size_t size() const { return offs_.size(); }
+    bool borrowed() const { return offs_.borrowed(); }
+    uint64_t bytes() const { return offs_.bytes() + poolLen_; }
+    uint64_t tid(size_t i) const { return offs_[i].first; }
+    const char* name(size_t i) const { return pool_ + offs_[i].second; }
+    const TaxIdTable<uint64_t>& offsets() const { return offs_; }
+    const char* pool() const { return pool_; }
+    size_t poolLen() const { return poolLen_; }
+
+    /**
+     * Return the name of 'tid', or 'def' if it has none.
+     */
+    const char* find(uint64_t tid, const char* def) const {
+        TaxIdTable<uint64_t>::const_iterator itr = offs_.find(tid);
+        return itr == offs_.end() ? def : pool_ + itr->second;
+    }
+
+private:
+    TaxNameTable(const TaxNameTable&);
+    TaxNameTable& operator=(const TaxNameTable&);
+
+    TaxIdTable<uint64_t> offs_;
+    EList<char>          own_;
+    const char*          pool_;
+    size_t               poolLen_;
+};
+
+/**
+ * Read-only table of the unique ID and taxonomic ID of each reference
+ * sequence, in the order of the sequences in the index.  The unique IDs
+ * are kept NUL-terminated in a pool of characters.
+ */
+class TaxRefTable {
+public:
+    TaxRefTable() : tids_(NULL), offs_(NULL), pool_(NULL), n_(0), poolLen_(0), borrowed_(false) { }
+
+    void assign(const EList<pair<string, uint64_t> >& refs) {
+        ownTids_.resizeExact(refs.size());
+        ownOffs_.resizeExact(refs.size());
+        ownPool_.clear();
+        for(size_t i = 0; i < refs.size(); i++) {
+            ownTids_[i] = refs[i].second;
+            ownOffs_[i] = ownPool_.size();
+            for(size_t c = 0; c < refs[i].first.length(); c++) {
+                ownPool_.push_back(refs[i].first[c]);
+            }
+            ownPool_.push_back('\0');
+        }
+        tids_ = ownTids_.ptr();
+        offs_ = ownOffs_.ptr();
+        pool_ = ownPool_.ptr();
+        n_ = refs.size();
+        poolLen_ = ownPool_.size();
+        borrowed_ = false;
+    }
+
+    void borrow(const uint64_t* tids, const uint64_t* offs, size_t n, const char* pool, size_t poolLen) {
+        ownTids_.clear();
+        ownOffs_.clear();
+        ownPool_.clear();
+        tids_ = tids;
+        offs_ = offs;
+        pool_ = pool;
+        n_ = n;
+        poolLen_ = poolLen;
+        borrowed_ = true;
+    }
+
+    size_t size() const { return n_; }
+    bool borrowed() const { return borrowed_; }
+    uint64_t bytes() const { return (uint64_t)n_ * 2 * sizeof(uint64_t) + poolLen_; }
+    uint64_t tid(size_t i) const { assert_lt(i, n_); return tids_[i]; }
+    const char* uid(size_t i) const { assert_lt(i, n_); return pool_ + offs_[i]; }
+    const uint64_t* tids() const { return tids_; }
+    const uint64_t* offsets() const { return offs_; }
+    const char* pool() const { return pool_; }
+    size_t poolLen() const { return poolLen_; }
+
+private:
+    TaxRefTable(const TaxRefTable&);
+    TaxRefTable& operator=(const TaxRefTable&);
+
+    EList<uint64_t> ownTids_;
+    EList<uint64_t> ownOffs_;
+    EList<char>     ownPool_;
+    const uint64_t* tids_;
+    const uint64_t* offs_;
+    const char*     pool_;
+    size_t          n_;
+    size_t          poolLen_;
+    bool            borrowed_;
+};
+
+/**
+ * The taxonomic IDs of a taxon and its ancestors, one per rank of
+ * TaxonomyPathTable, 0 where there's none; empty for an unknown taxon.
+ */
+struct TaxPath {
+    const uint64_t* ids;
+    size_t          n;
+
+    TaxPath() : ids(NULL), n(0) { }
+    TaxPath(const uint64_t* _ids, size_t _n) : ids(_ids), n(_n) { }
+
+    size_t size() const { return n; }
+    uint64_t operator[](size_t i) const { assert_lt(i, n); return ids[i]; }
+};
+
 struct TaxonomyPathTable {
     static const size_t nranks = 10;
 
-    map<uint64_t, uint32_t> tid_to_pid;  // from taxonomic ID to path ID
-    ELList<uint64_t> paths;
+    TaxIdTable<uint64_t> tid_to_pid;  // from taxonomic ID to path ID
+    EList<uint64_t>      path_buf;    // path_ids, when they aren't borrowed
+    const uint64_t*      path_ids;    // nranks IDs for each path
+    size_t               npaths;
+
+    TaxonomyPathTable() : path_ids(NULL), npaths(0) { }
 
     static uint8_t rank_to_pathID(uint8_t rank) {
         switch(rank) {
@@ -93,8 +317,7 @@ struct TaxonomyPathTable {
         }
     }
 
-    void buildPaths(const EList<pair<string, uint64_t> >& uid_to_tid,
-                    const std::map<uint64_t, TaxonomyNode>& tree)
+    void buildPaths(const TaxRefTable& refs, const TaxTreeTable& tree)
     {
         map<uint32_t, uint32_t> rank_map;
         rank_map[RANK_STRAIN]        = 0;
@@ -109,22 +332,22 @@ struct TaxonomyPathTable {
         rank_map[RANK_SUPER_KINGDOM] = 8;
         rank_map[RANK_DOMAIN]        = 9;
 
-        tid_to_pid.clear();
-        paths.clear();
-        for(size_t i = 0; i < uid_to_tid.size(); i++) {
-            uint64_t tid = uid_to_tid[i].second;
-            if(tid_to_pid.find(tid) != tid_to_pid.end())
+        map<uint64_t, uint64_t> pids;
+        path_buf.clear();
+        for(size_t i = 0; i < refs.size(); i++) {
+            uint64_t tid = refs.tid(i);
+            if(pids.find(tid) != pids.end())
                 continue;
             if(tree.find(tid) == tree.end())
                 continue;
-            tid_to_pid[tid] = (uint32_t)paths.size();
-            paths.expand();
-            EList<uint64_t>& path = paths.back();
-            path.resizeExact(nranks);
-            path.fillZero();
+            pids[tid] = path_buf.size() / nranks;
+            size_t start = path_buf.size();
+            path_buf.resize(start + nranks);
+            uint64_t* path = path_buf.ptr() + start;
+            memset(path, 0, nranks * sizeof(uint64_t));
             bool first = true;
             while(true) {
-                std::map<uint64_t, TaxonomyNode>::const_iterator itr = tree.find(tid);
+                TaxTreeTable::const_iterator itr = tree.find(tid);
                 if(itr == tree.end()) {
                     break;
                 }
@@ -135,7 +358,7 @@ struct TaxonomyPathTable {
                 } else if(rank_map.find(node.rank) != rank_map.end()) {
                     rank = rank_map[node.rank];
                 }
-                if(rank < path.size() && path[rank] == 0) {
+                if(rank < nranks && path[rank] == 0) {
                     path[rank] = tid;
                 }
 
@@ -146,18 +369,45 @@ struct TaxonomyPathTable {
                 tid = node.parent_tid;
             }
         }
+        tid_to_pid.assign(pids);
+        path_ids = path_buf.ptr();
+        npaths = path_buf.size() / nranks;
+    }
+
+    /**
+     * Use the 'npid' (ID, path ID) pairs at 'pids' and the 'n' paths at
+     * 'ids', precomputed by buildPaths, without copying them.
+     */
+    void borrow(const pair<uint64_t, uint64_t>* pids, size_t npid, const uint64_t* ids, size_t n) {
+        path_buf.clear();
+        tid_to_pid.borrow(pids, npid);
+        path_ids = ids;
+        npaths = n;
     }
 
+    bool borrowed() const { return tid_to_pid.borrowed(); }
+    uint64_t bytes() const { return tid_to_pid.bytes() + (uint64_t)npaths * nranks * sizeof(uint64_t); }
+
     void getPath(uint64_t tid, EList<uint64_t>& path) const {
-        map<uint64_t, uint32_t>::const_iterator itr = tid_to_pid.find(tid);
-        if(itr != tid_to_pid.end()) {
-            uint32_t pid = itr->second;
-            assert_lt(pid, paths.size());
-            path = paths[pid];
-        } else {
-            path.clear();
+        TaxPath p = pathOf(tid);
+        path.clear();
+        for(size_t i = 0; i < p.size(); i++) {
+            path.push_back(p[i]);
         }
     }
+
+    /**
+     * Like getPath, but point at the stored path itself (or an empty one)
+     * rather than copying it; it stays valid until the paths are rebuilt.
+     */
+    TaxPath pathOf(uint64_t tid) const {
+        TaxIdTable<uint64_t>::const_iterator itr = tid_to_pid.find(tid);
+        if(itr == tid_to_pid.end()) {
+            return TaxPath();
+        }
+        assert_lt(itr->second, npaths);
+        return TaxPath(path_ids + itr->second * nranks, nranks);
+    }
 };
 
 typedef std::map<uint64_t, TaxonomyNode> TaxonomyTree;
@@ -348,4 +598,49 @@ inline static TaxonomyTree read_taxonomy_tree(string taxonomy_fname) {
 }
 
 
+/**
+ * Set the size of each species, genus, family, order, class and phylum in
+ * 'tree' to the average size of the strains (and unranked leaves) under it
+ * that have one in 'size'.
+ */
+inline static void average_genome_sizes(const TaxonomyTree& tree, std::map<uint64_t, uint64_t>& size) {
+    for(TaxonomyTree::const_iterator tree_itr = tree.begin(); tree_itr != tree.end(); tree_itr++) {
+        uint64_t tid = tree_itr->first;
+        const TaxonomyNode& node = tree_itr->second;
+        if(node.rank == RANK_SPECIES || node.rank == RANK_GENUS || node.rank == RANK_FAMILY ||
+           node.rank == RANK_ORDER || node.rank == RANK_CLASS || node.rank == RANK_PHYLUM) {
+            size_t sum = 0, count = 0;
+            for(std::map<uint64_t, uint64_t>::const_iterator size_itr = size.begin(); size_itr != size.end(); size_itr++) {
+                uint64_t c_tid = size_itr->first;
+                TaxonomyTree::const_iterator tree_itr2 = tree.find(c_tid);
+                if(tree_itr2 == tree.end())
+                    continue;
+                
+                const TaxonomyNode& c_node = tree_itr2->second;
+                if((c_node.rank == RANK_UNKNOWN && c_node.leaf) ||
+                   tax_rank_num[c_node.rank] < tax_rank_num[RANK_SPECIES]) {
+                    c_tid = c_node.parent_tid;
+                    while(true) {
+                        if(c_tid == tid) {
+                            sum += size_itr->second;
+                            count += 1;
+                            break;
+                        }
+                        tree_itr2 = tree.find(c_tid);
+                        if(tree_itr2 == tree.end())
+                            break;
+                        if(c_tid == tree_itr2->second.parent_tid)
+                            break;
+                        c_tid = tree_itr2->second.parent_tid;
+                    }
+                }
+            }
+            if(count > 0) {
+                size[tid] = sum / count;
+            }
+        }
+    }
+}
+
+
 #endif /* TAXONOMY_H_ */